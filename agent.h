@@ -51,6 +51,8 @@ void proxy_stats_dump_proxy_main(ADD_STAT add_stats, conn *c,
                                  struct proxy_stats_cmd_info *pscip);
 void proxy_stats_dump_proxies(ADD_STAT add_stats, conn *c,
                               struct proxy_stats_cmd_info *pscip);
-void proxy_stats_dump_timings(ADD_STAT add_stats, conn *c);
+void proxy_stats_dump_timings(ADD_STAT add_stats, conn *c,
+                              const char *filter);
+void proxy_stats_dump_trace(ADD_STAT add_stats, conn *c);
 
 #endif /* AGENT_H */
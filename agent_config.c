@@ -11,7 +11,7 @@
 #include "work.h"
 #include "agent.h"
 #include "log.h"
-#include "cJSON.h"
+#include "json_scan.h"
 
 // Integration with libconflate.
 //
@@ -388,32 +388,64 @@ static bool cproxy_on_config_json_one(proxy_main *m, uint32_t new_config_ver,
                                       char *config, char *name);
 
 static bool cproxy_on_config_json_buckets(proxy_main *m, uint32_t new_config_ver,
-                                          cJSON *jBuckets, bool want_default);
+                                          json_span *jBuckets, int numBuckets,
+                                          bool want_default);
 
 static
 bool cproxy_on_config_json(proxy_main *m, uint32_t new_config_ver, char *config) {
     bool rv = false;
 
-    cJSON *c = cJSON_Parse(config);
-    if (c != NULL) {
-        cJSON *jBuckets = cJSON_GetObjectItem(c, "buckets");
-        if (jBuckets != NULL &&
-            jBuckets->type == cJSON_Array) {
-            // Make two passes through jBuckets, favoring any "default"
-            // bucket on the 1st pass, so the default bucket gets
-            // created earlier.
-            //
-            bool rv1 = cproxy_on_config_json_buckets(m, new_config_ver, jBuckets, true);
-            bool rv2 = cproxy_on_config_json_buckets(m, new_config_ver, jBuckets, false);
+    // A cluster config can have hundreds of buckets, each with a big
+    // vbucket map, so it's only scanned in place, and each bucket's
+    // config is handed on as its own span of the text, instead of as
+    // a cJSON tree that's then printed back out per bucket.
+    //
+    json_span c;
+    if (json_scan_doc(config, strlen(config), &c)) {
+        json_span jBuckets;
+        if (json_object_get(c, "buckets", &jBuckets) &&
+            json_scan_type(jBuckets) == JSON_ARRAY) {
+            json_iter it;
+            json_span jBucket;
+            int numBuckets = 0;
+
+            json_iter_init(&it, jBuckets);
+            while (json_iter_next(&it, NULL, &jBucket)) {
+                numBuckets++;
+            }
+
+            json_span *spans = calloc(numBuckets + 1, sizeof(json_span));
+            if (spans != NULL) {
+                int i = 0;
 
-            rv = rv1 || rv2;
+                json_iter_init(&it, jBuckets);
+                while (i < numBuckets &&
+                       json_iter_next(&it, NULL, &spans[i])) {
+                    i++;
+                }
+
+                // Make two passes through jBuckets, favoring any "default"
+                // bucket on the 1st pass, so the default bucket gets
+                // created earlier.
+                //
+                bool rv1 = cproxy_on_config_json_buckets(m, new_config_ver,
+                                                         spans, i, true);
+                bool rv2 = cproxy_on_config_json_buckets(m, new_config_ver,
+                                                         spans, i, false);
+
+                rv = rv1 || rv2;
+
+                free(spans);
+            }
         } else {
             // Just a single config.
             //
             rv = cproxy_on_config_json_one(m, new_config_ver, config, "default");
         }
-
-        cJSON_Delete(c);
+    } else {
+        if (settings.verbose > 1) {
+            moxi_log_write("ERROR: could not parse JSON config\n");
+        }
     }
 
     return rv;
@@ -421,32 +453,40 @@ bool cproxy_on_config_json(proxy_main *m, uint32_t new_config_ver, char *config)
 
 static
 bool cproxy_on_config_json_buckets(proxy_main *m, uint32_t new_config_ver,
-                                   cJSON *jBuckets, bool want_default) {
+                                   json_span *jBuckets, int numBuckets,
+                                   bool want_default) {
     bool rv = false;
 
-    int numBuckets = cJSON_GetArraySize(jBuckets);
     for (int i = 0; i < numBuckets; i++) {
-        cJSON *jBucket = cJSON_GetArrayItem(jBuckets, i);
-        if (jBucket != NULL &&
-            jBucket->type == cJSON_Object) {
-            char *name = "default";
-
-            cJSON *jName = cJSON_GetObjectItem(jBucket, "name");
-            if (jName != NULL &&
-                jName->type == cJSON_String &&
-                jName->valuestring != NULL) {
-                name = jName->valuestring;
+        json_span jBucket = jBuckets[i];
+        if (json_scan_type(jBucket) == JSON_OBJECT) {
+            char *name = NULL;
+
+            json_span jName;
+            if (json_object_get(jBucket, "name", &jName) &&
+                json_scan_type(jName) == JSON_STRING) {
+                name = json_string_dup(jName);
+                if (name == NULL) {
+                    continue;
+                }
             }
 
-            bool is_default = (strcmp(name, "default") == 0);
+            bool is_default = (name == NULL || strcmp(name, "default") == 0);
             if (!(is_default ^ want_default)) { // XOR.
-                char *jBucketStr = cJSON_Print(jBucket);
-                if (jBucketStr != NULL) {
-                    rv = cproxy_on_config_json_one(m, new_config_ver,
-                                                       jBucketStr, name) || rv;
-                    free(jBucketStr);
-                }
+                // The bucket's config is terminated in place for the
+                // call, which copies what it keeps.
+                //
+                char *jBucketStr = (char *) jBucket.ptr;
+                char saved = jBucketStr[jBucket.len];
+
+                jBucketStr[jBucket.len] = '\0';
+                rv = cproxy_on_config_json_one(m, new_config_ver,
+                                               jBucketStr,
+                                               name != NULL ? name : "default") || rv;
+                jBucketStr[jBucket.len] = saved;
             }
+
+            free(name);
         }
     }
 
@@ -789,18 +829,15 @@ void cproxy_on_config(void *data0, void *data1) {
 
     uint32_t max_config_ver = 0;
 
-    pthread_mutex_lock(&m->proxy_main_lock);
-
+    // Unchanged proxies keep their older config_ver, so the latest
+    // config_ver is the latest one that any proxy was listed in.
+    //
     for (proxy *p = m->proxy_head; p != NULL; p = p->next) {
-        pthread_mutex_lock(&p->proxy_lock);
-        if (max_config_ver < p->config_ver) {
-            max_config_ver = p->config_ver;
+        if (max_config_ver < p->config_seen_ver) {
+            max_config_ver = p->config_seen_ver;
         }
-        pthread_mutex_unlock(&p->proxy_lock);
     }
 
-    pthread_mutex_unlock(&m->proxy_main_lock);
-
     uint32_t new_config_ver = max_config_ver + 1;
 
     if (settings.verbose > 2) {
@@ -873,7 +910,7 @@ void close_outdated_proxies(proxy_main *m, uint32_t new_config_ver) {
 
         pthread_mutex_lock(&p->proxy_lock);
 
-        if (p->config_ver != new_config_ver) {
+        if (p->config_seen_ver != new_config_ver) {
             down = true;
 
             assert(p->port > 0);
@@ -912,6 +949,34 @@ void close_outdated_proxies(proxy_main *m, uint32_t new_config_ver) {
     pthread_mutex_unlock(&m->proxy_main_lock);
 }
 
+/* Fingerprints what a config push gives a proxy, to see if it changed
+ * without taking any locks.  The behaviors are hashed as raw bytes,
+ * which is safe, as any difference just means the config gets applied.
+ */
+static uint64_t cproxy_config_fingerprint(char *name, char *config,
+                                          proxy_behavior_pool *behavior_pool) {
+    uint32_t lo = 0;
+    uint32_t hi = 0x9e3779b9;
+
+    lo = hash(name, strlen(name), lo);
+    hi = hash(name, strlen(name), hi);
+    lo = hash(config, strlen(config), lo);
+    hi = hash(config, strlen(config), hi);
+    lo = hash(&behavior_pool->base, sizeof(proxy_behavior), lo);
+    hi = hash(&behavior_pool->base, sizeof(proxy_behavior), hi);
+
+    if (behavior_pool->arr != NULL) {
+        size_t n = behavior_pool->num * sizeof(proxy_behavior);
+
+        lo = hash(behavior_pool->arr, n, lo);
+        hi = hash(behavior_pool->arr, n, hi);
+    }
+
+    uint64_t rv = (((uint64_t) hi) << 32) | lo;
+
+    return rv != 0 ? rv : 1; // 0 means no config.
+}
+
 /**
  * A name and port uniquely identify a proxy.
  */
@@ -925,6 +990,34 @@ void cproxy_on_config_pool(proxy_main *m,
     assert(port >= 0);
     assert(is_listen_thread());
 
+    // Most pushes of a big cluster's config only change a few buckets,
+    // so an unchanged bucket is skipped here, before taking any locks
+    // or sending work to the worker threads.  Only the main listener
+    // thread modifies the proxy list, names and fingerprints.
+    //
+    uint64_t fingerprint = 0;
+
+    if (config != NULL) {
+        fingerprint = cproxy_config_fingerprint(name, config, behavior_pool);
+
+        for (proxy *p = m->proxy_head; p != NULL; p = p->next) {
+            if (p->port == port &&
+                p->config_fingerprint == fingerprint &&
+                strcmp(p->name, name) == 0) {
+                p->config_seen_ver = config_ver;
+                m->stat_proxy_skips++;
+
+                if (settings.verbose > 2) {
+                    moxi_log_write("conp unchanged %u, %s\n",
+                                   p->port, p->name);
+                }
+                return;
+            }
+        }
+    }
+
+    m->stat_proxy_applies++;
+
     // See if we've already got a proxy running with that name and port,
     // and create one if needed.
     //
@@ -960,6 +1053,8 @@ void cproxy_on_config_pool(proxy_main *m,
                           behavior_pool,
                           m->nthreads);
         if (p != NULL) {
+            p->config_fingerprint = fingerprint;
+
             pthread_mutex_lock(&m->proxy_main_lock);
 
             p->next = m->proxy_head;
@@ -1006,6 +1101,7 @@ void cproxy_on_config_pool(proxy_main *m,
         matcher_stop(&p->front_cache_unmatcher);
 
         matcher_stop(&p->optimize_set_matcher);
+        matcher_stop(&p->combine_set_matcher);
 
         pthread_mutex_lock(&p->proxy_lock);
 
@@ -1051,6 +1147,9 @@ void cproxy_on_config_pool(proxy_main *m,
 
         pthread_mutex_unlock(&p->proxy_lock);
 
+        p->config_fingerprint = shutdown_flag ? 0 : fingerprint;
+        p->config_seen_ver    = config_ver;
+
         if (settings.verbose > 2) {
             moxi_log_write("conp changed %s, shutdown %s\n",
                     changed ? "true" : "false",
@@ -1080,6 +1179,11 @@ void cproxy_on_config_pool(proxy_main *m,
                 matcher_start(&p->optimize_set_matcher,
                               behavior_pool->base.optimize_set);
             }
+
+            if (strlen(behavior_pool->base.combine_set) > 0) {
+                matcher_start(&p->combine_set_matcher,
+                              behavior_pool->base.combine_set);
+            }
         }
 
         // Send update across worker threads, avoiding locks.
@@ -1148,26 +1252,10 @@ static void update_ptd_config(void *data0, void *data1) {
     // Restart the key_stats, if necessary.
     //
     if (changed) {
-        mcache_stop(&ptd->key_stats);
-        matcher_stop(&ptd->key_stats_matcher);
-        matcher_stop(&ptd->key_stats_unmatcher);
+        key_stats_stop(ptd);
 
         if (ptd->config != NULL) {
-            if (ptd->behavior_pool.base.key_stats_max > 0 &&
-                ptd->behavior_pool.base.key_stats_lifespan > 0) {
-                mcache_start(&ptd->key_stats,
-                             ptd->behavior_pool.base.key_stats_max);
-
-                if (strlen(ptd->behavior_pool.base.key_stats_spec) > 0) {
-                    matcher_start(&ptd->key_stats_matcher,
-                                  ptd->behavior_pool.base.key_stats_spec);
-                }
-
-                if (strlen(ptd->behavior_pool.base.key_stats_unspec) > 0) {
-                    matcher_start(&ptd->key_stats_unmatcher,
-                                  ptd->behavior_pool.base.key_stats_unspec);
-                }
-            }
+            key_stats_start(ptd);
         }
 
         if (settings.verbose > 2) {
@@ -44,6 +44,7 @@ static void add_processed_key_stats(genhash_t *dest_map,
                                     genhash_t *src_map);
 static void add_proxy_stats(proxy_stats *agg,
                             proxy_stats *x);
+static void add_timing_htgram(HTGRAM_HANDLE *agg, HTGRAM_HANDLE x);
 static void add_stats_cmd(proxy_stats_cmd *agg,
                           proxy_stats_cmd *x);
 static void add_stats_cmd_with_rescale(proxy_stats_cmd *agg,
@@ -61,6 +62,9 @@ void map_pstd_foreach_emit(const void *key,
 void map_pstd_foreach_merge(const void *key,
                             const void *value,
                             void *user_data);
+static void map_pstd_foreach_free(const void *key,
+                                  const void *value,
+                                  void *user_data);
 
 static void map_key_stats_foreach_free(const void *key,
                                        const void *value,
@@ -72,6 +76,16 @@ static void map_key_stats_foreach_merge(const void *key,
                                         const void *value,
                                         void *user_data);
 
+static void map_topk_foreach_free(const void *key,
+                                  const void *value,
+                                  void *user_data);
+static void map_topk_foreach_emit(const void *key,
+                                  const void *value,
+                                  void *user_data);
+static void map_topk_foreach_merge(const void *key,
+                                   const void *value,
+                                   void *user_data);
+
 static void proxy_stats_dump_behavior(ADD_STAT add_stats,
                                       conn *c,
                                       const char *prefix,
@@ -112,6 +126,12 @@ struct main_stats_collect_info {
     struct main_stats_proxy_info *proxies;
 };
 
+static int  main_stats_collect_proxies(struct main_stats_collect_info *msci);
+static void main_stats_proxy_infos(struct main_stats_collect_info *msci,
+                                   int nproxy);
+static void snapshot_stats_collect(struct main_stats_collect_info *msci);
+static void collect_memcached_stats_for_proxies(struct main_stats_collect_info *msci);
+
 static char *cmd_names[] = { // Keep sync'ed with enum_stats_cmd.
     "get",
     "get_key",
@@ -141,6 +161,14 @@ static char *cmd_type_names[] = { // Keep sync'ed with enum_stats_cmd_type.
 struct stats_gathering_pair {
     genhash_t *map_pstd; // maps "<proxy-name>:<port>" strings to (proxy_stats_td *)
     genhash_t *map_key_stats; // maps "<proxy-name>:<port>" strings to (genhash that maps key names to (struct key_stats *))
+    genhash_t *map_topk; // maps "<proxy-name>:<port>" strings to (struct topk_collect *)
+};
+
+// Heavy hitter keys of a proxy, merged across worker threads.
+//
+struct topk_collect {
+    topk agg;
+    int  limit; // The proxy's key_stats_max, the number of keys to emit.
 };
 
 #ifndef REDIRECTS_FOR_MOCKS
@@ -200,6 +228,121 @@ out_free:
 #define collect_memcached_stats_for_proxy redirected_collect_memcached_stats_for_proxy
 #endif
 
+/* Emits the heavy hitter keys of a proxy, ranked by their estimated
+ * number of requests, as "<name>:topk:<rank>:<field>".
+ */
+static void map_topk_foreach_emit(const void *k,
+                                  const void *value,
+                                  void *user_data) {
+    const char *name = (const char *) k;
+    assert(name != NULL);
+
+    struct topk_collect *tc = (struct topk_collect *) value;
+    assert(tc != NULL);
+
+    const struct main_stats_collect_info *emit = user_data;
+    assert(emit != NULL);
+    assert(emit->result);
+
+    if (tc->limit <= 0) {
+        return;
+    }
+
+    topk_entry **out = calloc(tc->limit, sizeof(topk_entry *));
+    if (out == NULL) {
+        return;
+    }
+
+    int n = topk_sorted(&tc->agg, out, tc->limit);
+
+    char buf[200];
+    char buf_val[32];
+
+#define topk_stat(field, spec, val)                                  \
+    snprintf(buf, sizeof(buf), "%s:topk:%d:" field, name, i);        \
+    snprintf(buf_val, sizeof(buf_val), spec, val);                   \
+    conflate_add_field(emit->result, buf, buf_val);
+
+    for (int i = 0; i < n; i++) {
+        topk_entry *e = out[i];
+
+        snprintf(buf, sizeof(buf), "%s:topk:%d:key", name, i);
+        conflate_add_field(emit->result, buf, e->key);
+
+        topk_stat("count",  "%llu", (long long unsigned int) e->count);
+        topk_stat("error",  "%llu", (long long unsigned int) e->error);
+        topk_stat("gets",   "%llu", (long long unsigned int) e->gets);
+        topk_stat("sets",   "%llu", (long long unsigned int) e->sets);
+        topk_stat("misses", "%llu", (long long unsigned int) e->misses);
+        topk_stat("bytes",  "%llu", (long long unsigned int) e->bytes);
+    }
+
+#undef topk_stat
+
+    free(out);
+}
+
+static void collect_memcached_stats_for_proxies(struct main_stats_collect_info *msci) {
+    for (int i = 0; i < msci->nproxy; i++) {
+        collect_memcached_stats_for_proxy(msci,
+                                          msci->proxies[i].name,
+                                          msci->proxies[i].port);
+        free(msci->proxies[i].name);
+    }
+    free(msci->proxies);
+
+    msci->proxies = NULL;
+    msci->nproxy = 0;
+}
+
+/* Collects proxy stats from the snapshots that the worker threads
+ * publish every stats_snapshot_interval, on the calling thread,
+ * instead of a round trip through the main listener and worker
+ * threads' work_queues.  So the stats are up to an interval stale,
+ * and leave out the key stats, which aren't part of snapshots.
+ */
+static void snapshot_stats_collect(struct main_stats_collect_info *msci) {
+    proxy_main *m = msci->m;
+
+    int nproxy = main_stats_collect_proxies(msci);
+
+    if (msci->do_stats) {
+        proxy_stats_snapshot ss;
+        proxy_stats_td pstd;
+        char key_buf[300];
+
+        pthread_mutex_lock(&m->proxy_main_lock);
+
+        for (proxy *p = m->proxy_head; p != NULL; p = p->next) {
+            pthread_mutex_lock(&p->proxy_lock);
+            snprintf(key_buf, sizeof(key_buf), "%d:%s",
+                     p->port, p->name != NULL ? p->name : "");
+            pthread_mutex_unlock(&p->proxy_lock);
+
+            memset(&pstd, 0, sizeof(pstd));
+
+            for (int i = 1; i < m->nthreads; i++) {
+                if (cproxy_read_stats_snapshot(&p->thread_data[i], &ss)) {
+                    add_proxy_stats(&pstd.stats, &ss.stats);
+
+                    for (int j = 0; j < STATS_CMD_TYPE_last; j++) {
+                        for (int k = 0; k < STATS_CMD_last; k++) {
+                            add_stats_cmd(&pstd.stats_cmd[j][k],
+                                          &ss.stats_cmd[j][k]);
+                        }
+                    }
+                }
+            }
+
+            map_pstd_foreach_emit(key_buf, &pstd, msci);
+        }
+
+        pthread_mutex_unlock(&m->proxy_main_lock);
+    }
+
+    main_stats_proxy_infos(msci, nproxy);
+}
+
 /* This callback is invoked by conflate on a conflate thread
  * when it wants proxy stats.
  *
@@ -280,6 +423,10 @@ enum conflate_mgmt_cb_result on_conflate_get_stats(void *userdata,
                   (long long unsigned int) m->stat_proxy_existings);
         more_stat("%llu", "main_proxy_shutdowns",
                   (long long unsigned int) m->stat_proxy_shutdowns);
+        more_stat("%llu", "main_proxy_applies",
+                  (long long unsigned int) m->stat_proxy_applies);
+        more_stat("%llu", "main_proxy_skips",
+                  (long long unsigned int) m->stat_proxy_skips);
     }
 
 #undef more_stat
@@ -298,6 +445,16 @@ enum conflate_mgmt_cb_result on_conflate_get_stats(void *userdata,
         server_stats(add_stat_prefix_ase, &ase, NULL);
     }
 
+    if (m->behavior.stats_snapshot_interval > 0) {
+        // Read the worker threads' published snapshots right here,
+        // so neither the main listener nor the workers are stalled.
+        //
+        snapshot_stats_collect(&msci);
+        collect_memcached_stats_for_proxies(&msci);
+
+        return RV_OK;
+    }
+
     // Alloc here so the main listener thread has less work.
     //
     work_collect *ca = calloc(m->nthreads, sizeof(work_collect));
@@ -325,6 +482,13 @@ enum conflate_mgmt_cb_result on_conflate_get_stats(void *userdata,
             if (!(pair->map_key_stats = genhash_init(128, strhash_ops))) {
                 break;
             }
+
+            // Heavy hitter hashmap has same keys and
+            // struct topk_collect * as values.
+            //
+            if (!(pair->map_topk = genhash_init(128, strhash_ops))) {
+                break;
+            }
             work_collect_init(&ca[i], -1, pair);
         }
 
@@ -345,6 +509,7 @@ enum conflate_mgmt_cb_result on_conflate_get_stats(void *userdata,
                 struct stats_gathering_pair *end_pair = ca[1].data;
                 genhash_t *end_pstd = end_pair->map_pstd;
                 genhash_t *end_map_key_stats = end_pair->map_key_stats;
+                genhash_t *end_map_topk = end_pair->map_topk;
                 if (end_pstd != NULL) {
                     // Skip the first worker thread (index 1)'s results,
                     // because that's where we'll aggregate final results.
@@ -363,22 +528,25 @@ enum conflate_mgmt_cb_result on_conflate_get_stats(void *userdata,
                                          map_key_stats_foreach_merge,
                                          end_map_key_stats);
                         }
+
+                        genhash_t *map_topk = pair->map_topk;
+                        if (map_topk != NULL) {
+                            genhash_iter(map_topk,
+                                         map_topk_foreach_merge,
+                                         end_map_topk);
+                        }
                     }
 
                     genhash_iter(end_pstd, map_pstd_foreach_emit, &msci);
                     genhash_iter(end_map_key_stats,
                                  map_key_stats_foreach_emit, &msci);
+                    genhash_iter(end_map_topk,
+                                 map_topk_foreach_emit, &msci);
                 }
             }
         }
 
-        for (i = 0; i < msci.nproxy; i++) {
-            collect_memcached_stats_for_proxy(&msci,
-                                              msci.proxies[i].name,
-                                              msci.proxies[i].port);
-            free(msci.proxies[i].name);
-        }
-        free(msci.proxies);
+        collect_memcached_stats_for_proxies(&msci);
 
         for (i = 1; i < m->nthreads; i++) {
             struct stats_gathering_pair *pair = ca[i].data;
@@ -387,7 +555,7 @@ enum conflate_mgmt_cb_result on_conflate_get_stats(void *userdata,
             }
             genhash_t *map_pstd = pair->map_pstd;
             if (map_pstd != NULL) {
-                genhash_iter(map_pstd, genhash_free_entry, NULL);
+                genhash_iter(map_pstd, map_pstd_foreach_free, NULL);
                 genhash_free(map_pstd);
             }
             genhash_t *map_key_stats = pair->map_key_stats;
@@ -395,6 +563,11 @@ enum conflate_mgmt_cb_result on_conflate_get_stats(void *userdata,
                 genhash_iter(map_key_stats, map_key_stats_foreach_free, NULL);
                 genhash_free(map_key_stats);
             }
+            genhash_t *map_topk = pair->map_topk;
+            if (map_topk != NULL) {
+                genhash_iter(map_topk, map_topk_foreach_free, NULL);
+                genhash_free(map_topk);
+            }
             free(pair);
         }
 
@@ -419,6 +592,15 @@ void map_pstd_foreach_merge(const void *key,
     }
 }
 
+static void map_pstd_foreach_free(const void *key,
+                                  const void *value,
+                                  void *user_data) {
+    assert(value != NULL);
+
+    cproxy_free_stats_td_htgrams((proxy_stats_td *) value);
+    genhash_free_entry(key, value, user_data);
+}
+
 void map_key_stats_foreach_free(const void *key,
                                 const void *value,
                                 void *user_data) {
@@ -446,6 +628,33 @@ void map_key_stats_foreach_merge(const void *key,
     }
 }
 
+static void map_topk_foreach_free(const void *key,
+                                  const void *value,
+                                  void *user_data) {
+    (void)user_data;
+    assert(key);
+    assert(value);
+
+    struct topk_collect *tc = (struct topk_collect *) value;
+
+    topk_destroy(&tc->agg);
+    free(tc);
+    free((void *) key);
+}
+
+static void map_topk_foreach_merge(const void *key,
+                                   const void *value,
+                                   void *user_data) {
+    genhash_t *end_map_topk = user_data;
+    if (key != NULL) {
+        struct topk_collect *tc = (struct topk_collect *) value;
+        struct topk_collect *end_tc = genhash_find(end_map_topk, key);
+        if (tc != NULL && end_tc != NULL) {
+            topk_merge(&end_tc->agg, &tc->agg);
+        }
+    }
+}
+
 static void proxy_stats_dump_behavior(ADD_STAT add_stats,
                                       conn *c, const char *prefix,
                                       proxy_behavior *b, int level) {
@@ -470,8 +679,23 @@ static void proxy_stats_dump_behavior(ADD_STAT add_stats,
               (b->wait_queue_timeout.tv_sec * 1000 +
                b->wait_queue_timeout.tv_usec / 1000));
         APPEND_PREFIX_STAT("time_stats", "%d", b->time_stats);
+        APPEND_PREFIX_STAT("time_stats_detail", "%d", b->time_stats_detail);
+        APPEND_PREFIX_STAT("conn_buffer_pool", "%d", b->conn_buffer_pool);
+        APPEND_PREFIX_STAT("io_uring", "%d", b->io_uring);
+        APPEND_PREFIX_STAT("stats_snapshot_interval", "%u",
+                           b->stats_snapshot_interval);
         APPEND_PREFIX_STAT("connect_max_errors", "%d", b->connect_max_errors);
         APPEND_PREFIX_STAT("connect_retry_interval", "%d", b->connect_retry_interval);
+        APPEND_PREFIX_STAT("hedge_delay", "%u", b->hedge_delay);
+        APPEND_PREFIX_STAT("hedge_budget", "%u", b->hedge_budget);
+        APPEND_PREFIX_STAT("trace_sample", "%u", b->trace_sample);
+        APPEND_PREFIX_STAT("noreply_batch_max", "%u", b->noreply_batch_max);
+        APPEND_PREFIX_STAT("noreply_batch_interval", "%u",
+                           b->noreply_batch_interval);
+        APPEND_PREFIX_STAT("multiget_batch_max", "%u",
+                           b->multiget_batch_max);
+        APPEND_PREFIX_STAT("multiget_batch_window", "%u",
+                           b->multiget_batch_window);
         APPEND_PREFIX_STAT("front_cache_max", "%u", b->front_cache_max);
         APPEND_PREFIX_STAT("front_cache_lifespan", "%u", b->front_cache_lifespan);
         APPEND_PREFIX_STAT("front_cache_spec", "%s", b->front_cache_spec);
@@ -480,7 +704,11 @@ static void proxy_stats_dump_behavior(ADD_STAT add_stats,
         APPEND_PREFIX_STAT("key_stats_lifespan", "%u", b->key_stats_lifespan);
         APPEND_PREFIX_STAT("key_stats_spec", "%s", b->key_stats_spec);
         APPEND_PREFIX_STAT("key_stats_unspec", "%s", b->key_stats_unspec);
+        APPEND_PREFIX_STAT("key_stats_topk", "%d", b->key_stats_topk);
         APPEND_PREFIX_STAT("optimize_set", "%s", b->optimize_set);
+        APPEND_PREFIX_STAT("combine_set", "%s", b->combine_set);
+        APPEND_PREFIX_STAT("combine_set_window", "%u",
+                           b->combine_set_window);
     }
 
     APPEND_PREFIX_STAT("usr",    "%s", b->usr);
@@ -490,6 +718,7 @@ static void proxy_stats_dump_behavior(ADD_STAT add_stats,
 
     if (level >= 1) {
         APPEND_PREFIX_STAT("port_listen", "%d", b->port_listen);
+        APPEND_PREFIX_STAT("listen_reuseport", "%d", b->listen_reuseport);
         APPEND_PREFIX_STAT("default_bucket_name", "%s", b->default_bucket_name);
     }
 }
@@ -615,6 +844,26 @@ static void proxy_stats_dump_pstd_stats(ADD_STAT add_stats,
               "%llu", (long long unsigned int) pstats->max_retry_time);
     APPEND_PREFIX_STAT("tot_retry_vbucket",
               "%llu", (long long unsigned int) pstats->tot_retry_vbucket);
+    APPEND_PREFIX_STAT("tot_hedge_eligible",
+              "%llu", (long long unsigned int) pstats->tot_hedge_eligible);
+    APPEND_PREFIX_STAT("tot_hedge",
+              "%llu", (long long unsigned int) pstats->tot_hedge);
+    APPEND_PREFIX_STAT("tot_hedge_win",
+              "%llu", (long long unsigned int) pstats->tot_hedge_win);
+    APPEND_PREFIX_STAT("tot_hedge_over_budget",
+              "%llu", (long long unsigned int) pstats->tot_hedge_over_budget);
+    APPEND_PREFIX_STAT("tot_noreply_batched",
+              "%llu", (long long unsigned int) pstats->tot_noreply_batched);
+    APPEND_PREFIX_STAT("tot_noreply_batch_flushes",
+              "%llu", (long long unsigned int) pstats->tot_noreply_batch_flushes);
+    APPEND_PREFIX_STAT("tot_combine_sets",
+              "%llu", (long long unsigned int) pstats->tot_combine_sets);
+    APPEND_PREFIX_STAT("tot_combine_sets_collapsed",
+              "%llu", (long long unsigned int) pstats->tot_combine_sets_collapsed);
+    APPEND_PREFIX_STAT("tot_multiget_batches",
+              "%llu", (long long unsigned int) pstats->tot_multiget_batches);
+    APPEND_PREFIX_STAT("tot_multiget_batched",
+              "%llu", (long long unsigned int) pstats->tot_multiget_batched);
     APPEND_PREFIX_STAT("tot_upstream_paused",
               "%llu", (long long unsigned int) pstats->tot_upstream_paused);
     APPEND_PREFIX_STAT("tot_upstream_unpaused",
@@ -747,6 +996,10 @@ void proxy_stats_dump_proxy_main(ADD_STAT add_stats, conn *c,
                     "%llu", (long long unsigned int) pm->stat_proxy_existings);
         APPEND_PREFIX_STAT("stat_proxy_shutdowns",
                     "%llu", (long long unsigned int) pm->stat_proxy_shutdowns);
+        APPEND_PREFIX_STAT("stat_proxy_applies",
+                    "%llu", (long long unsigned int) pm->stat_proxy_applies);
+        APPEND_PREFIX_STAT("stat_proxy_skips",
+                    "%llu", (long long unsigned int) pm->stat_proxy_skips);
     }
 }
 
@@ -851,6 +1104,7 @@ void proxy_stats_dump_proxies(ADD_STAT add_stats, conn *c,
                 proxy_stats_dump_stats_cmd(add_stats, c, prefix,
                                            pstd->stats_cmd);
 
+                cproxy_free_stats_td_htgrams(pstd);
                 free(pstd);
             }
         }
@@ -888,24 +1142,15 @@ void proxy_stats_dump_proxies(ADD_STAT add_stats, conn *c,
  *
  * Puts stats gathering work on every worker thread's work_queue.
  */
-static void main_stats_collect(void *data0, void *data1) {
-    struct main_stats_collect_info *msci = data0;
-    assert(msci);
-    assert(msci->result);
-
+/* Emits each proxy's info, settings and front_cache stats,
+ * returning the number of proxies.
+ */
+static int main_stats_collect_proxies(struct main_stats_collect_info *msci) {
     proxy_main *m = msci->m;
-    assert(m);
-    assert(m->nthreads > 1);
-
-    work_collect *ca = data1;
-    assert(ca);
-
-    assert(is_listen_thread());
 
     struct main_stats_collect_info ase = *msci;
     ase.prefix = "";
 
-    int sent   = 0;
     int nproxy = 0;
 
     char bufk[200];
@@ -1010,6 +1255,56 @@ static void main_stats_collect(void *data0, void *data1) {
 
     pthread_mutex_unlock(&m->proxy_main_lock);
 
+    return nproxy;
+}
+
+/* Remembers the name and port of the first nproxy proxies, for
+ * collect_memcached_stats_for_proxy() after the stats are gathered.
+ */
+static void main_stats_proxy_infos(struct main_stats_collect_info *msci,
+                                   int nproxy) {
+    proxy_main *m = msci->m;
+
+    struct main_stats_proxy_info *infos =
+        calloc(nproxy, sizeof(struct main_stats_proxy_info));
+
+    pthread_mutex_lock(&m->proxy_main_lock);
+
+    proxy *p = m->proxy_head;
+    for (int i = 0; i < nproxy && infos != NULL; i++, p = p->next) {
+        if (p == NULL) {
+            break;
+        }
+
+        pthread_mutex_lock(&p->proxy_lock);
+        infos[i].name = p->name != NULL ? strdup(p->name) : NULL;
+        infos[i].port = p->port;
+        pthread_mutex_unlock(&p->proxy_lock);
+    }
+
+    pthread_mutex_unlock(&m->proxy_main_lock);
+
+    msci->proxies = infos;
+    msci->nproxy = infos != NULL ? nproxy : 0;
+}
+
+static void main_stats_collect(void *data0, void *data1) {
+    struct main_stats_collect_info *msci = data0;
+    assert(msci);
+    assert(msci->result);
+
+    proxy_main *m = msci->m;
+    assert(m);
+    assert(m->nthreads > 1);
+
+    work_collect *ca = data1;
+    assert(ca);
+
+    assert(is_listen_thread());
+
+    int sent   = 0;
+    int nproxy = main_stats_collect_proxies(msci);
+
     // Starting at 1 because 0 is the main listen thread.
     //
     for (int i = 1; i < m->nthreads; i++) {
@@ -1036,29 +1331,7 @@ static void main_stats_collect(void *data0, void *data1) {
         }
     }
 
-    {
-        struct main_stats_proxy_info *infos =
-            calloc(nproxy, sizeof(struct main_stats_proxy_info));
-
-        pthread_mutex_lock(&m->proxy_main_lock);
-
-        proxy *p = m->proxy_head;
-        for (int i = 0; i < nproxy; i++, p = p->next) {
-            if (p == NULL) {
-                break;
-            }
-
-            pthread_mutex_lock(&p->proxy_lock);
-            infos[i].name = p->name != NULL ? strdup(p->name) : NULL;
-            infos[i].port = p->port;
-            pthread_mutex_unlock(&p->proxy_lock);
-        }
-
-        pthread_mutex_unlock(&m->proxy_main_lock);
-
-        msci->proxies = infos;
-        msci->nproxy = nproxy;
-    }
+    main_stats_proxy_infos(msci, nproxy);
 
     // Normally, no need to wait for the worker threads to finish,
     // as the workers will signal using work_collect_one().
@@ -1138,6 +1411,34 @@ static void work_stats_collect(void *data0, void *data1) {
                 add_raw_key_stats(key_stats_map, &ptd->key_stats);
             }
 
+            if (ptd->key_stats_topk.max > 0) {
+                struct topk_collect *tc = genhash_find(pair->map_topk,
+                                                       key_buf);
+                if (tc == NULL) {
+                    // Sized to hold every worker thread's keys, so
+                    // merging loses nothing before the final ranking.
+                    //
+                    tc = calloc(1, sizeof(struct topk_collect));
+                    if (tc != NULL) {
+                        char *key = strdup(key_buf);
+                        if (key == NULL ||
+                            !topk_init(&tc->agg, ptd->key_stats_topk.max *
+                                       p->main->nthreads)) {
+                            free(key);
+                            free(tc);
+                            tc = NULL;
+                        } else {
+                            tc->limit = ptd->key_stats_topk.max;
+                            genhash_update(pair->map_topk, key, tc);
+                        }
+                    }
+                }
+
+                if (tc != NULL) {
+                    topk_merge(&tc->agg, &ptd->key_stats_topk);
+                }
+            }
+
             free(key_buf);
         }
     }
@@ -1162,6 +1463,48 @@ static void add_proxy_stats_td(proxy_stats_td *agg,
                           &x->stats_cmd[j][k]);
         }
     }
+
+    add_timing_htgram(&agg->downstream_reserved_time_htgram,
+                      x->downstream_reserved_time_htgram);
+    add_timing_htgram(&agg->downstream_connect_time_htgram,
+                      x->downstream_connect_time_htgram);
+
+    // A worker thread creates these on its own, when the
+    // time_stats_detail behavior is on.
+    //
+    for (int k = 0; k < STATS_CMD_last; k++) {
+        add_timing_htgram(&agg->cmd_time_htgram[k],
+                          __atomic_load_n(&x->cmd_time_htgram[k],
+                                          __ATOMIC_ACQUIRE));
+    }
+
+    for (int k = 0; k < PROXY_STATS_SERVER_MAX; k++) {
+        add_timing_htgram(&agg->server_time_htgram[k],
+                          __atomic_load_n(&x->server_time_htgram[k],
+                                          __ATOMIC_ACQUIRE));
+    }
+
+    add_timing_htgram(&agg->noreply_batch_htgram,
+                      x->noreply_batch_htgram);
+}
+
+/* The histograms of x may belong to, and be concurrently updated
+ * by, a worker thread, which htgram_add() allows.
+ */
+static void add_timing_htgram(HTGRAM_HANDLE *agg, HTGRAM_HANDLE x) {
+    assert(agg);
+
+    if (x == NULL) {
+        return;
+    }
+
+    if (*agg == NULL) {
+        *agg = cproxy_create_timing_histogram();
+    }
+
+    if (*agg != NULL) {
+        htgram_add(*agg, x);
+    }
 }
 
 static void add_proxy_stats(proxy_stats *agg, proxy_stats *x) {
@@ -1220,6 +1563,16 @@ static void add_proxy_stats(proxy_stats *agg, proxy_stats *x) {
     }
 
     agg->tot_retry_vbucket        += x->tot_retry_vbucket;
+    agg->tot_hedge_eligible       += x->tot_hedge_eligible;
+    agg->tot_hedge                += x->tot_hedge;
+    agg->tot_hedge_win            += x->tot_hedge_win;
+    agg->tot_hedge_over_budget    += x->tot_hedge_over_budget;
+    agg->tot_noreply_batched      += x->tot_noreply_batched;
+    agg->tot_noreply_batch_flushes += x->tot_noreply_batch_flushes;
+    agg->tot_combine_sets         += x->tot_combine_sets;
+    agg->tot_combine_sets_collapsed += x->tot_combine_sets_collapsed;
+    agg->tot_multiget_batches     += x->tot_multiget_batches;
+    agg->tot_multiget_batched     += x->tot_multiget_batched;
     agg->tot_upstream_paused      += x->tot_upstream_paused;
     agg->tot_upstream_unpaused    += x->tot_upstream_unpaused;
     agg->err_oom                  += x->err_oom;
@@ -1482,6 +1835,26 @@ void map_pstd_foreach_emit(const void *k,
               pstd->stats.max_retry_time);
     more_stat("tot_retry_vbucket",
               pstd->stats.tot_retry_vbucket);
+    more_stat("tot_hedge_eligible",
+              pstd->stats.tot_hedge_eligible);
+    more_stat("tot_hedge",
+              pstd->stats.tot_hedge);
+    more_stat("tot_hedge_win",
+              pstd->stats.tot_hedge_win);
+    more_stat("tot_hedge_over_budget",
+              pstd->stats.tot_hedge_over_budget);
+    more_stat("tot_noreply_batched",
+              pstd->stats.tot_noreply_batched);
+    more_stat("tot_noreply_batch_flushes",
+              pstd->stats.tot_noreply_batch_flushes);
+    more_stat("tot_combine_sets",
+              pstd->stats.tot_combine_sets);
+    more_stat("tot_combine_sets_collapsed",
+              pstd->stats.tot_combine_sets_collapsed);
+    more_stat("tot_multiget_batches",
+              pstd->stats.tot_multiget_batches);
+    more_stat("tot_multiget_batched",
+              pstd->stats.tot_multiget_batched);
     more_stat("tot_upstream_paused",
               pstd->stats.tot_upstream_paused);
     more_stat("tot_upstream_unpaused",
@@ -1620,6 +1993,8 @@ static void main_stats_reset(void *data0, void *data1) {
     m->stat_proxy_start_fails = 0;
     m->stat_proxy_existings = 0;
     m->stat_proxy_shutdowns = 0;
+    m->stat_proxy_applies = 0;
+    m->stat_proxy_skips = 0;
 
     int sent   = 0;
     int nproxy = 0;
@@ -1691,6 +2066,11 @@ static void work_stats_reset(void *data0, void *data1) {
     cproxy_reset_stats_td(&ptd->stats);
 
     mcache_flush_all(&ptd->key_stats, 0);
+    topk_reset(&ptd->key_stats_topk);
+
+    if (ptd->proxy->main->behavior.stats_snapshot_interval > 0) {
+        cproxy_publish_stats_snapshot(ptd);
+    }
 
     work_collect_one(c);
 }
@@ -1734,7 +2114,72 @@ static void htgram_dump_callback(HTGRAM_HANDLE h, const char *dump_line, void *c
     APPEND_STAT(prefix, "%s", dump_line);
 }
 
-void proxy_stats_dump_timings(ADD_STAT add_stats, conn *c) {
+static void htgram_percentile_stats(ADD_STAT add_stats, conn *c,
+                                    const char *prefix, HTGRAM_HANDLE h) {
+    int64_t value;
+
+    APPEND_PREFIX_STAT("count", "%llu",
+                       (long long unsigned int) htgram_get_count(h));
+
+    if (htgram_percentile(h, 50.0, &value)) {
+        APPEND_PREFIX_STAT("p50", "%lld", (long long int) value);
+    }
+    if (htgram_percentile(h, 90.0, &value)) {
+        APPEND_PREFIX_STAT("p90", "%lld", (long long int) value);
+    }
+    if (htgram_percentile(h, 99.0, &value)) {
+        APPEND_PREFIX_STAT("p99", "%lld", (long long int) value);
+    }
+    if (htgram_percentile(h, 99.9, &value)) {
+        APPEND_PREFIX_STAT("p999", "%lld", (long long int) value);
+    }
+}
+
+/* Emits the percentiles of one timing histogram, and its bins too
+ * when it was asked for by the filter or dump_bins is true.  A NULL
+ * filter matches everything, otherwise it must be either the
+ * category, like "cmd", or the exact group, like "cmd_get".
+ */
+static void proxy_stats_dump_timing(ADD_STAT add_stats, conn *c,
+                                    proxy *p, const char *filter,
+                                    const char *category, const char *group,
+                                    HTGRAM_HANDLE h, bool dump_bins) {
+    if (h == NULL) {
+        return;
+    }
+
+    if (filter != NULL) {
+        if (strcmp(filter, category) != 0 &&
+            strcmp(filter, group) != 0) {
+            return;
+        }
+
+        dump_bins = true;
+    }
+
+    char prefix[200];
+
+    snprintf(prefix, sizeof(prefix), "%u:%s:%s_", p->port, p->name, group);
+    htgram_percentile_stats(add_stats, c, prefix, h);
+
+    if (dump_bins) {
+        struct htgram_dump_callback_data cbdata;
+        cbdata.add_stats = add_stats;
+        cbdata.prefix    = prefix;
+        cbdata.conn      = c;
+
+        snprintf(prefix, sizeof(prefix), "%u:%s:%s", p->port, p->name, group);
+        htgram_dump(h, htgram_dump_callback, &cbdata);
+    }
+}
+
+/* Handles "stats proxy timings [filter]", where the optional
+ * filter is one of "connect", "reserved", "cmd", "cmd_<command>",
+ * "server", "server_<index>" or "noreply_batch".  The noreply_batch
+ * histogram counts writes per flushed pipeline, not usecs.
+ */
+void proxy_stats_dump_timings(ADD_STAT add_stats, conn *c,
+                              const char *filter) {
     assert(c != NULL);
 
     proxy_td *ptd = c->extra;
@@ -1750,43 +2195,140 @@ void proxy_stats_dump_timings(ADD_STAT add_stats, conn *c) {
         return;
     }
 
-    char prefix[200];
+    char group[100];
 
     for (proxy *p = pm->proxy_head; p != NULL; p = p->next) {
-        HTGRAM_HANDLE hreserved = cproxy_create_timing_histogram();
-        HTGRAM_HANDLE hconnect = cproxy_create_timing_histogram();
-        if (hreserved != NULL &&
-            hconnect != NULL) {
-            pthread_mutex_lock(&p->proxy_lock);
-            for (int i = 1; i < pm->nthreads; i++) {
-                proxy_td *thread_ptd = &p->thread_data[i];
-                if (thread_ptd != NULL &&
-                    thread_ptd->stats.downstream_reserved_time_htgram != NULL) {
-                    htgram_add(hreserved, thread_ptd->stats.downstream_reserved_time_htgram);
-                    htgram_add(hconnect, thread_ptd->stats.downstream_connect_time_htgram);
-                }
+        proxy_stats_td *pstd = calloc(1, sizeof(proxy_stats_td));
+        if (pstd == NULL) {
+            continue;
+        }
+
+        pthread_mutex_lock(&p->proxy_lock);
+        for (int i = 1; i < pm->nthreads; i++) {
+            proxy_td *thread_ptd = &p->thread_data[i];
+            if (thread_ptd != NULL) {
+                add_proxy_stats_td(pstd, &thread_ptd->stats);
             }
-            pthread_mutex_unlock(&p->proxy_lock);
+        }
+        pthread_mutex_unlock(&p->proxy_lock);
 
-            struct htgram_dump_callback_data cbdata;
-            cbdata.add_stats = add_stats;
-            cbdata.prefix    = prefix;
-            cbdata.conn      = c;
+        // Always report connect and reserved timings, even if empty.
+        //
+        if (pstd->downstream_connect_time_htgram == NULL) {
+            pstd->downstream_connect_time_htgram =
+                cproxy_create_timing_histogram();
+        }
+        if (pstd->downstream_reserved_time_htgram == NULL) {
+            pstd->downstream_reserved_time_htgram =
+                cproxy_create_timing_histogram();
+        }
 
-            snprintf(prefix, sizeof(prefix), "%u:%s:connect", p->port, p->name);
-            htgram_dump(hconnect, htgram_dump_callback, &cbdata);
+        proxy_stats_dump_timing(add_stats, c, p, filter,
+                                "connect", "connect",
+                                pstd->downstream_connect_time_htgram, true);
+        proxy_stats_dump_timing(add_stats, c, p, filter,
+                                "reserved", "reserved",
+                                pstd->downstream_reserved_time_htgram, true);
 
-            snprintf(prefix, sizeof(prefix), "%u:%s:reserved", p->port, p->name);
-            htgram_dump(hreserved, htgram_dump_callback, &cbdata);
+        for (int k = 0; k < STATS_CMD_last; k++) {
+            snprintf(group, sizeof(group), "cmd_%s", cmd_names[k]);
+            proxy_stats_dump_timing(add_stats, c, p, filter,
+                                    "cmd", group,
+                                    pstd->cmd_time_htgram[k], false);
         }
 
-        if (hreserved != NULL) {
-            htgram_destroy(hreserved);
+        for (int k = 0; k < PROXY_STATS_SERVER_MAX; k++) {
+            snprintf(group, sizeof(group), "server_%d", k);
+            proxy_stats_dump_timing(add_stats, c, p, filter,
+                                    "server", group,
+                                    pstd->server_time_htgram[k], false);
         }
 
-        if (hconnect != NULL) {
-            htgram_destroy(hconnect);
+        proxy_stats_dump_timing(add_stats, c, p, filter,
+                                "noreply_batch", "noreply_batch",
+                                pstd->noreply_batch_htgram, false);
+
+        cproxy_free_stats_td_htgrams(pstd);
+        free(pstd);
+    }
+
+    pthread_mutex_unlock(&pm->proxy_main_lock);
+}
+
+/* Handles "stats proxy trace", dumping each worker thread's latest
+ * sampled requests, oldest first, with each stage's time in usecs
+ * since the request paused for a downstream, or "-" if the request
+ * never reached the stage.
+ */
+void proxy_stats_dump_trace(ADD_STAT add_stats, conn *c) {
+    assert(c != NULL);
+
+    proxy_td *ptd = c->extra;
+    if (ptd == NULL ||
+        ptd->proxy == NULL ||
+        ptd->proxy->main == NULL) {
+        return;
+    }
+
+    proxy_main *pm = ptd->proxy->main;
+
+    if (pthread_mutex_trylock(&pm->proxy_main_lock) != 0) {
+        return;
+    }
+
+    char key[200];
+    char val[400];
+
+    for (proxy *p = pm->proxy_head; p != NULL; p = p->next) {
+        pthread_mutex_lock(&p->proxy_lock);
+
+        for (int i = 1; i < pm->nthreads && i < p->thread_data_num; i++) {
+            proxy_td *thread_ptd = &p->thread_data[i];
+            proxy_trace *t = __atomic_load_n(&thread_ptd->trace,
+                                             __ATOMIC_ACQUIRE);
+            if (t == NULL) {
+                continue;
+            }
+
+            uint64_t seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+            uint64_t id = seq > PROXY_TRACE_MAX ?
+                seq - PROXY_TRACE_MAX + 1 : 1;
+
+            for (; id <= seq; id++) {
+                proxy_trace_rec r;
+
+                if (!cproxy_read_trace(thread_ptd, id, &r)) {
+                    continue;
+                }
+
+                uint64_t start = r.usec[TRACE_STAGE_PAUSE];
+
+                int n = snprintf(val, sizeof(val), "cmd=%s fd=%d start=%llu",
+                                 r.cmd[0] != '\0' ? r.cmd : "-", r.sfd,
+                                 (long long unsigned int) start);
+
+                for (int k = TRACE_STAGE_PAUSE + 1;
+                     k < TRACE_STAGE_last && n > 0 && n < (int) sizeof(val);
+                     k++) {
+                    if (r.usec[k] != 0 && r.usec[k] >= start) {
+                        n += snprintf(val + n, sizeof(val) - n, " %s=%llu",
+                                      cproxy_trace_stage_name(k),
+                                      (long long unsigned int)
+                                      (r.usec[k] - start));
+                    } else {
+                        n += snprintf(val + n, sizeof(val) - n, " %s=-",
+                                      cproxy_trace_stage_name(k));
+                    }
+                }
+
+                snprintf(key, sizeof(key), "%u:%s:trace:%d:%llu",
+                         p->port, p->name, i, (long long unsigned int) id);
+
+                add_stats(key, strlen(key), val, strlen(val), c);
+            }
         }
+
+        pthread_mutex_unlock(&p->proxy_lock);
     }
 
     pthread_mutex_unlock(&pm->proxy_main_lock);
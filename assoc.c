@@ -22,6 +22,7 @@
 #include "log.h"
 
 static pthread_cond_t maintenance_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 typedef  unsigned long  int  ub4;   /* unsigned 4-byte quantities */
@@ -30,6 +31,15 @@ typedef  unsigned       char ub1;   /* unsigned 1-byte quantities */
 /* how many powers of 2's worth of buckets we use */
 static unsigned int hashpower = 16;
 
+/*
+ * A bucket's items all share an item lock (see items.c), as the item
+ * locks are a coarser split of the same hash bits.  Lookups, inserts
+ * and deletes of a key run under its item lock.  Starting and ending
+ * an expansion take every item lock, and the maintenance thread moves
+ * each old bucket under that bucket's item lock, so only the
+ * expand_bucket progress is read without the lock that writes it.
+ */
+
 #define hashsize(n) ((ub4)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
@@ -45,6 +55,9 @@ static item** old_hashtable = 0;
 /* Number of items in the hash table. */
 static unsigned int hash_items = 0;
 
+/* Flag: Has an insert asked the maintenance thread to expand? */
+static bool expand_requested = false;
+
 /* Flag: Are we in the middle of expanding now? */
 static bool expanding = false;
 
@@ -62,13 +75,16 @@ void assoc_init(void) {
     }
 }
 
-item *assoc_find(const char *key, const size_t nkey) {
-    uint32_t hv = hash(key, nkey, 0);
+static unsigned int assoc_expand_bucket(void) {
+    return __atomic_load_n(&expand_bucket, __ATOMIC_RELAXED);
+}
+
+item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
     item *it;
     unsigned int oldbucket;
 
     if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
+        (oldbucket = (hv & hashmask(hashpower - 1))) >= assoc_expand_bucket())
     {
         it = old_hashtable[oldbucket];
     } else {
@@ -92,13 +108,13 @@ item *assoc_find(const char *key, const size_t nkey) {
 /* returns the address of the item pointer before the key.  if *item == 0,
    the item wasn't found */
 
-static item** _hashitem_before (const char *key, const size_t nkey) {
-    uint32_t hv = hash(key, nkey, 0);
+static item** _hashitem_before (const char *key, const size_t nkey,
+                                const uint32_t hv) {
     item **pos;
     unsigned int oldbucket;
 
     if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
+        (oldbucket = (hv & hashmask(hashpower - 1))) >= assoc_expand_bucket())
     {
         pos = &old_hashtable[oldbucket];
     } else {
@@ -111,7 +127,13 @@ static item** _hashitem_before (const char *key, const size_t nkey) {
     return pos;
 }
 
-/* grows the hashtable to the next power of 2. */
+static bool assoc_too_full(void) {
+    return __atomic_load_n(&hash_items, __ATOMIC_RELAXED) >
+        (hashsize(hashpower) * 3) / 2;
+}
+
+/* grows the hashtable to the next power of 2.  The caller holds
+ * every item lock. */
 static void assoc_expand(void) {
     old_hashtable = primary_hashtable;
 
@@ -121,24 +143,34 @@ static void assoc_expand(void) {
             moxi_log_write("Hash table expansion starting\n");
         hashpower++;
         expanding = true;
-        expand_bucket = 0;
-        pthread_cond_signal(&maintenance_cond);
+        __atomic_store_n(&expand_bucket, 0, __ATOMIC_RELAXED);
     } else {
         primary_hashtable = old_hashtable;
         /* Bad news, but we can keep running. */
     }
 }
 
+/* An inserting thread holds an item lock, so it leaves the expansion
+ * to the maintenance thread. */
+static void assoc_request_expand(void) {
+    if (__atomic_load_n(&expand_requested, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&maintenance_lock);
+    __atomic_store_n(&expand_requested, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&maintenance_cond);
+    pthread_mutex_unlock(&maintenance_lock);
+}
+
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
-int assoc_insert(item *it) {
-    uint32_t hv;
+int assoc_insert(item *it, const uint32_t hv) {
     unsigned int oldbucket;
 
-    assert(assoc_find(ITEM_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
+    assert(assoc_find(ITEM_key(it), it->nkey, hv) == 0);  /* shouldn't have duplicately named things defined */
 
-    hv = hash(ITEM_key(it), it->nkey, 0);
     if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
+        (oldbucket = (hv & hashmask(hashpower - 1))) >= assoc_expand_bucket())
     {
         it->h_next = old_hashtable[oldbucket];
         old_hashtable[oldbucket] = it;
@@ -147,21 +179,21 @@ int assoc_insert(item *it) {
         primary_hashtable[hv & hashmask(hashpower)] = it;
     }
 
-    hash_items++;
-    if (! expanding && hash_items > (hashsize(hashpower) * 3) / 2) {
-        assoc_expand();
+    __atomic_add_fetch(&hash_items, 1, __ATOMIC_RELAXED);
+    if (! expanding && assoc_too_full()) {
+        assoc_request_expand();
     }
 
     MEMCACHED_ASSOC_INSERT(ITEM_key(it), it->nkey, hash_items);
     return 1;
 }
 
-void assoc_delete(const char *key, const size_t nkey) {
-    item **before = _hashitem_before(key, nkey);
+void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
+    item **before = _hashitem_before(key, nkey, hv);
 
     if (*before) {
         item *nxt;
-        hash_items--;
+        __atomic_sub_fetch(&hash_items, 1, __ATOMIC_RELAXED);
         /* The DTrace probe cannot be triggered as the last instruction
          * due to possible tail-optimization by the compiler
          */
@@ -182,45 +214,69 @@ static volatile int do_run_maintenance_thread = 1;
 #define DEFAULT_HASH_BULK_MOVE 1
 int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
 
+/* Moves an old bucket to the new hash table, under the item lock
+ * that all of the bucket's items share. */
+static void assoc_move_bucket(void) {
+    unsigned int oldbucket = expand_bucket;
+    item *it, *next;
+    int bucket;
+
+    item_lock(oldbucket);
+
+    for (it = old_hashtable[oldbucket]; NULL != it; it = next) {
+        next = it->h_next;
+
+        bucket = hash(ITEM_key(it), it->nkey, 0) & hashmask(hashpower);
+        it->h_next = primary_hashtable[bucket];
+        primary_hashtable[bucket] = it;
+    }
+
+    old_hashtable[oldbucket] = NULL;
+
+    __atomic_store_n(&expand_bucket, oldbucket + 1, __ATOMIC_RELAXED);
+
+    item_unlock(oldbucket);
+}
+
 static void *assoc_maintenance_thread(void *arg) {
     (void)arg;
 
     while (do_run_maintenance_thread) {
         int ii = 0;
 
-        /* Lock the cache, and bulk move multiple buckets to the new
-         * hash table. */
-        pthread_mutex_lock(&cache_lock);
-
-        for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
-            item *it, *next;
-            int bucket;
-
-            for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-                next = it->h_next;
+        if (!expanding) {
+            /* We are done expanding.. just wait for next invocation */
+            pthread_mutex_lock(&maintenance_lock);
+            while (!__atomic_load_n(&expand_requested, __ATOMIC_RELAXED) &&
+                   do_run_maintenance_thread) {
+                pthread_cond_wait(&maintenance_cond, &maintenance_lock);
+            }
+            pthread_mutex_unlock(&maintenance_lock);
 
-                bucket = hash(ITEM_key(it), it->nkey, 0) & hashmask(hashpower);
-                it->h_next = primary_hashtable[bucket];
-                primary_hashtable[bucket] = it;
+            item_lock_all();
+            if (!expanding && assoc_too_full()) {
+                assoc_expand();
             }
+            __atomic_store_n(&expand_requested, false, __ATOMIC_RELAXED);
+            item_unlock_all();
+            continue;
+        }
 
-            old_hashtable[expand_bucket] = NULL;
+        /* Bulk move multiple buckets to the new hash table. */
+        for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
+            assoc_move_bucket();
 
-            expand_bucket++;
             if (expand_bucket == hashsize(hashpower - 1)) {
+                item_lock_all();
                 expanding = false;
+                item_unlock_all();
+
                 free(old_hashtable);
+                old_hashtable = NULL;
                 if (settings.verbose > 1)
                     moxi_log_write("Hash table expansion done\n");
             }
         }
-
-        if (!expanding) {
-            /* We are done expanding.. just wait for next invocation */
-            pthread_cond_wait(&maintenance_cond, &cache_lock);
-        }
-
-        pthread_mutex_unlock(&cache_lock);
     }
     return NULL;
 }
@@ -245,10 +301,10 @@ int start_assoc_maintenance_thread() {
 }
 
 void stop_assoc_maintenance_thread() {
-    pthread_mutex_lock(&cache_lock);
+    pthread_mutex_lock(&maintenance_lock);
     do_run_maintenance_thread = 0;
     pthread_cond_signal(&maintenance_cond);
-    pthread_mutex_unlock(&cache_lock);
+    pthread_mutex_unlock(&maintenance_lock);
 
     /* Wait for the maintenance thread to stop */
     pthread_join(maintenance_tid, NULL);
@@ -1,8 +1,8 @@
 /* associative array */
 void assoc_init(void);
-item *assoc_find(const char *key, const size_t nkey);
-int assoc_insert(item *item);
-void assoc_delete(const char *key, const size_t nkey);
+item *assoc_find(const char *key, const size_t nkey, const uint32_t hv);
+int assoc_insert(item *item, const uint32_t hv);
+void assoc_delete(const char *key, const size_t nkey, const uint32_t hv);
 void do_assoc_move_next_bucket(void);
 int start_assoc_maintenance_thread(void);
 void stop_assoc_maintenance_thread(void);
@@ -83,13 +83,28 @@ START_TEST(test_parse_behavior) {
                             " key_stats_lifespan = 8 , "
                             " key_stats_spec = xxx|yyy , "
                             " key_stats_unspec  = zzz ,"
+                            " key_stats_topk = 1 ,"
+                            " time_stats_detail = 1 ,"
+                            " io_uring = 1 ,"
+                            " conn_buffer_pool = 1 ,"
+                            " stats_snapshot_interval = 9 ,"
+                            " trace_sample = 10 ,"
+                            " hedge_delay = 16 ,"
+                            " hedge_budget = 17 ,"
+                            " noreply_batch_max = 11 ,"
+                            " noreply_batch_interval = 12 ,"
+                            " multiget_batch_max = 14 ,"
+                            " multiget_batch_window = 15 ,"
                             " optimize_set =  1|2|3  , "
+                            " combine_set = ctr:|sess: , "
+                            " combine_set_window = 13 , "
                             " usr = user  , "
                             " pwd = pswd  , "
                             " host = hostname ,"
                             " port = 4321 , "
                             " bucket = buck , "
                             " port_listen = 443322 , "
+                            " listen_reuseport = 1 , "
                             " UNKNOWN_IGNORED_KEY =, "
                             " ,,,  ",
                             b);
@@ -107,13 +122,28 @@ START_TEST(test_parse_behavior) {
     fail_unless(w.key_stats_max == 7, "tpb");
     fail_unless(strcmp(w.key_stats_spec, "xxx|yyy") == 0, "tpb");
     fail_unless(strcmp(w.key_stats_unspec, "zzz") == 0, "tpb");
+    fail_unless(w.key_stats_topk == true, "tpb");
+    fail_unless(w.time_stats_detail == true, "tpb");
+    fail_unless(w.io_uring == true, "tpb");
+    fail_unless(w.conn_buffer_pool == true, "tpb");
+    fail_unless(w.stats_snapshot_interval == 9, "tpb");
+    fail_unless(w.trace_sample == 10, "tpb");
+    fail_unless(w.hedge_delay == 16, "tpb");
+    fail_unless(w.hedge_budget == 17, "tpb");
+    fail_unless(w.noreply_batch_max == 11, "tpb");
+    fail_unless(w.noreply_batch_interval == 12, "tpb");
+    fail_unless(w.multiget_batch_max == 14, "tpb");
+    fail_unless(w.multiget_batch_window == 15, "tpb");
     fail_unless(strcmp(w.optimize_set, "1|2|3") == 0, "tpb");
+    fail_unless(strcmp(w.combine_set, "ctr:|sess:") == 0, "tpb");
+    fail_unless(w.combine_set_window == 13, "tpb");
     fail_unless(strcmp(w.usr, "user") == 0, "tpb");
     fail_unless(strcmp(w.pwd, "pswd") == 0, "tpb");
     fail_unless(strcmp(w.host, "hostname") == 0, "tpb");
     fail_unless(w.port == 4321, "tpb");
     fail_unless(strcmp(w.bucket, "buck") == 0, "tpb");
     fail_unless(w.port_listen == 443322, "tpb");
+    fail_unless(w.listen_reuseport == true, "tpb");
 
     // Test that things get zero'ed out.
     //
@@ -133,13 +163,28 @@ START_TEST(test_parse_behavior) {
                             " key_stats_lifespan =  , "
                             " key_stats_spec =  , "
                             " key_stats_unspec  =  ,"
+                            " key_stats_topk =  ,"
+                            " time_stats_detail =  ,"
+                            " io_uring =  ,"
+                            " conn_buffer_pool =  ,"
+                            " stats_snapshot_interval =  ,"
+                            " trace_sample =  ,"
+                            " hedge_delay =  ,"
+                            " hedge_budget =  ,"
+                            " noreply_batch_max =  ,"
+                            " noreply_batch_interval =  ,"
+                            " multiget_batch_max =  ,"
+                            " multiget_batch_window =  ,"
                             " optimize_set =    , "
+                            " combine_set =  , "
+                            " combine_set_window =  , "
                             " usr =   , "
                             " pwd =   , "
                             " host =  ,"
                             " port =  , "
                             " bucket =  , "
                             " port_listen =  , "
+                            " listen_reuseport =  , "
                             " UNKNOWN_IGNORED_KEY =, "
                             " ,,,  ",
                             w);
@@ -156,13 +201,28 @@ START_TEST(test_parse_behavior) {
     fail_unless(u.key_stats_max == 0, "");
     fail_unless(strcmp(u.key_stats_spec, "") == 0, "tpb");
     fail_unless(strcmp(u.key_stats_unspec, "") == 0, "tpb");
+    fail_unless(u.key_stats_topk == false, "tpb");
+    fail_unless(u.time_stats_detail == false, "tpb");
+    fail_unless(u.io_uring == false, "tpb");
+    fail_unless(u.conn_buffer_pool == false, "tpb");
+    fail_unless(u.stats_snapshot_interval == 0, "tpb");
+    fail_unless(u.trace_sample == 0, "tpb");
+    fail_unless(u.hedge_delay == 0, "tpb");
+    fail_unless(u.hedge_budget == 0, "tpb");
+    fail_unless(u.noreply_batch_max == 0, "tpb");
+    fail_unless(u.noreply_batch_interval == 0, "tpb");
+    fail_unless(u.multiget_batch_max == 0, "tpb");
+    fail_unless(u.multiget_batch_window == 0, "tpb");
     fail_unless(strcmp(u.optimize_set, "") == 0, "tpb");
+    fail_unless(strcmp(u.combine_set, "") == 0, "tpb");
+    fail_unless(u.combine_set_window == 0, "tpb");
     fail_unless(strcmp(u.usr, "") == 0, "tpb");
     fail_unless(strcmp(u.pwd, "") == 0, "tpb");
     fail_unless(strcmp(u.host, "") == 0, "tpb");
     fail_unless(u.port == 0, "tpb");
     fail_unless(strcmp(u.bucket, "") == 0, "tpb");
     fail_unless(u.port_listen == 0, "tpb");
+    fail_unless(u.listen_reuseport == false, "tpb");
 }
 END_TEST
 
@@ -28,15 +28,12 @@ downstream *downstream_list_waiting_remove(downstream *head,
                                            downstream **tail,
                                            downstream *d);
 
-void downstream_timeout(const int fd,
-                        const short which,
-                        void *arg);
-void wait_queue_timeout(const int fd,
-                        const short which,
-                        void *arg);
-
-conn *conn_list_remove(conn *head, conn **tail,
-                       conn *c, bool *found);
+void downstream_timeout(twheel_timer *t, void *arg);
+void downstream_hedge_timeout(const int fd,
+                              const short which,
+                              void *arg);
+void downstream_connect_timeout(twheel_timer *t, void *arg);
+void wait_queue_timeout(twheel_timer *t, void *arg);
 
 bool is_compatible_request(conn *existing, conn *candidate);
 
@@ -44,6 +41,12 @@ void propagate_error(downstream *d);
 
 void downstream_reserved_time_sample(proxy_stats_td *ptds, uint64_t duration);
 void downstream_connect_time_sample(proxy_stats_td *ptds, uint64_t duration);
+void downstream_cmd_time_sample(proxy_stats_td *ptds, enum_stats_cmd cmd,
+                                uint64_t duration);
+void downstream_server_time_sample(proxy_stats_td *ptds, int server_index,
+                                   uint64_t duration);
+
+static enum_stats_cmd upstream_stats_cmd(conn *uc);
 
 bool downstream_connect_init(downstream *d, mcs_server_st *msst,
                              proxy_behavior *behavior, conn *c);
@@ -58,6 +61,11 @@ conn *zstored_acquire_downstream_conn(downstream *d,
                                       proxy_behavior *behavior,
                                       bool *downstream_conn_max_reached);
 
+conn *zstored_acquire_idle_downstream_conn(downstream *d,
+                                           LIBEVENT_THREAD *thread,
+                                           mcs_server_st *msst,
+                                           proxy_behavior *behavior);
+
 void zstored_release_downstream_conn(conn *dc, bool closing);
 
 void zstored_error_count(LIBEVENT_THREAD *thread,
@@ -169,6 +177,9 @@ proxy *cproxy_create(proxy_main *main,
         p->config     = trimstrdup(config);
         p->config_ver = config_ver;
 
+        p->config_fingerprint = 0;
+        p->config_seen_ver    = config_ver;
+
         p->behavior_pool.base = behavior_pool->base;
         p->behavior_pool.num  = behavior_pool->num;
         p->behavior_pool.arr  = cproxy_copy_behaviors(behavior_pool->num,
@@ -186,6 +197,7 @@ proxy *cproxy_create(proxy_main *main,
         matcher_init(&p->front_cache_unmatcher, true);
 
         matcher_init(&p->optimize_set_matcher, true);
+        matcher_init(&p->combine_set_matcher, true);
 
         if (behavior_pool->base.front_cache_max > 0 &&
             behavior_pool->base.front_cache_lifespan > 0) {
@@ -208,6 +220,11 @@ proxy *cproxy_create(proxy_main *main,
                           behavior_pool->base.optimize_set);
         }
 
+        if (strlen(behavior_pool->base.combine_set) > 0) {
+            matcher_start(&p->combine_set_matcher,
+                          behavior_pool->base.combine_set);
+        }
+
         p->thread_data_num = nthreads;
         p->thread_data = (proxy_td *) calloc(p->thread_data_num,
                                              sizeof(proxy_td));
@@ -240,8 +257,21 @@ proxy *cproxy_create(proxy_main *main,
                 ptd->downstream_num = 0;
                 ptd->downstream_max = behavior_pool->base.downstream_max;
                 ptd->downstream_assigns = 0;
-                ptd->timeout_tv.tv_sec = 0;
-                ptd->timeout_tv.tv_usec = 0;
+                twheel_timer_init(&ptd->timeout_timer);
+                twheel_timer_init(&ptd->snapshot_timer);
+                ptd->noreply_batch = NULL;
+                ptd->noreply_batch_cmds = NULL;
+                ptd->noreply_batch_num = 0;
+                ptd->noreply_batch_seq = 0;
+                twheel_timer_init(&ptd->noreply_batch_timer);
+                ptd->combine_sets = NULL;
+                twheel_timer_init(&ptd->combine_sets_timer);
+                ptd->combine_sets_thread = NULL;
+                ptd->combine_sets_waiting = NULL;
+                ptd->multiget_batch_num = 0;
+                ptd->hedge_recent_eligible = 0;
+                ptd->hedge_recent = 0;
+                twheel_timer_init(&ptd->multiget_batch_timer);
                 ptd->stats.stats.num_upstream = 0;
                 ptd->stats.stats.num_downstream_conn = 0;
 
@@ -252,21 +282,7 @@ proxy *cproxy_create(proxy_main *main,
                 matcher_init(&ptd->key_stats_matcher, false);
                 matcher_init(&ptd->key_stats_unmatcher, false);
 
-                if (behavior_pool->base.key_stats_max > 0 &&
-                    behavior_pool->base.key_stats_lifespan > 0) {
-                    mcache_start(&ptd->key_stats,
-                                 behavior_pool->base.key_stats_max);
-
-                    if (strlen(behavior_pool->base.key_stats_spec) > 0) {
-                        matcher_start(&ptd->key_stats_matcher,
-                                      behavior_pool->base.key_stats_spec);
-                    }
-
-                    if (strlen(behavior_pool->base.key_stats_unspec) > 0) {
-                        matcher_start(&ptd->key_stats_unmatcher,
-                                      behavior_pool->base.key_stats_unspec);
-                    }
-                }
+                key_stats_start(ptd);
             }
 
             return p;
@@ -305,8 +321,13 @@ int cproxy_listen(proxy *p) {
             listen_protocol = proxy_upstream_binary_prot;
         }
 
+        pthread_mutex_lock(&p->proxy_lock);
+        bool reuseport = p->behavior_pool.base.listen_reuseport;
+        pthread_mutex_unlock(&p->proxy_lock);
+
         int listening = cproxy_listen_port(p->port, listen_protocol,
                                            tcp_transport,
+                                           reuseport,
                                            p,
                                            &cproxy_listen_funcs);
         if (listening > 0) {
@@ -329,9 +350,26 @@ int cproxy_listen(proxy *p) {
     return p->listening;
 }
 
+// Ports with per-thread SO_REUSEPORT listeners, whose listening
+// conn's live on the worker threads instead of on listen_conn.
+// Modified/accessed only by main listener thread.
+//
+typedef struct reuseport_listener reuseport_listener;
+
+struct reuseport_listener {
+    int         port;
+    conn_funcs *funcs;
+    int         listening;
+
+    reuseport_listener *next;
+};
+
+static reuseport_listener *reuseport_listeners = NULL;
+
 int cproxy_listen_port(int port,
                        enum protocol protocol,
                        enum network_transport transport,
+                       bool        reuseport,
                        void       *conn_extra,
                        conn_funcs *funcs) {
     assert(port > 0 || settings.socketpath != NULL);
@@ -369,6 +407,19 @@ int cproxy_listen_port(int port,
         x = x->next;
     }
 
+    for (reuseport_listener *r = reuseport_listeners; r != NULL; r = r->next) {
+        if (r->port == port &&
+            r->funcs == funcs) {
+            if (settings.verbose > 1) {
+                moxi_log_write(
+                        "cproxy listening reusing per-thread listeners on port %d\n",
+                        port);
+            }
+
+            listening += r->listening;
+        }
+    }
+
     if (listening > 0) {
         // If we're already listening on the required port, then
         // we don't need to start a new server_socket().  This happens
@@ -381,6 +432,36 @@ int cproxy_listen_port(int port,
         //
         return listening;
     }
+
+    if (reuseport &&
+        settings.socketpath == NULL &&
+        transport == tcp_transport) {
+        int n = server_socket_per_thread(port, protocol, funcs, conn_extra);
+        if (n > 0) {
+            reuseport_listener *r = calloc(1, sizeof(reuseport_listener));
+            if (r != NULL) {
+                r->port      = port;
+                r->funcs     = funcs;
+                r->listening = n;
+                r->next      = reuseport_listeners;
+
+                reuseport_listeners = r;
+            }
+
+            if (settings.verbose > 1) {
+                moxi_log_write("cproxy listening on port %d"
+                               " with %d per-thread listeners\n",
+                               port, n);
+            }
+
+            return n;
+        }
+
+        moxi_log_write("cproxy could not use per-thread listeners"
+                       " on port %d, falling back to one listener\n",
+                       port);
+    }
+
 #ifdef HAVE_SYS_UN_H
     if (settings.socketpath ?
         (server_socket_unix(settings.socketpath, settings.access) == 0) :
@@ -512,6 +593,15 @@ void cproxy_on_close_upstream_conn(conn *c) {
                 genhash_iter(d->multiget, multiget_remove_upstream, c);
             }
 
+            // A merged batch of GETs only points the downstream conns
+            // at the downstream's own copy of the keys, so the batch
+            // can carry on for its other upstream conns.
+            //
+            if (d->multiget_batch != NULL &&
+                d->upstream_conn != NULL) {
+                continue;
+            }
+
             // The downstream conn's might have iov's that
             // point to the upstream conn's buffers.  Also, the
             // downstream conn might be in all sorts of states
@@ -547,6 +637,8 @@ void cproxy_on_close_upstream_conn(conn *c) {
         conn_list_remove(ptd->waiting_any_downstream_head,
                          &ptd->waiting_any_downstream_tail,
                          c, NULL);
+
+    cproxy_combine_set_close(ptd, c);
 }
 
 int delink_from_downstream_conns(conn *c) {
@@ -557,6 +649,13 @@ int delink_from_downstream_conns(conn *c) {
 
     c->extra = NULL;
 
+    if (d->hedge_primary == c) {
+        d->hedge_primary = NULL;
+    }
+    if (d->hedge_conn == c) {
+        d->hedge_conn = NULL;
+    }
+
     int n = mcs_server_count(&d->mst);
     int k = -1; // Index of conn.
 
@@ -643,6 +742,10 @@ void cproxy_on_close_downstream_conn(conn *c) {
         // If we haven't received any reply yet, we retry based
         // on our cmd_retries counter.
         //
+        // A merged batch of GETs isn't retried, even if just one of
+        // its upstream conns is left, as the downstream requests
+        // were for the whole batch's keys.
+        //
         // TODO: Reconsider retry behavior, is it right in all situations?
         //
         if (c->rcurr != NULL &&
@@ -650,6 +753,7 @@ void cproxy_on_close_downstream_conn(conn *c) {
             d->downstream_used_start == d->downstream_used &&
             d->downstream_used_start == 1 &&
             d->upstream_conn->next == NULL &&
+            d->multiget_batch == NULL &&
             d->behaviors_arr != NULL) {
             if (k >= 0 && k < d->behaviors_num) {
                 int retry_max = d->behaviors_arr[k].downstream_retry;
@@ -773,8 +877,7 @@ downstream *cproxy_reserve_downstream(proxy_td *ptd) {
         assert(d->downstream_used == 0);
         assert(d->downstream_used_start == 0);
         assert(d->merger == NULL);
-        assert(d->timeout_tv.tv_sec == 0);
-        assert(d->timeout_tv.tv_usec == 0);
+        assert(!twheel_timer_pending(&d->timeout_timer));
         assert(d->next_waiting == NULL);
 
         d->upstream_conn = NULL;
@@ -786,8 +889,6 @@ downstream *cproxy_reserve_downstream(proxy_td *ptd) {
         d->downstream_used = 0;
         d->downstream_used_start = 0;
         d->merger = NULL;
-        d->timeout_tv.tv_sec = 0;
-        d->timeout_tv.tv_usec = 0;
         d->next_waiting = NULL;
 
         if (cproxy_check_downstream_config(d)) {
@@ -820,16 +921,12 @@ bool cproxy_release_downstream(downstream *d, bool force) {
                        d->upstream_conn->sfd : -1);
     }
 
-    // Always release the timeout_event, even if we're going to retry,
-    // to avoid pegging CPU with leaked timeout_events.
+    // Always release the timeout, even if we're going to retry,
+    // to avoid leaking timers.
     //
-    if (d->timeout_tv.tv_sec != 0 ||
-        d->timeout_tv.tv_usec != 0) {
-        evtimer_del(&d->timeout_event);
-    }
+    twheel_del(&d->timeout_timer);
 
-    d->timeout_tv.tv_sec = 0;
-    d->timeout_tv.tv_usec = 0;
+    cproxy_clear_hedge(d);
 
     // If we need to retry the command, we do so here,
     // keeping the same downstream that would otherwise
@@ -874,10 +971,17 @@ bool cproxy_release_downstream(downstream *d, bool force) {
         }
     }
 
+    cproxy_trace_downstream(d, TRACE_STAGE_RELEASE);
+
     // Record reserved_time histogram timings.
     //
     if (d->usec_start > 0) {
-        uint64_t ux = usec_now() - d->usec_start;
+        // The usec_start snapshot was cached on the upstream
+        // conn's thread, so a cached read there is never earlier.
+        //
+        uint64_t ux = usec_now_cached(d->upstream_conn != NULL ?
+                                      d->upstream_conn->thread : NULL) -
+            d->usec_start;
 
         d->ptd->stats.stats.tot_downstream_reserved_time += ux;
 
@@ -894,6 +998,13 @@ bool cproxy_release_downstream(downstream *d, bool force) {
         }
 
         downstream_reserved_time_sample(&d->ptd->stats, ux);
+
+        if (d->upstream_conn != NULL &&
+            d->ptd->behavior_pool.base.time_stats_detail) {
+            downstream_cmd_time_sample(&d->ptd->stats,
+                                       upstream_stats_cmd(d->upstream_conn),
+                                       ux);
+        }
     }
 
     d->ptd->stats.stats.tot_downstream_released++;
@@ -904,9 +1015,9 @@ bool cproxy_release_downstream(downstream *d, bool force) {
         if (d->merger != NULL) {
             // TODO: Allow merger callback to be func pointer.
             //
-            genhash_iter(d->merger,
-                        protocol_stats_foreach_write,
-                        d->upstream_conn);
+            stats_merger_foreach(d->merger,
+                                 protocol_stats_write,
+                                 d->upstream_conn);
 
             if (update_event(d->upstream_conn, EV_WRITE | EV_PERSIST)) {
                 conn_set_state(d->upstream_conn, conn_mwrite);
@@ -969,11 +1080,13 @@ bool cproxy_release_downstream(downstream *d, bool force) {
     }
 
     if (d->merger != NULL) {
-        genhash_iter(d->merger, protocol_stats_foreach_free, NULL);
-        genhash_free(d->merger);
+        stats_merger_free(d->merger);
         d->merger = NULL;
     }
 
+    free(d->multiget_batch);
+    d->multiget_batch = NULL;
+
     d->upstream_conn = NULL;
     d->upstream_suffix = NULL; // No free(), expecting a static string.
     d->upstream_suffix_len = 0;
@@ -995,6 +1108,12 @@ bool cproxy_release_downstream(downstream *d, bool force) {
         }
     }
 
+    // Lets any upstream conns held behind its combine_sets go on.
+    //
+    if (d->combine_sets > 0) {
+        cproxy_combine_sets_released(d);
+    }
+
     // If this downstream still has the same configuration as our top-level
     // proxy config, go back onto the available, released downstream list.
     //
@@ -1025,9 +1144,11 @@ void cproxy_free_downstream(downstream *d) {
     assert(d->ptd != NULL);
     assert(d->upstream_conn == NULL);
     assert(d->multiget == NULL);
+    assert(d->multiget_batch == NULL);
     assert(d->merger == NULL);
-    assert(d->timeout_tv.tv_sec == 0);
-    assert(d->timeout_tv.tv_usec == 0);
+    assert(!twheel_timer_pending(&d->timeout_timer));
+    assert(d->hedge_tv.tv_sec == 0);
+    assert(d->hedge_tv.tv_usec == 0);
 
     if (settings.verbose > 2) {
         moxi_log_write("cproxy_free_downstream\n");
@@ -1035,6 +1156,10 @@ void cproxy_free_downstream(downstream *d) {
 
     d->ptd->stats.stats.tot_downstream_freed++;
 
+    if (d->combine_sets > 0) {
+        cproxy_combine_sets_released(d);
+    }
+
     d->ptd->downstream_reserved =
         downstream_list_remove(d->ptd->downstream_reserved, d);
     d->ptd->downstream_released =
@@ -1062,13 +1187,7 @@ void cproxy_free_downstream(downstream *d) {
     //
     mcs_free(&d->mst);
 
-    if (d->timeout_tv.tv_sec != 0 ||
-        d->timeout_tv.tv_usec != 0) {
-        evtimer_del(&d->timeout_event);
-    }
-
-    d->timeout_tv.tv_sec = 0;
-    d->timeout_tv.tv_usec = 0;
+    twheel_del(&d->timeout_timer);
 
     if (d->downstream_conns != NULL) {
         free(d->downstream_conns);
@@ -1296,9 +1415,34 @@ int cproxy_connect_downstream(downstream *d, LIBEVENT_THREAD *thread,
         }
     }
 
+    cproxy_trace_downstream(d, TRACE_STAGE_CONNECT);
+
     return s;
 }
 
+/* Returns the downstream conn of d to a server, which might be
+ * NULL_CONN, or else an idle conn to the server that's already open,
+ * or else NULL.  Unlike cproxy_connect_downstream(), it never starts
+ * a connect(), whose completion would re-forward d's request.
+ */
+conn *cproxy_connect_idle_downstream_conn(downstream *d,
+                                          LIBEVENT_THREAD *thread,
+                                          int server_index) {
+    assert(d != NULL);
+    assert(d->downstream_conns != NULL);
+    assert(server_index >= 0);
+    assert(server_index < (int) mcs_server_count(&d->mst));
+
+    if (d->downstream_conns[server_index] == NULL) {
+        d->downstream_conns[server_index] =
+            zstored_acquire_idle_downstream_conn(d, thread,
+                mcs_server_index(&d->mst, server_index),
+                &d->behaviors_arr[server_index]);
+    }
+
+    return d->downstream_conns[server_index];
+}
+
 conn *cproxy_connect_downstream_conn(downstream *d,
                                      LIBEVENT_THREAD *thread,
                                      mcs_server_st *msst,
@@ -1342,15 +1486,13 @@ conn *cproxy_connect_downstream_conn(downstream *d,
             c->cmd_start_time = start;
 
             if (err == EINPROGRESS) {
-                struct timeval connect_timeout;
-
-                connect_timeout.tv_sec = 5;
-                connect_timeout.tv_usec = 0;
-
-                if (update_event_timed(c, EV_WRITE | EV_PERSIST,
-                                       &connect_timeout)) {
+                if (update_event(c, EV_WRITE | EV_PERSIST)) {
                     conn_set_state(c, conn_connecting);
 
+                    thread_timer_add(thread, &c->timer,
+                                     DOWNSTREAM_CONNECT_TIMEOUT_MSEC,
+                                     downstream_connect_timeout, c);
+
                     return c;
                 } else {
                     d->ptd->stats.stats.err_oom++;
@@ -1540,6 +1682,11 @@ void cproxy_assign_downstream(proxy_td *ptd) {
 
     uint64_t da = ptd->downstream_assigns;
 
+    // Any GETs waiting for others to merge with get assigned now.
+    //
+    ptd->multiget_batch_num = 0;
+    twheel_del(&ptd->multiget_batch_timer);
+
     // Key loop that tries to reserve any available, released
     // downstream resources to waiting upstream conns.
     //
@@ -1584,9 +1731,9 @@ void cproxy_assign_downstream(proxy_td *ptd) {
         assert(d->downstream_used == 0);
         assert(d->downstream_used_start == 0);
         assert(d->multiget == NULL);
+        assert(d->multiget_batch == NULL);
         assert(d->merger == NULL);
-        assert(d->timeout_tv.tv_sec == 0);
-        assert(d->timeout_tv.tv_usec == 0);
+        assert(!twheel_timer_pending(&d->timeout_timer));
 
         // We have a downstream reserved, so assign the first
         // waiting upstream conn to it.
@@ -1606,27 +1753,68 @@ void cproxy_assign_downstream(proxy_td *ptd) {
         // By compatible, for example, we mean multi-gets from
         // different upstreams so we can de-deplicate get keys.
         //
-        conn *uc_last = d->upstream_conn;
+        // Each upstream conn has only one request waiting, so
+        // compatible conns can be taken from anywhere in the wait
+        // list.  Only the first multiget_batch_max waiting conns are
+        // looked at, though, so an assign stays cheap when the wait
+        // list is long and mostly incompatible.
+        //
+        conn    *uc_last = d->upstream_conn;
+        conn    *uc_prev = NULL;
+        conn    *uc_cand = NULL;
+        uint32_t uc_num  = 1;
+        uint32_t uc_scan = 0;
 
-        while (is_compatible_request(uc_last,
-                                     ptd->waiting_any_downstream_head)) {
-            uc_last->next = ptd->waiting_any_downstream_head;
+        if (cproxy_multiget_batchable(d->upstream_conn)) {
+            uc_cand = ptd->waiting_any_downstream_head;
+        }
 
-            ptd->waiting_any_downstream_head =
-                ptd->waiting_any_downstream_head->next;
-            if (ptd->waiting_any_downstream_head == NULL) {
-                ptd->waiting_any_downstream_tail = NULL;
-            }
+        while (uc_cand != NULL &&
+               uc_num < ptd->behavior_pool.base.multiget_batch_max &&
+               uc_scan < ptd->behavior_pool.base.multiget_batch_max) {
+            conn *uc_next = uc_cand->next;
 
-            uc_last = uc_last->next;
-            uc_last->next = NULL;
+            uc_scan++;
 
-            // Note: tot_assign_upstream - tot_assign_downstream
-            // should get us how many requests we've piggybacked together.
-            //
-            ptd->stats.stats.tot_assign_upstream++;
+            if (is_compatible_request(d->upstream_conn, uc_cand)) {
+                if (uc_prev != NULL) {
+                    uc_prev->next = uc_next;
+                } else {
+                    ptd->waiting_any_downstream_head = uc_next;
+                }
+                if (ptd->waiting_any_downstream_tail == uc_cand) {
+                    ptd->waiting_any_downstream_tail = uc_prev;
+                }
+
+                // Keep the tail of the original wait list, if we
+                // took it, at its last conn that's still waiting.
+                //
+                if (tail == uc_cand) {
+                    tail = uc_prev;
+                    if (tail == NULL) {
+                        stop = true;
+                    }
+                }
+
+                uc_last->next = uc_cand;
+                uc_last = uc_cand;
+                uc_last->next = NULL;
+                uc_num++;
+
+                // Note: tot_assign_upstream - tot_assign_downstream
+                // should get us how many requests we've piggybacked together.
+                //
+                ptd->stats.stats.tot_assign_upstream++;
+                ptd->stats.stats.tot_multiget_batched++;
+            } else {
+                uc_prev = uc_cand;
+            }
+
+            uc_cand = uc_next;
         }
 
+        cproxy_trace_downstream(d, TRACE_STAGE_ASSIGN);
+
         if (settings.verbose > 2) {
             moxi_log_write("%d: assign_downstream, matched to upstream\n",
                     d->upstream_conn->sfd);
@@ -1854,6 +2042,16 @@ void cproxy_release_downstream_conn(downstream *d, conn *c) {
                         d->upstream_conn->sfd : 0));
     }
 
+    if (d->usec_start > 0 &&
+        ptd->behavior_pool.base.time_stats_detail) {
+        int server_index = downstream_conn_index(d, c);
+        if (server_index >= 0) {
+            downstream_server_time_sample(&ptd->stats, server_index,
+                                          usec_now_cached(c->thread) -
+                                          d->usec_start);
+        }
+    }
+
     d->downstream_used--;
     if (d->downstream_used <= 0) {
         // The downstream_used count might go < 0 when if there's
@@ -1899,15 +2097,46 @@ void cproxy_pause_upstream_for_downstream(proxy_td *ptd, conn *upstream) {
                 upstream->sfd);
     }
 
+    // A SET to a combine_set key might just be buffered, in case a
+    // later SET to the same key replaces it.
+    //
+    if (cproxy_combine_set(ptd, upstream)) {
+        return;
+    }
+
+    // A noreply write might just join the open batch.  Otherwise,
+    // flush the batch first if it holds an earlier write from this
+    // upstream, so the upstream's requests stay in order.
+    //
+    if (ptd->noreply_batch != NULL) {
+        if (cproxy_batch_a2b_noreply(ptd, upstream)) {
+            return;
+        }
+
+        if (upstream->noreply_batch == ptd->noreply_batch_seq) {
+            cproxy_flush_a2b_noreply(ptd);
+        }
+    }
+
+    cproxy_trace_start(ptd, upstream);
+
     conn_set_state(upstream, conn_pause);
 
     cproxy_wait_any_downstream(ptd, upstream);
 
-    if (ptd->timeout_tv.tv_sec == 0 &&
-        ptd->timeout_tv.tv_usec == 0) {
+    if (!twheel_timer_pending(&ptd->timeout_timer)) {
         cproxy_start_wait_queue_timeout(ptd, upstream);
     }
 
+    cproxy_start_stats_snapshot_timer(ptd);
+
+    // A GET might wait a while in the queue for other GETs to merge
+    // with, see cproxy_multiget_batch_hold().
+    //
+    if (cproxy_multiget_batch_hold(ptd, upstream)) {
+        return;
+    }
+
     cproxy_assign_downstream(ptd);
 }
 
@@ -1945,28 +2174,23 @@ bool cproxy_start_wait_queue_timeout(proxy_td *ptd, conn *uc) {
     assert(uc->thread);
     assert(uc->thread->base);
 
-    ptd->timeout_tv = ptd->behavior_pool.base.wait_queue_timeout;
-    if (ptd->timeout_tv.tv_sec != 0 ||
-        ptd->timeout_tv.tv_usec != 0) {
+    struct timeval wqt = ptd->behavior_pool.base.wait_queue_timeout;
+    if (wqt.tv_sec != 0 ||
+        wqt.tv_usec != 0) {
         if (settings.verbose > 2) {
             moxi_log_write("wait_queue_timeout started\n");
         }
 
-        evtimer_set(&ptd->timeout_event, wait_queue_timeout, ptd);
-
-        event_base_set(uc->thread->base, &ptd->timeout_event);
-
-        return evtimer_add(&ptd->timeout_event, &ptd->timeout_tv) == 0;
+        thread_timer_add(uc->thread, &ptd->timeout_timer,
+                         (wqt.tv_sec * 1000) + (wqt.tv_usec / 1000),
+                         wait_queue_timeout, ptd);
     }
 
     return true;
 }
 
-void wait_queue_timeout(const int fd,
-                        const short which,
-                        void *arg) {
-    (void)fd;
-    (void)which;
+void wait_queue_timeout(twheel_timer *t, void *arg) {
+    (void)t;
     proxy_td *ptd = arg;
     assert(ptd != NULL);
 
@@ -1977,64 +2201,52 @@ void wait_queue_timeout(const int fd,
     // This timer callback is invoked when an upstream conn
     // has been in the wait queue for too long.
     //
-    if (ptd->timeout_tv.tv_sec != 0 ||
-        ptd->timeout_tv.tv_usec != 0) {
-        evtimer_del(&ptd->timeout_event);
-
-        ptd->timeout_tv.tv_sec = 0;
-        ptd->timeout_tv.tv_usec = 0;
+    struct timeval wqt = ptd->behavior_pool.base.wait_queue_timeout;
 
-        if (settings.verbose > 2) {
-            moxi_log_write("wait_queue_timeout cleared\n");
-        }
+    // TODO: Millisecond capacity in 32-bit field not enough?
+    //
+    uint32_t wqt_msec = (wqt.tv_sec * 1000) +
+                        (wqt.tv_usec / 1000);
 
-        struct timeval wqt = ptd->behavior_pool.base.wait_queue_timeout;
+    uint32_t cut_msec = msec_current_time - wqt_msec;
 
-        // TODO: Millisecond capacity in 32-bit field not enough?
-        //
-        uint32_t wqt_msec = (wqt.tv_sec * 1000) +
-                            (wqt.tv_usec / 1000);
+    // Run through all the old upstream conn's in
+    // the wait queue, remove them, and emit errors
+    // on them.  And then start a new timer if needed.
+    //
+    conn *uc_curr = ptd->waiting_any_downstream_head;
+    while (uc_curr != NULL) {
+        conn *uc = uc_curr;
 
-        uint32_t cut_msec = msec_current_time - wqt_msec;
+        uc_curr = uc_curr->next;
 
-        // Run through all the old upstream conn's in
-        // the wait queue, remove them, and emit errors
-        // on them.  And then start a new timer if needed.
+        // Check if upstream conn is old and should be removed.
         //
-        conn *uc_curr = ptd->waiting_any_downstream_head;
-        while (uc_curr != NULL) {
-            conn *uc = uc_curr;
-
-            uc_curr = uc_curr->next;
+        if (settings.verbose > 2) {
+            moxi_log_write("wait_queue_timeout compare %u to %u cutoff\n",
+                    uc->cmd_start_time, cut_msec);
+        }
 
-            // Check if upstream conn is old and should be removed.
-            //
-            if (settings.verbose > 2) {
-                moxi_log_write("wait_queue_timeout compare %u to %u cutoff\n",
-                        uc->cmd_start_time, cut_msec);
+        if (uc->cmd_start_time <= cut_msec) {
+            if (settings.verbose > 1) {
+                moxi_log_write("proxy_td_timeout sending error %d\n",
+                        uc->sfd);
             }
 
-            if (uc->cmd_start_time <= cut_msec) {
-                if (settings.verbose > 1) {
-                    moxi_log_write("proxy_td_timeout sending error %d\n",
-                            uc->sfd);
-                }
+            ptd->stats.stats.tot_wait_queue_timeout++;
 
-                ptd->stats.stats.tot_wait_queue_timeout++;
-
-                ptd->waiting_any_downstream_head =
-                    conn_list_remove(ptd->waiting_any_downstream_head,
-                                     &ptd->waiting_any_downstream_tail,
-                                     uc, NULL); // TODO: O(N^2).
+            ptd->waiting_any_downstream_head =
+                conn_list_remove(ptd->waiting_any_downstream_head,
+                                 &ptd->waiting_any_downstream_tail,
+                                 uc, NULL); // TODO: O(N^2).
 
-                upstream_error(uc);
-            }
+            upstream_error(uc);
         }
+    }
 
-        if (ptd->waiting_any_downstream_head != NULL) {
-            cproxy_start_wait_queue_timeout(ptd,
-                                            ptd->waiting_any_downstream_head);
-        }
+    if (ptd->waiting_any_downstream_head != NULL) {
+        cproxy_start_wait_queue_timeout(ptd,
+                                        ptd->waiting_any_downstream_head);
     }
 }
 
@@ -2319,57 +2531,37 @@ downstream *downstream_list_waiting_remove(downstream *head,
  * save on network hops.
  */
 bool is_compatible_request(conn *existing, conn *candidate) {
-    (void)existing;
-    (void)candidate;
-
-    // The not-my-vbucket error handling requires us to not
-    // squash ascii multi-GET requests, due to reusing the
-    // multiget-deduplication machinery during retries and
-    // to simplify the later codepaths.
-    /*
     assert(existing);
     assert(existing->state == conn_pause);
     assert(IS_PROXY(existing->protocol));
 
-    if (IS_BINARY(existing->protocol)) {
-        // TODO: Revisit multi-get squashing for binary another day.
-        //
+    if (candidate == NULL) {
         return false;
     }
 
-    assert(IS_ASCII(existing->protocol));
+    assert(IS_PROXY(candidate->protocol));
+    assert(candidate->state == conn_pause);
 
-    if (candidate != NULL) {
-        assert(IS_ASCII(candidate->protocol));
-        assert(IS_PROXY(candidate->protocol));
-        assert(candidate->state == conn_pause);
-
-        // TODO: Allow gets (CAS) for de-duplication.
-        //
-        if (existing->cmd == -1 &&
-            candidate->cmd == -1 &&
-            existing->cmd_retries <= 0 &&
-            candidate->cmd_retries <= 0 &&
-            !existing->noreply &&
-            !candidate->noreply &&
-            strncmp(existing->cmd_start, "get ", 4) == 0 &&
-            strncmp(candidate->cmd_start, "get ", 4) == 0) {
-            assert(existing->item == NULL);
-            assert(candidate->item == NULL);
+    // The not-my-vbucket error handling reuses the multiget
+    // de-duplication machinery during retries, which works for
+    // squashed ascii multi-GET requests as the downstream keeps
+    // its own copy of their keys, see multiget_ascii_downstream().
+    //
+    // TODO: Revisit multi-get squashing for binary another day.
+    //
+    if (cproxy_multiget_batchable(existing) &&
+        cproxy_multiget_batchable(candidate)) {
+        assert(existing->item == NULL);
+        assert(candidate->item == NULL);
 
-            return true;
-        }
+        return true;
     }
-    */
 
     return false;
 }
 
-void downstream_timeout(const int fd,
-                        const short which,
-                        void *arg) {
-    (void)fd;
-    (void)which;
+void downstream_timeout(twheel_timer *t, void *arg) {
+    (void)t;
 
     downstream *d = arg;
     assert(d != NULL);
@@ -2384,31 +2576,22 @@ void downstream_timeout(const int fd,
     // closing downstream conns, which might help by
     // freeing up downstream resources.
     //
-    if (d->timeout_tv.tv_sec != 0 ||
-        d->timeout_tv.tv_usec != 0) {
-        evtimer_del(&d->timeout_event);
-
-        d->timeout_tv.tv_sec = 0;
-        d->timeout_tv.tv_usec = 0;
+    d->ptd->stats.stats.tot_downstream_timeout++;
 
-        d->ptd->stats.stats.tot_downstream_timeout++;
-
-        int n = mcs_server_count(&d->mst);
+    int n = mcs_server_count(&d->mst);
 
-        for (int i = 0; i < n; i++) {
-            if (d->downstream_conns[i] != NULL &&
-                d->downstream_conns[i] != NULL_CONN) {
-                cproxy_close_conn(d->downstream_conns[i]);
-            }
-            d->downstream_conns[i] = NULL;
+    for (int i = 0; i < n; i++) {
+        if (d->downstream_conns[i] != NULL &&
+            d->downstream_conns[i] != NULL_CONN) {
+            cproxy_close_conn(d->downstream_conns[i]);
         }
+        d->downstream_conns[i] = NULL;
     }
 }
 
 bool cproxy_start_downstream_timeout(downstream *d, conn *c) {
     assert(d != NULL);
-    assert(d->timeout_tv.tv_sec == 0);
-    assert(d->timeout_tv.tv_usec == 0);
+    assert(!twheel_timer_pending(&d->timeout_timer));
     assert(d->behaviors_num > 0);
     assert(d->behaviors_arr != NULL);
 
@@ -2431,14 +2614,198 @@ bool cproxy_start_downstream_timeout(downstream *d, conn *c) {
                        (c != NULL ? c->sfd : -1));
     }
 
-    evtimer_set(&d->timeout_event, downstream_timeout, d);
+    thread_timer_add(uc->thread, &d->timeout_timer,
+                     (dt.tv_sec * 1000) + (dt.tv_usec / 1000),
+                     downstream_timeout, d);
+
+    return true;
+}
+
+/* Arms the hedge timer for a single-key GET that was just sent to
+ * the vbucket master on conn c.  If the master hasn't answered when
+ * the timer fires, the GET is also sent to a replica.
+ */
+bool cproxy_start_hedge_timeout(downstream *d, conn *c, int vbucket) {
+    assert(d != NULL);
+    assert(d->ptd != NULL);
+    assert(c != NULL);
+    assert(d->hedge_tv.tv_sec == 0);
+    assert(d->hedge_tv.tv_usec == 0);
+    assert(d->hedge_conn == NULL);
+
+    proxy_behavior *b = &d->ptd->behavior_pool.base;
+
+    if (b->hedge_delay == 0 ||
+        b->hedge_budget == 0 ||
+        mcs_server_replica(&d->mst, vbucket, 0) < 0) {
+        return false;
+    }
+
+    conn *uc = d->upstream_conn;
 
-    event_base_set(uc->thread->base, &d->timeout_event);
+    assert(uc != NULL);
+    assert(uc->thread != NULL);
+    assert(uc->thread->base != NULL);
 
-    d->timeout_tv.tv_sec  = dt.tv_sec;
-    d->timeout_tv.tv_usec = dt.tv_usec;
+    d->ptd->stats.stats.tot_hedge_eligible++;
 
-    return (evtimer_add(&d->timeout_event, &d->timeout_tv) == 0);
+    proxy_td *ptd = d->ptd;
+
+    if (++ptd->hedge_recent_eligible >= HEDGE_BUDGET_WINDOW) {
+        ptd->hedge_recent_eligible /= 2;
+        ptd->hedge_recent          /= 2;
+    }
+
+    evtimer_set(&d->hedge_event, downstream_hedge_timeout, d);
+
+    event_base_set(uc->thread->base, &d->hedge_event);
+
+    d->hedge_tv.tv_sec  = b->hedge_delay / 1000;
+    d->hedge_tv.tv_usec = (b->hedge_delay % 1000) * 1000;
+    d->hedge_primary = c;
+    d->hedge_vbucket = vbucket;
+
+    if (evtimer_add(&d->hedge_event, &d->hedge_tv) == 0) {
+        return true;
+    }
+
+    d->hedge_tv.tv_sec  = 0;
+    d->hedge_tv.tv_usec = 0;
+    d->hedge_primary = NULL;
+
+    return false;
+}
+
+void downstream_hedge_timeout(const int fd,
+                              const short which,
+                              void *arg) {
+    (void)fd;
+    (void)which;
+
+    downstream *d = arg;
+    assert(d != NULL);
+    assert(d->ptd != NULL);
+
+    if (d->hedge_tv.tv_sec == 0 &&
+        d->hedge_tv.tv_usec == 0) {
+        return;
+    }
+
+    d->hedge_tv.tv_sec  = 0;
+    d->hedge_tv.tv_usec = 0;
+
+    conn *uc = d->upstream_conn;
+
+    // Only hedge while the master request is the one and only
+    // outstanding request on this downstream.
+    //
+    if (uc == NULL ||
+        d->hedge_primary == NULL ||
+        d->hedge_conn != NULL ||
+        d->downstream_used != 1) {
+        return;
+    }
+
+    proxy_td    *ptd = d->ptd;
+    proxy_stats *ps  = &ptd->stats.stats;
+
+    if ((uint64_t) (ptd->hedge_recent + 1) * 100 >
+        (uint64_t) ptd->hedge_recent_eligible *
+        ptd->behavior_pool.base.hedge_budget) {
+        ps->tot_hedge_over_budget++;
+        return;
+    }
+
+    int r = mcs_server_replica(&d->mst, d->hedge_vbucket, 0);
+    if (r < 0 ||
+        r >= (int) mcs_server_count(&d->mst)) {
+        return;
+    }
+
+    // Never connect() from here, as a connect in progress would
+    // re-forward the whole request once it completes.  Only an
+    // already open conn to the replica is good enough for a hedge.
+    //
+    conn *rc = cproxy_connect_idle_downstream_conn(d, uc->thread, r);
+    if (rc == NULL ||
+        rc == d->hedge_primary ||
+        rc->state != conn_pause) {
+        return;
+    }
+
+    if (settings.verbose > 2) {
+        moxi_log_write("%d: downstream_hedge_timeout, vbucket %d, replica %d\n",
+                       uc->sfd, d->hedge_vbucket, rc->sfd);
+    }
+
+    if (IS_ASCII(uc->protocol) &&
+        IS_BINARY(rc->protocol) &&
+        cproxy_hedge_a2b_downstream(d, rc, d->hedge_vbucket)) {
+        d->hedge_conn = rc;
+        d->downstream_used_start++;
+        d->downstream_used++;
+
+        ptd->hedge_recent++;
+        ps->tot_hedge++;
+    }
+}
+
+void cproxy_clear_hedge(downstream *d) {
+    assert(d != NULL);
+
+    if (d->hedge_tv.tv_sec != 0 ||
+        d->hedge_tv.tv_usec != 0) {
+        evtimer_del(&d->hedge_event);
+    }
+
+    d->hedge_tv.tv_sec  = 0;
+    d->hedge_tv.tv_usec = 0;
+    d->hedge_primary = NULL;
+    d->hedge_conn    = NULL;
+    d->hedge_vbucket = -1;
+}
+
+/* Called with each single-key GET response on downstream conn c.
+ * Returns false when the response should be dropped, which happens
+ * when a hedged replica answers with anything but a hit while the
+ * master is still pending.  Otherwise, the response wins and any
+ * other outstanding conn for the same GET is closed.
+ */
+bool cproxy_hedge_response(downstream *d, conn *c, bool good) {
+    assert(d != NULL);
+    assert(c != NULL);
+
+    if (d->hedge_conn == NULL) {
+        cproxy_clear_hedge(d);
+        return true;
+    }
+
+    conn *loser;
+
+    if (c == d->hedge_conn) {
+        if (!good &&
+            d->hedge_primary != NULL) {
+            d->hedge_conn = NULL;
+            return false;
+        }
+
+        d->ptd->stats.stats.tot_hedge_win++;
+
+        loser = d->hedge_primary;
+    } else {
+        loser = d->hedge_conn;
+    }
+
+    cproxy_clear_hedge(d);
+
+    if (loser != NULL) {
+        // The loser is mid-request, so it can't go back to the pool.
+        // Closing it also drops its downstream_used count.
+        //
+        cproxy_close_conn(loser);
+    }
+
+    return true;
 }
 
 bool cproxy_auth_downstream(mcs_server_st *server,
@@ -2704,17 +3071,40 @@ void cproxy_upstream_state_change(conn *c, enum conn_states next_state) {
         if (next_state == conn_pause) {
             ptd->stats.stats.tot_upstream_paused++;
         }
+
+        if (c->trace_id != 0 &&
+            (c->state == conn_mwrite || c->state == conn_write) &&
+            next_state != c->state) {
+            cproxy_trace_mark(ptd, c, TRACE_STAGE_WRITTEN);
+        }
     }
 }
 
 // -------------------------------------------------
 
+/* Fires when a non-blocking downstream connect() takes too long,
+ * and runs the conn through the same path as a libevent timeout.
+ */
+void downstream_connect_timeout(twheel_timer *t, void *arg) {
+    (void)t;
+
+    conn *c = arg;
+    assert(c != NULL);
+
+    if (c->state == conn_connecting) {
+        c->which = EV_TIMEOUT;
+        drive_machine(c);
+    }
+}
+
 bool cproxy_on_connect_downstream_conn(conn *c) {
     int k;
 
     assert(c != NULL);
     assert(c->host_ident);
 
+    twheel_del(&c->timer);
+
     downstream *d = c->extra;
     assert(d != NULL);
 
@@ -2812,15 +3202,108 @@ void downstream_connect_time_sample(proxy_stats_td *pstd, uint64_t duration) {
     }
 }
 
+void downstream_cmd_time_sample(proxy_stats_td *pstd, enum_stats_cmd cmd,
+                                uint64_t duration) {
+    if (cmd >= STATS_CMD_last) {
+        return;
+    }
+
+    // Published with release, as stats collection reads the
+    // handle from other threads, see add_proxy_stats_td().
+    //
+    HTGRAM_HANDLE h = pstd->cmd_time_htgram[cmd];
+    if (h == NULL) {
+        h = cproxy_create_timing_histogram();
+        __atomic_store_n(&pstd->cmd_time_htgram[cmd], h, __ATOMIC_RELEASE);
+    }
+
+    if (h != NULL) {
+        htgram_incr(h, duration, 1);
+    }
+}
+
+void downstream_server_time_sample(proxy_stats_td *pstd, int server_index,
+                                   uint64_t duration) {
+    if (server_index < 0 ||
+        server_index >= PROXY_STATS_SERVER_MAX) {
+        return;
+    }
+
+    // Published like in downstream_cmd_time_sample().
+    //
+    HTGRAM_HANDLE h = pstd->server_time_htgram[server_index];
+    if (h == NULL) {
+        h = cproxy_create_timing_histogram();
+        __atomic_store_n(&pstd->server_time_htgram[server_index], h,
+                         __ATOMIC_RELEASE);
+    }
+
+    if (h != NULL) {
+        htgram_incr(h, duration, 1);
+    }
+}
+
+/* Classifies an upstream conn's current request for the
+ * per-command timing histograms.  Returns STATS_CMD_last for
+ * requests that aren't tracked, such as SASL.
+ */
+static enum_stats_cmd upstream_stats_cmd(conn *uc) {
+    assert(uc);
+
+    int opcode = uc->cmd_curr;
+    if (IS_BINARY(uc->protocol)) {
+        opcode = uc->binary_header.request.opcode;
+    }
+
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+        return STATS_CMD_GET;
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+        return STATS_CMD_SET;
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+        return STATS_CMD_ADD;
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+        return STATS_CMD_REPLACE;
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+        return STATS_CMD_DELETE;
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+        return STATS_CMD_APPEND;
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+        return STATS_CMD_PREPEND;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+        return STATS_CMD_INCR;
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+        return STATS_CMD_DECR;
+    case PROTOCOL_BINARY_CMD_FLUSH:
+    case PROTOCOL_BINARY_CMD_FLUSHQ:
+        return STATS_CMD_FLUSH_ALL;
+    case PROTOCOL_BINARY_CMD_STAT:
+        return STATS_CMD_STATS;
+    case PROTOCOL_BINARY_CMD_VERSION:
+        return STATS_CMD_VERSION;
+    default:
+        return STATS_CMD_last;
+    }
+}
+
 // A histogram for tracking timings, such as for usec request timings.
 //
 HTGRAM_HANDLE cproxy_create_timing_histogram(void) {
-    // TODO: Make histogram bins more configurable one day.
+    // Log-linear bins, within 1/32 of the real value, from
+    // 1 usec up to 134 secs.
     //
-    HTGRAM_HANDLE h1 = htgram_mk(2000, 100, 2.0, 20, NULL);
-    HTGRAM_HANDLE h0 = htgram_mk(0, 100, 1.0, 20, h1);
-
-    return h0;
+    return htgram_mk_loglinear(6, 27);
 }
 
 zstored_downstream_conns *zstored_get_downstream_conns(LIBEVENT_THREAD *thread,
@@ -3007,6 +3490,47 @@ conn *zstored_acquire_downstream_conn(downstream *d,
     return dc;
 }
 
+/* Like zstored_acquire_downstream_conn(), but only hands out an
+ * already connected conn from the thread's pool, and never connects.
+ */
+conn *zstored_acquire_idle_downstream_conn(downstream *d,
+                                           LIBEVENT_THREAD *thread,
+                                           mcs_server_st *msst,
+                                           proxy_behavior *behavior) {
+    assert(d);
+    assert(d->ptd);
+    assert(thread);
+    assert(msst);
+    assert(behavior);
+
+    char host_ident_buf[300];
+    format_host_ident(host_ident_buf, sizeof(host_ident_buf), msst,
+                      behavior->downstream_protocol);
+
+    zstored_downstream_conns *conns =
+        zstored_get_downstream_conns(thread, host_ident_buf);
+    if (conns == NULL ||
+        conns->dc == NULL) {
+        return NULL;
+    }
+
+    conn *dc = conns->dc;
+
+    assert(dc->thread == thread);
+    assert(strcmp(host_ident_buf, dc->host_ident) == 0);
+
+    d->ptd->stats.stats.tot_downstream_conn_acquired++;
+
+    conns->dc_acquired++;
+    conns->dc = dc->next;
+    dc->next = NULL;
+
+    assert(dc->extra == NULL);
+    dc->extra = d;
+
+    return dc;
+}
+
 // new fn by jsh
 void zstored_release_downstream_conn(conn *dc, bool closing) {
     assert(dc != NULL);
@@ -8,6 +8,8 @@
 #include "matcher.h"
 #include "mcs.h"
 #include "htgram.h"
+#include "topk.h"
+#include "stats_merger.h"
 
 // From libmemcached.
 //
@@ -27,6 +29,7 @@ int cproxy_init(char *cfg_str,
 extern volatile uint32_t msec_current_time;
 
 uint64_t usec_now(void);
+uint64_t usec_now_cached(LIBEVENT_THREAD *thread);
 
 extern char cproxy_hostname[300]; // Immutable after init.
 
@@ -104,12 +107,48 @@ struct proxy_behavior {
     struct timeval downstream_timeout;  // SL: Fields of 0 mean no timeout.
     struct timeval wait_queue_timeout;  // PL: Fields of 0 mean no timeout.
     bool           time_stats;          // IL: Capture timing stats.
+    bool           time_stats_detail;   // IL: Also per-command and
+                                        // per-server timing histograms,
+                                        // at ~18KB per histogram in use
+                                        // per worker thread.
+    bool           conn_buffer_pool;    // IL: Idle conns lend their buffers
+                                        // to a per-thread pool.
+    bool           io_uring;            // IL: Batch conn sends through
+                                        // per-thread io_urings, when the
+                                        // kernel has them.
+    uint32_t       stats_snapshot_interval; // ML: In millisecs, how often
+                                        // workers publish stats snapshots,
+                                        // which stats requests then read
+                                        // instead of asking every worker.
+                                        // 0 means no snapshots.
 
     uint32_t connect_max_errors;      // IL: Pause when too many connect() errs.
     uint32_t connect_retry_interval;  // IL: Time in millisecs before retrying
                                       // when too many connect() errors, to not
                                       // overwhelm the downstream servers.
 
+    uint32_t hedge_delay;  // PL: In millisecs, before a single-key GET is also
+                           // sent to a vbucket replica.  0 means no hedging.
+    uint32_t hedge_budget; // PL: Max hedged GETs, as a percent of hedgeable GETs.
+
+    uint32_t trace_sample; // PL: Trace 1 in this many requests, see
+                           // "stats proxy trace".  0 means no tracing.
+
+    uint32_t noreply_batch_max;      // PL: Max ascii noreply writes that are
+                                     // batched into quiet binary requests,
+                                     // before a flush.  0 means no batching.
+    uint32_t noreply_batch_interval; // PL: In millisecs, before a partial
+                                     // batch of noreply writes is flushed.
+
+    uint32_t multiget_batch_max;    // PL: Max ascii GETs from different
+                                    // upstream conns that are merged into
+                                    // one downstream multiget.  0 or 1
+                                    // means no merging.
+    uint32_t multiget_batch_window; // PL: In millisecs, how long a GET
+                                    // waits for others to merge with.  0
+                                    // means only GETs that are already
+                                    // waiting for a downstream are merged.
+
     uint32_t front_cache_max;         // PL: Max # of front cachable items.
     uint32_t front_cache_lifespan;    // PL: In millisecs.
     char     front_cache_spec[300];   // PL: Matcher prefixes for front caching.
@@ -119,9 +158,17 @@ struct proxy_behavior {
     uint32_t key_stats_lifespan;    // PL: In millisecs.
     char     key_stats_spec[300];   // PL: Matcher prefixes for key-level stats.
     char     key_stats_unspec[100]; // PL: Don't key stat prefixes.
+    bool     key_stats_topk;        // PL: Track only the key_stats_max
+                                    // hottest keys, with a compact sketch,
+                                    // instead of an LRU of full key stats.
 
     char optimize_set[400]; // PL: Matcher prefixes for SET optimization.
 
+    char     combine_set[400];   // PL: Matcher prefixes for SET write combining.
+    uint32_t combine_set_window; // PL: In millisecs, how long a SET to a
+                                 // combine_set key is buffered, so a later
+                                 // SET to the same key can replace it.
+
     char usr[250];    // SL.
     char pwd[900];    // SL.
     char host[250];   // SL.
@@ -132,6 +179,12 @@ struct proxy_behavior {
     //
     int port_listen;
 
+    // IL: When true, each worker thread accepts on its own
+    // SO_REUSEPORT listener, instead of the main thread accepting
+    // and dispatching new conn's to the workers.
+    //
+    bool listen_reuseport;
+
     char default_bucket_name[250]; // ML: The named bucket (proxy->name)
                                    // that upstream conn's should start on.
                                    // When empty (""), then only binary SASL
@@ -193,6 +246,8 @@ struct proxy_main {
     uint64_t stat_proxy_start_fails;
     uint64_t stat_proxy_existings;
     uint64_t stat_proxy_shutdowns;
+    uint64_t stat_proxy_applies; // Bucket configs applied.
+    uint64_t stat_proxy_skips;   // Bucket configs skipped, as unchanged.
 };
 
 /* Owned by main listener thread.
@@ -210,6 +265,14 @@ struct proxy {
     //
     uint32_t config_ver;
 
+    // Accessed only by the main listener thread.  The fingerprint of
+    // the config and behaviors last applied, or 0 if none, and the
+    // latest config_ver that listed this proxy, which runs ahead of
+    // config_ver while config pushes leave the proxy unchanged.
+    //
+    uint64_t config_fingerprint;
+    uint32_t config_seen_ver;
+
     // Mutable, covered by proxy_lock.
     //
     proxy_behavior_pool behavior_pool;
@@ -233,6 +296,7 @@ struct proxy {
     matcher front_cache_unmatcher;
 
     matcher optimize_set_matcher;
+    matcher combine_set_matcher;
 
     proxy_td *thread_data;     // Immutable.
     int       thread_data_num; // Immutable.
@@ -280,6 +344,16 @@ struct proxy_stats {
     uint64_t tot_retry_time;
     uint64_t max_retry_time;
     uint64_t tot_retry_vbucket;
+    uint64_t tot_hedge_eligible;
+    uint64_t tot_hedge;
+    uint64_t tot_hedge_win;
+    uint64_t tot_hedge_over_budget;
+    uint64_t tot_noreply_batched;
+    uint64_t tot_noreply_batch_flushes;
+    uint64_t tot_combine_sets;
+    uint64_t tot_combine_sets_collapsed;
+    uint64_t tot_multiget_batches;
+    uint64_t tot_multiget_batched;
     uint64_t tot_upstream_paused;
     uint64_t tot_upstream_unpaused;
     uint64_t tot_multiget_keys;
@@ -329,14 +403,76 @@ typedef enum {
     STATS_CMD_TYPE_last
 } enum_stats_cmd_type;
 
+// Max number of downstream servers, by server index, that
+// get their own request timing histogram.
+//
+#define PROXY_STATS_SERVER_MAX 256
+
 typedef struct {
     proxy_stats     stats;
     proxy_stats_cmd stats_cmd[STATS_CMD_TYPE_last][STATS_CMD_last];
 
     HTGRAM_HANDLE downstream_reserved_time_htgram;
     HTGRAM_HANDLE downstream_connect_time_htgram;
+
+    // Request timings, from forwarding a request until the
+    // downstream response is done, by command and by downstream
+    // server index.  Like the other histograms, they're created
+    // lazily on their first sample.
+    //
+    HTGRAM_HANDLE cmd_time_htgram[STATS_CMD_last];
+    HTGRAM_HANDLE server_time_htgram[PROXY_STATS_SERVER_MAX];
+
+    // Number of noreply writes in each flushed quiet request
+    // pipeline, per downstream conn.
+    //
+    HTGRAM_HANDLE noreply_batch_htgram;
 } proxy_stats_td;
 
+// A copy of a proxy_td's counters, which its worker thread
+// periodically publishes, so that other threads can read them
+// without a round trip through the work_queues.  It's a seqlock,
+// see cproxy_publish_stats_snapshot() and cproxy_read_stats_snapshot().
+//
+typedef struct {
+    uint64_t        seq;  // Odd while the worker thread is publishing.
+    uint64_t        msec; // The msec_current_time of the last publish,
+                          // or 0 when never published.
+    proxy_stats     stats;
+    proxy_stats_cmd stats_cmd[STATS_CMD_TYPE_last][STATS_CMD_last];
+} proxy_stats_snapshot;
+
+// The transitions of a request that a sampled trace timestamps.
+//
+typedef enum {
+    TRACE_STAGE_PAUSE = 0, // Upstream paused, waiting for a downstream.
+    TRACE_STAGE_ASSIGN,    // Assigned a downstream.
+    TRACE_STAGE_CONNECT,   // Downstream conns connected.
+    TRACE_STAGE_RESPONSE,  // First response from a downstream conn.
+    TRACE_STAGE_RELEASE,   // Downstream released.
+    TRACE_STAGE_WRITTEN,   // Upstream transmit complete.
+    TRACE_STAGE_last
+} enum_trace_stage;
+
+#define PROXY_TRACE_MAX 1024 // Records kept per proxy_td.
+
+typedef struct {
+    uint64_t id;                     // 0 when unused.  Rewritten last.
+    int      sfd;                    // Of the upstream conn.
+    char     cmd[16];                // First word of the request.
+    uint64_t usec[TRACE_STAGE_last]; // From usec_now(), 0 if not reached.
+} proxy_trace_rec;
+
+// A ring of the latest sampled requests of a worker thread.  Only
+// the worker thread writes it, and other threads read it like a
+// seqlock, see cproxy_read_trace().
+//
+typedef struct {
+    uint64_t        seq;       // Total requests sampled.
+    uint32_t        countdown; // Requests until the next sample.
+    proxy_trace_rec recs[PROXY_TRACE_MAX];
+} proxy_trace;
+
 struct key_stats {
     char key[KEY_MAX_LENGTH + 1];
     int  refcount;
@@ -376,20 +512,76 @@ struct proxy_td { // Per proxy, per worker-thread data struct.
 
     // A timeout for the wait_queue, so that we can emit error
     // on any upstream conn's that are waiting too long for
-    // an available downstream.
-    //
-    // Timeout is in use when timeout_tv fields are non-zero.
+    // an available downstream.  Lives on the thread's timer wheel.
     //
-    struct timeval timeout_tv;
-    struct event   timeout_event;
+    twheel_timer timeout_timer;
 
     mcache  key_stats;
     matcher key_stats_matcher;
     matcher key_stats_unmatcher;
 
+    // Used instead of key_stats when the key_stats_topk
+    // behavior is on.
+    //
+    topk    key_stats_topk;
+
     proxy_stats_td stats;
+
+    // Published by the worker thread when the proxy_main's
+    // stats_snapshot_interval behavior is on, and re-published
+    // on the snapshot_timer while the counters keep changing.
+    //
+    proxy_stats_snapshot stats_snapshot;
+    twheel_timer         snapshot_timer;
+
+    // Created on the first sampled request when the
+    // trace_sample behavior is on.
+    //
+    proxy_trace *trace;
+
+    // The open batch of ascii noreply writes, when the
+    // noreply_batch_max behavior is on.  The batch holds a reserved
+    // downstream, whose conns each accumulate a pipeline of quiet
+    // binary requests until the batch is flushed, on reaching
+    // noreply_batch_max or on the noreply_batch_timer.
+    //
+    downstream  *noreply_batch;
+    int         *noreply_batch_cmds; // Per server index.
+    uint32_t     noreply_batch_num;  // Total writes in the batch.
+    uint64_t     noreply_batch_seq;  // Bumped on each new batch.
+    twheel_timer noreply_batch_timer;
+
+    // The combine_set keys SET during the current combine_set_window,
+    // from the key to a combine_set_entry, which might buffer the
+    // key's latest SET until the combine_sets_timer flushes it.
+    // Created on the first SET to a combine_set key.  The upstream
+    // conns whose commands touch a kept or unanswered SET wait in
+    // combine_sets_waiting, linked by their next field.
+    //
+    genhash_t       *combine_sets;
+    twheel_timer     combine_sets_timer;
+    LIBEVENT_THREAD *combine_sets_thread;
+    conn            *combine_sets_waiting;
+
+    // Opened by the first GET that waits for others to merge with,
+    // when the multiget_batch_window behavior is on.  The waiting
+    // GETs are assigned downstreams when the window closes, or once
+    // multiget_batch_max of them are waiting.
+    //
+    uint32_t     multiget_batch_num;
+    twheel_timer multiget_batch_timer;
+
+    // Recent hedgeable GETs and the hedges sent for them, which the
+    // hedge_budget is checked against.  Both are halved every
+    // HEDGE_BUDGET_WINDOW hedgeable GETs, and unlike the tot_hedge
+    // stats, they're never reset.
+    //
+    uint32_t hedge_recent_eligible;
+    uint32_t hedge_recent;
 };
 
+#define HEDGE_BUDGET_WINDOW 1000
+
 /* A 'downstream' struct represents a set of downstream connections.
  * A possibly better name for it should have been "downstream_conn_set".
  *
@@ -433,12 +625,34 @@ struct downstream {
     int    upstream_retries;  // Count number of upstream_retry attempts.
 
     genhash_t *multiget; // Keyed by string.
-    genhash_t *merger;   // Keyed by string, for merging replies like STATS.
+    stats_merger *merger; // For merging replies like STATS.
+
+    // When GETs from several upstream conns are merged into one
+    // multiget, a copy of their command lines, which the upstream
+    // conns' cmd_start then point into, so that the keys outlive
+    // any upstream conn that closes mid-request.
+    //
+    char *multiget_batch;
 
-    // Timeout is in use when timeout_tv fields are non-zero.
+    // The combine_sets items sent by this downstream, when it's the
+    // batch of a combine_sets flush, which stay kept until it's
+    // released, see cproxy_combine.c.
     //
-    struct timeval timeout_tv;
-    struct event   timeout_event;
+    uint32_t combine_sets;
+
+    // Lives on the thread's timer wheel, in use while pending.
+    //
+    twheel_timer timeout_timer;
+
+    // Hedged single-key GET, in use when hedge_tv fields are non-zero
+    // (timer pending) or hedge_conn is non-NULL (replica request sent).
+    // The first good response wins and the other conn gets closed.
+    //
+    struct timeval hedge_tv;
+    struct event   hedge_event;
+    conn          *hedge_primary; // Downstream conn to the vbucket master.
+    conn          *hedge_conn;    // Downstream conn to the vbucket replica.
+    int            hedge_vbucket;
 };
 
 // Sentinel value for downstream->downstream_conns[] array entries,
@@ -447,6 +661,10 @@ struct downstream {
 //
 #define NULL_CONN ((conn *) -1)
 
+// How long a non-blocking connect() to a downstream server may take.
+//
+#define DOWNSTREAM_CONNECT_TIMEOUT_MSEC 5000
+
 // Functions.
 //
 proxy *cproxy_create(proxy_main *main,
@@ -461,6 +679,7 @@ int cproxy_listen(proxy *p);
 int cproxy_listen_port(int port,
                        enum protocol protocol,
                        enum network_transport transport,
+                       bool        reuseport,
                        void       *conn_extra,
                        conn_funcs *conn_funcs);
 
@@ -492,6 +711,9 @@ conn *cproxy_connect_downstream_conn(downstream *d,
                                      LIBEVENT_THREAD *thread,
                                      mcs_server_st *msst,
                                      proxy_behavior *behavior);
+conn *cproxy_connect_idle_downstream_conn(downstream *d,
+                                          LIBEVENT_THREAD *thread,
+                                          int server_index);
 
 void  cproxy_wait_any_downstream(proxy_td *ptd, conn *c);
 void  cproxy_assign_downstream(proxy_td *ptd);
@@ -567,8 +789,13 @@ bool cproxy_forward_a2b_downstream(downstream *d);
 bool cproxy_forward_a2b_multiget_downstream(downstream *d, conn *uc);
 bool cproxy_forward_a2b_simple_downstream(downstream *d, char *command,
                                           conn *uc);
+bool cproxy_hedge_a2b_downstream(downstream *d, conn *c, int vbucket);
 bool cproxy_forward_a2b_item_downstream(downstream *d, short cmd,
                                         item *it, conn *uc);
+bool cproxy_batch_a2b_noreply(proxy_td *ptd, conn *uc);
+bool cproxy_batch_a2b_item(proxy_td *ptd, LIBEVENT_THREAD *thread,
+                           item *it);
+void cproxy_flush_a2b_noreply(proxy_td *ptd);
 bool cproxy_broadcast_a2b_downstream(downstream *d,
                                      protocol_binary_request_header *req,
                                      int req_size,
@@ -651,6 +878,9 @@ void cproxy_upstream_ascii_item_response(item *it, conn *uc,
 struct timeval cproxy_get_downstream_timeout(downstream *d, conn *c);
 
 bool cproxy_start_downstream_timeout(downstream *d, conn *c);
+bool cproxy_start_hedge_timeout(downstream *d, conn *c, int vbucket);
+void cproxy_clear_hedge(downstream *d);
+bool cproxy_hedge_response(downstream *d, conn *c, bool good);
 bool cproxy_start_wait_queue_timeout(proxy_td *ptd, conn *uc);
 
 rel_time_t cproxy_realtime(const time_t exptime);
@@ -658,6 +888,10 @@ rel_time_t cproxy_realtime(const time_t exptime);
 void cproxy_close_conn(conn *c);
 
 void cproxy_reset_stats_td(proxy_stats_td *pstd);
+void cproxy_publish_stats_snapshot(proxy_td *ptd);
+void cproxy_start_stats_snapshot_timer(proxy_td *ptd);
+bool cproxy_read_stats_snapshot(proxy_td *ptd, proxy_stats_snapshot *out);
+void cproxy_free_stats_td_htgrams(proxy_stats_td *pstd);
 void cproxy_reset_stats(proxy_stats *ps);
 void cproxy_reset_stats_cmd(proxy_stats_cmd *sc);
 
@@ -694,6 +928,10 @@ void multiget_remove_upstream(const void *key,
                               const void *value,
                               void *user_data);
 
+bool cproxy_multiget_batchable(conn *uc);
+bool cproxy_multiget_batch_hold(proxy_td *ptd, conn *uc);
+bool cproxy_multiget_batched(downstream *d);
+
 // Space or null terminated key funcs.
 //
 size_t skey_len(const char *key);
@@ -707,23 +945,10 @@ void noop_free(void *v);
 
 // Stats handling.
 //
-bool protocol_stats_merge_line(genhash_t *merger, char *line);
-
-bool protocol_stats_merge_name_val(genhash_t *merger,
-                                   char *prefix,
-                                   int   prefix_len,
-                                   char *name,
-                                   int   name_len,
-                                   char *val,
-                                   int   val_len);
-
-void protocol_stats_foreach_free(const void *key,
-                                 const void *value,
-                                 void *user_data);
-
-void protocol_stats_foreach_write(const void *key,
-                                  const void *value,
-                                  void *user_data);
+void protocol_stats_write(const char *prefix, int prefix_len,
+                          const char *name, int name_len,
+                          const char *val, int val_len,
+                          void *arg);
 
 void cproxy_optimize_to_self(downstream *d, conn *uc,
                              char *command);
@@ -778,9 +1003,23 @@ void touch_key_stats(proxy_td *ptd, char *key, int key_len,
 void key_stats_add_ref(void *it);
 void key_stats_dec_ref(void *it);
 
+void key_stats_start(proxy_td *ptd);
+void key_stats_stop(proxy_td *ptd);
+
+void cproxy_trace_start(proxy_td *ptd, conn *uc);
+void cproxy_trace_mark(proxy_td *ptd, conn *uc, enum_trace_stage stage);
+void cproxy_trace_downstream(downstream *d, enum_trace_stage stage);
+bool cproxy_read_trace(proxy_td *ptd, uint64_t id, proxy_trace_rec *out);
+const char *cproxy_trace_stage_name(enum_trace_stage stage);
+
+bool cproxy_combine_set(proxy_td *ptd, conn *uc);
+void cproxy_combine_set_close(proxy_td *ptd, conn *uc);
+void cproxy_combine_sets_released(downstream *d);
+
 // TODO: The following generic items should be broken out into util file.
 //
 bool  add_conn_item(conn *c, item *it);
+conn *conn_list_remove(conn *head, conn **tail, conn *c, bool *found);
 char *add_conn_suffix(conn *c);
 
 size_t scan_tokens(char *command, token_t *tokens, const size_t max_tokens,
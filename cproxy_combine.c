@@ -0,0 +1,488 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "memcached.h"
+#include "cproxy.h"
+#include "log.h"
+
+// Write combining of SETs.  The first ascii SET to a key matching
+// the combine_set behavior goes downstream as usual, but opens a
+// window for the key, until the worker thread's combine_sets_timer
+// fires, at most combine_set_window millisecs later.  Any later SETs
+// to the key during its window are answered STORED right away, like
+// for optimize_set, and only the latest one's item is kept.  When the
+// timer fires, each kept item goes downstream as a quiet binary SET,
+// in a batch like for noreply_batch_max, and the windows close.  So a
+// key that's rewritten many times a second, whether by one upstream
+// conn or many, sends a value downstream at least once per window,
+// and at most about twice.
+//
+// A kept item whose server has no idle downstream conn at the flush
+// is stalled, and stays for the next flush.  A later SET to a stalled
+// key isn't answered early, but goes downstream as usual, replacing
+// the stalled item.
+//
+// Any other ascii command on the key of a kept item, including each
+// key of a multi-key get, flushes the kept items, and the upstream
+// conn is then held until the batch that sent the item has all its
+// NOOP responses, so the command can't reach the server first on
+// another downstream conn.  So is a command, including a SET, on the
+// key of an item whose batch is still unanswered, or of a stalled
+// item, which waits for a later flush, or for the wait_queue_timeout.
+//
+typedef struct combine_set_entry combine_set_entry;
+
+struct combine_set_entry {
+    item       *it;      // Referenced.  Holds the key of the entry.
+    bool        pending; // When the item's a kept SET that's not yet sent.
+    bool        stalled; // When a flush couldn't send the pending item.
+    downstream *batch;   // The batch that sent the item, until released.
+
+    combine_set_entry *next; // For the flush.
+};
+
+static void combine_set_entry_free(void *v) {
+    combine_set_entry *e = v;
+    if (e != NULL) {
+        item_remove(e->it);
+        free(e);
+    }
+}
+
+static void combine_sets_timeout(twheel_timer *t, void *arg);
+
+static void combine_sets_flush(proxy_td *ptd);
+
+static bool combine_set_eligible(proxy_td *ptd, conn *uc) {
+    if (ptd->behavior_pool.base.combine_set_window == 0 ||
+        ptd->behavior_pool.base.combine_set[0] == '\0' ||
+        uc->cmd != NREAD_SET ||
+        uc->item == NULL ||
+        uc->cmd_retries > 0 ||
+        uc->peer_host != NULL ||
+        !IS_ASCII(uc->protocol) ||
+        !IS_BINARY(ptd->behavior_pool.base.downstream_protocol)) {
+        return false;
+    }
+
+    item *it = uc->item;
+
+    return matcher_check(&ptd->proxy->combine_set_matcher,
+                         ITEM_key(it), it->nkey, false);
+}
+
+/* Returns true if a command on the key has to wait, as the key's
+ * item is kept or is in a batch that's not yet answered.  Sets flush
+ * if the kept items need a flush for the command to stop waiting.
+ */
+static bool combine_set_touch_key(proxy_td *ptd, char *key, int key_len,
+                                  bool *flush) {
+    char buf[KEY_MAX_LENGTH + 1];
+
+    if (key_len <= 0 ||
+        key_len > KEY_MAX_LENGTH) {
+        return false;
+    }
+
+    memcpy(buf, key, key_len);
+    buf[key_len] = '\0';
+
+    combine_set_entry *e = genhash_find(ptd->combine_sets, buf);
+    if (e == NULL ||
+        (e->pending == false && e->batch == NULL)) {
+        return false;
+    }
+
+    if (e->pending &&
+        e->stalled == false) {
+        *flush = true;
+    }
+
+    return true;
+}
+
+/* Returns true if the upstream conn's command touches the key of a
+ * kept or unanswered item, checking every key of a get or gets.
+ */
+static bool combine_set_touches(proxy_td *ptd, conn *uc, bool *flush) {
+    if (uc->item != NULL) {
+        item *it = uc->item;
+
+        return combine_set_touch_key(ptd, ITEM_key(it), it->nkey, flush);
+    }
+
+    char *key = NULL;
+    int   key_len = 0;
+
+    if (uc->cmd_start == NULL ||
+        !ascii_scan_key(uc->cmd_start, &key, &key_len)) {
+        return false;
+    }
+
+    bool multi = (strncmp(uc->cmd_start, "get ", 4) == 0 ||
+                  strncmp(uc->cmd_start, "gets ", 5) == 0);
+    bool touches = false;
+
+    do {
+        if (combine_set_touch_key(ptd, key, key_len, flush)) {
+            touches = true;
+        }
+    } while (multi &&
+             ascii_scan_key(key, &key, &key_len));
+
+    return touches;
+}
+
+/* Holds the upstream conn until the combine_sets it touches are
+ * answered, first flushing any it touches that are still kept.
+ * Returns false, leaving the upstream alone, if it touches none.
+ */
+static bool combine_set_hold(proxy_td *ptd, conn *uc) {
+    if (ptd->combine_sets == NULL ||
+        !IS_ASCII(uc->protocol)) {
+        return false;
+    }
+
+    bool flush = false;
+
+    if (!combine_set_touches(ptd, uc, &flush)) {
+        return false;
+    }
+
+    if (flush) {
+        combine_sets_flush(ptd);
+
+        // The batch might have failed already, dropping its items.
+        //
+        flush = false;
+
+        if (!combine_set_touches(ptd, uc, &flush)) {
+            return false;
+        }
+    }
+
+    if (settings.verbose > 2) {
+        moxi_log_write("<%d combine_set hold\n", uc->sfd);
+    }
+
+    conn_set_state(uc, conn_pause);
+
+    uc->next = ptd->combine_sets_waiting;
+    ptd->combine_sets_waiting = uc;
+
+    return true;
+}
+
+/* Retries the commands of the held upstream conns, which are held
+ * again if they still touch a kept or unanswered item, unless they've
+ * waited longer than the wait_queue_timeout.
+ */
+static void combine_sets_wake(proxy_td *ptd) {
+    conn *uc = ptd->combine_sets_waiting;
+
+    ptd->combine_sets_waiting = NULL;
+
+    struct timeval wqt = ptd->behavior_pool.base.wait_queue_timeout;
+
+    uint32_t wqt_msec = (wqt.tv_sec * 1000) +
+                        (wqt.tv_usec / 1000);
+
+    uint32_t cut_msec = msec_current_time - wqt_msec;
+
+    while (uc != NULL) {
+        conn *next = uc->next;
+
+        uc->next = NULL;
+
+        if (wqt_msec > 0 &&
+            uc->cmd_start_time <= cut_msec) {
+            ptd->stats.stats.tot_wait_queue_timeout++;
+
+            upstream_error(uc);
+        } else {
+            cproxy_pause_upstream_for_downstream(ptd, uc);
+        }
+
+        uc = next;
+    }
+}
+
+/* Makes the upstream conn's item the entry of its key, replacing
+ * any earlier entry, which keeps the window of the key open.
+ */
+static bool combine_set_put(proxy_td *ptd, conn *uc, bool pending) {
+    combine_set_entry *e = calloc(1, sizeof(combine_set_entry));
+    if (e == NULL) {
+        return false;
+    }
+
+    item *it = uc->item;
+
+    // The item's key is zero terminated, as the byte after it
+    // is reserved, so the key can be used as is for the hash.
+    //
+    char *key = ITEM_key(it);
+
+    key[it->nkey] = '\0';
+
+    genhash_delete(ptd->combine_sets, key);
+
+    item_ref(it);
+
+    e->it      = it;
+    e->pending = pending;
+
+    genhash_store(ptd->combine_sets, key, e);
+
+    if (!twheel_timer_pending(&ptd->combine_sets_timer)) {
+        ptd->combine_sets_thread = uc->thread;
+
+        thread_timer_add(uc->thread, &ptd->combine_sets_timer,
+                         ptd->behavior_pool.base.combine_set_window,
+                         combine_sets_timeout, ptd);
+    }
+
+    return true;
+}
+
+/* Returns true if the upstream conn's SET is now kept and answered,
+ * or if its command is held behind a kept or unanswered SET to one of
+ * its keys, in which case the caller shouldn't queue it for a
+ * downstream.
+ */
+bool cproxy_combine_set(proxy_td *ptd, conn *uc) {
+    assert(ptd != NULL);
+    assert(ptd->proxy != NULL);
+    assert(uc != NULL);
+    assert(uc->thread != NULL);
+
+    if (!combine_set_eligible(ptd, uc)) {
+        return combine_set_hold(ptd, uc);
+    }
+
+    if (ptd->combine_sets == NULL) {
+        struct hash_ops hops = skeyhash_ops;
+        hops.freeValue = combine_set_entry_free;
+
+        ptd->combine_sets = genhash_init(128, hops);
+        if (ptd->combine_sets == NULL) {
+            return false;
+        }
+    }
+
+    item *it = uc->item;
+
+    combine_set_entry *e = genhash_find(ptd->combine_sets, ITEM_key(it));
+    if (e != NULL &&
+        e->batch != NULL) {
+        // Follows the key's unanswered batch, and then opens a
+        // new window.
+        //
+        return combine_set_hold(ptd, uc);
+    }
+
+    if (e == NULL ||
+        e->stalled) {
+        // The key's first SET in a window goes downstream as usual.
+        // So does a SET that replaces a stalled item, which opens
+        // a downstream conn to its server if there's none, and
+        // which is only answered once the server has it.
+        //
+        if (e != NULL) {
+            ptd->stats.stats.tot_combine_sets_collapsed++;
+        }
+
+        combine_set_put(ptd, uc, false);
+
+        return false;
+    }
+
+    if (e->pending) {
+        ptd->stats.stats.tot_combine_sets_collapsed++;
+    }
+
+    if (!combine_set_put(ptd, uc, true)) {
+        return false;
+    }
+
+    ptd->stats.stats.tot_combine_sets++;
+
+    if (settings.verbose > 2) {
+        moxi_log_write("<%d combine_set kept: %s\n",
+                       uc->sfd, ITEM_key(it));
+    }
+
+    mcache_delete(&ptd->proxy->front_cache, ITEM_key(it), it->nkey);
+
+    out_string(uc, "STORED");
+
+    if (!update_event(uc, EV_WRITE | EV_PERSIST)) {
+        if (settings.verbose > 1) {
+            moxi_log_write("ERROR: Can't update upstream write event\n");
+        }
+
+        ptd->stats.stats.err_oom++;
+        cproxy_close_conn(uc);
+    }
+
+    return true;
+}
+
+struct combine_sets_flush_arg {
+    proxy_td          *ptd;
+    downstream        *batch; // For a release, the released batch.
+    combine_set_entry *done;  // Entries to delete after the iteration.
+    int                sent;
+    int                kept;  // Entries that stay for the next flush.
+};
+
+static void combine_sets_released_entry(const void *key, const void *val,
+                                        void *arg) {
+    (void) key;
+
+    combine_set_entry *e = (combine_set_entry *) val;
+    struct combine_sets_flush_arg *fa = arg;
+
+    if (e->batch == fa->batch) {
+        e->next  = fa->done;
+        fa->done = e;
+    }
+}
+
+/* Forgets an upstream conn that's closing while it's held.
+ */
+void cproxy_combine_set_close(proxy_td *ptd, conn *uc) {
+    assert(ptd != NULL);
+    assert(uc != NULL);
+
+    ptd->combine_sets_waiting =
+        conn_list_remove(ptd->combine_sets_waiting, NULL, uc, NULL);
+}
+
+/* Called as a downstream is released, which ends the items of its
+ * batch, if it was a flush's batch, and lets the upstream conns that
+ * were held behind them go on.
+ */
+void cproxy_combine_sets_released(downstream *d) {
+    assert(d != NULL);
+
+    proxy_td *ptd = d->ptd;
+    assert(ptd != NULL);
+    assert(ptd->combine_sets != NULL);
+
+    d->combine_sets = 0;
+
+    struct combine_sets_flush_arg fa = {
+        .ptd   = ptd,
+        .batch = d,
+        .done  = NULL,
+        .sent  = 0,
+        .kept  = 0
+    };
+
+    genhash_iter(ptd->combine_sets, combine_sets_released_entry, &fa);
+
+    while (fa.done != NULL) {
+        combine_set_entry *e = fa.done;
+        fa.done = e->next;
+
+        genhash_delete(ptd->combine_sets, ITEM_key(e->it));
+    }
+
+    combine_sets_wake(ptd);
+}
+
+static void combine_sets_flush_entry(const void *key, const void *val,
+                                     void *arg) {
+    (void) key;
+
+    combine_set_entry *e = (combine_set_entry *) val;
+    struct combine_sets_flush_arg *fa = arg;
+
+    if (e->batch != NULL) {
+        return; // Stays until its batch is released.
+    }
+
+    if (e->pending) {
+        if (cproxy_batch_a2b_item(fa->ptd, fa->ptd->combine_sets_thread,
+                                  e->it) == false) {
+            e->stalled = true;
+            fa->kept++;
+            return;
+        }
+
+        e->pending = false;
+        e->stalled = false;
+        e->batch   = fa->ptd->noreply_batch;
+        assert(e->batch != NULL);
+
+        e->batch->combine_sets++;
+        fa->sent++;
+        return;
+    }
+
+    e->next  = fa->done;
+    fa->done = e;
+}
+
+/* Sends the kept items downstream, which closes every key's window.
+ */
+static void combine_sets_flush(proxy_td *ptd) {
+    assert(ptd != NULL);
+    assert(ptd->combine_sets != NULL);
+    assert(ptd->combine_sets_thread != NULL);
+
+    twheel_del(&ptd->combine_sets_timer);
+
+    struct combine_sets_flush_arg fa = {
+        .ptd   = ptd,
+        .batch = NULL,
+        .done  = NULL,
+        .sent  = 0,
+        .kept  = 0
+    };
+
+    genhash_iter(ptd->combine_sets, combine_sets_flush_entry, &fa);
+
+    while (fa.done != NULL) {
+        combine_set_entry *e = fa.done;
+        fa.done = e->next;
+
+        genhash_delete(ptd->combine_sets, ITEM_key(e->it));
+    }
+
+    if (settings.verbose > 2) {
+        moxi_log_write("combine_sets flush, %d sent, %d kept\n",
+                       fa.sent, fa.kept);
+    }
+
+    if (fa.kept > 0) {
+        thread_timer_add(ptd->combine_sets_thread, &ptd->combine_sets_timer,
+                         ptd->behavior_pool.base.combine_set_window,
+                         combine_sets_timeout, ptd);
+    }
+
+    // Also releases the batch's downstream if it was opened here,
+    // but nothing could be sent, and ends the sent items if their
+    // conns can't be written.
+    //
+    if (fa.sent + fa.kept > 0) {
+        cproxy_flush_a2b_noreply(ptd);
+    }
+}
+
+static void combine_sets_timeout(twheel_timer *t, void *arg) {
+    (void) t;
+
+    proxy_td *ptd = arg;
+    assert(ptd != NULL);
+
+    combine_sets_flush(ptd);
+
+    // Retries the commands held behind stalled items.
+    //
+    combine_sets_wake(ptd);
+}
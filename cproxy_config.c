@@ -55,9 +55,20 @@ proxy_behavior behavior_default_g = {
         .tv_sec  = 0,
         .tv_usec = 0
     },
-    .time_stats = false,
+    .time_stats = true,
+    .time_stats_detail = false,
+    .conn_buffer_pool = false,
+    .io_uring = false,
+    .stats_snapshot_interval = 0,
     .connect_max_errors = 0,     // In zstored, 10.
     .connect_retry_interval = 0, // In zstored, 30000.
+    .hedge_delay = 0,
+    .hedge_budget = 5,
+    .trace_sample = 0,
+    .noreply_batch_max = 0,
+    .noreply_batch_interval = 2,
+    .multiget_batch_max = 0,
+    .multiget_batch_window = 0,
     .front_cache_max = 200,
     .front_cache_lifespan = 0,
     .front_cache_spec = {0},
@@ -66,13 +77,17 @@ proxy_behavior behavior_default_g = {
     .key_stats_lifespan = 0,
     .key_stats_spec = {0},
     .key_stats_unspec = {0},
+    .key_stats_topk = false,
     .optimize_set = {0},
+    .combine_set = {0},
+    .combine_set_window = 10,
     .host = {0},
     .port = 0,
     .bucket = {0},
     .usr = {0},
     .pwd = {0},
     .port_listen = MOXI_DEFAULT_LISTEN_PORT,
+    .listen_reuseport = false,
     .default_bucket_name = "default"
 };
 
@@ -320,6 +335,18 @@ int cproxy_init(char *cfg_str,
         msec_cycle = behavior.cycle;
     }
 
+    if (behavior.conn_buffer_pool) {
+        settings.conn_buffer_pool = true;
+    }
+
+    if (behavior.io_uring) {
+        if (uring_probe()) {
+            settings.io_uring = true;
+        } else if (settings.verbose > 0) {
+            moxi_log_write("io_uring not available, using sendmsg\n");
+        }
+    }
+
     msec_clockevent_base = main_base;
     msec_clock_handler(0, 0, NULL);
 
@@ -545,6 +572,8 @@ proxy_main *cproxy_gen_proxy_main(proxy_behavior behavior, int nthreads,
         m->stat_proxy_start_fails = 0;
         m->stat_proxy_existings   = 0;
         m->stat_proxy_shutdowns   = 0;
+        m->stat_proxy_applies     = 0;
+        m->stat_proxy_skips       = 0;
     }
 
     return m;
@@ -643,10 +672,32 @@ void cproxy_parse_behavior_key_val(char *key,
             behavior->wait_queue_timeout.tv_usec = (ms % 1000) * 1000;
         } else if (wordeq(key, "time_stats")) {
             behavior->time_stats = strtol(val, NULL, 10);
+        } else if (wordeq(key, "time_stats_detail")) {
+            behavior->time_stats_detail = strtol(val, NULL, 10);
+        } else if (wordeq(key, "conn_buffer_pool")) {
+            behavior->conn_buffer_pool = strtol(val, NULL, 10);
+        } else if (wordeq(key, "io_uring")) {
+            behavior->io_uring = strtol(val, NULL, 10);
+        } else if (wordeq(key, "stats_snapshot_interval")) {
+            behavior->stats_snapshot_interval = strtol(val, NULL, 10);
         } else if (wordeq(key, "connect_max_errors")) {
             behavior->connect_max_errors = strtol(val, NULL, 10);
         } else if (wordeq(key, "connect_retry_interval")) {
             behavior->connect_retry_interval = strtol(val, NULL, 10);
+        } else if (wordeq(key, "hedge_delay")) {
+            behavior->hedge_delay = strtol(val, NULL, 10);
+        } else if (wordeq(key, "hedge_budget")) {
+            behavior->hedge_budget = strtol(val, NULL, 10);
+        } else if (wordeq(key, "trace_sample")) {
+            behavior->trace_sample = strtol(val, NULL, 10);
+        } else if (wordeq(key, "noreply_batch_max")) {
+            behavior->noreply_batch_max = strtol(val, NULL, 10);
+        } else if (wordeq(key, "noreply_batch_interval")) {
+            behavior->noreply_batch_interval = strtol(val, NULL, 10);
+        } else if (wordeq(key, "multiget_batch_max")) {
+            behavior->multiget_batch_max = strtol(val, NULL, 10);
+        } else if (wordeq(key, "multiget_batch_window")) {
+            behavior->multiget_batch_window = strtol(val, NULL, 10);
         } else if (wordeq(key, "front_cache_max")) {
             behavior->front_cache_max = strtol(val, NULL, 10);
         } else if (wordeq(key, "front_cache_lifespan")) {
@@ -671,10 +722,18 @@ void cproxy_parse_behavior_key_val(char *key,
             if (strlen(val) < sizeof(behavior->key_stats_unspec)) {
                 strcpy(behavior->key_stats_unspec, val);
             }
+        } else if (wordeq(key, "key_stats_topk")) {
+            behavior->key_stats_topk = strtol(val, NULL, 10);
         } else if (wordeq(key, "optimize_set")) {
             if (strlen(val) < sizeof(behavior->optimize_set)) {
                 strcpy(behavior->optimize_set, val);
             }
+        } else if (wordeq(key, "combine_set")) {
+            if (strlen(val) < sizeof(behavior->combine_set)) {
+                strcpy(behavior->combine_set, val);
+            }
+        } else if (wordeq(key, "combine_set_window")) {
+            behavior->combine_set_window = strtol(val, NULL, 10);
         } else if (wordeq(key, "usr")) {
             if (strlen(val) < sizeof(behavior->usr)) {
                 strcpy(behavior->usr, val);
@@ -695,6 +754,8 @@ void cproxy_parse_behavior_key_val(char *key,
             }
         } else if (wordeq(key, "port_listen")) {
             behavior->port_listen = strtol(val, NULL, 10);
+        } else if (wordeq(key, "listen_reuseport")) {
+            behavior->listen_reuseport = strtol(val, NULL, 10);
         } else if (wordeq(key, "default_bucket_name")) {
             if (strlen(val) < sizeof(behavior->default_bucket_name)) {
                 strcpy(behavior->default_bucket_name, val);
@@ -805,8 +866,19 @@ void cproxy_dump_behavior_ex(proxy_behavior *b, char *prefix, int level,
               (b->wait_queue_timeout.tv_sec * 1000 +
                b->wait_queue_timeout.tv_usec / 1000));
         vdump("time_stats", "%d", b->time_stats);
+        vdump("time_stats_detail", "%d", b->time_stats_detail);
+        vdump("conn_buffer_pool", "%d", b->conn_buffer_pool);
+        vdump("io_uring", "%d", b->io_uring);
+        vdump("stats_snapshot_interval", "%u", b->stats_snapshot_interval);
         vdump("connect_max_errors", "%u", b->connect_max_errors);
         vdump("connect_retry_interval", "%u", b->connect_retry_interval);
+        vdump("hedge_delay", "%u", b->hedge_delay);
+        vdump("hedge_budget", "%u", b->hedge_budget);
+        vdump("trace_sample", "%u", b->trace_sample);
+        vdump("noreply_batch_max", "%u", b->noreply_batch_max);
+        vdump("noreply_batch_interval", "%u", b->noreply_batch_interval);
+        vdump("multiget_batch_max", "%u", b->multiget_batch_max);
+        vdump("multiget_batch_window", "%u", b->multiget_batch_window);
         vdump("front_cache_max", "%u", b->front_cache_max);
         vdump("front_cache_lifespan", "%u", b->front_cache_lifespan);
         vdump("front_cache_spec", "%s", b->front_cache_spec);
@@ -815,7 +887,10 @@ void cproxy_dump_behavior_ex(proxy_behavior *b, char *prefix, int level,
         vdump("key_stats_lifespan", "%u", b->key_stats_lifespan);
         vdump("key_stats_spec", "%s", b->key_stats_spec);
         vdump("key_stats_unspec", "%s", b->key_stats_unspec);
+        vdump("key_stats_topk", "%d", b->key_stats_topk);
         vdump("optimize_set", "%s", b->optimize_set);
+        vdump("combine_set", "%s", b->combine_set);
+        vdump("combine_set_window", "%u", b->combine_set_window);
     }
 
     vdump("usr",    "%s", b->usr);
@@ -825,6 +900,7 @@ void cproxy_dump_behavior_ex(proxy_behavior *b, char *prefix, int level,
 
     if (level >= 1) {
         vdump("port_listen", "%d", b->port_listen);
+        vdump("listen_reuseport", "%d", b->listen_reuseport);
         vdump("default_bucket_name", "%s", b->default_bucket_name);
     }
 }
@@ -847,20 +923,36 @@ void cproxy_dump_behavior_stderr(const void *dump_opaque,
 
 // ---------------------------------------
 
+/* Microsecs since process start, from the monotonic clock, so
+ * it's never zero and never jumps backwards.
+ */
 uint64_t usec_now(void) {
-    struct timeval timer;
-    gettimeofday(&timer, NULL);
-    return ((timer.tv_sec - process_started) * 1000000) + timer.tv_usec;
+    return monotonic_usec() - process_started_usec;
+}
+
+/* Like usec_now(), but reads the clock at most once per event
+ * loop iteration on the given thread.  thread_event_loop() clears
+ * the cache before each iteration's callbacks, so no callback has
+ * to, and durations between two cached reads on the same thread
+ * are never negative.
+ */
+uint64_t usec_now_cached(LIBEVENT_THREAD *thread) {
+    if (thread == NULL) {
+        return usec_now();
+    }
+
+    if (thread->usec_time == 0) {
+        thread->usec_time = usec_now();
+    }
+
+    return thread->usec_time;
 }
 
 /* Time-sensitive callers can call it by hand with this,
  * outside the normal subsecond timer
  */
 void msec_set_current_time(void) {
-    struct timeval timer;
-    gettimeofday(&timer, NULL);
-    msec_current_time =
-        (timer.tv_sec - process_started) * 1000 + (timer.tv_usec / 1000);
+    msec_current_time = (uint32_t) (usec_now() / 1000);
 }
 
 void msec_clock_handler(const int fd, const short which, void *arg) {
@@ -47,6 +47,39 @@ void multiget_foreach_free(const void *key,
     // TODO: Track key-level multiget squashes (length > 1).
 }
 
+/* Copies the command lines of a merged batch of upstream GETs into
+ * the downstream, one after another in upstream conn order.  The
+ * multiget map's keys, the downstream requests' keys, and a binary
+ * request's opaque key index then all refer to the copy, which lives
+ * until the downstream is released.  The upstream conns' cmd_start
+ * is left alone, as a retry re-parses it after the release.
+ */
+static bool multiget_batch_copy(downstream *d, conn *uc) {
+    size_t len = 0;
+
+    for (conn *c = uc; c != NULL; c = c->next) {
+        len += strlen(c->cmd_start) + 1;
+    }
+
+    char *buf = malloc(len);
+    if (buf == NULL) {
+        return false;
+    }
+
+    char *p = buf;
+
+    for (conn *c = uc; c != NULL; c = c->next) {
+        size_t n = strlen(c->cmd_start) + 1;
+
+        memcpy(p, c->cmd_start, n);
+        p += n;
+    }
+
+    d->multiget_batch = buf;
+
+    return true;
+}
+
 /* Callback to g_hash_table_foreach that clears out multiget_entries
  * which have the given upstream conn (passed as user_data).
  */
@@ -104,6 +137,22 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
         }
     }
 
+    if (uc->next != NULL &&
+        d->multiget_batch == NULL) {
+        if (multiget_batch_copy(d, uc) == false) {
+            ptd->stats.stats.err_oom++;
+            return false;
+        }
+
+        ptd->stats.stats.tot_multiget_batches++;
+    }
+
+    // Key indexes are relative to the batch's copy of the command
+    // lines, if any, else to the single upstream's command line.
+    //
+    char *key_base = d->multiget_batch;
+    char *key_line = key_base;
+
     // Snapshot the volatile only once.
     //
     uint32_t msec_current_time_snapshot = msec_current_time;
@@ -118,9 +167,13 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
         assert(IS_ASCII(uc_cur->protocol));
         assert(IS_PROXY(uc_cur->protocol));
 
-        char *command = uc_cur->cmd_start;
+        char *command = (key_line != NULL ? key_line : uc_cur->cmd_start);
         assert(command != NULL);
 
+        if (key_line != NULL) {
+            key_line += strlen(key_line) + 1;
+        }
+
         char *space = strchr(command, ' ');
         assert(space > command);
 
@@ -274,9 +327,11 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
                     // retrying already successfully attempted keys.
                     //
                     // Previously, we used to only have a map when there was more than
-                    // one upstream conn.
+                    // one upstream conn.  A merged batch of upstream GETs
+                    // always needs the map, to route each key's response.
                     //
-                    if (key_last == false &&
+                    if ((key_last == false ||
+                         d->multiget_batch != NULL) &&
                         d->multiget == NULL) {
                         d->multiget = genhash_init(128, skeyhash_ops);
                         if (settings.verbose > 1) {
@@ -336,7 +391,8 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
                         // Provide the preceding space as optimization
                         // for ascii-to-ascii configuration.
                         //
-                        emit_skey(c, key - 1, key_len + 1, vbucket, key - command);
+                        emit_skey(c, key - 1, key_len + 1, vbucket,
+                                  key - (key_base != NULL ? key_base : command));
                     } else {
                         ptd->stats.stats.tot_multiget_keys_dedupe++;
 
@@ -515,3 +571,93 @@ void multiget_ascii_downstream_response(downstream *d, item *it) {
     }
 }
 
+
+// Merging of ascii GETs from different upstream conns, when the
+// multiget_batch_max behavior is > 1.  When a downstream is assigned,
+// up to multiget_batch_max waiting GETs are chained onto its upstream
+// conn list, and are sent as one multiget per downstream server, whose
+// responses are routed back to each upstream through the multiget map.
+// With the multiget_batch_window behavior, a GET also waits a while for
+// others to merge with, even if a downstream is available, trading
+// some latency for fewer and bigger downstream requests.
+//
+static void multiget_batch_timeout(twheel_timer *t, void *arg);
+
+/* Returns true if an upstream conn's request is an ascii get that
+ * may be merged with other upstream conns' gets.
+ */
+bool cproxy_multiget_batchable(conn *uc) {
+    assert(uc != NULL);
+
+    proxy_td *ptd = uc->extra;
+    if (ptd == NULL ||
+        ptd->behavior_pool.base.multiget_batch_max <= 1) {
+        return false;
+    }
+
+    // TODO: Allow gets (CAS), too.
+    //
+    return IS_ASCII(uc->protocol) &&
+           uc->cmd == -1 &&
+           uc->item == NULL &&
+           uc->cmd_retries <= 0 &&
+           uc->noreply == false &&
+           uc->peer_host == NULL &&
+           (uc->cmd_curr == PROTOCOL_BINARY_CMD_GETK ||
+            uc->cmd_curr == PROTOCOL_BINARY_CMD_GETKQ) &&
+           uc->cmd_start != NULL &&
+           strncmp(uc->cmd_start, "get ", 4) == 0;
+}
+
+/* Returns true if a waiting upstream GET should wait for others to
+ * merge with, instead of being assigned a downstream right away.
+ */
+bool cproxy_multiget_batch_hold(proxy_td *ptd, conn *uc) {
+    assert(ptd != NULL);
+    assert(uc != NULL);
+    assert(uc->thread != NULL);
+
+    uint32_t window = ptd->behavior_pool.base.multiget_batch_window;
+    if (window == 0 ||
+        cproxy_multiget_batchable(uc) == false) {
+        return false;
+    }
+
+    ptd->multiget_batch_num++;
+    if (ptd->multiget_batch_num >=
+        ptd->behavior_pool.base.multiget_batch_max) {
+        return false; // Enough GETs are waiting already.
+    }
+
+    if (!twheel_timer_pending(&ptd->multiget_batch_timer)) {
+        thread_timer_add(uc->thread, &ptd->multiget_batch_timer,
+                         window, multiget_batch_timeout, ptd);
+    }
+
+    return true;
+}
+
+/* Returns true if the downstream's upstream GETs are, or were, a
+ * merged batch, so they need a multiget to every downstream server,
+ * even if there's only a single key left.
+ */
+bool cproxy_multiget_batched(downstream *d) {
+    assert(d != NULL);
+    assert(d->upstream_conn != NULL);
+
+    return d->upstream_conn->next != NULL ||
+           d->multiget_batch != NULL;
+}
+
+static void multiget_batch_timeout(twheel_timer *t, void *arg) {
+    (void) t;
+    proxy_td *ptd = arg;
+    assert(ptd != NULL);
+
+    if (settings.verbose > 2) {
+        moxi_log_write("multiget_batch_timeout %u\n",
+                       ptd->multiget_batch_num);
+    }
+
+    cproxy_assign_downstream(ptd);
+}
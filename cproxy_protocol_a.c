@@ -13,11 +13,15 @@
 // Internal declarations.
 //
 #define COMMAND_TOKEN 0
+#define KEY_TOKEN     1
 #define MAX_TOKENS    8
 
 #define MAX_HOSTNAME_LEN 200
 #define MAX_PORT_LEN     8
 
+static void touch_update_key_stats(proxy_td *ptd, token_t *key_token,
+                                   int cmd_st, int cmdx, item *it);
+
 void cproxy_process_upstream_ascii(conn *c, char *line) {
     assert(c != NULL);
     assert(c->next == NULL);
@@ -173,6 +177,9 @@ void cproxy_process_upstream_ascii(conn *c, char *line) {
                 SEEN(cmdx, false, cmd_len);
                 ptd->stats.stats_cmd[cmd_st][cmdx].misses++;
             }
+
+            touch_update_key_stats(ptd, &tokens[KEY_TOKEN],
+                                   cmd_st, cmdx, it);
         }
 
     } else if ((ntokens == 7 || ntokens == 8) &&
@@ -193,6 +200,9 @@ void cproxy_process_upstream_ascii(conn *c, char *line) {
             ptd->stats.stats_cmd[cmd_st][STATS_CMD_CAS].misses++;
         }
 
+        touch_update_key_stats(ptd, &tokens[KEY_TOKEN],
+                               cmd_st, STATS_CMD_CAS, it);
+
     } else if ((ntokens == 4 || ntokens == 5) &&
                (false == self_command) &&
                (strncmp(cmd, "incr", 4) == 0) &&
@@ -302,9 +312,7 @@ void cproxy_process_upstream_ascii_nread(conn *c) {
 
     assert(it != NULL);
 
-    // pthread_mutex_lock(&c->thread->stats.mutex);
-    // c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++;
-    // pthread_mutex_unlock(&c->thread->stats.mutex);
+    // THREAD_STATS_ADD(c->thread->stats.slab_stats[it->slabs_clsid].set_cmds, 1);
 
     if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) == 0) {
         proxy_td *ptd = c->extra;
@@ -484,6 +492,8 @@ void cproxy_process_downstream_ascii(conn *c, char *line) {
     assert(d != NULL);
     assert(d->upstream_conn != NULL);
 
+    cproxy_trace_downstream(d, TRACE_STAGE_RESPONSE);
+
     if (IS_ASCII(d->upstream_conn->protocol)) {
         cproxy_process_a2a_downstream(c, line);
     } else {
@@ -535,3 +545,27 @@ bool ascii_scan_key(char *line, char **key, int *key_len) {
     return *key_len > 0;
 }
 
+/* Update key-based statistics for a set/add/replace/append/prepend/cas,
+ * where a NULL item means the request couldn't be read.
+ */
+static void touch_update_key_stats(proxy_td *ptd, token_t *key_token,
+                                   int cmd_st, int cmdx, item *it) {
+    char *key = key_token->value;
+    int key_len = key_token->length;
+
+    if (key_len <= 0 ||
+        key_len > KEY_MAX_LENGTH) {
+        return;
+    }
+
+    if (matcher_check(&ptd->key_stats_matcher,
+                      key, key_len, false) == true &&
+        matcher_check(&ptd->key_stats_unmatcher,
+                      key, key_len, false) == false) {
+        touch_key_stats(ptd, key, key_len,
+                        msec_current_time,
+                        cmd_st, cmdx,
+                        1, 0, it == NULL ? 1 : 0,
+                        it != NULL ? it->nbytes : 0, 0);
+    }
+}
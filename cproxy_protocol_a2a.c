@@ -132,7 +132,7 @@ void cproxy_process_a2a_downstream(conn *c, char *line) {
         if (uc != NULL) {
             assert(uc->next == NULL);
 
-            if (protocol_stats_merge_line(d->merger, line) == false) {
+            if (stats_merger_add_line(d->merger, line) == false) {
                 // Forward the line as-is if we couldn't merge it.
                 //
                 int nline = strlen(line);
@@ -207,9 +207,7 @@ void cproxy_process_a2a_downstream_nread(conn *c) {
 
     conn_set_state(c, conn_new_cmd);
 
-    // pthread_mutex_lock(&c->thread->stats.mutex);
-    // c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++;
-    // pthread_mutex_unlock(&c->thread->stats.mutex);
+    // THREAD_STATS_ADD(c->thread->stats.slab_stats[it->slabs_clsid].set_cmds, 1);
 
     multiget_ascii_downstream_response(d, it);
 
@@ -234,7 +232,8 @@ bool cproxy_forward_a2a_downstream(downstream *d) {
 
     int server_index = -1;
 
-    if (cproxy_is_broadcast_cmd(uc->cmd_curr) == false) {
+    if (cproxy_is_broadcast_cmd(uc->cmd_curr) == false &&
+        cproxy_multiget_batched(d) == false) {
         char *key = NULL;
         int   key_len = 0;
 
@@ -255,7 +254,7 @@ bool cproxy_forward_a2a_downstream(downstream *d) {
 
         if (d->usec_start == 0 &&
             d->ptd->behavior_pool.base.time_stats) {
-            d->usec_start = usec_now();
+            d->usec_start = usec_now_cached(uc->thread);
         }
 
         if (uc->cmd == -1) {
@@ -322,7 +321,7 @@ bool cproxy_forward_a2a_simple_downstream(downstream *d,
 
         if (cproxy_broadcast_a2a_downstream(d, command, uc,
                                             "END\r\n")) {
-            d->merger = genhash_init(512, skeyhash_ops);
+            d->merger = stats_merger_create();
             return true;
         } else {
             return false;
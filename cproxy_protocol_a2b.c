@@ -173,6 +173,14 @@ void a2b_set_opaque(conn *c, protocol_binary_request_header *header, bool norepl
 bool a2b_not_my_vbucket(conn *uc, conn *c,
                         protocol_binary_response_header *header);
 
+static void a2b_fill_item_request(conn *c, short cmd, item *it,
+                                  bool noreply, int vbucket,
+                                  protocol_binary_request_header *req,
+                                  uint8_t extlen);
+
+static bool a2b_noreply_batch_open(proxy_td *ptd, downstream *d);
+static bool a2b_noreply_batch_start(downstream *d);
+
 void cproxy_init_a2b() {
     memset(&req_noop, 0, sizeof(req_noop));
 
@@ -676,6 +684,21 @@ void a2b_process_downstream_response(conn *c) {
 
     conn *uc = d->upstream_conn;
 
+    // A hedged single-key GET has two responses racing, so only
+    // the winner gets processed.  A replica's not-my-vbucket error
+    // is dropped here, too, so it won't disturb the vbucket map.
+    //
+    if (c->cmd == PROTOCOL_BINARY_CMD_GETK &&
+        c->noreply == false &&
+        cproxy_hedge_response(d, c, status == 0) == false) {
+        if (it != NULL) {
+            item_remove(it);
+        }
+
+        conn_set_state(c, conn_pause);
+        return;
+    }
+
     // Handle not-my-vbucket error response.
     //
     if (status == PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET) {
@@ -937,10 +960,10 @@ void a2b_process_downstream_response(conn *c) {
 
                 // TODO: Handle ITEM and PREFIX.
                 //
-                protocol_stats_merge_name_val(d->merger,
-                                              "STAT", 4,
-                                              ITEM_key(it), it->nkey,
-                                              ITEM_data(it), it->nbytes - 2);
+                stats_merger_add(d->merger,
+                                 "STAT", 4,
+                                 ITEM_key(it), it->nkey,
+                                 ITEM_data(it), it->nbytes - 2);
             }
 
             item_remove(it);
@@ -979,7 +1002,8 @@ bool cproxy_forward_a2b_downstream(downstream *d) {
 
     int server_index = -1;
 
-    if (cproxy_is_broadcast_cmd(uc->cmd_curr) == false) {
+    if (cproxy_is_broadcast_cmd(uc->cmd_curr) == false &&
+        cproxy_multiget_batched(d) == false) {
         char *key = NULL;
         int   key_len = 0;
 
@@ -998,9 +1022,14 @@ bool cproxy_forward_a2b_downstream(downstream *d) {
     if (nc > 0) {
         assert(d->downstream_conns != NULL);
 
+        if (d->ptd->noreply_batch == NULL &&
+            a2b_noreply_batch_start(d)) {
+            return true;
+        }
+
         if (d->usec_start == 0 &&
             d->ptd->behavior_pool.base.time_stats) {
-            d->usec_start = usec_now();
+            d->usec_start = usec_now_cached(uc->thread);
         }
 
         if (uc->cmd == -1) {
@@ -1030,9 +1059,10 @@ bool cproxy_forward_a2b_simple_downstream(downstream *d,
     assert(uc->cmd_curr != (protocol_binary_command) -1);
     assert(d->merger == NULL);
 
-    // Handles multi-key get and gets.
+    // Handles multi-key get and gets, and merged batches of gets.
     //
-    if (uc->cmd_curr == PROTOCOL_BINARY_CMD_GETKQ) {
+    if (uc->cmd_curr == PROTOCOL_BINARY_CMD_GETKQ ||
+        cproxy_multiget_batched(d)) {
         // Only use front_cache for 'get', not for 'gets'.
         //
         mcache *front_cache =
@@ -1142,7 +1172,7 @@ bool cproxy_forward_a2b_simple_downstream(downstream *d,
                                                 out_keylen,
                                                 out_extlen, uc,
                                                 "END\r\n")) {
-                d->merger = genhash_init(128, skeyhash_ops);
+                d->merger = stats_merger_create();
                 return true;
             }
         }
@@ -1238,6 +1268,11 @@ bool cproxy_forward_a2b_simple_downstream(downstream *d,
 
                     if (cproxy_dettach_if_noreply(d, uc) == false) {
                         cproxy_start_downstream_timeout(d, c);
+
+                        if (uc->cmd_curr == PROTOCOL_BINARY_CMD_GETK &&
+                            vbucket >= 0) {
+                            cproxy_start_hedge_timeout(d, c, vbucket);
+                        }
                     } else {
                         c->write_and_go = conn_pause;
 
@@ -1288,6 +1323,83 @@ bool cproxy_forward_a2b_simple_downstream(downstream *d,
     return false;
 }
 
+/* Sends a copy of the upstream's single-key GET to a vbucket
+ * replica's downstream conn c, after the master was too slow.
+ */
+bool cproxy_hedge_a2b_downstream(downstream *d, conn *c, int vbucket) {
+    assert(d != NULL);
+    assert(c != NULL);
+    assert(c->state == conn_pause);
+    assert(IS_BINARY(c->protocol));
+
+    conn *uc = d->upstream_conn;
+
+    assert(uc != NULL);
+    assert(uc->cmd_start != NULL);
+    assert(uc->cmd_curr == PROTOCOL_BINARY_CMD_GETK);
+    assert(uc->noreply == false);
+
+    int      cmd_len = 0;
+    token_t  tokens[MAX_TOKENS];
+    size_t   ntokens = scan_tokens(uc->cmd_start, tokens, MAX_TOKENS, &cmd_len);
+
+    if (ntokens <= 1 ||
+        cproxy_prep_conn_for_write(c) == false) {
+        return false;
+    }
+
+    assert(c->wbuf);
+    assert(c->wsize >= a2b_size_max);
+
+    protocol_binary_request_header *header =
+        (protocol_binary_request_header *) c->wbuf;
+
+    memset(header, 0, a2b_size_max);
+
+    uint8_t *out_key    = NULL;
+    uint16_t out_keylen = 0;
+    uint8_t  out_extlen = 0;
+
+    int size = a2b_fill_request(uc->cmd_curr,
+                                tokens, ntokens,
+                                false, header,
+                                &out_key,
+                                &out_keylen,
+                                &out_extlen);
+    if (size <= 0 ||
+        out_key == NULL ||
+        out_keylen == 0) {
+        return false;
+    }
+
+    assert(size <= a2b_size_max);
+
+    header->request.reserved = htons(vbucket);
+    header->request.opaque   = htonl(vbucket);
+    header->request.bodylen  = htonl(out_keylen + out_extlen);
+
+    if (add_iov(c, header, size) != 0 ||
+        add_iov(c, out_key, out_keylen) != 0) {
+        return false;
+    }
+
+    if (settings.verbose > 2) {
+        moxi_log_write("hedging a2b to %d, cmd %x, vbucket %d\n",
+                       c->sfd, header->request.opcode, vbucket);
+    }
+
+    conn_set_state(c, conn_mwrite);
+    c->write_and_go = conn_new_cmd;
+
+    if (update_event(c, EV_WRITE | EV_PERSIST)) {
+        return true;
+    }
+
+    conn_set_state(c, conn_pause);
+
+    return false;
+}
+
 int a2b_multiget_start(conn *c, char *cmd, int cmd_len) {
     (void)c;
     (void)cmd;
@@ -1502,83 +1614,8 @@ bool cproxy_forward_a2b_item_downstream(downstream *d, short cmd,
                     protocol_binary_request_header *req =
                         (protocol_binary_request_header *) ITEM_data(it_hdr);
 
-                    memset(req, 0, hdrlen);
-
-                    req->request.magic    = PROTOCOL_BINARY_REQ;
-                    req->request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-                    req->request.keylen   = htons((uint16_t) it->nkey);
-                    req->request.extlen   = extlen;
-
-                    if (vbucket >= 0) {
-                        // We also put the vbucket id into the opaque,
-                        // so we can have it later for not-my-vbucket
-                        // error handling.
-                        //
-                        req->request.reserved = htons(vbucket);
-                        req->request.opaque   = htonl(vbucket);
-                    }
-
-                    switch (cmd) {
-                    case NREAD_SET:
-                        req->request.opcode =
-                            uc->noreply ?
-                            PROTOCOL_BINARY_CMD_SETQ :
-                            PROTOCOL_BINARY_CMD_SET;
-                        break;
-                    case NREAD_CAS: {
-                        uint64_t cas = ITEM_get_cas(it);
-                        req->request.cas = mc_swap64(cas);
-                        req->request.opcode =
-                            uc->noreply ?
-                            PROTOCOL_BINARY_CMD_SETQ :
-                            PROTOCOL_BINARY_CMD_SET;
-                        break;
-                    }
-                    case NREAD_ADD:
-                        req->request.opcode =
-                            uc->noreply ?
-                            PROTOCOL_BINARY_CMD_ADDQ :
-                            PROTOCOL_BINARY_CMD_ADD;
-                        break;
-                    case NREAD_REPLACE:
-                        req->request.opcode =
-                            uc->noreply ?
-                            PROTOCOL_BINARY_CMD_REPLACEQ :
-                            PROTOCOL_BINARY_CMD_REPLACE;
-                        break;
-                    case NREAD_APPEND:
-                        req->request.opcode =
-                            uc->noreply ?
-                            PROTOCOL_BINARY_CMD_APPENDQ :
-                            PROTOCOL_BINARY_CMD_APPEND;
-                        break;
-                    case NREAD_PREPEND:
-                        req->request.opcode =
-                            uc->noreply ?
-                            PROTOCOL_BINARY_CMD_PREPENDQ :
-                            PROTOCOL_BINARY_CMD_PREPEND;
-                        break;
-                    default:
-                        assert(false); // TODO.
-                        break;
-                    }
-
-                    a2b_set_opaque(c, req, uc->noreply);
-
-                    if (cmd != NREAD_APPEND &&
-                        cmd != NREAD_PREPEND) {
-                        protocol_binary_request_set *req_set =
-                            (protocol_binary_request_set *) req;
-
-                        req_set->message.body.flags =
-                            htonl(strtoul(ITEM_suffix(it), NULL, 10));
-
-                        req_set->message.body.expiration =
-                            htonl(it->exptime);
-                    }
-
-                    req->request.bodylen =
-                        htonl(it->nkey + (it->nbytes - 2) + extlen);
+                    a2b_fill_item_request(c, cmd, it, uc->noreply,
+                                          vbucket, req, extlen);
 
                     if (add_iov(c, ITEM_data(it_hdr), hdrlen) == 0 &&
                         add_iov(c, ITEM_key(it),  it->nkey) == 0 &&
@@ -1631,6 +1668,93 @@ bool cproxy_forward_a2b_item_downstream(downstream *d, short cmd,
     return false;
 }
 
+/* Fills the binary request header, and its extras, for an upstream
+ * ascii command that came with item data.
+ */
+static void a2b_fill_item_request(conn *c, short cmd, item *it,
+                                  bool noreply, int vbucket,
+                                  protocol_binary_request_header *req,
+                                  uint8_t extlen) {
+    memset(req, 0, sizeof(protocol_binary_request_header) + extlen);
+
+    req->request.magic    = PROTOCOL_BINARY_REQ;
+    req->request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    req->request.keylen   = htons((uint16_t) it->nkey);
+    req->request.extlen   = extlen;
+
+    if (vbucket >= 0) {
+        // We also put the vbucket id into the opaque,
+        // so we can have it later for not-my-vbucket
+        // error handling.
+        //
+        req->request.reserved = htons(vbucket);
+        req->request.opaque   = htonl(vbucket);
+    }
+
+    switch (cmd) {
+    case NREAD_SET:
+        req->request.opcode =
+            noreply ?
+            PROTOCOL_BINARY_CMD_SETQ :
+            PROTOCOL_BINARY_CMD_SET;
+        break;
+    case NREAD_CAS: {
+        uint64_t cas = ITEM_get_cas(it);
+        req->request.cas = mc_swap64(cas);
+        req->request.opcode =
+            noreply ?
+            PROTOCOL_BINARY_CMD_SETQ :
+            PROTOCOL_BINARY_CMD_SET;
+        break;
+    }
+    case NREAD_ADD:
+        req->request.opcode =
+            noreply ?
+            PROTOCOL_BINARY_CMD_ADDQ :
+            PROTOCOL_BINARY_CMD_ADD;
+        break;
+    case NREAD_REPLACE:
+        req->request.opcode =
+            noreply ?
+            PROTOCOL_BINARY_CMD_REPLACEQ :
+            PROTOCOL_BINARY_CMD_REPLACE;
+        break;
+    case NREAD_APPEND:
+        req->request.opcode =
+            noreply ?
+            PROTOCOL_BINARY_CMD_APPENDQ :
+            PROTOCOL_BINARY_CMD_APPEND;
+        break;
+    case NREAD_PREPEND:
+        req->request.opcode =
+            noreply ?
+            PROTOCOL_BINARY_CMD_PREPENDQ :
+            PROTOCOL_BINARY_CMD_PREPEND;
+        break;
+    default:
+        assert(false); // TODO.
+        break;
+    }
+
+    a2b_set_opaque(c, req, noreply);
+
+    if (cmd != NREAD_APPEND &&
+        cmd != NREAD_PREPEND) {
+        protocol_binary_request_set *req_set =
+            (protocol_binary_request_set *) req;
+
+        req_set->message.body.flags =
+            htonl(strtoul(ITEM_suffix(it), NULL, 10));
+
+        req_set->message.body.expiration =
+            htonl(it->exptime);
+    }
+
+    req->request.bodylen =
+        htonl(it->nkey + (it->nbytes - 2) + extlen);
+
+}
+
 void a2b_set_opaque(conn *c, protocol_binary_request_header *header,
                     bool noreply) {
     if (noreply) {
@@ -1722,8 +1846,12 @@ bool a2b_not_my_vbucket(conn *uc, conn *c,
         assert(uc->cmd_start != NULL);
         assert(header->response.opaque != 0);
 
+        // The key index is relative to the copy of a merged batch's
+        // command lines, see multiget_ascii_downstream().
+        //
         int   key_index = ntohl(header->response.opaque);
-        char *key       = uc->cmd_start + key_index;
+        char *key       = (d->multiget_batch != NULL ?
+                           d->multiget_batch : uc->cmd_start) + key_index;
         int   key_len   = skey_len(key);
 
         // The key is not NULL or space terminated.
@@ -1782,3 +1910,455 @@ bool a2b_not_my_vbucket(conn *uc, conn *c,
         return true;
     }
 }
+
+// ----------------------------------------------------------------
+
+// Batching of ascii noreply writes, when the noreply_batch_max
+// behavior is on.  Instead of each noreply write reserving a
+// downstream of its own, the writes join the proxy_td's open batch,
+// where each downstream conn gathers a pipeline of quiet binary
+// requests.  A flush ends each pipeline with a NOOP, whose response
+// releases the conn, like for a multiget.  The quiet requests only
+// have error responses, which are eaten due to OPAQUE_IGNORE_REPLY.
+//
+static bool a2b_noreply_batchable(proxy_td *ptd, conn *uc) {
+    assert(ptd != NULL);
+    assert(uc != NULL);
+
+    if (ptd->behavior_pool.base.noreply_batch_max == 0 ||
+        uc->noreply == false ||
+        uc->cmd_retries > 0 ||
+        uc->peer_host != NULL ||
+        !IS_ASCII(uc->protocol) ||
+        !IS_BINARY(ptd->behavior_pool.base.downstream_protocol)) {
+        return false;
+    }
+
+    switch (uc->cmd) {
+    case NREAD_SET:
+    case NREAD_ADD:
+    case NREAD_REPLACE:
+    case NREAD_APPEND:
+    case NREAD_PREPEND:
+        return uc->item != NULL;
+    case -1:
+        return uc->cmd_curr == PROTOCOL_BINARY_CMD_DELETE;
+    default:
+        return false; // Like cas, which isn't a blind write.
+    }
+}
+
+/* Returns an item holding the quiet binary request of a noreply
+ * write, without the item data of a set/add/etc, or NULL.  The cmd
+ * is the NREAD_XXX of an item, or else the binary command.
+ * A delete's key is copied after the header, as the upstream's read
+ * buffer is reused once the upstream moves on.
+ */
+static item *a2b_noreply_batch_request(conn *c, int cmd, item *it,
+                                       int vbucket,
+                                       token_t *tokens, size_t ntokens,
+                                       uint32_t *out_len) {
+    if (it != NULL) {
+        uint8_t  extlen = (cmd == NREAD_APPEND ||
+                           cmd == NREAD_PREPEND) ? 0 : 8;
+        uint32_t hdrlen =
+            sizeof(protocol_binary_request_header) + extlen;
+
+        item *it_hdr = item_alloc("i", 1, 0, 0, hdrlen);
+        if (it_hdr != NULL) {
+            a2b_fill_item_request(c, cmd, it, true, vbucket,
+                                  (protocol_binary_request_header *)
+                                  ITEM_data(it_hdr), extlen);
+            *out_len = hdrlen;
+        }
+
+        return it_hdr;
+    }
+
+    int key_len = tokens[KEY_TOKEN].length;
+
+    item *it_hdr = item_alloc("i", 1, 0, 0, a2b_size_max + key_len);
+    if (it_hdr != NULL) {
+        protocol_binary_request_header *header =
+            (protocol_binary_request_header *) ITEM_data(it_hdr);
+
+        memset(header, 0, a2b_size_max);
+
+        uint8_t *out_key    = NULL;
+        uint16_t out_keylen = 0;
+        uint8_t  out_extlen = 0;
+
+        int size = a2b_fill_request(cmd,
+                                    tokens, ntokens,
+                                    true, header,
+                                    &out_key,
+                                    &out_keylen,
+                                    &out_extlen);
+        if (size > 0 &&
+            out_keylen == key_len) {
+            if (vbucket >= 0) {
+                header->request.reserved = htons(vbucket);
+            }
+
+            header->request.bodylen = htonl(out_keylen + out_extlen);
+
+            a2b_set_opaque(c, header, true);
+
+            memcpy(ITEM_data(it_hdr) + size, out_key, out_keylen);
+            *out_len = size + out_keylen;
+
+            return it_hdr;
+        }
+
+        item_remove(it_hdr);
+    }
+
+    return NULL;
+}
+
+/* Adds a quiet binary write of the key to the pipeline of the open
+ * batch's conn to the key's server.  Returns false if the write
+ * can't be batched, such as when the server has no conn that's
+ * already open.
+ */
+static bool a2b_noreply_batch_add(proxy_td *ptd, LIBEVENT_THREAD *thread,
+                                  int cmd, item *it,
+                                  char *key, int key_len,
+                                  token_t *tokens, size_t ntokens) {
+    downstream *d = ptd->noreply_batch;
+    assert(d != NULL);
+    assert(d->upstream_conn == NULL);
+    assert(ptd->noreply_batch_cmds != NULL);
+
+    int s = cproxy_server_index(d, key, key_len, NULL);
+    if (s < 0 ||
+        s >= (int) mcs_server_count(&d->mst) ||
+        ptd->noreply_batch_cmds[s] < 0 ||
+        cproxy_connect_idle_downstream_conn(d, thread, s) == NULL) {
+        return false;
+    }
+
+    bool self = false;
+    int  vbucket = -1;
+
+    conn *c = cproxy_find_downstream_conn_ex(d, key, key_len,
+                                             &self, &vbucket);
+    if (c == NULL ||
+        self ||
+        c->state != conn_pause) {
+        return false;
+    }
+
+    uint32_t hdrlen = 0;
+
+    item *it_hdr = a2b_noreply_batch_request(c, cmd, it, vbucket,
+                                             tokens, ntokens, &hdrlen);
+    if (it_hdr == NULL) {
+        return false;
+    }
+
+    if (ptd->noreply_batch_cmds[s] == 0 &&
+        cproxy_prep_conn_for_write(c) == false) {
+        ptd->stats.stats.err_downstream_write_prep++;
+        item_remove(it_hdr);
+        return false;
+    }
+
+    bool ok = false;
+
+    if (add_conn_item(c, it_hdr)) {
+        ok = (add_iov(c, ITEM_data(it_hdr), hdrlen) == 0);
+
+        // The writer of the item might release it before the
+        // pipeline's sent, so the pipeline needs its own refcount.
+        //
+        if (ok && it != NULL) {
+            ok = false;
+
+            if (add_conn_item(c, it)) {
+                item_ref(it);
+
+                ok = (add_iov(c, ITEM_key(it), it->nkey) == 0 &&
+                      add_iov(c, ITEM_data(it), it->nbytes - 2) == 0);
+            }
+        }
+    } else {
+        item_remove(it_hdr);
+    }
+
+    if (!ok) {
+        // The pipeline might now end with a partial request, so the
+        // flush closes the conn instead of sending it.
+        //
+        ptd->noreply_batch_cmds[s] = -1;
+        ptd->stats.stats.err_oom++;
+        return false;
+    }
+
+    if (settings.verbose > 2) {
+        moxi_log_write("a2b noreply batched to %d, %u in batch\n",
+                       c->sfd, ptd->noreply_batch_num + 1);
+    }
+
+    ptd->noreply_batch_cmds[s]++;
+    ptd->noreply_batch_num++;
+
+    return true;
+}
+
+/* Adds an upstream's noreply write to the open batch, and moves
+ * the upstream on to its next command.  Returns false, without
+ * touching the upstream, if the write can't be batched, such as
+ * when its server has no conn that's already open.
+ */
+bool cproxy_batch_a2b_noreply(proxy_td *ptd, conn *uc) {
+    assert(ptd != NULL);
+    assert(uc != NULL);
+
+    downstream *d = ptd->noreply_batch;
+    if (d == NULL ||
+        a2b_noreply_batchable(ptd, uc) == false) {
+        return false;
+    }
+
+    item    *it = uc->item;
+    char    *key;
+    int      key_len;
+    token_t  tokens[MAX_TOKENS];
+    size_t   ntokens = 0;
+
+    if (it != NULL) {
+        key     = ITEM_key(it);
+        key_len = it->nkey;
+    } else {
+        ntokens = scan_tokens(uc->cmd_start, tokens, MAX_TOKENS, NULL);
+        if (ntokens <= 2) {
+            return false;
+        }
+
+        key     = tokens[KEY_TOKEN].value;
+        key_len = tokens[KEY_TOKEN].length;
+    }
+
+    if (a2b_noreply_batch_add(ptd, uc->thread,
+                              it != NULL ? uc->cmd : (int) uc->cmd_curr, it,
+                              key, key_len, tokens, ntokens) == false) {
+        return false;
+    }
+
+    if (it == NULL) {
+        mcache_delete(&ptd->proxy->front_cache, key, key_len);
+    }
+
+    ptd->stats.stats.tot_noreply_batched++;
+
+    uc->noreply_batch = ptd->noreply_batch_seq;
+
+    cproxy_dettach_if_noreply(d, uc);
+
+    if (ptd->noreply_batch_num >= ptd->behavior_pool.base.noreply_batch_max) {
+        cproxy_flush_a2b_noreply(ptd);
+    }
+
+    return true;
+}
+
+/* Adds a SET of an item that no upstream is waiting on to the open
+ * batch, first opening a batch with a newly reserved downstream if
+ * there's none.  The caller should flush the batch afterwards.
+ */
+bool cproxy_batch_a2b_item(proxy_td *ptd, LIBEVENT_THREAD *thread,
+                           item *it) {
+    assert(ptd != NULL);
+    assert(thread != NULL);
+    assert(it != NULL);
+
+    if (ptd->noreply_batch == NULL) {
+        downstream *d = cproxy_reserve_downstream(ptd);
+        if (d == NULL) {
+            return false;
+        }
+
+        if (a2b_noreply_batch_open(ptd, d) == false) {
+            cproxy_release_downstream(d, false);
+            return false;
+        }
+    }
+
+    return a2b_noreply_batch_add(ptd, thread, NREAD_SET, it,
+                                 ITEM_key(it), it->nkey, NULL, 0);
+}
+
+static void a2b_noreply_batch_timeout(twheel_timer *t, void *arg) {
+    (void)t;
+
+    proxy_td *ptd = arg;
+    assert(ptd != NULL);
+
+    if (settings.verbose > 2) {
+        moxi_log_write("a2b_noreply_batch_timeout\n");
+    }
+
+    cproxy_flush_a2b_noreply(ptd);
+}
+
+/* Makes d, a downstream with no upstream conn, the open batch.
+ */
+static bool a2b_noreply_batch_open(proxy_td *ptd, downstream *d) {
+    assert(ptd->noreply_batch == NULL);
+    assert(d->upstream_conn == NULL);
+
+    ptd->noreply_batch_cmds = calloc(mcs_server_count(&d->mst),
+                                     sizeof(int));
+    if (ptd->noreply_batch_cmds == NULL) {
+        return false;
+    }
+
+    ptd->noreply_batch     = d;
+    ptd->noreply_batch_num = 0;
+    ptd->noreply_batch_seq++;
+
+    d->usec_start = 0;
+
+    return true;
+}
+
+/* Opens a batch with d, which was just connected for its upstream's
+ * noreply write, as the batch's first write.
+ */
+static bool a2b_noreply_batch_start(downstream *d) {
+    proxy_td *ptd = d->ptd;
+    assert(ptd != NULL);
+    assert(ptd->noreply_batch == NULL);
+
+    conn *uc = d->upstream_conn;
+    assert(uc != NULL);
+
+    if (uc->next != NULL ||
+        a2b_noreply_batchable(ptd, uc) == false) {
+        return false;
+    }
+
+    LIBEVENT_THREAD *thread = uc->thread;
+
+    d->upstream_conn = NULL;
+
+    if (a2b_noreply_batch_open(ptd, d) == false) {
+        d->upstream_conn = uc;
+
+        return false;
+    }
+
+    if (cproxy_batch_a2b_noreply(ptd, uc) == false) {
+        free(ptd->noreply_batch_cmds);
+        ptd->noreply_batch_cmds = NULL;
+        ptd->noreply_batch = NULL;
+
+        d->upstream_conn = uc;
+
+        return false;
+    }
+
+    // The first write might have already filled the batch.
+    //
+    if (ptd->noreply_batch == d) {
+        thread_timer_add(thread, &ptd->noreply_batch_timer,
+                         ptd->behavior_pool.base.noreply_batch_interval,
+                         a2b_noreply_batch_timeout, ptd);
+    }
+
+    return true;
+}
+
+/* Sends each pipeline of the open batch, if any, ending it with a
+ * NOOP.  The batch's downstream is released after the last NOOP
+ * response, like after a multiget.
+ */
+void cproxy_flush_a2b_noreply(proxy_td *ptd) {
+    assert(ptd != NULL);
+
+    downstream *d = ptd->noreply_batch;
+    if (d == NULL) {
+        return;
+    }
+
+    int *cmds = ptd->noreply_batch_cmds;
+    assert(cmds != NULL);
+
+    if (settings.verbose > 2) {
+        moxi_log_write("a2b noreply batch flush, %u in batch\n",
+                       ptd->noreply_batch_num);
+    }
+
+    ptd->noreply_batch      = NULL;
+    ptd->noreply_batch_cmds = NULL;
+    ptd->noreply_batch_num  = 0;
+    ptd->stats.stats.tot_noreply_batch_flushes++;
+
+    twheel_del(&ptd->noreply_batch_timer);
+
+    int n = mcs_server_count(&d->mst);
+    int used = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (cmds[i] != 0) {
+            used++;
+        }
+    }
+
+    d->downstream_used_start = used;
+    d->downstream_used       = used;
+
+    for (int i = 0; i < n; i++) {
+        if (cmds[i] <= 0) {
+            continue;
+        }
+
+        conn *c = d->downstream_conns[i];
+        assert(c != NULL);
+        assert(c != NULL_CONN);
+        assert(c->state == conn_pause);
+
+        if (ptd->stats.noreply_batch_htgram == NULL) {
+            ptd->stats.noreply_batch_htgram =
+                cproxy_create_timing_histogram();
+        }
+
+        if (ptd->stats.noreply_batch_htgram != NULL) {
+            htgram_incr(ptd->stats.noreply_batch_htgram, cmds[i], 1);
+        }
+
+        if (d->usec_start == 0 &&
+            ptd->behavior_pool.base.time_stats) {
+            d->usec_start = usec_now_cached(c->thread);
+        }
+
+        if (a2b_multiget_end(c) == 0) {
+            conn_set_state(c, conn_mwrite);
+            c->write_and_go = conn_new_cmd;
+
+            if (update_event(c, EV_WRITE | EV_PERSIST)) {
+                continue;
+            }
+        }
+
+        ptd->stats.stats.err_oom++;
+        cmds[i] = -1;
+    }
+
+    // Close the conns that couldn't be sent only after the others
+    // are on their way, as closing the last one releases d.
+    //
+    for (int i = 0; i < n; i++) {
+        if (cmds[i] < 0) {
+            cproxy_close_conn(d->downstream_conns[i]);
+        }
+    }
+
+    free(cmds);
+
+    if (used == 0) {
+        cproxy_release_downstream(d, false);
+        cproxy_assign_downstream(ptd);
+    }
+}
@@ -124,9 +124,7 @@ void cproxy_process_upstream_binary_nread(conn *c) {
                 c->sfd, c->cmd, extlen, keylen, bodylen);
     }
 
-    // pthread_mutex_lock(&c->thread->stats.mutex);
-    // c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++;
-    // pthread_mutex_unlock(&c->thread->stats.mutex);
+    // THREAD_STATS_ADD(c->thread->stats.slab_stats[it->slabs_clsid].set_cmds, 1);
 
     proxy_td *ptd = c->extra;
     assert(ptd != NULL);
@@ -281,6 +279,8 @@ void cproxy_process_downstream_binary(conn *c) {
     assert(d != NULL);
     assert(d->upstream_conn != NULL);
 
+    cproxy_trace_downstream(d, TRACE_STAGE_RESPONSE);
+
     if (IS_ASCII(d->upstream_conn->protocol)) {
         cproxy_process_a2b_downstream(c);
     } else {
@@ -83,7 +83,7 @@ bool cproxy_forward_b2b_downstream(downstream *d) {
 
         if (d->usec_start == 0 &&
             d->ptd->behavior_pool.base.time_stats) {
-            d->usec_start = usec_now();
+            d->usec_start = usec_now_cached(uc->thread);
         }
 
         int nconns = mcs_server_count(&d->mst);
@@ -269,7 +269,7 @@ bool cproxy_broadcast_b2b_downstream(downstream *d, conn *uc) {
         //
         if (uc->cmd == PROTOCOL_BINARY_CMD_STAT &&
             d->merger == NULL) {
-            d->merger = genhash_init(128, skeyhash_ops);
+            d->merger = stats_merger_create();
         }
 
         item *it = item_alloc("h", 1, 0, 0,
@@ -447,9 +447,9 @@ void cproxy_process_b2b_downstream_nread(conn *c) {
                         char *key = (ITEM_data(it)) + sizeof(*header) + extlen;
                         char *val = key + keylen;
 
-                        protocol_stats_merge_name_val(d->merger, "STAT", 4,
-                                                      key, keylen,
-                                                      val, bodylen - keylen - extlen);
+                        stats_merger_add(d->merger, "STAT", 4,
+                                         key, keylen,
+                                         val, bodylen - keylen - extlen);
                     }
 
                     conn_set_state(c, conn_new_cmd); // Get next STATS response.
@@ -6,40 +6,12 @@
 #include <errno.h>
 #include <pthread.h>
 #include <assert.h>
+#include <sched.h>
 #include "memcached.h"
 #include "cproxy.h"
 #include "work.h"
 #include "log.h"
 
-// Protocol STATS command handling.
-//
-// Special STATS value merging rules, instead of the
-// default to just sum the values.  Note the trailing space.
-//
-char *protocol_stats_keys_first =
-    "pid version libevent "
-    "ep_version ep_dbname ep_storage_type ep_flusher_state ep_warmup_thread ";
-
-char *protocol_stats_keys_smallest =
-    "uptime "
-    "time "
-    "pointer_size "
-    "limit_maxbytes "
-    "accepting_conns "
-    ":chunk_size "
-    ":chunk_per_page "
-    ":age "; // TODO: Should age merge be largest, not smallest?
-
-bool protocol_stats_merge_sum(char *v1, int v1len,
-                              char *v2, int v2len,
-                              char *out, int outlen);
-bool protocol_stats_merge_smallest(char *v1, int v1len,
-                                   char *v2, int v2len,
-                                   char *out, int outlen);
-
-int count_dot_pair(char *x, int xlen, char *y, int ylen);
-int count_dot(char *x, int len);
-
 // Per-key stats.
 //
 static char *key_stats_key(void *it);
@@ -66,325 +38,288 @@ mcache_funcs mcache_key_stats_funcs = {
     .item_set_exptime = key_stats_set_exptime
 };
 
-#define MAX_TOKENS     5
-#define PREFIX_TOKEN   0
-#define NAME_TOKEN     1
-#define VALUE_TOKEN    2
-#define MERGE_BUF_SIZE 300
-
-bool protocol_stats_merge_line(genhash_t *merger, char *line) {
-    assert(merger != NULL);
-    assert(line != NULL);
+/* Callback to stats_merger_foreach() that writes a merged
+ * stat to an upstream conn, in the upstream's protocol.
+ */
+void protocol_stats_write(const char *prefix, int prefix_len,
+                          const char *name, int name_len,
+                          const char *val, int val_len,
+                          void *arg) {
+    conn *uc = (conn *) arg;
+    assert(uc != NULL);
 
-    int nline = strlen(line); // Ex: "STATS uptime 123455"
-    if (nline <= 0 ||
-        nline >= MERGE_BUF_SIZE) {
-        return false;
+    if (settings.verbose > 2) {
+        moxi_log_write("%d: cproxy_stats writing: %.*s %.*s %.*s\n",
+                       uc->sfd, prefix_len, prefix,
+                       name_len, name, val_len, val);
     }
 
-    token_t tokens[MAX_TOKENS];
-    size_t  ntokens = scan_tokens(line, tokens, MAX_TOKENS, NULL);
+    if (IS_BINARY(uc->protocol)) {
+        uint16_t key_len  = name_len;
+        uint32_t data_len = val_len;
 
-    if (ntokens != 4) { // 3 + 1 for the terminal token.
-        return false;
-    }
+        item *it = item_alloc("s", 1, 0, 0,
+                              sizeof(protocol_binary_response_stats) + key_len + data_len);
+        if (it != NULL) {
+            protocol_binary_response_stats *header =
+                (protocol_binary_response_stats *) ITEM_data(it);
 
-    char *name     = tokens[NAME_TOKEN].value;
-    int   name_len = tokens[NAME_TOKEN].length;
-    if (name == NULL ||
-        name_len <= 0 ||
-        tokens[VALUE_TOKEN].value == NULL ||
-        tokens[VALUE_TOKEN].length <= 0 ||
-        tokens[VALUE_TOKEN].length >= MERGE_BUF_SIZE) {
-        return false;
-    }
+            memset(ITEM_data(it), 0, it->nbytes);
 
-    return protocol_stats_merge_name_val(merger,
-                                         tokens[PREFIX_TOKEN].value,
-                                         tokens[PREFIX_TOKEN].length,
-                                         name, name_len,
-                                         tokens[VALUE_TOKEN].value,
-                                         tokens[VALUE_TOKEN].length);
-}
+            header->message.header.response.magic = (uint8_t) PROTOCOL_BINARY_RES;
+            header->message.header.response.opcode = uc->binary_header.request.opcode;
+            header->message.header.response.keylen  = (uint16_t) htons(key_len);
+            header->message.header.response.bodylen = htonl(key_len + data_len);
+            header->message.header.response.opaque  = uc->opaque;
 
-// TODO: The stats merge assumes an ascii upstream.
-//
-bool protocol_stats_merge_name_val(genhash_t *merger,
-                                   char *prefix,
-                                   int   prefix_len,
-                                   char *name,
-                                   int   name_len,
-                                   char *val,
-                                   int   val_len) {
-    assert(merger);
-    assert(name);
-    assert(val);
-
-    char *key = name + name_len - 1;     // Key part for merge rule lookup.
-    while (key >= name && *key != ':') { // Scan for last colon.
-        key--;
-    }
-    if (key < name) {
-        key = name;
-    }
-    int key_len = name_len - (key - name);
-    if (key_len > 0 &&
-        key_len < MERGE_BUF_SIZE) {
-        char buf_name[MERGE_BUF_SIZE];
-        char buf_key[MERGE_BUF_SIZE];
-        char buf_val[MERGE_BUF_SIZE];
-
-        strncpy(buf_name, name, name_len);
-        buf_name[name_len] = '\0';
-
-        char *prev = (char *) genhash_find(merger, buf_name);
-        if (prev == NULL) {
-            char *hval = malloc(prefix_len + 1 +
-                                name_len + 1 +
-                                val_len + 1);
-            if (hval != NULL) {
-                memcpy(hval, prefix, prefix_len);
-                hval[prefix_len] = ' ';
-
-                memcpy(hval + prefix_len + 1, name, name_len);
-                hval[prefix_len + 1 + name_len] = ' ';
-
-                memcpy(hval + prefix_len + 1 + name_len + 1, val, val_len);
-                hval[prefix_len + 1 + name_len + 1 + val_len] = '\0';
-
-                genhash_update(merger, hval + prefix_len + 1, hval);
+            memcpy((ITEM_data(it)) + sizeof(protocol_binary_response_stats),
+                   name, key_len);
+            memcpy((ITEM_data(it)) + sizeof(protocol_binary_response_stats) + key_len,
+                   val, data_len);
+
+            if (add_conn_item(uc, it)) {
+                add_iov(uc, ITEM_data(it), it->nbytes);
+
+                if (settings.verbose > 2) {
+                    moxi_log_write("%d: cproxy_stats writing binary", uc->sfd);
+                    cproxy_dump_header(uc->sfd, ITEM_data(it));
+                }
+
+                return;
             }
 
-            return true;
+            item_remove(it);
         }
 
-        strncpy(buf_key, key, key_len);
-        buf_key[key_len] = '\0';
+        return;
+    }
 
-        if (strstr(protocol_stats_keys_first, buf_key) != NULL) {
-            return true;
-        }
+    int nline = prefix_len + 1 + name_len + 1 + val_len;
 
-        token_t prev_tokens[MAX_TOKENS];
-        size_t  prev_ntokens = scan_tokens(prev, prev_tokens,
-                                           MAX_TOKENS, NULL);
+    item *it = item_alloc("s", 1, 0, 0, nline + 2);
+    if (it != NULL) {
+        char *p = ITEM_data(it);
 
-        if (prev_ntokens != 4) {
-            return true;
-        }
+        memcpy(p, prefix, prefix_len);
+        p += prefix_len;
+        *p++ = ' ';
+        memcpy(p, name, name_len);
+        p += name_len;
+        *p++ = ' ';
+        memcpy(p, val, val_len);
+        p += val_len;
+        memcpy(p, "\r\n", 2);
 
-        strncpy(buf_val, val, val_len);
-        buf_val[val_len] = '\0';
-
-        bool ok;
-
-        if (strstr(protocol_stats_keys_smallest, buf_key) != NULL) {
-            ok = protocol_stats_merge_smallest(prev_tokens[VALUE_TOKEN].value,
-                                               prev_tokens[VALUE_TOKEN].length,
-                                               buf_val, val_len,
-                                               buf_val, MERGE_BUF_SIZE);
-        } else {
-            ok = protocol_stats_merge_sum(prev_tokens[VALUE_TOKEN].value,
-                                          prev_tokens[VALUE_TOKEN].length,
-                                          buf_val, val_len,
-                                          buf_val, MERGE_BUF_SIZE);
+        if (add_conn_item(uc, it)) {
+            add_iov(uc, ITEM_data(it), nline + 2);
+            return;
         }
 
-        if (ok) {
-            int   vlen = strlen(buf_val);
-            char *hval = malloc(prefix_len + 1 +
-                                name_len + 1 +
-                                vlen + 1);
-            if (hval != NULL) {
-                memcpy(hval, prefix, prefix_len);
-                hval[prefix_len] = ' ';
+        item_remove(it);
+    }
+}
 
-                memcpy(hval + prefix_len + 1, name, name_len);
-                hval[prefix_len + 1 + name_len] = ' ';
+// ----------------------------------------
 
-                strcpy(hval + prefix_len + 1 + name_len + 1, buf_val);
-                hval[prefix_len + 1 + name_len + 1 + vlen] = '\0';
+void cproxy_reset_stats_td(proxy_stats_td *pstd) {
+    assert(pstd);
 
-                genhash_update(merger, hval + prefix_len + 1, hval);
+    cproxy_reset_stats(&pstd->stats);
 
-                free(prev);
-            }
+    for (int j = 0; j < STATS_CMD_TYPE_last; j++) {
+        for (int k = 0; k < STATS_CMD_last; k++) {
+            cproxy_reset_stats_cmd(&pstd->stats_cmd[j][k]);
         }
-
-        // Note, if we couldn't merge, then just keep
-        // the previous value.
-        //
-        return true;
     }
 
-    return false;
-}
+    if (pstd->downstream_reserved_time_htgram != NULL) {
+        htgram_reset(pstd->downstream_reserved_time_htgram);
+    }
 
-bool protocol_stats_merge_sum(char *v1, int v1len,
-                              char *v2, int v2len,
-                              char *out, int outlen) {
-    (void)outlen;
-    int dot = count_dot_pair(v1, v1len, v2, v2len);
-    if (dot > 0) {
-        float v1f = strtof(v1, NULL);
-        float v2f = strtof(v2, NULL);
-        sprintf(out, "%f", v1f + v2f);
-        return true;
-    } else {
-        uint64_t v1i = 0;
-        uint64_t v2i = 0;
+    if (pstd->downstream_connect_time_htgram != NULL) {
+        htgram_reset(pstd->downstream_connect_time_htgram);
+    }
 
-        if (safe_strtoull(v1, &v1i) &&
-            safe_strtoull(v2, &v2i)) {
-            sprintf(out, "%llu", (long long unsigned int) (v1i + v2i));
-            return true;
+    for (int k = 0; k < STATS_CMD_last; k++) {
+        if (pstd->cmd_time_htgram[k] != NULL) {
+            htgram_reset(pstd->cmd_time_htgram[k]);
         }
     }
 
-    return false;
-}
-
-bool protocol_stats_merge_smallest(char *v1, int v1len,
-                                   char *v2, int v2len,
-                                   char *out, int outlen) {
-    (void)outlen;
-    int dot = count_dot_pair(v1, v1len, v2, v2len);
-    if (dot > 0) {
-        float v1f = strtof(v1, NULL);
-        float v2f = strtof(v2, NULL);
-        sprintf(out, "%f", (v1f > v2f ? v1f : v2f));
-        return true;
-    } else {
-        uint64_t v1i = 0;
-        uint64_t v2i = 0;
-
-        if (safe_strtoull(v1, &v1i) &&
-            safe_strtoull(v2, &v2i)) {
-            sprintf(out, "%llu", (long long unsigned int) (v1i > v2i ? v1i : v2i));
-            return true;
+    for (int k = 0; k < PROXY_STATS_SERVER_MAX; k++) {
+        if (pstd->server_time_htgram[k] != NULL) {
+            htgram_reset(pstd->server_time_htgram[k]);
         }
     }
 
-    return false;
+    if (pstd->noreply_batch_htgram != NULL) {
+        htgram_reset(pstd->noreply_batch_htgram);
+    }
 }
 
-/* Callback to hash table iteration that frees the multiget_entry list.
+/* Frees the lazily created histograms of a proxy_stats_td,
+ * such as one that was used to aggregate other threads' stats.
  */
-void protocol_stats_foreach_free(const void *key,
-                                 const void *value,
-                                 void *user_data) {
-    (void)key;
-    (void)user_data;
-    assert(value != NULL);
-    free((void*)value);
-}
+void cproxy_free_stats_td_htgrams(proxy_stats_td *pstd) {
+    assert(pstd);
 
-void protocol_stats_foreach_write(const void *key,
-                                  const void *value,
-                                  void *user_data) {
-    (void)key;
-    char *line = (char *) value;
-    assert(line != NULL);
+    if (pstd->downstream_reserved_time_htgram != NULL) {
+        htgram_destroy(pstd->downstream_reserved_time_htgram);
+        pstd->downstream_reserved_time_htgram = NULL;
+    }
 
-    conn *uc = (conn *) user_data;
-    assert(uc != NULL);
+    if (pstd->downstream_connect_time_htgram != NULL) {
+        htgram_destroy(pstd->downstream_connect_time_htgram);
+        pstd->downstream_connect_time_htgram = NULL;
+    }
 
-    int nline = strlen(line);
-    if (nline > 0) {
-        if (settings.verbose > 2) {
-            moxi_log_write("%d: cproxy_stats writing: %s\n", uc->sfd, line);
+    for (int k = 0; k < STATS_CMD_last; k++) {
+        if (pstd->cmd_time_htgram[k] != NULL) {
+            htgram_destroy(pstd->cmd_time_htgram[k]);
+            pstd->cmd_time_htgram[k] = NULL;
         }
+    }
 
-        if (IS_BINARY(uc->protocol)) {
-            token_t line_tokens[MAX_TOKENS];
-            size_t  line_ntokens = scan_tokens(line, line_tokens, MAX_TOKENS, NULL);
+    for (int k = 0; k < PROXY_STATS_SERVER_MAX; k++) {
+        if (pstd->server_time_htgram[k] != NULL) {
+            htgram_destroy(pstd->server_time_htgram[k]);
+            pstd->server_time_htgram[k] = NULL;
+        }
+    }
 
-            if (line_ntokens == 4) {
-                uint16_t key_len  = line_tokens[NAME_TOKEN].length;
-                uint32_t data_len = line_tokens[VALUE_TOKEN].length;
+    if (pstd->noreply_batch_htgram != NULL) {
+        htgram_destroy(pstd->noreply_batch_htgram);
+        pstd->noreply_batch_htgram = NULL;
+    }
+}
 
-                item *it = item_alloc("s", 1, 0, 0,
-                                      sizeof(protocol_binary_response_stats) + key_len + data_len);
-                if (it != NULL) {
-                    protocol_binary_response_stats *header =
-                        (protocol_binary_response_stats *) ITEM_data(it);
+// ----------------------------------------
 
-                    memset(ITEM_data(it), 0, it->nbytes);
+// The snapshot's counters are copied a word at a time with relaxed
+// atomics, as readers may race with the publishing worker thread,
+// and then retry on a seq mismatch.
+//
+#define SNAPSHOT_WORDS \
+    ((sizeof(proxy_stats) + \
+      sizeof(proxy_stats_cmd) * STATS_CMD_TYPE_last * STATS_CMD_last) / \
+     sizeof(uint64_t))
+
+static void snapshot_store_words(uint64_t *dst, const uint64_t *src,
+                                 size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    }
+}
 
-                    header->message.header.response.magic = (uint8_t) PROTOCOL_BINARY_RES;
-                    header->message.header.response.opcode = uc->binary_header.request.opcode;
-                    header->message.header.response.keylen  = (uint16_t) htons(key_len);
-                    header->message.header.response.bodylen = htonl(key_len + data_len);
-                    header->message.header.response.opaque  = uc->opaque;
+static void snapshot_load_words(uint64_t *dst, const uint64_t *src,
+                                size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
 
-                    memcpy((ITEM_data(it)) + sizeof(protocol_binary_response_stats),
-                           line_tokens[NAME_TOKEN].value, key_len);
-                    memcpy((ITEM_data(it)) + sizeof(protocol_binary_response_stats) + key_len,
-                           line_tokens[VALUE_TOKEN].value, data_len);
+/* Publishes a proxy_td's counters into its stats_snapshot.
+ * Must be invoked on the proxy_td's worker thread, the only
+ * writer of both the counters and the snapshot.
+ */
+void cproxy_publish_stats_snapshot(proxy_td *ptd) {
+    assert(ptd);
 
-                    if (add_conn_item(uc, it)) {
-                        add_iov(uc, ITEM_data(it), it->nbytes);
+    proxy_stats_snapshot *ss = &ptd->stats_snapshot;
 
-                        if (settings.verbose > 2) {
-                            moxi_log_write("%d: cproxy_stats writing binary", uc->sfd);
-                            cproxy_dump_header(uc->sfd, ITEM_data(it));
-                        }
+    uint64_t seq = ss->seq;
 
-                        return;
-                    }
+    __atomic_store_n(&ss->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-                    item_remove(it);
-                }
-            }
+    snapshot_store_words((uint64_t *) &ss->stats,
+                         (const uint64_t *) &ptd->stats.stats,
+                         sizeof(proxy_stats) / sizeof(uint64_t));
+    snapshot_store_words((uint64_t *) ss->stats_cmd,
+                         (const uint64_t *) ptd->stats.stats_cmd,
+                         SNAPSHOT_WORDS -
+                         sizeof(proxy_stats) / sizeof(uint64_t));
 
-            return;
+    __atomic_store_n(&ss->msec,
+                     msec_current_time > 0 ? msec_current_time : 1,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&ss->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Copies the latest published snapshot of a proxy_td's counters.
+ * May be invoked on any thread.  Returns false if the worker thread
+ * hasn't published a snapshot yet, where out is left zeroed.
+ */
+bool cproxy_read_stats_snapshot(proxy_td *ptd, proxy_stats_snapshot *out) {
+    assert(ptd);
+    assert(out);
+
+    proxy_stats_snapshot *ss = &ptd->stats_snapshot;
+
+    while (true) {
+        uint64_t seq = __atomic_load_n(&ss->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield(); // The worker thread is mid-publish.
+            continue;
         }
 
-        item *it = item_alloc("s", 1, 0, 0, nline + 2);
-        if (it != NULL) {
-            strncpy(ITEM_data(it), line, nline);
-            strncpy(ITEM_data(it) + nline, "\r\n", 2);
+        snapshot_load_words((uint64_t *) &out->stats,
+                            (const uint64_t *) &ss->stats,
+                            SNAPSHOT_WORDS);
+        out->msec = __atomic_load_n(&ss->msec, __ATOMIC_RELAXED);
 
-            if (add_conn_item(uc, it)) {
-                add_iov(uc, ITEM_data(it), nline + 2);
-                return;
-            }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
 
-            item_remove(it);
+        if (__atomic_load_n(&ss->seq, __ATOMIC_RELAXED) == seq) {
+            out->seq = seq;
+            break;
         }
     }
-}
 
-int count_dot_pair(char *x, int xlen, char *y, int ylen) {
-    int xdot = count_dot(x, xlen);
-    int ydot = count_dot(y, ylen);
-
-    return (xdot > ydot ? xdot : ydot);
+    return out->msec != 0;
 }
 
-int count_dot(char *x, int len) { // Number of '.' chars in a string.
-    int dot = 0;
+static void stats_snapshot_timeout(twheel_timer *t, void *arg) {
+    (void) t;
 
-    for (char *end = x + len; x < end; x++) {
-        if (*x == '.')
-            dot++;
-    }
+    proxy_td *ptd = arg;
+    assert(ptd);
 
-    return dot;
+    // Only keep ticking while the counters change, so idle
+    // proxies don't keep waking up their worker thread.
+    //
+    if (ptd->stats_snapshot.msec == 0 ||
+        memcmp(&ptd->stats_snapshot.stats, &ptd->stats.stats,
+               sizeof(ptd->stats.stats)) != 0 ||
+        memcmp(ptd->stats_snapshot.stats_cmd, ptd->stats.stats_cmd,
+               sizeof(ptd->stats.stats_cmd)) != 0) {
+        cproxy_publish_stats_snapshot(ptd);
+        cproxy_start_stats_snapshot_timer(ptd);
+    }
 }
 
-// ----------------------------------------
-
-void cproxy_reset_stats_td(proxy_stats_td *pstd) {
-    assert(pstd);
+/* Arms the timer that publishes a proxy_td's stats snapshot, when
+ * snapshots are on and the timer isn't already pending.  Must be
+ * invoked on the proxy_td's worker thread.
+ */
+void cproxy_start_stats_snapshot_timer(proxy_td *ptd) {
+    assert(ptd);
+    assert(ptd->proxy);
 
-    cproxy_reset_stats(&pstd->stats);
+    uint32_t interval =
+        ptd->proxy->main->behavior.stats_snapshot_interval;
 
-    for (int j = 0; j < STATS_CMD_TYPE_last; j++) {
-        for (int k = 0; k < STATS_CMD_last; k++) {
-            cproxy_reset_stats_cmd(&pstd->stats_cmd[j][k]);
-        }
+    if (interval == 0 ||
+        twheel_timer_pending(&ptd->snapshot_timer)) {
+        return;
     }
+
+    LIBEVENT_THREAD *thread =
+        thread_by_index(ptd - ptd->proxy->thread_data);
+    assert(thread);
+
+    thread_timer_add(thread, &ptd->snapshot_timer, interval,
+                     stats_snapshot_timeout, ptd);
 }
 
 void cproxy_reset_stats(proxy_stats *ps) {
@@ -426,6 +361,16 @@ void cproxy_reset_stats(proxy_stats *ps) {
     ps->tot_retry_time = 0;
     ps->max_retry_time = 0;
     ps->tot_retry_vbucket = 0;
+    ps->tot_hedge_eligible = 0;
+    ps->tot_hedge = 0;
+    ps->tot_hedge_win = 0;
+    ps->tot_hedge_over_budget = 0;
+    ps->tot_noreply_batched = 0;
+    ps->tot_noreply_batch_flushes = 0;
+    ps->tot_combine_sets = 0;
+    ps->tot_combine_sets_collapsed = 0;
+    ps->tot_multiget_batches = 0;
+    ps->tot_multiget_batched = 0;
     ps->tot_upstream_paused = 0;
     ps->tot_upstream_unpaused = 0;
     ps->tot_multiget_keys = 0;
@@ -480,6 +425,27 @@ void touch_key_stats(proxy_td *ptd, char *key, int key_len,
                      int delta_misses,
                      int delta_read_bytes,
                      int delta_write_bytes) {
+    if (ptd->key_stats_topk.max > 0) {
+        // Only a request counts towards a key's rank, while hits
+        // and misses just update an already tracked key.
+        //
+        topk_entry *e = topk_touch(&ptd->key_stats_topk, key, key_len,
+                                   delta_seen);
+        if (e != NULL) {
+            if (cmd == STATS_CMD_GET ||
+                cmd == STATS_CMD_GET_KEY) {
+                e->gets += delta_seen;
+            } else {
+                e->sets += delta_seen;
+            }
+
+            e->misses += delta_misses;
+            e->bytes  += delta_read_bytes + delta_write_bytes;
+        }
+
+        return;
+    }
+
     key_stats *ks = find_key_stats(ptd, key, key_len, msec_time);
     if (ks != NULL) {
         proxy_stats_cmd *psc = &ks->stats_cmd[cmd_type][cmd];
@@ -495,6 +461,46 @@ void touch_key_stats(proxy_td *ptd, char *key, int key_len,
     }
 }
 
+/* Starts key-level stats for a proxy_td, if its behaviors ask
+ * for them, either as an LRU of key_stats or as a top-K sketch.
+ */
+void key_stats_start(proxy_td *ptd) {
+    assert(ptd);
+
+    proxy_behavior *b = &ptd->behavior_pool.base;
+
+    if (b->key_stats_max <= 0) {
+        return;
+    }
+
+    if (b->key_stats_topk) {
+        if (!topk_init(&ptd->key_stats_topk, b->key_stats_max)) {
+            return;
+        }
+    } else if (b->key_stats_lifespan > 0) {
+        mcache_start(&ptd->key_stats, b->key_stats_max);
+    } else {
+        return;
+    }
+
+    if (strlen(b->key_stats_spec) > 0) {
+        matcher_start(&ptd->key_stats_matcher, b->key_stats_spec);
+    }
+
+    if (strlen(b->key_stats_unspec) > 0) {
+        matcher_start(&ptd->key_stats_unmatcher, b->key_stats_unspec);
+    }
+}
+
+void key_stats_stop(proxy_td *ptd) {
+    assert(ptd);
+
+    mcache_stop(&ptd->key_stats);
+    topk_destroy(&ptd->key_stats_topk);
+    matcher_stop(&ptd->key_stats_matcher);
+    matcher_stop(&ptd->key_stats_unmatcher);
+}
+
 // -------------------------------------------------
 
 static char *key_stats_key(void *it) {
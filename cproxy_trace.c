@@ -0,0 +1,188 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "memcached.h"
+#include "cproxy.h"
+#include "log.h"
+
+// Sampled request tracing.  When the trace_sample behavior is N > 0,
+// 1 in N requests that pause for a downstream gets a record in its
+// worker thread's proxy_trace ring, which is then timestamped at each
+// enum_trace_stage the request reaches.  The upstream conn remembers
+// the record by its id, and a stage is only recorded while the
+// record still has that id, so a request that outlives its slot in
+// the ring is just no longer traced.
+//
+static const char *trace_stage_names[TRACE_STAGE_last] = {
+    "pause",
+    "assign",
+    "connect",
+    "response",
+    "release",
+    "written"
+};
+
+const char *cproxy_trace_stage_name(enum_trace_stage stage) {
+    assert(stage < TRACE_STAGE_last);
+
+    return trace_stage_names[stage];
+}
+
+static proxy_trace_rec *trace_rec(proxy_trace *t, uint64_t id) {
+    return &t->recs[(id - 1) % PROXY_TRACE_MAX];
+}
+
+void cproxy_trace_start(proxy_td *ptd, conn *uc) {
+    assert(ptd != NULL);
+    assert(uc != NULL);
+
+    // A retried request keeps the trace it started with.  Any other
+    // leftover trace_id, like of a noreply request that was never
+    // written, belongs to an earlier request.
+    //
+    if (uc->trace_id != 0 &&
+        uc->cmd_retries > 0) {
+        return;
+    }
+
+    uc->trace_id = 0;
+
+    uint32_t sample = ptd->behavior_pool.base.trace_sample;
+    if (sample == 0) {
+        return;
+    }
+
+    proxy_trace *t = ptd->trace;
+    if (t == NULL) {
+        t = calloc(1, sizeof(proxy_trace));
+        if (t == NULL) {
+            return;
+        }
+
+        __atomic_store_n(&ptd->trace, t, __ATOMIC_RELEASE);
+    }
+
+    if (t->countdown > 1) {
+        t->countdown--;
+        return;
+    }
+
+    t->countdown = sample;
+
+    uint64_t id = t->seq + 1;
+    proxy_trace_rec *r = trace_rec(t, id);
+
+    // Readers skip the record while its id is 0.  The fence keeps
+    // the rewrites below from becoming visible before the id of 0,
+    // which cproxy_read_trace() checks again after its copy.
+    //
+    __atomic_store_n(&r->id, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    r->sfd = uc->sfd;
+    r->cmd[0] = '\0';
+
+    if (IS_ASCII(uc->protocol)) {
+        if (uc->cmd_start != NULL) {
+            size_t n = strcspn(uc->cmd_start, " \r\n");
+            if (n >= sizeof(r->cmd)) {
+                n = sizeof(r->cmd) - 1;
+            }
+            memcpy(r->cmd, uc->cmd_start, n);
+            r->cmd[n] = '\0';
+        }
+    } else {
+        snprintf(r->cmd, sizeof(r->cmd), "0x%02x",
+                 uc->binary_header.request.opcode);
+    }
+
+    for (int i = 0; i < TRACE_STAGE_last; i++) {
+        __atomic_store_n(&r->usec[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&r->usec[TRACE_STAGE_PAUSE], usec_now(),
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&r->id, id, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->seq, id, __ATOMIC_RELEASE);
+
+    uc->trace_id = id;
+}
+
+// Only the first time a request reaches a stage is recorded, so
+// retries and multi-server requests keep their earliest timestamp.
+//
+void cproxy_trace_mark(proxy_td *ptd, conn *uc, enum_trace_stage stage) {
+    assert(ptd != NULL);
+    assert(uc != NULL);
+    assert(stage < TRACE_STAGE_last);
+
+    if (uc->trace_id == 0 ||
+        ptd->trace == NULL) {
+        return;
+    }
+
+    proxy_trace_rec *r = trace_rec(ptd->trace, uc->trace_id);
+    if (r->id != uc->trace_id) {
+        uc->trace_id = 0;
+        return;
+    }
+
+    if (r->usec[stage] == 0) {
+        __atomic_store_n(&r->usec[stage], usec_now(), __ATOMIC_RELAXED);
+    }
+
+    if (stage == TRACE_STAGE_WRITTEN) {
+        uc->trace_id = 0;
+    }
+}
+
+void cproxy_trace_downstream(downstream *d, enum_trace_stage stage) {
+    assert(d != NULL);
+    assert(d->ptd != NULL);
+
+    if (d->ptd->trace == NULL) {
+        return;
+    }
+
+    for (conn *uc = d->upstream_conn; uc != NULL; uc = uc->next) {
+        if (uc->trace_id != 0) {
+            cproxy_trace_mark(d->ptd, uc, stage);
+        }
+    }
+}
+
+/* Copies the record of a sampled request from any thread.  Returns
+ * false if the worker thread has reused or is rewriting its slot.
+ */
+bool cproxy_read_trace(proxy_td *ptd, uint64_t id, proxy_trace_rec *out) {
+    assert(ptd != NULL);
+    assert(out != NULL);
+
+    proxy_trace *t = __atomic_load_n(&ptd->trace, __ATOMIC_ACQUIRE);
+    if (t == NULL || id == 0) {
+        return false;
+    }
+
+    proxy_trace_rec *r = trace_rec(t, id);
+
+    if (__atomic_load_n(&r->id, __ATOMIC_ACQUIRE) != id) {
+        return false;
+    }
+
+    out->sfd = r->sfd;
+    memcpy(out->cmd, r->cmd, sizeof(out->cmd));
+    out->cmd[sizeof(out->cmd) - 1] = '\0';
+
+    for (int i = 0; i < TRACE_STAGE_last; i++) {
+        out->usec[i] = __atomic_load_n(&r->usec[i], __ATOMIC_RELAXED);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    out->id = __atomic_load_n(&r->id, __ATOMIC_RELAXED);
+
+    return out->id == id;
+}
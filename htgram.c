@@ -9,6 +9,23 @@
 
 #include "htgram.h"
 
+// Bin counts have a single writer, and may be read by other
+// threads, such as during htgram_add().
+//
+#ifdef __ATOMIC_RELAXED
+#define HTGRAM_LOAD(counter) \
+    __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define HTGRAM_STORE(counter, val) \
+    __atomic_store_n(&(counter), (val), __ATOMIC_RELAXED)
+#else
+#define HTGRAM_LOAD(counter) \
+    (*(volatile uint64_t *) &(counter))
+#define HTGRAM_STORE(counter, val) \
+    (*(volatile uint64_t *) &(counter) = (val))
+#endif
+#define HTGRAM_ADD(counter, n) \
+    HTGRAM_STORE(counter, HTGRAM_LOAD(counter) + (n))
+
 struct htgram_bin_st {
     int64_t start;
     int64_t width;
@@ -21,6 +38,10 @@ struct htgram_st {
     double  bin_width_growth;
     size_t  num_bins;
 
+    // Non-zero for a log-linear htgram, from htgram_mk_loglinear().
+    //
+    int     sub_bits;
+
     struct htgram_bin_st *bins;
 
     uint64_t lt_count; // For data points < the bins.
@@ -73,6 +94,83 @@ HTGRAM_HANDLE htgram_mk(int64_t bin_start,
     return h;
 }
 
+HTGRAM_HANDLE htgram_mk_loglinear(int sub_bits, int max_bits) {
+    assert(sub_bits >= 1);
+    assert(sub_bits <= max_bits);
+    assert(max_bits <= 62);
+
+    int64_t sub_count = (int64_t) 1 << (sub_bits - 1);
+    size_t  num_bins = ((size_t) 1 << sub_bits) +
+                       (max_bits - sub_bits) * sub_count;
+
+    struct htgram_st *h = calloc(sizeof(struct htgram_st), 1);
+    if (h == NULL) {
+        return NULL;
+    }
+
+    h->bins = calloc(sizeof(struct htgram_bin_st), num_bins);
+    if (h->bins == NULL) {
+        free(h);
+        return NULL;
+    }
+
+    h->bin_start = 0;
+    h->bin_start_width = 1;
+    h->bin_width_growth = 0.0;
+    h->num_bins = num_bins;
+    h->sub_bits = sub_bits;
+
+    size_t i = 0;
+
+    for (; i < ((size_t) 1 << sub_bits); i++) {
+        h->bins[i].start = i;
+        h->bins[i].width = 1;
+    }
+
+    for (int m = sub_bits; m < max_bits; m++) {
+        int64_t w = (int64_t) 1 << (m - sub_bits + 1);
+        for (int64_t j = 0; j < sub_count; j++, i++) {
+            h->bins[i].start = ((int64_t) 1 << m) + j * w;
+            h->bins[i].width = w;
+        }
+    }
+
+    assert(i == num_bins);
+
+    return h;
+}
+
+static int msb64(uint64_t v) {
+    assert(v != 0);
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(v);
+#else
+    int m = 0;
+    while (v >>= 1) {
+        m++;
+    }
+    return m;
+#endif
+}
+
+// Returns the log-linear bin index of a non-negative data point,
+// which may be >= num_bins.
+//
+static size_t loglinear_index(HTGRAM_HANDLE h, int64_t data_point) {
+    uint64_t v = (uint64_t) data_point;
+    int      p = h->sub_bits;
+
+    if (v < ((uint64_t) 1 << p)) {
+        return v;
+    }
+
+    int m = msb64(v);
+
+    return ((size_t) 1 << p) +
+        ((size_t) (m - p) << (p - 1)) +
+        ((v >> (m - p + 1)) - ((uint64_t) 1 << (p - 1)));
+}
+
 void htgram_destroy(HTGRAM_HANDLE h) {
     if (h->bins != NULL) {
         free(h->bins);
@@ -101,20 +199,26 @@ size_t htgram_get_num_bins(HTGRAM_HANDLE h) {
 
 void htgram_incr(HTGRAM_HANDLE h, int64_t data_point, uint64_t count) {
     if (data_point < h->bin_start) {
-        h->lt_count += count;
+        HTGRAM_ADD(h->lt_count, count);
         return;
     }
 
     size_t i = 0;
 
-    if (h->bin_width_growth == 1.0) {
-        i = data_point / h->bin_start_width;
+    if (h->sub_bits > 0) {
+        i = loglinear_index(h, data_point);
+        if (i < h->num_bins) {
+            HTGRAM_ADD(h->bins[i].count, count);
+            return;
+        }
+    } else if (h->bin_width_growth == 1.0) {
+        i = (data_point - h->bin_start) / h->bin_start_width;
     }
 
     while (i < h->num_bins) {
         if (data_point < (h->bins[i].start +
                           h->bins[i].width)) {
-            h->bins[i].count += count;
+            HTGRAM_ADD(h->bins[i].count, count);
             return;
         }
 
@@ -126,7 +230,7 @@ void htgram_incr(HTGRAM_HANDLE h, int64_t data_point, uint64_t count) {
         return;
     }
 
-    h->gt_count += count;
+    HTGRAM_ADD(h->gt_count, count);
 }
 
 bool htgram_get_bin_data(HTGRAM_HANDLE h, int bin_index,
@@ -134,7 +238,7 @@ bool htgram_get_bin_data(HTGRAM_HANDLE h, int bin_index,
                          int64_t *out_bin_width,
                          uint64_t *out_bin_count) {
     if (bin_index < 0) {
-        *out_bin_count = h->lt_count;
+        *out_bin_count = HTGRAM_LOAD(h->lt_count);
         return false;
     }
 
@@ -146,24 +250,24 @@ bool htgram_get_bin_data(HTGRAM_HANDLE h, int bin_index,
                                        out_bin_count);
         }
 
-        *out_bin_count = h->gt_count;
+        *out_bin_count = HTGRAM_LOAD(h->gt_count);
         return false;
     }
 
     *out_bin_start = h->bins[bin_index].start;
     *out_bin_width = h->bins[bin_index].width;
-    *out_bin_count = h->bins[bin_index].count;
+    *out_bin_count = HTGRAM_LOAD(h->bins[bin_index].count);
 
     return true;
 }
 
 void htgram_reset(HTGRAM_HANDLE h) {
     for (size_t i = 0; i < h->num_bins; i++) {
-        h->bins[i].count = 0;
+        HTGRAM_STORE(h->bins[i].count, 0);
     }
 
-    h->lt_count = 0;
-    h->gt_count = 0;
+    HTGRAM_STORE(h->lt_count, 0);
+    HTGRAM_STORE(h->gt_count, 0);
 
     if (h->next != NULL) {
         htgram_reset(h->next);
@@ -171,25 +275,91 @@ void htgram_reset(HTGRAM_HANDLE h) {
 }
 
 void htgram_add(HTGRAM_HANDLE agg, HTGRAM_HANDLE x) {
-    int64_t  astart;
-    int64_t  awidth;
-    uint64_t acount;
+    while (agg != NULL && x != NULL) {
+        assert(agg->bin_start == x->bin_start);
+        assert(agg->num_bins == x->num_bins);
+        assert(agg->sub_bits == x->sub_bits);
 
-    int64_t  xstart;
-    int64_t  xwidth;
-    uint64_t xcount;
+        for (size_t i = 0; i < agg->num_bins; i++) {
+            assert(agg->bins[i].start == x->bins[i].start);
+            assert(agg->bins[i].width == x->bins[i].width);
 
-    int i = 0;
+            HTGRAM_ADD(agg->bins[i].count, HTGRAM_LOAD(x->bins[i].count));
+        }
+
+        HTGRAM_ADD(agg->lt_count, HTGRAM_LOAD(x->lt_count));
+        HTGRAM_ADD(agg->gt_count, HTGRAM_LOAD(x->gt_count));
+
+        agg = agg->next;
+        x = x->next;
+    }
+}
 
-    while (htgram_get_bin_data(agg, i, &astart, &awidth, &acount) &&
-           htgram_get_bin_data(x,   i, &xstart, &xwidth, &xcount)) {
-        assert(astart == xstart);
-        assert(awidth == xwidth);
+uint64_t htgram_get_count(HTGRAM_HANDLE h) {
+    uint64_t count = 0;
 
-        htgram_incr(agg, astart, xcount);
+    for (; h != NULL; h = h->next) {
+        for (size_t i = 0; i < h->num_bins; i++) {
+            count += HTGRAM_LOAD(h->bins[i].count);
+        }
+
+        count += HTGRAM_LOAD(h->lt_count);
+        count += HTGRAM_LOAD(h->gt_count);
+    }
+
+    return count;
+}
+
+bool htgram_percentile(HTGRAM_HANDLE h, double percentile,
+                       int64_t *out_value) {
+    uint64_t tot_count = htgram_get_count(h);
+    if (tot_count == 0) {
+        return false;
+    }
+
+    // The rank of the data point that's at the percentile,
+    // counting from 1.
+    //
+    double   r = (percentile / 100.0) * tot_count;
+    uint64_t rank = (uint64_t) r;
+    if (rank < r) {
+        rank++;
+    }
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > tot_count) {
+        rank = tot_count;
+    }
+
+    int64_t  start = h->bin_start;
+    int64_t  width = 0;
+    uint64_t count;
+    uint64_t run_count; // Cummulative count.
+
+    htgram_get_bin_data(h, -1, &start, &width, &count);
+    run_count = count;
+    if (run_count >= rank) {
+        *out_value = h->bin_start;
+        return true;
+    }
+
+    int i = 0;
+
+    while (htgram_get_bin_data(h, i, &start, &width, &count)) {
+        run_count += count;
+        if (run_count >= rank) {
+            break;
+        }
 
         i++;
     }
+
+    // When past the bins, start and width are of the last bin.
+    //
+    *out_value = start + (width > 0 ? width - 1 : 0);
+
+    return true;
 }
 
 void htgram_dump(HTGRAM_HANDLE h,
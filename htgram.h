@@ -68,6 +68,26 @@ extern "C" {
                             size_t  num_bins,
                             HTGRAM_HANDLE next);
 
+    /**
+     * Create a log-linear (HDR-style) htgram, covering the range
+     * [0, 2^max_bits).
+     *
+     * Values below 2^sub_bits get bins of width 1.  Each power of two
+     * range above that, [2^m, 2^(m+1)), is split into 2^(sub_bits - 1)
+     * equal width bins, so the width of any bin is never more than
+     * 1 / 2^(sub_bits - 1) of the values it holds.  For example,
+     * htgram_mk_loglinear(6, 27) has 736 bins, covers up to 134
+     * seconds of usecs, with a relative error of at most 1/32.
+     *
+     * Finding the bin for a data point is O(1).  Data points at or
+     * beyond 2^max_bits are counted past the last bin.
+     *
+     * @param sub_bits 1 to max_bits.
+     * @param max_bits sub_bits to 62.
+     */
+    HTGRAM_PUBLIC_API
+    HTGRAM_HANDLE htgram_mk_loglinear(int sub_bits, int max_bits);
+
     /**
      * Destroy a htgram.
      *
@@ -98,7 +118,8 @@ extern "C" {
     int64_t htgram_get_bin_start_width(HTGRAM_HANDLE h);
 
     /**
-     * Get the growth factor for bin widths.
+     * Get the growth factor for bin widths, which is 0.0 for a
+     * log-linear htgram.
      */
     HTGRAM_PUBLIC_API
     double htgram_get_bin_width_growth(HTGRAM_HANDLE h);
@@ -135,10 +156,37 @@ extern "C" {
 
     /**
      * Add the values from histogram x into histogram agg (aggregate).
+     * Both must have been created with the same parameters.
+     *
+     * Bin counts are only ever updated by a single writer, so x may be
+     * owned and concurrently incremented by another thread, without
+     * any locking.  The result is then a snapshot that may miss the
+     * data points added during the htgram_add().
      */
     HTGRAM_PUBLIC_API
     void htgram_add(HTGRAM_HANDLE agg, HTGRAM_HANDLE x);
 
+    /**
+     * Get the total count of all data points, including those
+     * outside the bins.
+     */
+    HTGRAM_PUBLIC_API
+    uint64_t htgram_get_count(HTGRAM_HANDLE h);
+
+    /**
+     * Find the data point value at a percentile, such as 99.9, which
+     * is the highest value of the bin holding that percentile.  With
+     * a log-linear htgram, that's within the htgram's relative error
+     * of the real value.  A percentile that lands outside the bins
+     * returns the nearest edge of the bins.
+     *
+     * Returns false, leaving out_value alone, if the histogram is
+     * empty.
+     */
+    HTGRAM_PUBLIC_API
+    bool htgram_percentile(HTGRAM_HANDLE h, double percentile,
+                           int64_t *out_value);
+
     /**
      * Call signature of callback from htgram_dump().
      */
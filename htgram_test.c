@@ -127,9 +127,122 @@ static void testChained(void) {
     assert(count == 0);
 }
 
+static void testLogLinear(void) {
+    HTGRAM_HANDLE h0, h1;
+
+    int64_t start;
+    int64_t width;
+    uint64_t count;
+    int64_t value;
+
+    h0 = htgram_mk_loglinear(6, 27);
+    assert(h0 != NULL);
+    assert(htgram_get_num_bins(h0) == 64 + 21 * 32);
+    assert(htgram_get_count(h0) == 0);
+    assert(htgram_percentile(h0, 50.0, &value) == false);
+
+    // Bins are contiguous, and never wider than 1/32 of their start.
+    //
+    int64_t next = 0;
+    int i;
+    for (i = 0; htgram_get_bin_data(h0, i, &start, &width, &count); i++) {
+        assert(start == next);
+        assert(width >= 1);
+        assert(width == 1 || width * 32 <= start);
+        next = start + width;
+    }
+    assert(i == (int) htgram_get_num_bins(h0));
+    assert(next == ((int64_t) 1 << 27));
+
+    // Every data point lands in the bin that holds it.
+    //
+    for (int64_t v = 0; v < ((int64_t) 1 << 27); v = v * 9 / 8 + 1) {
+        htgram_reset(h0);
+        htgram_incr(h0, v, 1);
+
+        int found = 0;
+        for (i = 0; htgram_get_bin_data(h0, i, &start, &width, &count); i++) {
+            if (count > 0) {
+                assert(count == 1);
+                assert(start <= v);
+                assert(v < start + width);
+                found++;
+            }
+        }
+        assert(found == 1);
+    }
+
+    htgram_reset(h0);
+    htgram_incr(h0, -1, 3);
+    htgram_incr(h0, (int64_t) 1 << 27, 5);
+    assert(htgram_get_bin_data(h0, -1, &start, &width, &count) == false);
+    assert(count == 3);
+    assert(htgram_get_bin_data(h0, i, &start, &width, &count) == false);
+    assert(count == 5);
+    assert(htgram_get_count(h0) == 8);
+
+    // Percentiles of 1..10000, each within the relative error.
+    //
+    htgram_reset(h0);
+    for (int64_t v = 1; v <= 10000; v++) {
+        htgram_incr(h0, v, 1);
+    }
+    assert(htgram_get_count(h0) == 10000);
+
+    double pcts[] = { 0.0, 50.0, 90.0, 99.0, 99.9, 100.0 };
+    int64_t expect[] = { 1, 5000, 9000, 9900, 9990, 10000 };
+    for (i = 0; i < (int) (sizeof(pcts) / sizeof(pcts[0])); i++) {
+        assert(htgram_percentile(h0, pcts[i], &value) == true);
+        assert(value >= expect[i]);
+        assert(value <= expect[i] + expect[i] / 32);
+    }
+
+    // Merging sums the counts.
+    //
+    h1 = htgram_mk_loglinear(6, 27);
+    htgram_incr(h1, 20000, 10000);
+    htgram_incr(h1, -5, 1);
+    htgram_add(h1, h0);
+    assert(htgram_get_count(h1) == 20001);
+    assert(htgram_percentile(h1, 25.0, &value) == true);
+    assert(value >= 5000 && value <= 5000 + 5000 / 32);
+    assert(htgram_percentile(h1, 75.0, &value) == true);
+    assert(value >= 20000 && value <= 20000 + 20000 / 32);
+    assert(htgram_percentile(h1, 0.0, &value) == true);
+    assert(value == 0);
+
+    htgram_destroy(h1);
+    htgram_destroy(h0);
+}
+
+static void testPercentile(void) {
+    HTGRAM_HANDLE h0;
+    int64_t value;
+
+    h0 = htgram_mk(0, 10, 1.0, 10, NULL);
+    htgram_incr(h0, 5, 1);
+    htgram_incr(h0, 15, 1);
+    htgram_incr(h0, 25, 2);
+
+    assert(htgram_percentile(h0, 25.0, &value) == true);
+    assert(value == 9);
+    assert(htgram_percentile(h0, 50.0, &value) == true);
+    assert(value == 19);
+    assert(htgram_percentile(h0, 99.0, &value) == true);
+    assert(value == 29);
+
+    htgram_incr(h0, 1000, 100);
+    assert(htgram_percentile(h0, 99.0, &value) == true);
+    assert(value == 99);
+
+    htgram_destroy(h0);
+}
+
 int main(void) {
     testSimple();
     testChained();
+    testLogLinear();
+    testPercentile();
 
     return 0;
 }
@@ -0,0 +1,347 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * Multi-threaded GET/SET benchmark of the embedded item cache, to show
+ * how it scales with threads.  Each thread runs a random mix of GETs
+ * and SETs over a shared key space, doing what the item_get(),
+ * item_remove() and store_item() wrappers in thread.c do.
+ *
+ * Every thread count is run twice, first with each operation also
+ * under one global mutex, like the cache_lock that every item
+ * operation used to take, and then with only the striped item locks.
+ *
+ * Usage: item_lock_bench [-t max_threads] [-n ops_per_thread]
+ *                        [-k keys] [-s set_percent] [-v value_bytes]
+ *                        [-m megabytes]
+ */
+
+#include "config.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "memcached.h"
+#include "log.h"
+
+// The bench links just the item, assoc and slab code, so it stands
+// in for the few parts of memcached.c, thread.c and log.c they use.
+//
+time_t process_started;
+moxi_log *ml;
+
+static pthread_mutex_t bench_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int log_error_write(moxi_log *mlog, const char *filename, unsigned int line,
+                    const char *fmt, ...) {
+    (void) mlog;
+    (void) filename;
+    (void) line;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return 0;
+}
+
+void STATS_LOCK(void) {
+    pthread_mutex_lock(&bench_stats_lock);
+}
+
+void STATS_UNLOCK(void) {
+    pthread_mutex_unlock(&bench_stats_lock);
+}
+
+void threadlocal_stats_aggregate(struct thread_stats *thread_stats) {
+    memset(thread_stats, 0, sizeof(*thread_stats));
+}
+
+void append_stat(const char *name, ADD_STAT add_stats, void *c,
+                 const char *fmt, ...) {
+    (void) name;
+    (void) add_stats;
+    (void) c;
+    (void) fmt;
+}
+
+void item_stats(ADD_STAT add_stats, void *c) {
+    do_item_stats(add_stats, c);
+}
+
+void item_stats_sizes(ADD_STAT add_stats, void *c) {
+    do_item_stats_sizes(add_stats, c);
+}
+
+typedef struct {
+    int      id;
+    int      ops;
+    bool     global;
+    uint32_t seed;
+    uint64_t gets;
+    uint64_t hits;
+    uint64_t sets;
+    uint64_t set_fails;
+} bench_thread;
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int bench_keys      = 100000;
+static int bench_set_pct   = 10;
+static int bench_value_len = 100;
+
+static char *bench_value;
+
+static pthread_barrier_t bench_barrier;
+
+static uint64_t bench_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((uint64_t) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static uint32_t bench_rand(uint32_t *seed) {
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+static bool bench_get(const char *key, size_t nkey) {
+    uint32_t hv = hash(key, nkey, 0);
+
+    item_lock(hv);
+    item *it = do_item_get(key, nkey, hv);
+    item_unlock(hv);
+
+    if (it == NULL) {
+        return false;
+    }
+
+    assert(memcmp(ITEM_data(it), bench_value, 8) == 0);
+
+    item_lock(hv);
+    do_item_remove(it);
+    item_unlock(hv);
+
+    return true;
+}
+
+static bool bench_set(const char *key, size_t nkey) {
+    item *it = do_item_alloc((char *) key, nkey, 0, 0, bench_value_len + 2);
+    if (it == NULL) {
+        return false;
+    }
+
+    memcpy(ITEM_data(it), bench_value, bench_value_len);
+    memcpy(ITEM_data(it) + bench_value_len, "\r\n", 2);
+
+    uint32_t hv = hash(key, nkey, 0);
+
+    item_lock(hv);
+    item *old_it = do_item_get(key, nkey, hv);
+    if (old_it != NULL) {
+        do_item_replace(old_it, it, hv);
+        do_item_remove(old_it);
+    } else {
+        do_item_link(it, hv);
+    }
+    do_item_remove(it);
+    item_unlock(hv);
+
+    return true;
+}
+
+static void *bench_thread_main(void *arg) {
+    bench_thread *t = arg;
+    char key[KEY_MAX_LENGTH];
+
+    pthread_barrier_wait(&bench_barrier);
+
+    for (int i = 0; i < t->ops; i++) {
+        uint32_t r = bench_rand(&t->seed);
+        int nkey = snprintf(key, sizeof(key), "key:%u",
+                            (r >> 8) % (uint32_t) bench_keys);
+        bool set = (int) (r & 0xff) * 100 < bench_set_pct * 256;
+
+        if (t->global) {
+            pthread_mutex_lock(&global_lock);
+        }
+
+        if (set) {
+            t->sets++;
+            if (!bench_set(key, nkey)) {
+                t->set_fails++;
+            }
+        } else {
+            t->gets++;
+            if (bench_get(key, nkey)) {
+                t->hits++;
+            }
+        }
+
+        if (t->global) {
+            pthread_mutex_unlock(&global_lock);
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_run(int nthreads, int ops, bool global) {
+    bench_thread *threads = calloc(nthreads, sizeof(bench_thread));
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    assert(threads != NULL && tids != NULL);
+
+    pthread_barrier_init(&bench_barrier, NULL, nthreads + 1);
+
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].id     = i;
+        threads[i].ops    = ops;
+        threads[i].global = global;
+        threads[i].seed   = 2463534242u + i * 7919;
+
+        if (pthread_create(&tids[i], NULL, bench_thread_main,
+                           &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&bench_barrier);
+    uint64_t start = bench_usec();
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    uint64_t elapsed = bench_usec() - start;
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    pthread_barrier_destroy(&bench_barrier);
+
+    uint64_t gets = 0, hits = 0, sets = 0, set_fails = 0;
+
+    for (int i = 0; i < nthreads; i++) {
+        gets      += threads[i].gets;
+        hits      += threads[i].hits;
+        sets      += threads[i].sets;
+        set_fails += threads[i].set_fails;
+    }
+
+    printf("%-7s threads %2d: %10.0f ops/sec, %8llu usec,"
+           " gets %llu (hits %llu), sets %llu (failed %llu),"
+           " items %u, evictions %llu\n",
+           global ? "global" : "striped", nthreads,
+           (double) (gets + sets) * 1000000.0 / elapsed,
+           (unsigned long long) elapsed,
+           (unsigned long long) gets, (unsigned long long) hits,
+           (unsigned long long) sets, (unsigned long long) set_fails,
+           stats.curr_items, (unsigned long long) stats.evictions);
+
+    free(tids);
+    free(threads);
+}
+
+static void usage(void) {
+    printf("item_lock_bench [-t max_threads] [-n ops_per_thread]\n"
+           "                [-k keys] [-s set_percent] [-v value_bytes]\n"
+           "                [-m megabytes]\n");
+}
+
+int main(int argc, char **argv) {
+    int max_threads = 8;
+    int ops = 1000000;
+    int megabytes = 64;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:n:k:s:v:m:h")) != -1) {
+        switch (c) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            ops = atoi(optarg);
+            break;
+        case 'k':
+            bench_keys = atoi(optarg);
+            break;
+        case 's':
+            bench_set_pct = atoi(optarg);
+            break;
+        case 'v':
+            bench_value_len = atoi(optarg);
+            break;
+        case 'm':
+            megabytes = atoi(optarg);
+            break;
+        default:
+            usage();
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (max_threads <= 0 || ops <= 0 || bench_keys <= 0 ||
+        bench_set_pct < 0 || bench_set_pct > 100 ||
+        bench_value_len < 8 || megabytes <= 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    bench_value = malloc(bench_value_len);
+    assert(bench_value != NULL);
+    memset(bench_value, 'v', bench_value_len);
+
+    settings.use_cas = true;
+    settings.maxbytes = (size_t) megabytes * 1024 * 1024;
+    settings.evict_to_free = 1;
+    settings.factor = 1.25;
+    settings.chunk_size = 48;
+    settings.num_threads = max_threads;
+
+    item_init();
+    assoc_init();
+    slabs_init(settings.maxbytes, settings.factor, false);
+
+    if (start_assoc_maintenance_thread() == -1) {
+        return EXIT_FAILURE;
+    }
+
+    // Load every key once, so GETs mostly hit.
+    //
+    char key[KEY_MAX_LENGTH];
+    for (int i = 0; i < bench_keys; i++) {
+        int nkey = snprintf(key, sizeof(key), "key:%d", i);
+        bench_set(key, nkey);
+    }
+
+    printf("item_lock_bench: %d keys, %d%% sets, %d byte values,"
+           " %d ops per thread\n",
+           bench_keys, bench_set_pct, bench_value_len, ops);
+
+    for (int n = 1; ; n *= 2) {
+        if (n > max_threads) {
+            n = max_threads;
+        }
+
+        bench_run(n, ops, true);
+        bench_run(n, ops, false);
+
+        if (n == max_threads) {
+            break;
+        }
+    }
+
+    stop_assoc_maintenance_thread();
+    free(bench_value);
+
+    return 0;
+}
@@ -11,6 +11,7 @@
 /* Forward Declarations */
 static void item_link_q(item *it);
 static void item_unlink_q(item *it);
+static void do_item_unlink_nolock(item *it, const uint32_t hv);
 
 /*
  * We only reposition items in the LRU queue if they haven't been repositioned
@@ -32,6 +33,84 @@ static item *tails[LARGEST_ID];
 static itemstats_t itemstats[LARGEST_ID];
 static unsigned int sizes[LARGEST_ID];
 
+/*
+ * Instead of one lock for the whole cache, an item is protected by
+ * the item lock that its key's assoc hash falls into, and each LRU
+ * (heads[], tails[], sizes[] and itemstats[] of one slab class) has
+ * a lock of its own.  The item lock of a key covers its hash chain,
+ * its refcount and its flags.
+ *
+ * Locks are taken in the order item lock, LRU lock, then the slabs
+ * and stats locks.  Anything that holds an LRU lock, like eviction,
+ * only ever trylocks an item lock, and skips the item if that fails.
+ *
+ * The assoc hash table buckets are a finer split of the same hash
+ * bits, so the item locks must be no more than the smallest hash
+ * table (see assoc.c).
+ */
+#define ITEM_LOCK_POWER_MAX 13
+
+static pthread_mutex_t *item_locks;
+static uint32_t item_lock_mask;
+static pthread_mutex_t lru_locks[LARGEST_ID];
+
+static void item_locks_init(int nthreads) {
+    int power;
+
+    /* More threads means more chance of two of them on one lock. */
+    if (nthreads < 3) {
+        power = 10;
+    } else if (nthreads < 4) {
+        power = 11;
+    } else if (nthreads < 5) {
+        power = 12;
+    } else {
+        power = ITEM_LOCK_POWER_MAX;
+    }
+
+    uint32_t count = (uint32_t) 1 << power;
+
+    item_locks = calloc(count, sizeof(pthread_mutex_t));
+    if (item_locks == NULL) {
+        moxi_log_write("Failed to allocate item locks.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        pthread_mutex_init(&item_locks[i], NULL);
+    }
+
+    item_lock_mask = count - 1;
+}
+
+void item_lock(const uint32_t hv) {
+    pthread_mutex_lock(&item_locks[hv & item_lock_mask]);
+}
+
+bool item_trylock(const uint32_t hv) {
+    return pthread_mutex_trylock(&item_locks[hv & item_lock_mask]) == 0;
+}
+
+void item_unlock(const uint32_t hv) {
+    pthread_mutex_unlock(&item_locks[hv & item_lock_mask]);
+}
+
+/*
+ * Takes every item lock, always in the same order, for the rare
+ * operations that touch every item or the hash table as a whole.
+ */
+void item_lock_all(void) {
+    for (uint32_t i = 0; i <= item_lock_mask; i++) {
+        pthread_mutex_lock(&item_locks[i]);
+    }
+}
+
+void item_unlock_all(void) {
+    for (uint32_t i = item_lock_mask + 1; i > 0; i--) {
+        pthread_mutex_unlock(&item_locks[i - 1]);
+    }
+}
+
 void item_init(void) {
     int i;
     memset(itemstats, 0, sizeof(itemstats_t) * LARGEST_ID);
@@ -39,20 +118,26 @@ void item_init(void) {
         heads[i] = NULL;
         tails[i] = NULL;
         sizes[i] = 0;
+        pthread_mutex_init(&lru_locks[i], NULL);
     }
+
+    item_locks_init(settings.num_threads);
 }
 
 void item_stats_reset(void) {
-    pthread_mutex_lock(&cache_lock);
-    memset(itemstats, 0, sizeof(itemstats_t) * LARGEST_ID);
-    pthread_mutex_unlock(&cache_lock);
+    int i;
+    for (i = 0; i < LARGEST_ID; i++) {
+        pthread_mutex_lock(&lru_locks[i]);
+        memset(&itemstats[i], 0, sizeof(itemstats_t));
+        pthread_mutex_unlock(&lru_locks[i]);
+    }
 }
 
 
 /* Get the next CAS id for a new item. */
 uint64_t get_cas_id(void) {
     static uint64_t cas_id = 0;
-    return ++cas_id;
+    return __atomic_add_fetch(&cas_id, 1, __ATOMIC_RELAXED);
 }
 
 /* Enable this for reference-count debugging. */
@@ -121,21 +206,35 @@ item *do_item_alloc(char *key, const size_t nkey, const int flags, const rel_tim
     int tries = 50;
     item *it = NULL;
     item *search;
+    uint32_t hv;
+
+    pthread_mutex_lock(&lru_locks[id]);
 
     for (search = tails[id];
          tries > 0 && search != NULL;
          tries--, search=search->prev) {
         if (search->refcount == 0 &&
             (search->exptime != 0 && search->exptime < current_time)) {
+            /* Recheck under the item lock, since another thread
+             * may be in the middle of using it. */
+            hv = hash(ITEM_key(search), search->nkey, 0);
+            if (!item_trylock(hv)) {
+                continue;
+            }
+            if (search->refcount != 0) {
+                item_unlock(hv);
+                continue;
+            }
             it = search;
             /* I don't want to actually free the object, just steal
              * the item to avoid to grab the slab mutex twice ;-)
              */
             it->refcount = 1;
-            do_item_unlink(it);
+            do_item_unlink_nolock(it, hv);
             /* Initialize the item block: */
             it->slabs_clsid = 0;
             it->refcount = 0;
+            item_unlock(hv);
             break;
         }
     }
@@ -153,6 +252,7 @@ item *do_item_alloc(char *key, const size_t nkey, const int flags, const rel_tim
 
         if (settings.evict_to_free == 0) {
             itemstats[id].outofmemory++;
+            pthread_mutex_unlock(&lru_locks[id]);
             return NULL;
         }
 
@@ -165,11 +265,20 @@ item *do_item_alloc(char *key, const size_t nkey, const int flags, const rel_tim
 
         if (tails[id] == 0) {
             itemstats[id].outofmemory++;
+            pthread_mutex_unlock(&lru_locks[id]);
             return NULL;
         }
 
         for (search = tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
             if (search->refcount == 0) {
+                hv = hash(ITEM_key(search), search->nkey, 0);
+                if (!item_trylock(hv)) {
+                    continue;
+                }
+                if (search->refcount != 0) {
+                    item_unlock(hv);
+                    continue;
+                }
                 if (search->exptime == 0 || search->exptime > current_time) {
                     itemstats[id].evicted++;
                     itemstats[id].evicted_time = current_time - search->time;
@@ -177,7 +286,8 @@ item *do_item_alloc(char *key, const size_t nkey, const int flags, const rel_tim
                     stats.evictions++;
                     STATS_UNLOCK();
                 }
-                do_item_unlink(search);
+                do_item_unlink_nolock(search, hv);
+                item_unlock(hv);
                 break;
             }
         }
@@ -194,25 +304,31 @@ item *do_item_alloc(char *key, const size_t nkey, const int flags, const rel_tim
             tries = 50;
             for (search = tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
                 if (search->refcount != 0 && search->time + TAIL_REPAIR_TIME < current_time) {
+                    hv = hash(ITEM_key(search), search->nkey, 0);
+                    if (!item_trylock(hv)) {
+                        continue;
+                    }
                     itemstats[id].tailrepairs++;
                     search->refcount = 0;
-                    do_item_unlink(search);
+                    do_item_unlink_nolock(search, hv);
+                    item_unlock(hv);
                     break;
                 }
             }
             it = slabs_alloc(ntotal, id);
             if (it == 0) {
+                pthread_mutex_unlock(&lru_locks[id]);
                 return NULL;
             }
         }
     }
 
+    pthread_mutex_unlock(&lru_locks[id]);
+
     assert(it->slabs_clsid == 0);
 
     it->slabs_clsid = id;
 
-    assert(it != heads[it->slabs_clsid]);
-
     it->next = it->prev = it->h_next = 0;
     it->refcount = 1;     /* the caller will have a reference */
     DEBUG_REFCNT(it, '*');
@@ -238,8 +354,6 @@ void item_free(item *it) {
     size_t ntotal = ITEM_ntotal(it);
     unsigned int clsid;
     assert((it->it_flags & ITEM_LINKED) == 0);
-    assert(it != heads[it->slabs_clsid]);
-    assert(it != tails[it->slabs_clsid]);
     assert(it->refcount == 0);
 
     /* so slab size changer can tell later if item is already free or not */
@@ -263,6 +377,7 @@ bool item_size_ok(const size_t nkey, const int flags, const int nbytes) {
                                         prefix, &nsuffix)) != 0;
 }
 
+/* The caller holds the LRU lock of the item's slab class. */
 static void item_link_q(item *it) { /* item is the new head */
     (void)it;
 #ifndef MOXI_ITEM_MALLOC
@@ -284,6 +399,7 @@ static void item_link_q(item *it) { /* item is the new head */
 #endif
 }
 
+/* The caller holds the LRU lock of the item's slab class. */
 static void item_unlink_q(item *it) {
     (void)it;
 #ifndef MOXI_ITEM_MALLOC
@@ -310,41 +426,48 @@ static void item_unlink_q(item *it) {
 #endif
 }
 
-int do_item_link(item *it) {
+/*
+ * The do_item_link(), do_item_unlink(), do_item_replace() and
+ * do_item_get() callers hold the item lock of hv, the assoc hash
+ * of the item's key.  The curr/total item stats are kept with
+ * atomics, so linking doesn't need the global stats lock either.
+ */
+int do_item_link(item *it, const uint32_t hv) {
     MEMCACHED_ITEM_LINK(ITEM_key(it), it->nkey, it->nbytes);
     assert((it->it_flags & (ITEM_LINKED|ITEM_SLABBED)) == 0);
     assert(it->nbytes < (1024 * 1024));  /* 1MB max size */
     it->it_flags |= ITEM_LINKED;
     it->time = current_time;
-    assoc_insert(it);
+    assoc_insert(it, hv);
 
 #ifdef MOXI_ITEM_MALLOC
     it->refcount++;
 #endif
 
-    STATS_LOCK();
-    stats.curr_bytes += ITEM_ntotal(it);
-    stats.curr_items += 1;
-    stats.total_items += 1;
-    STATS_UNLOCK();
+    __atomic_add_fetch(&stats.curr_bytes, ITEM_ntotal(it), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.curr_items, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.total_items, 1, __ATOMIC_RELAXED);
 
     /* Allocate a new CAS ID on link. */
     ITEM_set_cas(it, (settings.use_cas) ? get_cas_id() : 0);
 
+#ifndef MOXI_ITEM_MALLOC
+    pthread_mutex_lock(&lru_locks[it->slabs_clsid]);
     item_link_q(it);
+    pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
+#endif
 
     return 1;
 }
 
-void do_item_unlink(item *it) {
+/* Like do_item_unlink(), for a caller already holding the LRU lock. */
+static void do_item_unlink_nolock(item *it, const uint32_t hv) {
     MEMCACHED_ITEM_UNLINK(ITEM_key(it), it->nkey, it->nbytes);
     if ((it->it_flags & ITEM_LINKED) != 0) {
         it->it_flags &= ~ITEM_LINKED;
-        STATS_LOCK();
-        stats.curr_bytes -= ITEM_ntotal(it);
-        stats.curr_items -= 1;
-        STATS_UNLOCK();
-        assoc_delete(ITEM_key(it), it->nkey);
+        __atomic_sub_fetch(&stats.curr_bytes, ITEM_ntotal(it), __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&stats.curr_items, 1, __ATOMIC_RELAXED);
+        assoc_delete(ITEM_key(it), it->nkey, hv);
         item_unlink_q(it);
 
 #ifndef MOXI_ITEM_MALLOC
@@ -353,6 +476,19 @@ void do_item_unlink(item *it) {
     }
 }
 
+void do_item_unlink(item *it, const uint32_t hv) {
+#ifdef MOXI_ITEM_MALLOC
+    /* There are no LRUs to lock when items are malloc'ed. */
+    do_item_unlink_nolock(it, hv);
+#else
+    unsigned int id = it->slabs_clsid;
+
+    pthread_mutex_lock(&lru_locks[id]);
+    do_item_unlink_nolock(it, hv);
+    pthread_mutex_unlock(&lru_locks[id]);
+#endif
+}
+
 void do_item_remove(item *it) {
 #ifdef MOXI_ITEM_MALLOC
     item_free(it);
@@ -369,26 +505,36 @@ void do_item_remove(item *it) {
 #endif
 }
 
+void do_item_ref(item *it) {
+#ifndef MOXI_ITEM_MALLOC
+    assert((it->it_flags & ITEM_SLABBED) == 0);
+#endif
+    it->refcount++;
+    DEBUG_REFCNT(it, '+');
+}
+
 void do_item_update(item *it) {
     MEMCACHED_ITEM_UPDATE(ITEM_key(it), it->nkey, it->nbytes);
     if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
         assert((it->it_flags & ITEM_SLABBED) == 0);
 
         if ((it->it_flags & ITEM_LINKED) != 0) {
+            pthread_mutex_lock(&lru_locks[it->slabs_clsid]);
             item_unlink_q(it);
             it->time = current_time;
             item_link_q(it);
+            pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
         }
     }
 }
 
-int do_item_replace(item *it, item *new_it) {
+int do_item_replace(item *it, item *new_it, const uint32_t hv) {
     MEMCACHED_ITEM_REPLACE(ITEM_key(it), it->nkey, it->nbytes,
                            ITEM_key(new_it), new_it->nkey, new_it->nbytes);
     assert((it->it_flags & ITEM_SLABBED) == 0);
 
-    do_item_unlink(it);
-    return do_item_link(new_it);
+    do_item_unlink(it, hv);
+    return do_item_link(new_it, hv);
 }
 
 /*@null@*/
@@ -402,13 +548,15 @@ char *do_item_cachedump(const unsigned int clsid, const unsigned int limit, unsi
     char key_temp[KEY_MAX_LENGTH + 1];
     char temp[512];
 
-    if (clsid > LARGEST_ID) return NULL;
-    it = heads[clsid];
+    if (clsid >= LARGEST_ID) return NULL;
 
     buffer = malloc((size_t)memlimit);
     if (buffer == 0) return NULL;
     bufcurr = 0;
 
+    pthread_mutex_lock(&lru_locks[clsid]);
+    it = heads[clsid];
+
     while (it != NULL && (limit == 0 || shown < limit)) {
         assert(it->nkey <= KEY_MAX_LENGTH);
         /* Copy the key since it may not be null-terminated in the struct */
@@ -425,6 +573,8 @@ char *do_item_cachedump(const unsigned int clsid, const unsigned int limit, unsi
         it = it->next;
     }
 
+    pthread_mutex_unlock(&lru_locks[clsid]);
+
     memcpy(buffer + bufcurr, "END\r\n", 6);
     bufcurr += 5;
 
@@ -435,22 +585,34 @@ char *do_item_cachedump(const unsigned int clsid, const unsigned int limit, unsi
 void do_item_stats(ADD_STAT add_stats, void *c) {
     int i;
     for (i = 0; i < LARGEST_ID; i++) {
+        unsigned int size = 0;
+        rel_time_t age = 0;
+        itemstats_t is;
+
+        pthread_mutex_lock(&lru_locks[i]);
         if (tails[i] != NULL) {
+            size = sizes[i];
+            age = tails[i]->time;
+            is = itemstats[i];
+        }
+        pthread_mutex_unlock(&lru_locks[i]);
+
+        if (size > 0) {
             const char *fmt = "items:%d:%s";
             char key_str[STAT_KEY_LEN];
             char val_str[STAT_VAL_LEN];
             int klen = 0, vlen = 0;
 
-            APPEND_NUM_FMT_STAT(fmt, i, "number", "%u", sizes[i]);
-            APPEND_NUM_FMT_STAT(fmt, i, "age", "%u", tails[i]->time);
+            APPEND_NUM_FMT_STAT(fmt, i, "number", "%u", size);
+            APPEND_NUM_FMT_STAT(fmt, i, "age", "%u", age);
             APPEND_NUM_FMT_STAT(fmt, i, "evicted",
-                                "%u", itemstats[i].evicted);
+                                "%u", is.evicted);
             APPEND_NUM_FMT_STAT(fmt, i, "evicted_time",
-                                "%u", itemstats[i].evicted_time);
+                                "%u", is.evicted_time);
             APPEND_NUM_FMT_STAT(fmt, i, "outofmemory",
-                                "%u", itemstats[i].outofmemory);
+                                "%u", is.outofmemory);
             APPEND_NUM_FMT_STAT(fmt, i, "tailrepairs",
-                                "%u", itemstats[i].tailrepairs);;
+                                "%u", is.tailrepairs);;
         }
     }
 
@@ -471,6 +633,7 @@ void do_item_stats_sizes(ADD_STAT add_stats, void *c) {
 
         /* build the histogram */
         for (i = 0; i < LARGEST_ID; i++) {
+            pthread_mutex_lock(&lru_locks[i]);
             item *iter = heads[i];
             while (iter) {
                 int ntotal = ITEM_ntotal(iter);
@@ -479,6 +642,7 @@ void do_item_stats_sizes(ADD_STAT add_stats, void *c) {
                 if (bucket < num_buckets) histogram[bucket]++;
                 iter = iter->next;
             }
+            pthread_mutex_unlock(&lru_locks[i]);
         }
 
         /* write the buffer */
@@ -497,8 +661,8 @@ void do_item_stats_sizes(ADD_STAT add_stats, void *c) {
 }
 
 /** wrapper around assoc_find which does the lazy expiration logic */
-item *do_item_get(const char *key, const size_t nkey) {
-    item *it = assoc_find(key, nkey);
+item *do_item_get(const char *key, const size_t nkey, const uint32_t hv) {
+    item *it = assoc_find(key, nkey, hv);
     int was_found = 0;
 
     if (settings.verbose > 2) {
@@ -512,7 +676,7 @@ item *do_item_get(const char *key, const size_t nkey) {
 
     if (it != NULL && settings.oldest_live != 0 && settings.oldest_live <= current_time &&
         it->time <= settings.oldest_live) {
-        do_item_unlink(it);           /* MTSAFE - cache_lock held */
+        do_item_unlink(it, hv);       /* MTSAFE - item lock held */
         it = NULL;
     }
 
@@ -522,7 +686,7 @@ item *do_item_get(const char *key, const size_t nkey) {
     }
 
     if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
-        do_item_unlink(it);           /* MTSAFE - cache_lock held */
+        do_item_unlink(it, hv);       /* MTSAFE - item lock held */
         it = NULL;
     }
 
@@ -543,8 +707,8 @@ item *do_item_get(const char *key, const size_t nkey) {
 }
 
 /** returns an item whether or not it's expired. */
-item *do_item_get_nocheck(const char *key, const size_t nkey) {
-    item *it = assoc_find(key, nkey);
+item *do_item_get_nocheck(const char *key, const size_t nkey, const uint32_t hv) {
+    item *it = assoc_find(key, nkey, hv);
     if (it) {
         it->refcount++;
         DEBUG_REFCNT(it, '+');
@@ -552,13 +716,15 @@ item *do_item_get_nocheck(const char *key, const size_t nkey) {
     return it;
 }
 
-/* expires items that are more recent than the oldest_live setting. */
+/* expires items that are more recent than the oldest_live setting.
+ * The caller holds every item lock (see item_lock_all()). */
 void do_item_flush_expired(void) {
     int i;
     item *iter, *next;
     if (settings.oldest_live == 0)
         return;
     for (i = 0; i < LARGEST_ID; i++) {
+        pthread_mutex_lock(&lru_locks[i]);
         /* The LRU is sorted in decreasing time order, and an item's timestamp
          * is never newer than its last access time, so we only need to walk
          * back until we hit an item older than the oldest_live time.
@@ -568,12 +734,70 @@ void do_item_flush_expired(void) {
             if (iter->time >= settings.oldest_live) {
                 next = iter->next;
                 if ((iter->it_flags & ITEM_SLABBED) == 0) {
-                    do_item_unlink(iter);
+                    do_item_unlink_nolock(iter,
+                                          hash(ITEM_key(iter), iter->nkey, 0));
                 }
             } else {
                 /* We've hit the first old item. Continue to the next queue. */
                 break;
             }
         }
+        pthread_mutex_unlock(&lru_locks[i]);
     }
 }
+
+/* Returns how often a slab class has had to evict or failed to allocate,
+ * which the slab rebalancer watches for classes short of pages. */
+uint64_t item_class_pressure(const unsigned int id) {
+    uint64_t n;
+
+    if (id >= LARGEST_ID) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&lru_locks[id]);
+    n = (uint64_t)itemstats[id].evicted + itemstats[id].outofmemory;
+    pthread_mutex_unlock(&lru_locks[id]);
+    return n;
+}
+
+/*
+ * Evicts the item in a chunk of a slab page that the slab rebalancer is
+ * taking away from class id.  Returns false if the chunk doesn't hold a
+ * linked item that nobody is using, so the rebalancer has to come back.
+ * The caller holds no locks.
+ */
+bool item_evict_chunk(item *it, const unsigned int id) {
+#ifdef MOXI_ITEM_MALLOC
+    (void)it;
+    (void)id;
+    return false;
+#else
+    bool evicted = false;
+
+    /* A linked item's key doesn't change, so the hash of what we read
+     * unlocked is only trusted once it's confirmed under the item lock. */
+    if ((__atomic_load_n(&it->it_flags, __ATOMIC_ACQUIRE) & ITEM_LINKED) == 0 ||
+        id >= LARGEST_ID) {
+        return false;
+    }
+
+    uint8_t nkey = it->nkey;
+    uint32_t hv = hash(ITEM_key(it), nkey, 0);
+
+    item_lock(hv);
+    if ((it->it_flags & ITEM_LINKED) != 0 &&
+        it->slabs_clsid == id && it->nkey == nkey &&
+        hash(ITEM_key(it), nkey, 0) == hv) {
+        pthread_mutex_lock(&lru_locks[id]);
+        if (it->refcount == 0) {
+            do_item_unlink_nolock(it, hv);
+            evicted = true;
+        }
+        pthread_mutex_unlock(&lru_locks[id]);
+    }
+    item_unlock(hv);
+
+    return evicted;
+#endif
+}
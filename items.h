@@ -7,11 +7,12 @@ item *do_item_alloc(char *key, const size_t nkey, const int flags, const rel_tim
 void item_free(item *it);
 bool item_size_ok(const size_t nkey, const int flags, const int nbytes);
 
-int  do_item_link(item *it);     /** may fail if transgresses limits */
-void do_item_unlink(item *it);
+int  do_item_link(item *it, const uint32_t hv);     /** may fail if transgresses limits */
+void do_item_unlink(item *it, const uint32_t hv);
 void do_item_remove(item *it);
+void do_item_ref(item *it);
 void do_item_update(item *it);   /** update LRU time to current and reposition */
-int  do_item_replace(item *it, item *new_it);
+int  do_item_replace(item *it, item *new_it, const uint32_t hv);
 
 /*@null@*/
 char *do_item_cachedump(const unsigned int slabs_clsid, const unsigned int limit, unsigned int *bytes);
@@ -20,7 +21,17 @@ void do_item_stats(ADD_STAT add_stats, void *c);
 void do_item_stats_sizes(ADD_STAT add_stats, void *c);
 void do_item_flush_expired(void);
 
-item *do_item_get(const char *key, const size_t nkey);
-item *do_item_get_nocheck(const char *key, const size_t nkey);
+item *do_item_get(const char *key, const size_t nkey, const uint32_t hv);
+item *do_item_get_nocheck(const char *key, const size_t nkey, const uint32_t hv);
 void item_stats_reset(void);
-extern pthread_mutex_t cache_lock;
+
+/* For the slab rebalancer (see slabs.c) */
+uint64_t item_class_pressure(const unsigned int id);
+bool item_evict_chunk(item *it, const unsigned int id);
+
+/* Item locks, striped by the assoc hash of the key (see items.c) */
+void item_lock(const uint32_t hv);
+bool item_trylock(const uint32_t hv);
+void item_unlock(const uint32_t hv);
+void item_lock_all(void);
+void item_unlock_all(void);
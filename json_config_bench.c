@@ -0,0 +1,314 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * Micro-benchmark of splitting a cluster config into its buckets'
+ * configs, which the main thread does on every config push.  It
+ * compares the json_scan way, which scans the config once in place
+ * and hands on each bucket's span of it, against the previous way,
+ * which parsed the config into a cJSON tree and printed each bucket
+ * back out with cJSON_Print().
+ *
+ * The config is either read from a file, or else a synthetic one of
+ * many buckets, each with a full vbucket map, like a big cluster's.
+ *
+ * Usage: json_config_bench [-b buckets] [-s servers] [-v vbuckets]
+ *                          [-r replicas] [-n iterations] [config_file]
+ */
+
+#include "config.h"
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "cJSON.h"
+#include "json_scan.h"
+
+static uint64_t bench_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((uint64_t) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+typedef struct {
+    char  *buf;
+    size_t len;
+    size_t size;
+} bench_buf;
+
+static void buf_printf(bench_buf *b, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+static void buf_printf(bench_buf *b, const char *fmt, ...) {
+    va_list ap;
+
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+
+        assert(n >= 0);
+        if ((size_t) n < b->size - b->len) {
+            b->len += n;
+            return;
+        }
+
+        b->size = b->size * 2 + n + 1024;
+        b->buf = realloc(b->buf, b->size);
+        assert(b->buf != NULL);
+    }
+}
+
+static char *make_config(int buckets, int servers, int vbuckets,
+                         int replicas) {
+    bench_buf b = { NULL, 0, 0 };
+
+    buf_printf(&b, "{\"buckets\":[");
+
+    for (int i = 0; i < buckets; i++) {
+        char name[32];
+        if (i == 0) {
+            snprintf(name, sizeof(name), "default");
+        } else {
+            snprintf(name, sizeof(name), "bucket-%d", i);
+        }
+
+        buf_printf(&b, "%s{\"name\":\"%s\",\"bucketType\":\"membase\","
+                   "\"authType\":\"sasl\",\"saslPassword\":\"\","
+                   "\"nodeLocator\":\"vbucket\",\"nodes\":[",
+                   i > 0 ? "," : "", name);
+
+        for (int s = 0; s < servers; s++) {
+            buf_printf(&b, "%s{\"hostname\":\"10.1.2.%d:8091\","
+                       "\"status\":\"healthy\",\"version\":\"1.8.0\","
+                       "\"ports\":{\"proxy\":11211,\"direct\":11210}}",
+                       s > 0 ? "," : "", s);
+        }
+
+        buf_printf(&b, "],\"vBucketServerMap\":{\"hashAlgorithm\":\"CRC\","
+                   "\"numReplicas\":%d,\"serverList\":[", replicas);
+
+        for (int s = 0; s < servers; s++) {
+            buf_printf(&b, "%s\"10.1.2.%d:11210\"", s > 0 ? "," : "", s);
+        }
+
+        buf_printf(&b, "],\"vBucketMap\":[");
+
+        for (int v = 0; v < vbuckets; v++) {
+            buf_printf(&b, "%s[%d", v > 0 ? "," : "", v % servers);
+            for (int r = 1; r <= replicas; r++) {
+                buf_printf(&b, ",%d", (v + r) % servers);
+            }
+            buf_printf(&b, "]");
+        }
+
+        buf_printf(&b, "]}}");
+    }
+
+    buf_printf(&b, "]}");
+
+    return b.buf;
+}
+
+// Stands in for cproxy_on_config_json_one(), which copies the config.
+//
+static size_t bench_sink;
+
+static void on_bucket(const char *config, const char *name) {
+    bench_sink += strlen(config) + strlen(name);
+}
+
+static int split_cjson(char *config) {
+    int n = 0;
+
+    cJSON *c = cJSON_Parse(config);
+    assert(c != NULL);
+
+    cJSON *jBuckets = cJSON_GetObjectItem(c, "buckets");
+    assert(jBuckets != NULL && jBuckets->type == cJSON_Array);
+
+    for (int pass = 0; pass < 2; pass++) {
+        int numBuckets = cJSON_GetArraySize(jBuckets);
+        for (int i = 0; i < numBuckets; i++) {
+            cJSON *jBucket = cJSON_GetArrayItem(jBuckets, i);
+            if (jBucket != NULL &&
+                jBucket->type == cJSON_Object) {
+                char *name = "default";
+
+                cJSON *jName = cJSON_GetObjectItem(jBucket, "name");
+                if (jName != NULL &&
+                    jName->type == cJSON_String &&
+                    jName->valuestring != NULL) {
+                    name = jName->valuestring;
+                }
+
+                bool is_default = (strcmp(name, "default") == 0);
+                if (!(is_default ^ (pass == 0))) {
+                    char *jBucketStr = cJSON_Print(jBucket);
+                    assert(jBucketStr != NULL);
+                    on_bucket(jBucketStr, name);
+                    free(jBucketStr);
+                    n++;
+                }
+            }
+        }
+    }
+
+    cJSON_Delete(c);
+
+    return n;
+}
+
+static int split_scan(char *config) {
+    int n = 0;
+
+    json_span c, jBuckets, jBucket;
+    bool ok = json_scan_doc(config, strlen(config), &c);
+    assert(ok);
+
+    ok = json_object_get(c, "buckets", &jBuckets);
+    assert(ok && json_scan_type(jBuckets) == JSON_ARRAY);
+
+    json_iter it;
+    int numBuckets = 0;
+
+    json_iter_init(&it, jBuckets);
+    while (json_iter_next(&it, NULL, &jBucket)) {
+        numBuckets++;
+    }
+
+    json_span *spans = calloc(numBuckets + 1, sizeof(json_span));
+    assert(spans != NULL);
+
+    json_iter_init(&it, jBuckets);
+    for (int i = 0; i < numBuckets; i++) {
+        json_iter_next(&it, NULL, &spans[i]);
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < numBuckets; i++) {
+            json_span jName;
+            char *name = NULL;
+
+            if (json_object_get(spans[i], "name", &jName)) {
+                name = json_string_dup(jName);
+            }
+
+            bool is_default = (name == NULL || strcmp(name, "default") == 0);
+            if (!(is_default ^ (pass == 0))) {
+                char *s = (char *) spans[i].ptr;
+                char saved = s[spans[i].len];
+
+                s[spans[i].len] = '\0';
+                on_bucket(s, name != NULL ? name : "default");
+                s[spans[i].len] = saved;
+                n++;
+            }
+
+            free(name);
+        }
+    }
+
+    free(spans);
+
+    return n;
+}
+
+static char *read_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    bench_buf b = { NULL, 0, 0 };
+    char chunk[65536];
+    size_t n;
+
+    buf_printf(&b, "%s", "");
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        buf_printf(&b, "%.*s", (int) n, chunk);
+    }
+
+    fclose(f);
+
+    return b.buf;
+}
+
+static void usage(void) {
+    printf("json_config_bench [-b buckets] [-s servers] [-v vbuckets]\n"
+           "                  [-r replicas] [-n iterations] [config_file]\n");
+}
+
+int main(int argc, char **argv) {
+    int buckets = 300;
+    int servers = 10;
+    int vbuckets = 1024;
+    int replicas = 1;
+    int iterations = 5;
+    int c;
+
+    while ((c = getopt(argc, argv, "b:s:v:r:n:h")) != -1) {
+        switch (c) {
+        case 'b':
+            buckets = atoi(optarg);
+            break;
+        case 's':
+            servers = atoi(optarg);
+            break;
+        case 'v':
+            vbuckets = atoi(optarg);
+            break;
+        case 'r':
+            replicas = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            usage();
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (buckets <= 0 || servers <= 0 || vbuckets <= 0 ||
+        replicas < 0 || iterations <= 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    char *config = optind < argc ?
+        read_file(argv[optind]) :
+        make_config(buckets, servers, vbuckets, replicas);
+
+    printf("json_config_bench: %zu byte config, %d iterations\n",
+           strlen(config), iterations);
+
+    uint64_t start = bench_usec();
+    int n_cjson = 0;
+    for (int i = 0; i < iterations; i++) {
+        n_cjson = split_cjson(config);
+    }
+    uint64_t cjson_usec = bench_usec() - start;
+
+    start = bench_usec();
+    int n_scan = 0;
+    for (int i = 0; i < iterations; i++) {
+        n_scan = split_scan(config);
+    }
+    uint64_t scan_usec = bench_usec() - start;
+
+    assert(n_cjson == n_scan);
+
+    printf("cJSON parse+print: %8.2f ms per config, %d buckets\n",
+           cjson_usec / 1000.0 / iterations, n_cjson);
+    printf("json_scan split:   %8.2f ms per config, %d buckets\n",
+           scan_usec / 1000.0 / iterations, n_scan);
+
+    free(config);
+
+    return 0;
+}
@@ -0,0 +1,510 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_scan.h"
+
+// Each scan_*() function takes the first byte of what it scans, and
+// returns the byte just past it, or NULL if it's not valid JSON.
+//
+static const char *scan_value(const char *p, const char *end, int depth);
+
+static const char *skip_ws(const char *p, const char *end) {
+    while (p < end &&
+           (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static const char *scan_string(const char *p, const char *end) {
+    assert(p < end && *p == '"');
+
+    for (p++; p < end; p++) {
+        unsigned char c = (unsigned char) *p;
+
+        if (c == '"') {
+            return p + 1;
+        }
+        if (c < 0x20) {
+            return NULL;
+        }
+        if (c == '\\') {
+            if (++p >= end) {
+                return NULL;
+            }
+            switch (*p) {
+            case '"': case '\\': case '/':
+            case 'b': case 'f': case 'n': case 'r': case 't':
+                break;
+            case 'u':
+                if (end - p < 5) {
+                    return NULL;
+                }
+                for (int i = 1; i <= 4; i++) {
+                    if (hex_digit(p[i]) < 0) {
+                        return NULL;
+                    }
+                }
+                p += 4;
+                break;
+            default:
+                return NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static const char *scan_digits(const char *p, const char *end) {
+    const char *start = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        p++;
+    }
+    return p > start ? p : NULL;
+}
+
+static const char *scan_number(const char *p, const char *end) {
+    if (*p == '-') {
+        p++;
+    }
+    if (p < end && *p == '0') {
+        p++;
+    } else if ((p = scan_digits(p, end)) == NULL) {
+        return NULL;
+    }
+    if (p < end && *p == '.') {
+        if ((p = scan_digits(p + 1, end)) == NULL) {
+            return NULL;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) {
+            p++;
+        }
+        if ((p = scan_digits(p, end)) == NULL) {
+            return NULL;
+        }
+    }
+    return p;
+}
+
+static const char *scan_literal(const char *p, const char *end,
+                                const char *lit) {
+    size_t n = strlen(lit);
+    if ((size_t) (end - p) < n ||
+        memcmp(p, lit, n) != 0) {
+        return NULL;
+    }
+    return p + n;
+}
+
+static const char *scan_container(const char *p, const char *end,
+                                  int depth) {
+    bool object = (*p == '{');
+    char close = object ? '}' : ']';
+
+    if (depth >= JSON_SCAN_DEPTH_MAX) {
+        return NULL;
+    }
+
+    p = skip_ws(p + 1, end);
+    if (p < end && *p == close) {
+        return p + 1;
+    }
+
+    while (p < end) {
+        if (object) {
+            if (*p != '"' ||
+                (p = scan_string(p, end)) == NULL) {
+                return NULL;
+            }
+            p = skip_ws(p, end);
+            if (p >= end || *p != ':') {
+                return NULL;
+            }
+            p = skip_ws(p + 1, end);
+        }
+
+        if ((p = scan_value(p, end, depth + 1)) == NULL) {
+            return NULL;
+        }
+
+        p = skip_ws(p, end);
+        if (p >= end) {
+            return NULL;
+        }
+        if (*p == close) {
+            return p + 1;
+        }
+        if (*p != ',') {
+            return NULL;
+        }
+        p = skip_ws(p + 1, end);
+    }
+
+    return NULL;
+}
+
+static const char *scan_value(const char *p, const char *end, int depth) {
+    if (p >= end) {
+        return NULL;
+    }
+
+    switch (*p) {
+    case '{':
+    case '[':
+        return scan_container(p, end, depth);
+    case '"':
+        return scan_string(p, end);
+    case 't':
+        return scan_literal(p, end, "true");
+    case 'f':
+        return scan_literal(p, end, "false");
+    case 'n':
+        return scan_literal(p, end, "null");
+    default:
+        if (*p == '-' || (*p >= '0' && *p <= '9')) {
+            return scan_number(p, end);
+        }
+        return NULL;
+    }
+}
+
+bool json_scan_doc(const char *buf, size_t len, json_span *out) {
+    assert(buf != NULL);
+    assert(out != NULL);
+
+    const char *end = buf + len;
+    const char *p = skip_ws(buf, end);
+    const char *v = scan_value(p, end, 0);
+
+    if (v == NULL ||
+        skip_ws(v, end) != end) {
+        return false;
+    }
+
+    out->ptr = p;
+    out->len = v - p;
+
+    return true;
+}
+
+json_type json_scan_type(json_span v) {
+    if (v.ptr == NULL || v.len == 0) {
+        return JSON_NONE;
+    }
+
+    switch (v.ptr[0]) {
+    case '{': return JSON_OBJECT;
+    case '[': return JSON_ARRAY;
+    case '"': return JSON_STRING;
+    case 't': return JSON_TRUE;
+    case 'f': return JSON_FALSE;
+    case 'n': return JSON_NULL;
+    default:  return JSON_NUMBER;
+    }
+}
+
+// Skips a value that json_scan_doc() already checked, which only has
+// to track strings and nesting.
+//
+static const char *skip_value(const char *p, const char *end) {
+    int depth = 0;
+
+    do {
+        switch (*p) {
+        case '"':
+            for (p++; *p != '"'; p++) {
+                if (*p == '\\') {
+                    p++;
+                }
+            }
+            p++;
+            break;
+        case '{':
+        case '[':
+            depth++;
+            p++;
+            break;
+        case '}':
+        case ']':
+            depth--;
+            p++;
+            break;
+        default:
+            if (depth == 0) {
+                // A number or literal, which ends at a delimiter.
+                //
+                while (p < end &&
+                       *p != ',' && *p != '}' && *p != ']' &&
+                       *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+                    p++;
+                }
+                return p;
+            }
+            p++;
+            break;
+        }
+    } while (depth > 0 && p < end);
+
+    return p;
+}
+
+bool json_iter_init(json_iter *it, json_span container) {
+    json_type t = json_scan_type(container);
+    if (t != JSON_OBJECT && t != JSON_ARRAY) {
+        return false;
+    }
+
+    it->pos    = container.ptr + 1;
+    it->end    = container.ptr + container.len - 1;
+    it->object = (t == JSON_OBJECT);
+
+    return true;
+}
+
+bool json_iter_next(json_iter *it, json_span *key, json_span *val) {
+    const char *p = skip_ws(it->pos, it->end);
+    const char *q;
+
+    if (p < it->end && *p == ',') {
+        p = skip_ws(p + 1, it->end);
+    }
+    if (p >= it->end) {
+        return false;
+    }
+
+    if (it->object) {
+        q = skip_value(p, it->end);
+        if (key != NULL) {
+            key->ptr = p;
+            key->len = q - p;
+        }
+        p = skip_ws(q, it->end);
+        p = skip_ws(p + 1, it->end); // The ':'.
+    } else if (key != NULL) {
+        key->ptr = NULL;
+        key->len = 0;
+    }
+
+    q = skip_value(p, it->end);
+
+    val->ptr = p;
+    val->len = q - p;
+    it->pos  = q;
+
+    return true;
+}
+
+bool json_object_get(json_span obj, const char *name, json_span *val) {
+    json_iter it;
+    json_span key;
+
+    if (json_scan_type(obj) != JSON_OBJECT ||
+        !json_iter_init(&it, obj)) {
+        return false;
+    }
+
+    while (json_iter_next(&it, &key, val)) {
+        if (json_string_equals(key, name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Where the unescaped bytes of a string go: into a buffer, or else
+// compared against another string.
+//
+typedef struct {
+    char       *buf;
+    size_t      size;
+    const char *cmp;
+    size_t      n;
+    bool        same;
+} json_sink;
+
+static void sink_put(json_sink *k, char c) {
+    if (k->cmp != NULL) {
+        if (k->same &&
+            (c == '\0' || k->cmp[k->n] != c)) {
+            k->same = false;
+        }
+    } else if (k->n < k->size) {
+        k->buf[k->n] = c;
+    }
+    k->n++;
+}
+
+static void sink_put_utf8(json_sink *k, uint32_t cp) {
+    if (cp < 0x80) {
+        sink_put(k, (char) cp);
+    } else if (cp < 0x800) {
+        sink_put(k, (char) (0xc0 | (cp >> 6)));
+        sink_put(k, (char) (0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        sink_put(k, (char) (0xe0 | (cp >> 12)));
+        sink_put(k, (char) (0x80 | ((cp >> 6) & 0x3f)));
+        sink_put(k, (char) (0x80 | (cp & 0x3f)));
+    } else {
+        sink_put(k, (char) (0xf0 | (cp >> 18)));
+        sink_put(k, (char) (0x80 | ((cp >> 12) & 0x3f)));
+        sink_put(k, (char) (0x80 | ((cp >> 6) & 0x3f)));
+        sink_put(k, (char) (0x80 | (cp & 0x3f)));
+    }
+}
+
+static uint32_t hex4(const char *p) {
+    return (hex_digit(p[0]) << 12) | (hex_digit(p[1]) << 8) |
+           (hex_digit(p[2]) << 4) | hex_digit(p[3]);
+}
+
+/* Unescapes a string value, which was already checked by the scan,
+ * into the sink. */
+static bool unescape(json_span v, json_sink *k) {
+    if (json_scan_type(v) != JSON_STRING ||
+        v.len < 2) {
+        return false;
+    }
+
+    const char *p = v.ptr + 1;
+    const char *end = v.ptr + v.len - 1;
+
+    while (p < end) {
+        if (*p != '\\') {
+            sink_put(k, *p++);
+            continue;
+        }
+
+        p++;
+        switch (*p++) {
+        case 'b': sink_put(k, '\b'); break;
+        case 'f': sink_put(k, '\f'); break;
+        case 'n': sink_put(k, '\n'); break;
+        case 'r': sink_put(k, '\r'); break;
+        case 't': sink_put(k, '\t'); break;
+        case 'u': {
+            uint32_t cp = hex4(p);
+            p += 4;
+            if (cp >= 0xd800 && cp < 0xdc00 &&
+                end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                uint32_t lo = hex4(p + 2);
+                if (lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    p += 6;
+                }
+            }
+            sink_put_utf8(k, cp);
+            break;
+        }
+        default:
+            sink_put(k, p[-1]); // The '"', '\\' or '/'.
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool json_string_equals(json_span v, const char *s) {
+    json_sink k = { .cmp = s, .same = true };
+
+    return unescape(v, &k) && k.same && s[k.n] == '\0';
+}
+
+bool json_string_copy(json_span v, char *buf, size_t buf_size) {
+    json_sink k = { .buf = buf, .size = buf_size };
+
+    if (!unescape(v, &k) ||
+        k.n >= buf_size) {
+        return false;
+    }
+
+    buf[k.n] = '\0';
+
+    return true;
+}
+
+char *json_string_dup(json_span v) {
+    if (json_scan_type(v) != JSON_STRING) {
+        return NULL;
+    }
+
+    // Unescaping never makes a string longer than its quoted form.
+    //
+    char *s = malloc(v.len);
+    if (s != NULL &&
+        !json_string_copy(v, s, v.len)) {
+        free(s);
+        s = NULL;
+    }
+
+    return s;
+}
+
+bool json_int(json_span v, long *out) {
+    const char *p = v.ptr;
+    const char *end = v.ptr + v.len;
+    bool neg = false;
+    unsigned long n = 0;
+
+    if (json_scan_type(v) != JSON_NUMBER) {
+        return false;
+    }
+
+    if (*p == '-') {
+        neg = true;
+        p++;
+    }
+
+    if (p >= end) {
+        return false;
+    }
+
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+
+        unsigned long d = *p - '0';
+        if (n > (ULONG_MAX - d) / 10) {
+            return false;
+        }
+        n = n * 10 + d;
+    }
+
+    if (neg) {
+        if (n > (unsigned long) LONG_MAX + 1) {
+            return false;
+        }
+        *out = n == (unsigned long) LONG_MAX + 1 ? LONG_MIN : -(long) n;
+    } else {
+        if (n > (unsigned long) LONG_MAX) {
+            return false;
+        }
+        *out = (long) n;
+    }
+
+    return true;
+}
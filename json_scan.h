@@ -0,0 +1,99 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef JSON_SCAN_H
+#define JSON_SCAN_H 1
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * A single pass JSON scanner, which finds values in a document in
+     * place instead of building a tree of them, as cJSON does.  A value
+     * is just a span of the document's text, so a member of a big
+     * document, like one bucket of a cluster config, can be used as a
+     * JSON document of its own without printing it back out.
+     *
+     * json_scan_doc() checks the whole document once.  The other
+     * functions only take spans that came from it, and never allocate
+     * memory, except for json_string_dup().
+     */
+
+#define JSON_SCAN_DEPTH_MAX 64
+
+    typedef enum {
+        JSON_NONE = 0,
+        JSON_OBJECT,
+        JSON_ARRAY,
+        JSON_STRING,
+        JSON_NUMBER,
+        JSON_TRUE,
+        JSON_FALSE,
+        JSON_NULL
+    } json_type;
+
+    typedef struct {
+        const char *ptr; // The value's first byte in the document.
+        size_t      len;
+    } json_span;
+
+    /**
+     * Checks that buf holds exactly one JSON value, with optional
+     * whitespace around it, and returns the span of the value.
+     * Returns false if it's not valid JSON, or nests deeper than
+     * JSON_SCAN_DEPTH_MAX.
+     */
+    bool json_scan_doc(const char *buf, size_t len, json_span *out);
+
+    json_type json_scan_type(json_span v);
+
+    typedef struct {
+        const char *pos;
+        const char *end;    // The container's closing bracket.
+        bool        object;
+    } json_iter;
+
+    /**
+     * Iterates over the members of an object or the elements of an
+     * array.  For an object, key is the span of each member's name,
+     * quotes included; for an array, key may be NULL.
+     */
+    bool json_iter_init(json_iter *it, json_span container);
+
+    bool json_iter_next(json_iter *it, json_span *key, json_span *val);
+
+    /**
+     * Finds the first member of an object with the given name.
+     */
+    bool json_object_get(json_span obj, const char *name, json_span *val);
+
+    /**
+     * Compares a string value, unescaped, to s.
+     */
+    bool json_string_equals(json_span v, const char *s);
+
+    /**
+     * Unescapes a string value into buf, zero terminated.  Returns
+     * false if v isn't a string or doesn't fit in buf.
+     */
+    bool json_string_copy(json_span v, char *buf, size_t buf_size);
+
+    /**
+     * Returns a malloc'ed, unescaped copy of a string value, or NULL.
+     */
+    char *json_string_dup(json_span v);
+
+    /**
+     * Reads an integer value.  Returns false if v isn't an integer
+     * or doesn't fit in a long.
+     */
+    bool json_int(json_span v, long *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
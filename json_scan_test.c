@@ -0,0 +1,129 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <json_scan.h>
+
+static bool scan(const char *s, json_span *out) {
+    return json_scan_doc(s, strlen(s), out);
+}
+
+static void testValid(void) {
+    json_span v;
+
+    assert(scan("{}", &v) && json_scan_type(v) == JSON_OBJECT);
+    assert(scan(" [ ] ", &v) && json_scan_type(v) == JSON_ARRAY);
+    assert(v.len == 3 && v.ptr[0] == '[');
+    assert(scan("\"a\\\"b\\u00e9\"", &v) && json_scan_type(v) == JSON_STRING);
+    assert(scan("-0.5e+10", &v) && json_scan_type(v) == JSON_NUMBER);
+    assert(scan("true", &v) && json_scan_type(v) == JSON_TRUE);
+    assert(scan("false", &v) && json_scan_type(v) == JSON_FALSE);
+    assert(scan("null", &v) && json_scan_type(v) == JSON_NULL);
+    assert(scan("{\"a\":[1,{\"b\":null}],\"c\":\"d\"}\n", &v));
+}
+
+static void testInvalid(void) {
+    json_span v;
+
+    assert(!scan("", &v));
+    assert(!scan("{", &v));
+    assert(!scan("{\"a\"}", &v));
+    assert(!scan("{\"a\":1,}", &v));
+    assert(!scan("[1 2]", &v));
+    assert(!scan("[1] x", &v));
+    assert(!scan("01", &v));
+    assert(!scan("1.", &v));
+    assert(!scan("\"a\\x\"", &v));
+    assert(!scan("\"a\nb\"", &v));
+    assert(!scan("\"\\u12g4\"", &v));
+    assert(!scan("tru", &v));
+
+    char deep[2 * JSON_SCAN_DEPTH_MAX + 3];
+    memset(deep, '[', JSON_SCAN_DEPTH_MAX + 1);
+    memset(deep + JSON_SCAN_DEPTH_MAX + 1, ']', JSON_SCAN_DEPTH_MAX + 1);
+    deep[2 * JSON_SCAN_DEPTH_MAX + 2] = '\0';
+    assert(!scan(deep, &v));
+    deep[2 * JSON_SCAN_DEPTH_MAX + 1] = '\0';
+    assert(scan(deep + 1, &v));
+}
+
+static void testMembers(void) {
+    const char *doc =
+        "{\"buckets\": [ {\"name\":\"b\\u0031\", \"x\":[1,2]},"
+        " {\"name\":\"default\"}, 7 ],"
+        " \"n\": -42, \"big\": 99999999999999999999999,"
+        " \"esc\\\"key\": \"\\ud83d\\ude00/\\/\"}";
+    json_span c, v, key;
+    char buf[100];
+    long n;
+
+    assert(scan(doc, &c));
+
+    assert(json_object_get(c, "n", &v));
+    assert(json_int(v, &n) && n == -42);
+    assert(json_object_get(c, "big", &v));
+    assert(!json_int(v, &n));
+    assert(!json_object_get(c, "missing", &v));
+
+    assert(json_object_get(c, "esc\"key", &v));
+    assert(json_string_copy(v, buf, sizeof(buf)));
+    assert(strcmp(buf, "\xf0\x9f\x98\x80//") == 0);
+    assert(!json_string_copy(v, buf, 6));
+    assert(json_string_copy(v, buf, 7));
+
+    assert(json_object_get(c, "buckets", &v));
+    assert(json_scan_type(v) == JSON_ARRAY);
+
+    json_iter it;
+    json_span elem;
+    int i = 0;
+
+    assert(json_iter_init(&it, v));
+    while (json_iter_next(&it, &key, &elem)) {
+        assert(key.ptr == NULL);
+        if (i == 0) {
+            json_span name;
+            assert(json_object_get(elem, "name", &name));
+            assert(json_string_equals(name, "b1"));
+            assert(!json_string_equals(name, "b"));
+            assert(!json_string_equals(name, "b12"));
+
+            char *s = json_string_dup(name);
+            assert(s != NULL && strcmp(s, "b1") == 0);
+            free(s);
+
+            // A member is a document of its own, as is.
+            //
+            json_span again;
+            assert(json_scan_doc(elem.ptr, elem.len, &again));
+            assert(again.len == elem.len);
+        } else if (i == 1) {
+            assert(elem.len == strlen("{\"name\":\"default\"}"));
+        } else {
+            assert(json_int(elem, &n) && n == 7);
+        }
+        i++;
+    }
+    assert(i == 3);
+
+    json_span empty;
+    assert(scan("{ }", &empty));
+    assert(json_iter_init(&it, empty));
+    assert(!json_iter_next(&it, &key, &elem));
+
+    assert(json_object_get(c, "n", &v));
+    assert(!json_iter_init(&it, v));
+}
+
+int main(void) {
+    testValid();
+    testInvalid();
+    testMembers();
+
+    return 0;
+}
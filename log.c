@@ -11,6 +11,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <time.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -45,10 +46,7 @@
 int log_error_open(moxi_log *mlog) {
     assert(mlog);
 
-    if (!mlog->logbuf) {
-        mlog->logbuf = calloc(1, MAX_LOGBUF_LEN + 1);
-        mlog->logbuf_used = 0;
-    }
+    pthread_mutex_init(&mlog->rings_lock, NULL);
 
     if (mlog->log_mode == ERRORLOG_FILE) {
         const char *logfile = mlog->log_file;
@@ -139,101 +137,515 @@ int log_error_close(moxi_log *mlog) {
     return 0;
 }
 
+// A single producer, single consumer ring of log lines, each line a
+// uint32_t length followed by its bytes, that can wrap around the end
+// of buf.  Only the owning thread moves head and only the writer
+// thread moves tail.
+//
+#define LOG_RING_SIZE (256 * 1024) // Must be a power of 2.
+
+#define LOG_WRITER_IDLE_USEC 2000 // Without a wakeup pipe.
+#define LOG_WRITER_BATCH     (64 * 1024)
+
+typedef struct log_ring log_ring;
+
+struct log_ring {
+    log_ring *next;    // In mlog->rings, never removed.
+    int       orphan;  // Set when the owning thread exits.
+    uint64_t  dropped; // Only written by the owning thread.
+    uint64_t  head;    // Only written by the owning thread.
+    char      pad[64]; // Keeps tail off head's cache line.
+    uint64_t  tail;    // Only written by the writer thread.
+    time_t    ts_last; // Timestamp cache of the owning thread.
+    char      ts_str[64];
+    char      buf[LOG_RING_SIZE];
+};
+
+struct log_line {
+    char buf[MAX_LOGBUF_LEN + 1];
+    int  used;
+};
+
 static inline
-void mappend_log(moxi_log *mlog, const char *str) {
+void mappend_log(struct log_line *l, const char *str) {
     int str_len = strlen(str);
-    if (mlog->logbuf_used + str_len >= MAX_LOGBUF_LEN)
-        str_len = MAX_LOGBUF_LEN - 1 - mlog->logbuf_used;
+    if (l->used + str_len >= MAX_LOGBUF_LEN)
+        str_len = MAX_LOGBUF_LEN - 1 - l->used;
     if (str_len <= 0)
         return;
-    memcpy(mlog->logbuf + mlog->logbuf_used, str, str_len);
-    mlog->logbuf_used += str_len;
-    assert(mlog->logbuf_used < MAX_LOGBUF_LEN);
+    memcpy(l->buf + l->used, str, str_len);
+    l->used += str_len;
+    assert(l->used < MAX_LOGBUF_LEN);
 }
 
 static inline
-void mappend_log_int(moxi_log *mlog, int num) {
+void mappend_log_int(struct log_line *l, int num) {
     char buf[32];
     snprintf(buf, sizeof(buf), "%d", num);
-    mappend_log(mlog, buf);
+    mappend_log(l, buf);
 }
 
-int log_error_write(moxi_log *mlog, const char *filename, unsigned int line, const char *fmt, ...) {
-    va_list ap;
-    static char ts_debug_str[255];
-    int written = 0;
+// Formats now into ts_str, unless it already holds the time of ts_last.
+//
+static void log_timestamp(time_t *ts_last, char *ts_str, size_t ts_len) {
+    time_t now = time(NULL);
+
+    if (now != *ts_last || ts_str[0] == '\0') {
+        struct tm tm;
+
+        ts_str[0] = '\0';
+        strftime(ts_str, ts_len, "%Y-%m-%d %H:%M:%S",
+                 localtime_r(&now, &tm));
+        *ts_last = now;
+    }
+}
+
+// Starts a line with its timestamp and source location.  A thread
+// with a ring caches its timestamp there, as localtime_r() may take a
+// process wide lock.
+//
+static void log_line_header(moxi_log *mlog, struct log_line *l,
+                            log_ring *r,
+                            const char *filename, unsigned int line) {
+    time_t ts_last = 0;
+    char ts_buf[64];
 
-    mlog->logbuf_used = 0;
+    l->used = 0;
 
     switch(mlog->log_mode) {
         case ERRORLOG_FILE:
         case ERRORLOG_STDERR:
-            /* cache the generated timestamp */
-            if (!mlog->cur_ts) {
-                mlog->cur_ts = time(NULL);
+            if (r != NULL) {
+                log_timestamp(&r->ts_last, r->ts_str, sizeof(r->ts_str));
+                mappend_log(l, r->ts_str);
+            } else {
+                ts_buf[0] = '\0';
+                log_timestamp(&ts_last, ts_buf, sizeof(ts_buf));
+                mappend_log(l, ts_buf);
             }
-
-            if (mlog->cur_ts != mlog->last_generated_debug_ts) {
-                memset(ts_debug_str, 0, sizeof(ts_debug_str));
-                strftime(ts_debug_str, 254, "%Y-%m-%d %H:%M:%S", localtime(&(mlog->cur_ts)));
-                mlog->last_generated_debug_ts = mlog->cur_ts;
-            }
-
-            mappend_log(mlog, ts_debug_str);
-
-            /*mappend_log(zl, ts_debug_str)*/
-            mappend_log(mlog, ": (");
+            mappend_log(l, ": (");
             break;
 #ifdef HAVE_SYSLOG_H
         case ERRORLOG_SYSLOG:
-            memset(mlog->logbuf, 0,  MAX_LOGBUF_LEN);
             /* syslog is generating its own timestamps */
-            mappend_log(mlog, "(");
+            mappend_log(l, "(");
             break;
 #endif
     }
 
-    mappend_log(mlog, filename);
-    mappend_log(mlog, ".");
-    mappend_log_int(mlog, line);
-    mappend_log(mlog, ") ");
+    mappend_log(l, filename);
+    mappend_log(l, ".");
+    mappend_log_int(l, line);
+    mappend_log(l, ") ");
+}
+
+static pthread_key_t  log_ring_key;
+static pthread_once_t log_ring_key_once = PTHREAD_ONCE_INIT;
 
-    assert(mlog->logbuf_used < MAX_LOGBUF_LEN);
+static void log_ring_orphan(void *arg) {
+    log_ring *r = arg;
+    __atomic_store_n(&r->orphan, 1, __ATOMIC_RELEASE);
+}
 
-    va_start(ap, fmt);
-    mlog->logbuf_used +=
-        vsnprintf((mlog->logbuf + mlog->logbuf_used), (MAX_LOGBUF_LEN - mlog->logbuf_used - 1), fmt, ap);
-    va_end(ap);
+static void log_ring_key_create(void) {
+    pthread_key_create(&log_ring_key, log_ring_orphan);
+}
+
+// Returns the calling thread's ring, registering one the first time
+// the thread logs, or NULL if there's no memory for one.
+//
+static log_ring *log_ring_get(moxi_log *mlog) {
+    pthread_once(&log_ring_key_once, log_ring_key_create);
+
+    log_ring *r = pthread_getspecific(log_ring_key);
+    if (r != NULL) {
+        return r;
+    }
+
+    pthread_mutex_lock(&mlog->rings_lock);
+
+    // Reuse the ring of an exited thread, so short lived threads
+    // don't leak rings.
+    //
+    for (r = mlog->rings; r != NULL; r = r->next) {
+        if (__atomic_load_n(&r->orphan, __ATOMIC_ACQUIRE)) {
+            r->orphan = 0;
+            break;
+        }
+    }
+
+    if (r == NULL) {
+        r = calloc(1, sizeof(log_ring));
+        if (r != NULL) {
+            r->next = mlog->rings;
+            __atomic_store_n(&mlog->rings, r, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_unlock(&mlog->rings_lock);
+
+    if (r != NULL) {
+        pthread_setspecific(log_ring_key, r);
+    }
+
+    return r;
+}
+
+static void log_ring_copy_in(log_ring *r, uint64_t pos,
+                             const char *src, uint32_t len) {
+    uint32_t off = pos & (LOG_RING_SIZE - 1);
+    uint32_t first = LOG_RING_SIZE - off;
+    if (first > len) {
+        first = len;
+    }
+
+    memcpy(r->buf + off, src, first);
+    memcpy(r->buf, src + first, len - first);
+}
 
-    /* vsprintf returns total string length, so no buffer overflow is
-     * possible, but we can shoot logbuf_used past MAX_LOGBUF_LEN */
-    if (mlog->logbuf_used >= MAX_LOGBUF_LEN) {
-        mlog->logbuf_used = MAX_LOGBUF_LEN - 1;
+static void log_ring_copy_out(log_ring *r, uint64_t pos,
+                              char *dst, uint32_t len) {
+    uint32_t off = pos & (LOG_RING_SIZE - 1);
+    uint32_t first = LOG_RING_SIZE - off;
+    if (first > len) {
+        first = len;
     }
 
-    if (mlog->logbuf_used > 1) {
-        mlog->logbuf[mlog->logbuf_used - 1] = '\n';
+    memcpy(dst, r->buf + off, first);
+    memcpy(dst + first, r->buf, len - first);
+}
+
+// Wakes the writer thread if it's waiting for lines.  Only the caller
+// that clears writer_sleeping writes to the pipe, so a burst of lines
+// costs one write().  Safe from a signal handler.
+//
+static void log_writer_wake(moxi_log *mlog) {
+    if (__atomic_exchange_n(&mlog->writer_sleeping, 0, __ATOMIC_SEQ_CST)) {
+        char c = 0;
+
+        if (write(mlog->wake_fds[1], &c, 1) < 0) {
+            // The pipe's full, so the writer has a wakeup pending.
+        }
+    }
+}
+
+// Called only by the owning thread.  Drops the line, rather than
+// waiting for the writer thread, when the ring is full.
+//
+static void log_ring_push(moxi_log *mlog, log_ring *r,
+                          const char *line, uint32_t len) {
+    uint64_t head = r->head;
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    if (LOG_RING_SIZE - (head - tail) < sizeof(len) + len) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_ring_copy_in(r, head, (const char *) &len, sizeof(len));
+    log_ring_copy_in(r, head + sizeof(len), line, len);
+
+    __atomic_store_n(&r->head, head + sizeof(len) + len, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in log_writer_wait(), so either the writer
+    // sees our line before it sleeps, or we see that it's sleeping.
+    //
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&mlog->writer_sleeping, __ATOMIC_RELAXED)) {
+        log_writer_wake(mlog);
     }
+}
 
-    assert(mlog->logbuf_used < MAX_LOGBUF_LEN);
-    mlog->logbuf[mlog->logbuf_used] = '\0';
+static void log_output(moxi_log *mlog, const char *buf, int len) {
+    int written = 0;
 
     switch(mlog->log_mode) {
         case ERRORLOG_FILE:
-            written = write(mlog->fd, mlog->logbuf, mlog->logbuf_used);
+            written = write(mlog->fd, buf, len);
             break;
         case ERRORLOG_STDERR:
-            written = write(STDERR_FILENO, mlog->logbuf, mlog->logbuf_used);
+            written = write(STDERR_FILENO, buf, len);
             break;
 #ifdef HAVE_SYSLOG_H
         case ERRORLOG_SYSLOG:
-            syslog(LOG_ERR, "%s", mlog->logbuf);
+            syslog(LOG_ERR, "%.*s", len, buf);
             break;
 #endif
     }
 
+    (void) written;
+}
+
+struct log_batch {
+    int  used;
+    char buf[LOG_WRITER_BATCH];
+};
+
+static void log_batch_flush(moxi_log *mlog, struct log_batch *b) {
+    if (b->used > 0) {
+        log_output(mlog, b->buf, b->used);
+        b->used = 0;
+    }
+}
+
+static void log_batch_add(moxi_log *mlog, struct log_batch *b,
+                          const char *line, int len) {
+    // Syslog wants a call per line.
+    //
+    if (mlog->log_mode == ERRORLOG_SYSLOG) {
+        log_output(mlog, line, len);
+        return;
+    }
+
+    if (b->used + len > LOG_WRITER_BATCH) {
+        log_batch_flush(mlog, b);
+    }
+
+    memcpy(b->buf + b->used, line, len);
+    b->used += len;
+}
+
+// Called only by the writer thread, or at exit once the writer
+// thread has stopped.  Returns the number of lines drained.
+//
+static int log_rings_drain(moxi_log *mlog, struct log_batch *b) {
+    char line[MAX_LOGBUF_LEN];
+    uint64_t dropped = 0;
+    int n = 0;
+
+    for (log_ring *r = __atomic_load_n(&mlog->rings, __ATOMIC_ACQUIRE);
+         r != NULL;
+         r = r->next) {
+        uint64_t tail = r->tail;
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+        while (tail < head) {
+            uint32_t len;
+
+            log_ring_copy_out(r, tail, (char *) &len, sizeof(len));
+            assert(len < sizeof(line));
+            log_ring_copy_out(r, tail + sizeof(len), line, len);
+            tail += sizeof(len) + len;
+
+            log_batch_add(mlog, b, line, len);
+            n++;
+        }
+
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+
+    uint64_t prev = __atomic_load_n(&mlog->dropped, __ATOMIC_RELAXED);
+    if (dropped > prev) {
+        struct log_line l;
+
+        log_line_header(mlog, &l, NULL, __FILE__, __LINE__);
+        l.used += snprintf(l.buf + l.used, MAX_LOGBUF_LEN - l.used,
+                           "dropped %llu log lines, total %llu\n",
+                           (unsigned long long) (dropped - prev),
+                           (unsigned long long) dropped);
+        if (l.used < MAX_LOGBUF_LEN) {
+            log_batch_add(mlog, b, l.buf, l.used);
+        }
+
+        __atomic_store_n(&mlog->dropped, dropped, __ATOMIC_RELAXED);
+    }
+
+    log_batch_flush(mlog, b);
+
+    return n;
+}
+
+static int log_rings_pending(moxi_log *mlog) {
+    for (log_ring *r = __atomic_load_n(&mlog->rings, __ATOMIC_ACQUIRE);
+         r != NULL;
+         r = r->next) {
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail) {
+            return 1;
+        }
+    }
+
     return 0;
 }
 
+// Called only by the writer thread once the rings are empty.  Blocks
+// until a line is pushed, a cycle is requested or the writer's asked
+// to stop, so an idle log doesn't wake the writer at all.
+//
+static void log_writer_wait(moxi_log *mlog) {
+    if (mlog->wake_fds[0] < 0) {
+        usleep(LOG_WRITER_IDLE_USEC);
+        return;
+    }
+
+    __atomic_store_n(&mlog->writer_sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!log_rings_pending(mlog) &&
+        !__atomic_load_n(&mlog->cycle_requested, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&mlog->writer_running, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = {
+            .fd     = mlog->wake_fds[0],
+            .events = POLLIN
+        };
+
+        poll(&pfd, 1, -1);
+    }
+
+    __atomic_store_n(&mlog->writer_sleeping, 0, __ATOMIC_SEQ_CST);
+
+    char buf[64];
+    while (read(mlog->wake_fds[0], buf, sizeof(buf)) > 0) {
+        // Drain the wakeups.
+    }
+}
+
+static void *log_writer_main(void *arg) {
+    moxi_log *mlog = arg;
+    struct log_batch *b = malloc(sizeof(struct log_batch));
+    assert(b != NULL);
+
+    b->used = 0;
+
+    while (__atomic_load_n(&mlog->writer_running, __ATOMIC_ACQUIRE)) {
+        if (__atomic_exchange_n(&mlog->cycle_requested, 0,
+                                __ATOMIC_ACQ_REL)) {
+            log_rings_drain(mlog, b);
+            log_error_cycle(mlog);
+        }
+
+        if (log_rings_drain(mlog, b) == 0) {
+            log_writer_wait(mlog);
+        }
+    }
+
+    log_rings_drain(mlog, b);
+    free(b);
+
+    return NULL;
+}
+
+static moxi_log *log_atexit_mlog;
+
+static void log_writer_close_pipe(moxi_log *mlog) {
+    for (int i = 0; i < 2; i++) {
+        if (mlog->wake_fds[i] >= 0) {
+            close(mlog->wake_fds[i]);
+        }
+        mlog->wake_fds[i] = -1;
+    }
+}
+
+static void log_error_atexit(void) {
+    log_error_stop_writer(log_atexit_mlog);
+}
+
+int log_error_start_writer(moxi_log *mlog) {
+    assert(mlog);
+
+    if (mlog->writer_running) {
+        return 0;
+    }
+
+    // Without a wakeup pipe, the writer falls back to polling.
+    //
+    if (pipe(mlog->wake_fds) != 0 ||
+        fcntl(mlog->wake_fds[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(mlog->wake_fds[1], F_SETFL, O_NONBLOCK) != 0) {
+        log_writer_close_pipe(mlog);
+    }
 
+    mlog->writer_sleeping = 0;
 
+    __atomic_store_n(&mlog->writer_running, 1, __ATOMIC_RELEASE);
+
+    int rc = pthread_create(&mlog->writer_tid, NULL, log_writer_main, mlog);
+    if (rc != 0) {
+        __atomic_store_n(&mlog->writer_running, 0, __ATOMIC_RELEASE);
+        log_writer_close_pipe(mlog);
+        log_error_write(mlog, __FILE__, __LINE__,
+                        "could not start log writer thread: %s, "
+                        "logging synchronously\n", strerror(rc));
+        return -1;
+    }
+
+    if (log_atexit_mlog == NULL) {
+        log_atexit_mlog = mlog;
+        atexit(log_error_atexit);
+    }
+
+    return 0;
+}
+
+void log_error_stop_writer(moxi_log *mlog) {
+    if (mlog == NULL ||
+        !__atomic_load_n(&mlog->writer_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&mlog->writer_running, 0, __ATOMIC_SEQ_CST);
+    log_writer_wake(mlog);
+
+    pthread_join(mlog->writer_tid, NULL);
+
+    log_writer_close_pipe(mlog);
+}
+
+void log_error_request_cycle(moxi_log *mlog) {
+    if (mlog->writer_running) {
+        __atomic_store_n(&mlog->cycle_requested, 1, __ATOMIC_SEQ_CST);
+        log_writer_wake(mlog);
+    } else {
+        log_error_cycle(mlog);
+    }
+}
+
+uint64_t log_error_dropped(moxi_log *mlog) {
+    return mlog != NULL ? __atomic_load_n(&mlog->dropped, __ATOMIC_RELAXED) : 0;
+}
+
+int log_error_write(moxi_log *mlog, const char *filename, unsigned int line, const char *fmt, ...) {
+    va_list ap;
+    struct log_line l;
+    log_ring *r = NULL;
+    int n;
+
+    if (__atomic_load_n(&mlog->writer_running, __ATOMIC_ACQUIRE)) {
+        r = log_ring_get(mlog);
+    }
+
+    log_line_header(mlog, &l, r, filename, line);
+
+    assert(l.used < MAX_LOGBUF_LEN);
+
+    va_start(ap, fmt);
+    n = vsnprintf(l.buf + l.used, MAX_LOGBUF_LEN - l.used - 1, fmt, ap);
+    va_end(ap);
+
+    /* vsnprintf returns total string length, so no buffer overflow is
+     * possible, but we can shoot used past MAX_LOGBUF_LEN */
+    if (n > 0) {
+        l.used += n;
+    }
+    if (l.used >= MAX_LOGBUF_LEN) {
+        l.used = MAX_LOGBUF_LEN - 1;
+    }
+
+    if (l.used > 1) {
+        l.buf[l.used - 1] = '\n';
+    }
+
+    assert(l.used < MAX_LOGBUF_LEN);
+    l.buf[l.used] = '\0';
+
+    if (r != NULL) {
+        log_ring_push(mlog, r, l.buf, l.used);
+        return 0;
+    }
+
+    log_output(mlog, l.buf, l.used);
+
+    return 0;
+}
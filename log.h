@@ -7,6 +7,8 @@
 #define _LOG_H_
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 
 /*
@@ -24,6 +26,8 @@
 #define ERRORLOG_SYSLOG        0x4
 
 
+struct log_ring;
+
 struct moxi_log {
 
     int fd;             /* log fd */
@@ -32,10 +36,20 @@ struct moxi_log {
     char *log_ident;    /* syslog identifier */
     char *log_file;     /* if log file is specified */
     int use_syslog;     /* set if syslog is being used */
-    char *logbuf;       /* scratch buffer */
-    int logbuf_used;    /* length of scratch buffer */
-    time_t cur_ts;      /* current timestamp */
-    time_t last_generated_debug_ts;
+
+    /* Once the writer thread is started, each thread formats its log
+     * lines into its own ring, which the writer thread drains, so a
+     * thread that logs never blocks on the log's fd or on the other
+     * logging threads.
+     */
+    struct log_ring *rings;     /* registered per-thread rings */
+    pthread_mutex_t rings_lock; /* only held to register a ring */
+    pthread_t writer_tid;
+    int writer_running;         /* set while the writer thread runs */
+    int writer_sleeping;        /* set while the writer waits on wake_fds */
+    int wake_fds[2];            /* pipe that wakes the writer, or -1's */
+    int cycle_requested;        /* set by SIGHUP, done by the writer */
+    uint64_t dropped;           /* lines dropped because a ring was full */
 };
 
 typedef struct moxi_log moxi_log;
@@ -45,6 +59,25 @@ int log_error_close(moxi_log *);
 int log_error_write(moxi_log *, const char *filename, unsigned int line, const char *fmt, ...);
 int log_error_cycle(moxi_log *);
 
+/*
+ * Starts the writer thread, after which log_error_write() only
+ * appends to the calling thread's ring.  Call this after any
+ * daemonize(), as threads don't survive a fork.  The rings are
+ * drained once more at exit().
+ */
+int log_error_start_writer(moxi_log *);
+void log_error_stop_writer(moxi_log *);
+
+/*
+ * Asks for the log to be cycled, which is safe from a signal handler.
+ */
+void log_error_request_cycle(moxi_log *);
+
+/*
+ * Number of log lines dropped so far because a thread's ring was full.
+ */
+uint64_t log_error_dropped(moxi_log *);
+
 #ifndef MAIN_CHECK
 extern moxi_log *ml;
 #define moxi_log_write(...) log_error_write (ml, __FILE__, __LINE__, __VA_ARGS__)
@@ -12,6 +12,10 @@
 #include "mcs.h"
 #include "log.h"
 
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
+
 // TODO: This timeout is inherited from zstored, but use it where?
 //
 #define DOWNSTREAM_DEFAULT_LINGER 1000
@@ -23,6 +27,7 @@ void     lvb_free_data(mcs_st *ptr);
 bool     lvb_stable_update(mcs_st *curr_version, mcs_st *next_version);
 uint32_t lvb_key_hash(mcs_st *ptr, const char *key, size_t key_length, int *vbucket);
 void     lvb_server_invalid_vbucket(mcs_st *ptr, int server_index, int vbucket);
+int      lvb_server_replica(mcs_st *ptr, int vbucket, int n);
 
 // The lmc stands for libmemcached.
 //
@@ -125,74 +130,407 @@ void mcs_server_invalid_vbucket(mcs_st *ptr, int server_index, int vbucket) {
 #endif
 }
 
+/* Returns the server index of the n'th replica of a vbucket,
+ * or -1 if there's no such replica or no vbucket map.
+ */
+int mcs_server_replica(mcs_st *ptr, int vbucket, int n) {
+#ifdef MOXI_USE_LIBVBUCKET
+    if (ptr->kind == MCS_KIND_LIBVBUCKET &&
+        vbucket >= 0) {
+        return lvb_server_replica(ptr, vbucket, n);
+    }
+#endif
+    (void) ptr;
+    (void) vbucket;
+    (void) n;
+    return -1;
+}
+
 // ----------------------------------------------------------------------
 
+// Every downstream of every worker thread used to parse the config
+// into its own libvbucket or libmemcached instance.  Instead, a config
+// string is parsed once into mcs_routes, which every mcs_st made from
+// the same config then shares, read-only and refcounted.  For vbucket
+// configs, the routes are flat vbucket to server arrays, and keys are
+// hashed by an inlined CRC32 like libvbucket's, so that neither making
+// a downstream nor routing a key goes through libvbucket.
+//
+struct mcs_routes {
+    mcs_routes    *next;      // In routes_list.
+    int            refcount;  // Under routes_lock.
+    char          *config;
+    size_t         config_len;
+    mcs_kind       kind;
+    int            nservers;
+    mcs_server_st *servers;   // Each mcs_st gets a copy, for its fd's.
 #ifdef MOXI_USE_LIBVBUCKET
+    VBUCKET_CONFIG_HANDLE vch;
+    bool           crc;       // Keys hash to vbuckets with mcs_crc32().
+    uint32_t       mask;
+    int            nvbuckets;
+    int            nreplicas;
+    int           *masters;   // [nvbuckets]
+    int           *replicas;  // [nvbuckets * nreplicas]
+#endif
+#ifdef MOXI_USE_LIBMEMCACHED
+    memcached_st  *mst;       // Never hashed with, only cloned, so
+                              // it's only read after it's made.
+    pthread_mutex_t mst_lock; // For hashing with mst, if a clone
+                              // couldn't be made.
+#endif
+};
 
-mcs_st *lvb_create(mcs_st *ptr, const char *config) {
-    assert(ptr);
-    memset(ptr, 0, sizeof(*ptr));
-    ptr->kind = MCS_KIND_LIBVBUCKET;
+#if defined(MOXI_USE_LIBVBUCKET) || defined(MOXI_USE_LIBMEMCACHED)
+
+static pthread_mutex_t routes_lock = PTHREAD_MUTEX_INITIALIZER;
+static mcs_routes     *routes_list; // Under routes_lock.
+
+static void routes_destroy(mcs_routes *r) {
+    if (r->servers != NULL) {
+        for (int i = 0; i < r->nservers; i++) {
+            free(r->servers[i].usr);
+            free(r->servers[i].pwd);
+        }
+        free(r->servers);
+    }
+#ifdef MOXI_USE_LIBVBUCKET
+    if (r->vch != NULL) {
+        vbucket_config_destroy(r->vch);
+    }
+    free(r->masters);
+    free(r->replicas);
+#endif
+#ifdef MOXI_USE_LIBMEMCACHED
+    if (r->mst != NULL) {
+        memcached_free(r->mst);
+    }
+    if (r->kind == MCS_KIND_LIBMEMCACHED) {
+        pthread_mutex_destroy(&r->mst_lock);
+    }
+#endif
+    free(r->config);
+    free(r);
+}
+
+/* Returns the shared routes of a config, parsing it with the create
+ * function if no mcs_st uses that config yet.  Parsing is done under
+ * the routes_lock, so that when a new config comes in, only the first
+ * worker thread to see it parses it.
+ */
+static mcs_routes *routes_acquire(const char *config,
+                                  mcs_routes *(*create)(const char *config)) {
+    size_t len = strlen(config);
+    mcs_routes *r;
+
+    pthread_mutex_lock(&routes_lock);
+
+    for (r = routes_list; r != NULL; r = r->next) {
+        if (r->config_len == len &&
+            memcmp(r->config, config, len) == 0) {
+            break;
+        }
+    }
+
+    if (r == NULL) {
+        r = create(config);
+        if (r != NULL) {
+            r->config = strdup(config);
+            if (r->config != NULL) {
+                r->config_len = len;
+                r->next = routes_list;
+                routes_list = r;
+            } else {
+                routes_destroy(r);
+                r = NULL;
+            }
+        }
+    }
+
+    if (r != NULL) {
+        r->refcount++;
+    }
+
+    pthread_mutex_unlock(&routes_lock);
+
+    return r;
+}
+
+static void routes_release(mcs_routes *r) {
+    pthread_mutex_lock(&routes_lock);
+
+    assert(r->refcount > 0);
+    if (--r->refcount == 0) {
+        mcs_routes **prev = &routes_list;
+        while (*prev != r) {
+            prev = &(*prev)->next;
+        }
+        *prev = r->next;
+
+        routes_destroy(r);
+    }
+
+    pthread_mutex_unlock(&routes_lock);
+}
+
+/* Gives an mcs_st its own copy of the routes' servers.
+ */
+static bool routes_copy_servers(mcs_st *ptr, mcs_routes *r) {
+    if (r->nservers <= 0) {
+        return false;
+    }
+
+    ptr->servers = calloc(sizeof(mcs_server_st), r->nservers);
+    if (ptr->servers == NULL) {
+        return false;
+    }
+
+    ptr->nservers = r->nservers;
+
+    for (int i = 0; i < r->nservers; i++) {
+        mcs_server_st *s = &ptr->servers[i];
+
+        memcpy(s->hostname, r->servers[i].hostname, sizeof(s->hostname));
+        s->port = r->servers[i].port;
+        s->fd   = -1;
+
+        if (r->servers[i].usr != NULL &&
+            (s->usr = strdup(r->servers[i].usr)) == NULL) {
+            return false;
+        }
+        if (r->servers[i].pwd != NULL &&
+            (s->pwd = strdup(r->servers[i].pwd)) == NULL) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#endif // MOXI_USE_LIBVBUCKET || MOXI_USE_LIBMEMCACHED
+
+// ----------------------------------------------------------------------
+
+#ifdef MOXI_USE_LIBVBUCKET
+
+// The CRC32 that libvbucket hashes keys with.  ARMv8 has instructions
+// for its polynomial.  The x86 crc32 instruction is for a different
+// polynomial (Castagnoli), so there, the CRC is done with tables, 8
+// bytes at a time.
+//
+static uint32_t crc32_tab[8][256];
+
+/* Called under the routes_lock, before the first routes are made.
+ */
+static void mcs_crc32_init(void) {
+    if (crc32_tab[0][1] != 0) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        }
+        crc32_tab[0][i] = c;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t c = crc32_tab[t - 1][i];
+            crc32_tab[t][i] = (c >> 8) ^ crc32_tab[0][c & 0xff];
+        }
+    }
+}
+
+static inline uint32_t mcs_le32(const unsigned char *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+        ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint32_t mcs_crc32(const char *key, size_t key_length) {
+    const unsigned char *p = (const unsigned char *) key;
+    uint32_t crc = UINT32_MAX;
+
+#ifdef __ARM_FEATURE_CRC32
+    for (; key_length >= 8; key_length -= 8, p += 8) {
+        crc = __crc32d(crc, mcs_le32(p) | ((uint64_t) mcs_le32(p + 4) << 32));
+    }
+    for (; key_length > 0; key_length--, p++) {
+        crc = __crc32b(crc, *p);
+    }
+#else
+    for (; key_length >= 8; key_length -= 8, p += 8) {
+        uint32_t lo = crc ^ mcs_le32(p);
+
+        crc = crc32_tab[7][lo & 0xff] ^
+              crc32_tab[6][(lo >> 8) & 0xff] ^
+              crc32_tab[5][(lo >> 16) & 0xff] ^
+              crc32_tab[4][lo >> 24] ^
+              crc32_tab[3][p[4]] ^
+              crc32_tab[2][p[5]] ^
+              crc32_tab[1][p[6]] ^
+              crc32_tab[0][p[7]];
+    }
+    for (; key_length > 0; key_length--, p++) {
+        crc = (crc >> 8) ^ crc32_tab[0][(crc ^ *p) & 0xff];
+    }
+#endif
+
+    return ~crc;
+}
+
+static inline int lvb_vbucket(mcs_routes *r, const char *key, size_t key_length) {
+    if (r->crc) {
+        return (int) (((mcs_crc32(key, key_length) >> 16) & 0x7fff) & r->mask);
+    }
+
+    return vbucket_get_vbucket_by_key(r->vch, key, key_length);
+}
 
+static mcs_routes *lvb_routes_create(const char *config) {
     VBUCKET_CONFIG_HANDLE vch = vbucket_config_parse_string(config);
-    if (vch != NULL) {
-        ptr->data     = vch;
-        ptr->nservers = vbucket_config_get_num_servers(vch);
-        if (ptr->nservers > 0) {
-            ptr->servers = calloc(sizeof(mcs_server_st), ptr->nservers);
-            if (ptr->servers != NULL) {
-                for (int i = 0; i < ptr->nservers; i++) {
-                    ptr->servers[i].fd = -1;
-                }
+    if (vch == NULL) {
+        moxi_log_write("mcs_create failed, vbucket_config_parse_string: %s\n",
+                       config);
+        return NULL;
+    }
+
+    mcs_routes *r = calloc(1, sizeof(mcs_routes));
+    if (r == NULL) {
+        vbucket_config_destroy(vch);
+        return NULL;
+    }
 
-                int j = 0;
-                for (; j < ptr->nservers; j++) {
-                    const char *hostport = vbucket_config_get_server(vch, j);
-                    if (hostport != NULL &&
-                        strlen(hostport) > 0 &&
-                        strlen(hostport) < sizeof(ptr->servers[j].hostname) - 1) {
-                        strncpy(ptr->servers[j].hostname,
-                                hostport,
-                                sizeof(ptr->servers[j].hostname) - 1);
-                        char *colon = strchr(ptr->servers[j].hostname, ':');
-                        if (colon != NULL) {
-                            *colon = '\0';
-                            ptr->servers[j].port = atoi(colon + 1);
-                            if (ptr->servers[j].port <= 0) {
-                                moxi_log_write("mcs_create failed, could not parse port: %s\n",
-                                        config);
-                                break;
-                            }
-                        } else {
-                            moxi_log_write("mcs_create failed, missing port: %s\n",
-                                    config);
-                            break;
-                        }
-                    } else {
-                        moxi_log_write("mcs_create failed, unknown server: %s\n",
-                                config);
-                        break;
-                    }
-
-                    const char *user = vbucket_config_get_user(vch);
-                    if (user != NULL) {
-                        ptr->servers[j].usr = strdup(user);
-                    }
-
-                    const char *password = vbucket_config_get_password(vch);
-                    if (password != NULL) {
-                        ptr->servers[j].pwd = strdup(password);
-                    }
+    r->kind      = MCS_KIND_LIBVBUCKET;
+    r->vch       = vch;
+    r->nservers  = vbucket_config_get_num_servers(vch);
+    r->nvbuckets = vbucket_config_get_num_vbuckets(vch);
+    r->nreplicas = vbucket_config_get_num_replicas(vch);
+
+    if (r->nservers <= 0 ||
+        r->nvbuckets < 0 ||
+        r->nreplicas < 0) {
+        routes_destroy(r);
+        return NULL;
+    }
+
+    r->servers = calloc(sizeof(mcs_server_st), r->nservers);
+    if (r->servers == NULL) {
+        routes_destroy(r);
+        return NULL;
+    }
+
+    const char *user     = vbucket_config_get_user(vch);
+    const char *password = vbucket_config_get_password(vch);
+
+    for (int j = 0; j < r->nservers; j++) {
+        mcs_server_st *s = &r->servers[j];
+
+        const char *hostport = vbucket_config_get_server(vch, j);
+        if (hostport != NULL &&
+            strlen(hostport) > 0 &&
+            strlen(hostport) < sizeof(s->hostname) - 1) {
+            strncpy(s->hostname, hostport, sizeof(s->hostname) - 1);
+            char *colon = strchr(s->hostname, ':');
+            if (colon != NULL) {
+                *colon = '\0';
+                s->port = atoi(colon + 1);
+                if (s->port <= 0) {
+                    moxi_log_write("mcs_create failed, could not parse port: %s\n",
+                            config);
+                    routes_destroy(r);
+                    return NULL;
                 }
+            } else {
+                moxi_log_write("mcs_create failed, missing port: %s\n",
+                        config);
+                routes_destroy(r);
+                return NULL;
+            }
+        } else {
+            moxi_log_write("mcs_create failed, unknown server: %s\n",
+                    config);
+            routes_destroy(r);
+            return NULL;
+        }
+
+        if ((user != NULL && (s->usr = strdup(user)) == NULL) ||
+            (password != NULL && (s->pwd = strdup(password)) == NULL)) {
+            routes_destroy(r);
+            return NULL;
+        }
+    }
+
+    if (r->nvbuckets > 0) {
+        r->masters  = calloc(r->nvbuckets, sizeof(int));
+        r->replicas = calloc((size_t) r->nvbuckets * (r->nreplicas + 1),
+                             sizeof(int));
+        if (r->masters == NULL ||
+            r->replicas == NULL) {
+            routes_destroy(r);
+            return NULL;
+        }
 
-                if (j >= ptr->nservers) {
-                    return ptr;
+        for (int v = 0; v < r->nvbuckets; v++) {
+            r->masters[v] = vbucket_get_master(vch, v);
+
+            for (int n = 0; n < r->nreplicas; n++) {
+                int s = vbucket_get_replica(vch, v, n);
+                if (s < 0 ||
+                    s >= r->nservers) {
+                    s = -1;
                 }
+                r->replicas[v * r->nreplicas + n] = s;
             }
         }
-    } else {
-        moxi_log_write("mcs_create failed, vbucket_config_parse_string: %s\n",
-                       config);
+    }
+
+    // Keys only hash natively when the config uses libvbucket's CRC
+    // hashing, which is checked on a few keys.
+    //
+    mcs_crc32_init();
+
+    if (r->nvbuckets > 0 &&
+        (r->nvbuckets & (r->nvbuckets - 1)) == 0) {
+        static const char *probes[] = {
+            "a", "hello", "user:1234", "0123456789abcdefghijklmnopqrstuvwxyz"
+        };
+
+        r->mask = (uint32_t) r->nvbuckets - 1;
+        r->crc  = true;
+
+        for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+            size_t n = strlen(probes[i]);
+            if (lvb_vbucket(r, probes[i], n) !=
+                vbucket_get_vbucket_by_key(vch, probes[i], n)) {
+                r->crc = false;
+                break;
+            }
+        }
+    }
+
+    if (settings.verbose > 2) {
+        moxi_log_write("mcs_create routes: %d servers, %d vbuckets, %s hash\n",
+                       r->nservers, r->nvbuckets,
+                       r->crc ? "native" : "libvbucket");
+    }
+
+    return r;
+}
+
+mcs_st *lvb_create(mcs_st *ptr, const char *config) {
+    assert(ptr);
+    memset(ptr, 0, sizeof(*ptr));
+    ptr->kind = MCS_KIND_LIBVBUCKET;
+
+    mcs_routes *r = routes_acquire(config, lvb_routes_create);
+    if (r != NULL) {
+        ptr->data = r;
+
+        if (routes_copy_servers(ptr, r)) {
+            return ptr;
+        }
     }
 
     mcs_free(ptr);
@@ -204,10 +542,13 @@ void lvb_free_data(mcs_st *ptr) {
     assert(ptr->kind == MCS_KIND_LIBVBUCKET);
 
     if (ptr->data != NULL) {
-        vbucket_config_destroy((VBUCKET_CONFIG_HANDLE) ptr->data);
+        routes_release((mcs_routes *) ptr->data);
     }
 
-    ptr->data = NULL;
+    free(ptr->masters);
+
+    ptr->data    = NULL;
+    ptr->masters = NULL;
 }
 
 /* Returns true if curr_version could be updated with next_version in
@@ -227,14 +568,22 @@ bool lvb_stable_update(mcs_st *curr_version, mcs_st *next_version) {
 
     bool rv = false;
 
-    VBUCKET_CONFIG_DIFF *diff =
-        vbucket_compare((VBUCKET_CONFIG_HANDLE) curr_version->data,
-                        (VBUCKET_CONFIG_HANDLE) next_version->data);
+    mcs_routes *curr = curr_version->data;
+    mcs_routes *next = next_version->data;
+
+    VBUCKET_CONFIG_DIFF *diff = vbucket_compare(curr->vch, next->vch);
     if (diff != NULL) {
         if (!diff->sequence_changed) {
-            vbucket_config_destroy((VBUCKET_CONFIG_HANDLE) curr_version->data);
-            curr_version->data = next_version->data;
-            next_version->data = 0;
+            // The next_version's routes are handed over with its
+            // reference, and the masters found incorrect so far are
+            // forgotten, as the new config knows better.
+            //
+            routes_release(curr);
+            curr_version->data = next;
+            next_version->data = NULL;
+
+            free(curr_version->masters);
+            curr_version->masters = NULL;
 
             rv = true;
         }
@@ -249,23 +598,65 @@ uint32_t lvb_key_hash(mcs_st *ptr, const char *key, size_t key_length, int *vbuc
     assert(ptr->kind == MCS_KIND_LIBVBUCKET);
     assert(ptr->data != NULL);
 
-    VBUCKET_CONFIG_HANDLE vch = (VBUCKET_CONFIG_HANDLE) ptr->data;
+    mcs_routes *r = ptr->data;
 
-    int v = vbucket_get_vbucket_by_key(vch, key, key_length);
+    int v = lvb_vbucket(r, key, key_length);
     if (vbucket != NULL) {
         *vbucket = v;
     }
 
-    return (uint32_t) vbucket_get_master(vch, v);
+    if (v < 0 ||
+        v >= r->nvbuckets) {
+        return (uint32_t) -1;
+    }
+
+    return (uint32_t) (ptr->masters != NULL ? ptr->masters[v] : r->masters[v]);
 }
 
+/* Like libvbucket's vbucket_found_incorrect_master(), moves a vbucket
+ * to the next server, in this mcs_st's own copy of the masters.
+ */
 void lvb_server_invalid_vbucket(mcs_st *ptr, int server_index, int vbucket) {
     assert(ptr->kind == MCS_KIND_LIBVBUCKET);
     assert(ptr->data != NULL);
 
-    VBUCKET_CONFIG_HANDLE vch = (VBUCKET_CONFIG_HANDLE) ptr->data;
+    mcs_routes *r = ptr->data;
+
+    if (vbucket < 0 ||
+        vbucket >= r->nvbuckets) {
+        return;
+    }
+
+    int *masters = ptr->masters != NULL ? ptr->masters : r->masters;
+    if (masters[vbucket] != server_index) {
+        return;
+    }
+
+    if (ptr->masters == NULL) {
+        ptr->masters = malloc(r->nvbuckets * sizeof(int));
+        if (ptr->masters == NULL) {
+            return;
+        }
+        memcpy(ptr->masters, r->masters, r->nvbuckets * sizeof(int));
+    }
+
+    ptr->masters[vbucket] = (server_index + 1) % r->nservers;
+}
+
+int lvb_server_replica(mcs_st *ptr, int vbucket, int n) {
+    assert(ptr->kind == MCS_KIND_LIBVBUCKET);
+    assert(ptr->data != NULL);
+
+    mcs_routes *r = ptr->data;
+
+    if (n < 0 ||
+        n >= r->nreplicas ||
+        vbucket < 0 ||
+        vbucket >= r->nvbuckets) {
+        return -1;
+    }
 
-    vbucket_found_incorrect_master(vch, vbucket, server_index);
+    return r->replicas[vbucket * r->nreplicas + n];
 }
 
 #endif // MOXI_USE_LIBVBUCKET
@@ -274,54 +665,82 @@ void lvb_server_invalid_vbucket(mcs_st *ptr, int server_index, int vbucket) {
 
 #ifdef MOXI_USE_LIBMEMCACHED
 
+// Keys go to servers by libmemcached's ketama continuum, so they
+// keep going to the same servers as with libmemcached's clients.
+// But memcached_generate_hash() may rebuild the continuum of the
+// memcached_st it's given, so the shared routes only hold the parsed
+// memcached_st, and each mcs_st hashes with its own clone of it.
+//
+static mcs_routes *lmc_routes_create(const char *config) {
+    mcs_routes *r = calloc(1, sizeof(mcs_routes));
+    if (r == NULL) {
+        return NULL;
+    }
+
+    r->kind = MCS_KIND_LIBMEMCACHED;
+
+    pthread_mutex_init(&r->mst_lock, NULL);
+
+    r->mst = memcached_create(NULL);
+    if (r->mst == NULL) {
+        routes_destroy(r);
+        return NULL;
+    }
+
+    memcached_behavior_set(r->mst, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
+    memcached_behavior_set(r->mst, MEMCACHED_BEHAVIOR_KETAMA, 1);
+    memcached_behavior_set(r->mst, MEMCACHED_BEHAVIOR_TCP_NODELAY, 1);
+
+    memcached_server_st *mservers = memcached_servers_parse(config);
+    if (mservers == NULL) {
+        routes_destroy(r);
+        return NULL;
+    }
+
+    memcached_server_push(r->mst, mservers);
+
+    r->nservers = (int) memcached_server_list_count(mservers);
+    if (r->nservers > 0) {
+        r->servers = calloc(sizeof(mcs_server_st), r->nservers);
+    }
+
+    int j = 0;
+    if (r->servers != NULL) {
+        for (; j < r->nservers; j++) {
+            strncpy(r->servers[j].hostname,
+                    memcached_server_name(mservers + j),
+                    sizeof(r->servers[j].hostname) - 1);
+            r->servers[j].port = (int) memcached_server_port(mservers + j);
+            if (r->servers[j].port <= 0) {
+                moxi_log_write("lmc_create failed, could not parse port: %s\n",
+                               config);
+                break;
+            }
+        }
+    }
+
+    memcached_server_list_free(mservers);
+
+    if (r->servers == NULL ||
+        j < r->nservers) {
+        routes_destroy(r);
+        return NULL;
+    }
+
+    return r;
+}
+
 mcs_st *lmc_create(mcs_st *ptr, const char *config) {
     assert(ptr);
     memset(ptr, 0, sizeof(*ptr));
     ptr->kind = MCS_KIND_LIBMEMCACHED;
 
-    memcached_st *mst = memcached_create(NULL);
-    if (mst != NULL) {
-        memcached_behavior_set(mst, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
-        memcached_behavior_set(mst, MEMCACHED_BEHAVIOR_KETAMA, 1);
-        memcached_behavior_set(mst, MEMCACHED_BEHAVIOR_TCP_NODELAY, 1);
-
-        memcached_server_st *mservers;
-
-        mservers = memcached_servers_parse(config);
-        if (mservers != NULL) {
-            memcached_server_push(mst, mservers);
-
-            ptr->data     = mst;
-            ptr->nservers = (int) memcached_server_list_count(mservers);
-            if (ptr->nservers > 0) {
-                ptr->servers = calloc(sizeof(mcs_server_st), ptr->nservers);
-                if (ptr->servers != NULL) {
-                    for (int i = 0; i < ptr->nservers; i++) {
-                        ptr->servers[i].fd = -1;
-                    }
-
-                    int j = 0;
-                    for (; j < ptr->nservers; j++) {
-                        strncpy(ptr->servers[j].hostname,
-                                memcached_server_name(mservers + j),
-                                sizeof(ptr->servers[j].hostname) - 1);
-                        ptr->servers[j].port = (int) memcached_server_port(mservers + j);
-                        if (ptr->servers[j].port <= 0) {
-                            moxi_log_write("lmc_create failed, could not parse port: %s\n",
-                                           config);
-                            break;
-                        }
-                    }
-
-                    if (j >= ptr->nservers) {
-                        memcached_server_list_free(mservers);
-
-                        return ptr;
-                    }
-                }
-            }
+    mcs_routes *r = routes_acquire(config, lmc_routes_create);
+    if (r != NULL) {
+        ptr->data = r;
 
-            memcached_server_list_free(mservers);
+        if (routes_copy_servers(ptr, r)) {
+            return ptr;
         }
     }
 
@@ -333,11 +752,16 @@ mcs_st *lmc_create(mcs_st *ptr, const char *config) {
 void lmc_free_data(mcs_st *ptr) {
     assert(ptr->kind == MCS_KIND_LIBMEMCACHED);
 
+    if (ptr->hasher != NULL) {
+        memcached_free((memcached_st *) ptr->hasher);
+    }
+
     if (ptr->data != NULL) {
-        memcached_free((memcached_st *) ptr->data);
+        routes_release((mcs_routes *) ptr->data);
     }
 
-    ptr->data = NULL;
+    ptr->data   = NULL;
+    ptr->hasher = NULL;
 }
 
 uint32_t lmc_key_hash(mcs_st *ptr, const char *key, size_t key_length, int *vbucket) {
@@ -348,7 +772,22 @@ uint32_t lmc_key_hash(mcs_st *ptr, const char *key, size_t key_length, int *vbuc
         *vbucket = -1;
     }
 
-    return memcached_generate_hash((memcached_st *) ptr->data, key, key_length);
+    mcs_routes *r = ptr->data;
+
+    if (ptr->hasher == NULL) {
+        ptr->hasher = memcached_clone(NULL, r->mst);
+    }
+
+    if (ptr->hasher != NULL) {
+        return memcached_generate_hash((memcached_st *) ptr->hasher,
+                                       key, key_length);
+    }
+
+    pthread_mutex_lock(&r->mst_lock);
+    uint32_t rv = memcached_generate_hash(r->mst, key, key_length);
+    pthread_mutex_unlock(&r->mst_lock);
+
+    return rv;
 }
 
 #endif // MOXI_USE_LIBMEMCACHED
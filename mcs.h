@@ -40,11 +40,20 @@ typedef struct {
     char *pwd;
 } mcs_server_st;
 
+// The parsed form of a config, shared by the mcs_st's made from it.
+//
+typedef struct mcs_routes mcs_routes;
+
 typedef struct {
     mcs_kind       kind;
-    void          *data;     // Depends on kind.
+    void          *data;     // Depends on kind, usually the mcs_routes.
     int            nservers; // Size of servers array.
     mcs_server_st *servers;
+    int           *masters;  // Own vbucket masters, once one was found
+                             // incorrect, instead of the shared ones.
+    void          *hasher;   // Own clone of the routes' memcached_st,
+                             // made on first use, as hashing a key
+                             // may rebuild a ketama continuum.
 } mcs_st;
 
 mcs_st *mcs_create(mcs_st *ptr, const char *config);
@@ -59,6 +68,8 @@ uint32_t mcs_key_hash(mcs_st *ptr, const char *key, size_t key_length, int *vbuc
 
 void mcs_server_invalid_vbucket(mcs_st *ptr, int server_index, int vbucket);
 
+int mcs_server_replica(mcs_st *ptr, int vbucket, int n);
+
 void mcs_server_st_quit(mcs_server_st *ptr, uint8_t io_death);
 
 mcs_return mcs_server_st_connect(mcs_server_st *ptr,
@@ -73,7 +73,6 @@ static void settings_init(void);
 
 /* event handling, network IO */
 static void event_handler(const int fd, const short which, void *arg);
-static void conn_close(conn *c);
 static void conn_init(void);
 static void write_and_free(conn *c, char *buf, int bytes);
 
@@ -89,6 +88,7 @@ static void conn_free(conn *c);
 struct stats stats;
 struct settings settings;
 time_t process_started;     /* when the process was started */
+uint64_t process_started_usec;
 conn *listen_conn = NULL;
 
 /** file scope variables **/
@@ -160,6 +160,7 @@ static void stats_init(void) {
        like 'settings.oldest_live' which act as booleans as well as
        values are now false in boolean context... */
     process_started = time(0) - 2;
+    process_started_usec = monotonic_usec() - 2000000;
     stats_prefix_init();
 }
 
@@ -195,6 +196,11 @@ static void settings_init(void) {
     settings.reqs_per_event = 20;
     settings.backlog = 1024;
     settings.binding_protocol = negotiating_prot;
+    settings.conn_buffer_pool = false;
+    settings.io_uring = false;
+    settings.large_pages = false;
+    settings.numa_interleave = false;
+    settings.slab_automove = false;
 }
 
 /*
@@ -443,7 +449,11 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->cmd_start = NULL;
     c->cmd_start_time = 0;
     c->cmd_retries = 0;
+    c->trace_id = 0;
+    c->noreply_batch = 0;
     c->corked = NULL;
+    c->uring_state = conn_uring_idle;
+    c->uring_next = NULL;
     c->host_ident = NULL;
 
     c->extra = extra;
@@ -538,11 +548,18 @@ void conn_free(conn *c) {
     }
 }
 
-static void conn_close(conn *c) {
+void conn_close(conn *c) {
     assert(c != NULL);
 
     /* delete the event, the socket and the conn */
     event_del(&c->event);
+    twheel_del(&c->timer);
+
+    /* don't free buffers the kernel might still be sending from, nor
+       the fd its send might still name, until the send completes */
+    if (!thread_uring_cancel(c)) {
+        return;
+    }
 
     if (settings.verbose > 1)
         moxi_log_write("<%d connection closed.\n", c->sfd);
@@ -550,10 +567,16 @@ static void conn_close(conn *c) {
     MEMCACHED_CONN_RELEASE(c->sfd);
     close(c->sfd);
     accept_new_conns(true);
+    thread_accept_resume(c->thread);
     conn_cleanup(c);
 
-    /* if the connection has big buffers, just free it */
-    if (c->rsize > READ_BUFFER_HIGHWAT || conn_add_to_freelist(c)) {
+    /* a conn that lent out its buffers can't be reused as is */
+    if (c->rbuf == NULL && c->thread != NULL) {
+        THREAD_STATS_ADD(c->thread->stats.conns_unbuffered, -1);
+
+        conn_free(c);
+    } else if (c->rsize > READ_BUFFER_HIGHWAT || conn_add_to_freelist(c)) {
+        /* if the connection has big buffers, just free it */
         conn_free(c);
     }
 
@@ -622,6 +645,150 @@ static void conn_shrink(conn *c) {
     }
 }
 
+/*
+ * Bytes of memory a conn holds at its initial buffer sizes, beyond
+ * its struct, which is what an idle conn saves by lending them out.
+ */
+static size_t conn_buffers_bytes(void) {
+    return DATA_BUFFER_SIZE * 2 +
+           sizeof(item *) * ITEM_LIST_INITIAL +
+           sizeof(char *) * SUFFIX_LIST_INITIAL +
+           sizeof(struct iovec) * IOV_LIST_INITIAL +
+           sizeof(struct msghdr) * MSG_LIST_INITIAL;
+}
+
+/*
+ * Returns true if an idle conn may lend its buffers to its thread's
+ * pool.  Downstream conns may not, because the proxy writes requests
+ * into them while they're idle, rather than from their own events.
+ */
+static bool conn_buffers_lendable(conn *c) {
+    return settings.conn_buffer_pool &&
+           c->thread != NULL &&
+           c->rbuf != NULL &&
+           !IS_UDP(c->transport) &&
+           c->protocol != proxy_downstream_ascii_prot &&
+           c->protocol != proxy_downstream_binary_prot;
+}
+
+/*
+ * Hands an idle conn's buffers back to its thread's pool, or frees
+ * them if they've grown or the pool is full.  The conn must not be
+ * holding any unparsed input or pending output.
+ */
+static void conn_release_buffers(conn *c) {
+    assert(c != NULL);
+    assert(c->rbytes == 0);
+    assert(c->ileft == 0);
+    assert(c->suffixleft == 0);
+
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (me->conn_buffer_pool_count < CONN_BUFFER_POOL_MAX &&
+        c->rsize == DATA_BUFFER_SIZE &&
+        c->wsize == DATA_BUFFER_SIZE &&
+        c->isize == ITEM_LIST_INITIAL &&
+        c->suffixsize == SUFFIX_LIST_INITIAL &&
+        c->iovsize == IOV_LIST_INITIAL &&
+        c->msgsize == MSG_LIST_INITIAL) {
+        conn_buffers *b = &me->conn_buffer_pool[me->conn_buffer_pool_count++];
+        b->rbuf = c->rbuf;
+        b->wbuf = c->wbuf;
+        b->ilist = c->ilist;
+        b->suffixlist = c->suffixlist;
+        b->iov = c->iov;
+        b->msglist = c->msglist;
+    } else {
+        free(c->rbuf);
+        free(c->wbuf);
+        free(c->ilist);
+        free(c->suffixlist);
+        free(c->iov);
+        free(c->msglist);
+    }
+
+    c->rbuf = c->rcurr = NULL;
+    c->wbuf = c->wcurr = NULL;
+    c->ilist = c->icurr = NULL;
+    c->suffixlist = c->suffixcurr = NULL;
+    c->iov = NULL;
+    c->msglist = NULL;
+    c->rsize = c->wsize = c->isize = c->suffixsize = 0;
+    c->iovsize = c->msgsize = 0;
+    c->iovused = c->msgused = c->msgcurr = 0;
+
+    THREAD_STATS_ADD(me->stats.conns_unbuffered, 1);
+}
+
+/*
+ * Gives a conn that lent out its buffers a set again, from its
+ * thread's pool if there's one.  Returns false when out of memory.
+ */
+static bool conn_acquire_buffers(conn *c) {
+    assert(c != NULL);
+    assert(c->thread != NULL);
+
+    if (c->rbuf != NULL) {
+        return true;
+    }
+
+    LIBEVENT_THREAD *me = c->thread;
+    bool hit = me->conn_buffer_pool_count > 0;
+
+    if (hit) {
+        conn_buffers *b = &me->conn_buffer_pool[--me->conn_buffer_pool_count];
+        c->rbuf = b->rbuf;
+        c->wbuf = b->wbuf;
+        c->ilist = b->ilist;
+        c->suffixlist = b->suffixlist;
+        c->iov = b->iov;
+        c->msglist = b->msglist;
+    } else {
+        c->rbuf = (char *)malloc((size_t)DATA_BUFFER_SIZE);
+        c->wbuf = (char *)malloc((size_t)DATA_BUFFER_SIZE);
+        c->ilist = (item **)malloc(sizeof(item *) * ITEM_LIST_INITIAL);
+        c->suffixlist = (char **)malloc(sizeof(char *) * SUFFIX_LIST_INITIAL);
+        c->iov = (struct iovec *)malloc(sizeof(struct iovec) * IOV_LIST_INITIAL);
+        c->msglist = (struct msghdr *)malloc(sizeof(struct msghdr) * MSG_LIST_INITIAL);
+
+        if (c->rbuf == 0 || c->wbuf == 0 || c->ilist == 0 || c->iov == 0 ||
+                c->msglist == 0 || c->suffixlist == 0) {
+            free(c->rbuf);
+            free(c->wbuf);
+            free(c->ilist);
+            free(c->suffixlist);
+            free(c->iov);
+            free(c->msglist);
+            c->rbuf = NULL;
+            c->wbuf = NULL;
+            c->ilist = NULL;
+            c->suffixlist = NULL;
+            c->iov = NULL;
+            c->msglist = NULL;
+            return false;
+        }
+    }
+
+    c->rcurr = c->rbuf;
+    c->wcurr = c->wbuf;
+    c->icurr = c->ilist;
+    c->suffixcurr = c->suffixlist;
+    c->rsize = c->wsize = DATA_BUFFER_SIZE;
+    c->isize = ITEM_LIST_INITIAL;
+    c->suffixsize = SUFFIX_LIST_INITIAL;
+    c->iovsize = IOV_LIST_INITIAL;
+    c->msgsize = MSG_LIST_INITIAL;
+
+    if (hit) {
+        THREAD_STATS_ADD(me->stats.conn_buffer_hits, 1);
+    } else {
+        THREAD_STATS_ADD(me->stats.conn_buffer_misses, 1);
+    }
+    THREAD_STATS_ADD(me->stats.conns_unbuffered, -1);
+
+    return true;
+}
+
 /**
  * Convert a state name to a human readable form.
  */
@@ -840,9 +1007,7 @@ void complete_nread_ascii(conn *c) {
     int comm = c->cmd;
     enum store_item_type ret;
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THREAD_STATS_ADD(c->thread->stats.slab_stats[it->slabs_clsid].set_cmds, 1);
 
     if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
         out_string(c, "CLIENT_ERROR bad data chunk");
@@ -1132,13 +1297,11 @@ static void complete_incr_bin(conn *c) {
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, 0);
     } else {
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (c->cmd == PROTOCOL_BINARY_CMD_INCREMENT) {
-            c->thread->stats.incr_misses++;
+            THREAD_STATS_ADD(c->thread->stats.incr_misses, 1);
         } else {
-            c->thread->stats.decr_misses++;
+            THREAD_STATS_ADD(c->thread->stats.decr_misses, 1);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
     }
@@ -1151,9 +1314,7 @@ static void complete_update_bin(conn *c) {
 
     item *it = c->item;
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THREAD_STATS_ADD(c->thread->stats.slab_stats[it->slabs_clsid].set_cmds, 1);
 
     /* We don't actually receive the trailing two characters in the bin
      * protocol, so we're going to just set them here */
@@ -1236,10 +1397,8 @@ static void process_bin_get(conn *c) {
         uint16_t keylen = 0;
         uint32_t bodylen = sizeof(rsp->message.body) + (it->nbytes - 2);
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.get_cmds++;
-        c->thread->stats.slab_stats[it->slabs_clsid].get_hits++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread->stats.get_cmds, 1);
+        THREAD_STATS_ADD(c->thread->stats.slab_stats[it->slabs_clsid].get_hits, 1);
 
         MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
                               it->nbytes, ITEM_get_cas(it));
@@ -1265,10 +1424,8 @@ static void process_bin_get(conn *c) {
         /* Remember this command so we can garbage collect it later */
         c->item = it;
     } else {
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.get_cmds++;
-        c->thread->stats.get_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread->stats.get_cmds, 1);
+        THREAD_STATS_ADD(c->thread->stats.get_misses, 1);
 
         MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
 
@@ -1832,9 +1989,7 @@ static void process_bin_flush(conn *c) {
     }
     item_flush_expired();
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.flush_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THREAD_STATS_ADD(c->thread->stats.flush_cmds, 1);
 
     write_bin_response(c, NULL, 0, 0, 0);
 }
@@ -1936,13 +2091,15 @@ void complete_nread(conn *c) {
 
 /*
  * Stores an item in the cache according to the semantics of one of the set
- * commands. In threaded mode, this is protected by the cache lock.
+ * commands. In threaded mode, this is protected by the item lock
+ * of hv, the hash of the item's key.
  *
  * Returns the state of storage.
  */
-enum store_item_type do_store_item(item *it, int comm, conn *c) {
+enum store_item_type do_store_item(item *it, int comm, conn *c,
+                                   const uint32_t hv) {
     char *key = ITEM_key(it);
-    item *old_it = do_item_get(key, it->nkey);
+    item *old_it = do_item_get(key, it->nkey, hv);
     enum store_item_type stored = NOT_STORED;
 
     item *new_it = NULL;
@@ -1960,24 +2117,18 @@ enum store_item_type do_store_item(item *it, int comm, conn *c) {
         if(old_it == NULL) {
             // LRU expired
             stored = NOT_FOUND;
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.cas_misses++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THREAD_STATS_ADD(c->thread->stats.cas_misses, 1);
         }
         else if (ITEM_get_cas(it) == ITEM_get_cas(old_it)) {
             // cas validates
             // it and old_it may belong to different classes.
             // I'm updating the stats for the one that's getting pushed out
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[old_it->slabs_clsid].cas_hits++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THREAD_STATS_ADD(c->thread->stats.slab_stats[old_it->slabs_clsid].cas_hits, 1);
 
-            item_replace(old_it, it);
+            do_item_replace(old_it, it, hv);
             stored = STORED;
         } else {
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[old_it->slabs_clsid].cas_badval++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THREAD_STATS_ADD(c->thread->stats.slab_stats[old_it->slabs_clsid].cas_badval, 1);
 
             if(settings.verbose > 1) {
                 moxi_log_write("CAS:  failure: expected %llu, got %llu\n",
@@ -2035,9 +2186,9 @@ enum store_item_type do_store_item(item *it, int comm, conn *c) {
 
         if (stored == NOT_STORED) {
             if (old_it != NULL)
-                item_replace(old_it, it);
+                do_item_replace(old_it, it, hv);
             else
-                do_item_link(it);
+                do_item_link(it, hv);
 
             c->cas = ITEM_get_cas(it);
 
@@ -2271,6 +2422,14 @@ void server_stats(ADD_STAT add_stats, void *c, const char *prefix) {
     APPEND_PREFIX_STAT("listen_disabled_num", "%llu", (unsigned long long)stats.listen_disabled_num);
     APPEND_PREFIX_STAT("threads", "%d", settings.num_threads);
     APPEND_PREFIX_STAT("conn_yields", "%llu", (unsigned long long)thread_stats.conn_yields);
+    APPEND_PREFIX_STAT("conn_struct_bytes", "%lu", (unsigned long)sizeof(conn));
+    APPEND_PREFIX_STAT("conn_buffer_bytes", "%lu", (unsigned long)conn_buffers_bytes());
+    APPEND_PREFIX_STAT("conns_unbuffered", "%llu", (unsigned long long)thread_stats.conns_unbuffered);
+    APPEND_PREFIX_STAT("conn_buffer_hits", "%llu", (unsigned long long)thread_stats.conn_buffer_hits);
+    APPEND_PREFIX_STAT("conn_buffer_misses", "%llu", (unsigned long long)thread_stats.conn_buffer_misses);
+#ifndef MAIN_CHECK
+    APPEND_PREFIX_STAT("log_dropped", "%llu", (unsigned long long)log_error_dropped(ml));
+#endif
 
     STATS_UNLOCK();
 }
@@ -2299,6 +2458,16 @@ void process_stat_settings(ADD_STAT add_stats, void *c, const char *prefix) {
     APPEND_PREFIX_STAT("tcp_backlog", "%d", settings.backlog);
     APPEND_PREFIX_STAT("binding_protocol", "%s",
                 prot_text(settings.binding_protocol));
+    APPEND_PREFIX_STAT("conn_buffer_pool", "%s",
+                settings.conn_buffer_pool ? "yes" : "no");
+    APPEND_PREFIX_STAT("io_uring", "%s",
+                settings.io_uring ? "yes" : "no");
+    APPEND_PREFIX_STAT("large_pages", "%s",
+                settings.large_pages ? "yes" : "no");
+    APPEND_PREFIX_STAT("numa_interleave", "%s",
+                settings.numa_interleave ? "yes" : "no");
+    APPEND_PREFIX_STAT("slab_automove", "%s",
+                settings.slab_automove ? "yes" : "no");
 }
 
 static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
@@ -2394,13 +2563,11 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
             nkey = key_token->length;
 
             if(nkey > KEY_MAX_LENGTH) {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.get_cmds   += stats_get_cmds;
-                c->thread->stats.get_misses += stats_get_misses;
+                THREAD_STATS_ADD(c->thread->stats.get_cmds, stats_get_cmds);
+                THREAD_STATS_ADD(c->thread->stats.get_misses, stats_get_misses);
                 for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-                    c->thread->stats.slab_stats[sid].get_hits += stats_get_hits[sid];
+                    THREAD_STATS_ADD(c->thread->stats.slab_stats[sid].get_hits, stats_get_hits[sid]);
                 }
-                pthread_mutex_unlock(&c->thread->stats.mutex);
                 out_string(c, "CLIENT_ERROR bad command line format");
                 return;
             }
@@ -2449,13 +2616,11 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
 
                   suffix = cache_alloc(c->thread->suffix_cache);
                   if (suffix == NULL) {
-                    pthread_mutex_lock(&c->thread->stats.mutex);
-                    c->thread->stats.get_cmds   += stats_get_cmds;
-                    c->thread->stats.get_misses += stats_get_misses;
+                    THREAD_STATS_ADD(c->thread->stats.get_cmds, stats_get_cmds);
+                    THREAD_STATS_ADD(c->thread->stats.get_misses, stats_get_misses);
                     for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-                        c->thread->stats.slab_stats[sid].get_hits += stats_get_hits[sid];
+                        THREAD_STATS_ADD(c->thread->stats.slab_stats[sid].get_hits, stats_get_hits[sid]);
                     }
-                    pthread_mutex_unlock(&c->thread->stats.mutex);
                     out_string(c, "SERVER_ERROR out of memory making CAS suffix");
                     item_remove(it);
                     return;
@@ -2541,13 +2706,11 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
         c->msgcurr = 0;
     }
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.get_cmds   += stats_get_cmds;
-    c->thread->stats.get_misses += stats_get_misses;
+    THREAD_STATS_ADD(c->thread->stats.get_cmds, stats_get_cmds);
+    THREAD_STATS_ADD(c->thread->stats.get_misses, stats_get_misses);
     for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-        c->thread->stats.slab_stats[sid].get_hits += stats_get_hits[sid];
+        THREAD_STATS_ADD(c->thread->stats.slab_stats[sid].get_hits, stats_get_hits[sid]);
     }
-    pthread_mutex_unlock(&c->thread->stats.mutex);
 
     return;
 }
@@ -2660,13 +2823,11 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
 
     it = item_get(key, nkey);
     if (!it) {
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (incr) {
-            c->thread->stats.incr_misses++;
+            THREAD_STATS_ADD(c->thread->stats.incr_misses, 1);
         } else {
-            c->thread->stats.decr_misses++;
+            THREAD_STATS_ADD(c->thread->stats.decr_misses, 1);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         out_string(c, "NOT_FOUND");
         return;
@@ -2698,7 +2859,8 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
  * returns a response string to send back to the client.
  */
 enum delta_result_type do_add_delta(conn *c, item *it, const bool incr,
-                                    const int64_t delta, char *buf) {
+                                    const int64_t delta, char *buf,
+                                    const uint32_t hv) {
     char *ptr;
     int64_t value;
     int res;
@@ -2721,13 +2883,11 @@ enum delta_result_type do_add_delta(conn *c, item *it, const bool incr,
         MEMCACHED_COMMAND_DECR(c->sfd, ITEM_key(it), it->nkey, value);
     }
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
     if (incr) {
-        c->thread->stats.slab_stats[it->slabs_clsid].incr_hits++;
+        THREAD_STATS_ADD(c->thread->stats.slab_stats[it->slabs_clsid].incr_hits, 1);
     } else {
-        c->thread->stats.slab_stats[it->slabs_clsid].decr_hits++;
+        THREAD_STATS_ADD(c->thread->stats.slab_stats[it->slabs_clsid].decr_hits, 1);
     }
-    pthread_mutex_unlock(&c->thread->stats.mutex);
 
     snprintf(buf, INCR_MAX_STORAGE_LEN, "%llu", (unsigned long long)value);
     res = strlen(buf);
@@ -2739,7 +2899,7 @@ enum delta_result_type do_add_delta(conn *c, item *it, const bool incr,
         }
         memcpy(ITEM_data(new_it), buf, res);
         memcpy(ITEM_data(new_it) + res, "\r\n", 2);
-        item_replace(it, new_it);
+        do_item_replace(it, new_it, hv);
         do_item_remove(new_it);       /* release our reference */
     } else { /* replace in-place */
         /* When changing the value without replacing the item, we
@@ -2778,17 +2938,13 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
     if (it) {
         MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.slab_stats[it->slabs_clsid].delete_hits++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread->stats.slab_stats[it->slabs_clsid].delete_hits, 1);
 
         item_unlink(it);
         item_remove(it);      /* release our reference */
         out_string(c, "DELETED");
     } else {
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.delete_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread->stats.delete_misses, 1);
 
         out_string(c, "NOT_FOUND");
     }
@@ -2887,9 +3043,7 @@ void process_command(conn *c, char *command) {
 
         set_noreply_maybe(c, tokens, ntokens);
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.flush_cmds++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread->stats.flush_cmds, 1);
 
         if(ntokens == (c->noreply ? 3 : 2)) {
             settings.oldest_live = current_time - 1;
@@ -2971,8 +3125,13 @@ void process_stats_proxy_command(conn *c, token_t *tokens, const size_t ntokens)
         return;
     }
 
-    if (ntokens == 4 && strcmp(tokens[2].value, "timings") == 0) {
-        proxy_stats_dump_timings(&append_stats, c);
+    if ((ntokens == 4 || ntokens == 5) &&
+        strcmp(tokens[2].value, "timings") == 0) {
+        proxy_stats_dump_timings(&append_stats, c,
+                                 ntokens == 5 ? tokens[3].value : NULL);
+    } else if (ntokens == 4 &&
+               strcmp(tokens[2].value, "trace") == 0) {
+        proxy_stats_dump_trace(&append_stats, c);
     } else {
         bool do_all = (ntokens == 3 || strcmp(tokens[2].value, "all") == 0);
         struct proxy_stats_cmd_info psci = {
@@ -3137,9 +3296,7 @@ static enum try_read_result try_read_udp(conn *c) {
     if (res > 8) {
         unsigned char *buf = (unsigned char *)c->rbuf;
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.bytes_read += res;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread->stats.bytes_read, res);
 
         add_bytes_read(c, res);
 
@@ -3200,9 +3357,7 @@ static enum try_read_result try_read_network(conn *c) {
         int avail = c->rsize - c->rbytes;
         res = read(c->sfd, c->rbuf + c->rbytes, avail);
         if (res > 0) {
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.bytes_read += res;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THREAD_STATS_ADD(c->thread->stats.bytes_read, res);
 
             add_bytes_read(c, res);
 
@@ -3303,11 +3458,26 @@ static enum transmit_result transmit(conn *c) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
 
-        res = sendmsg(c->sfd, m, 0);
+        if (c->uring_state == conn_uring_sending) {
+            /* woken by some other event while the send is in flight */
+            update_event(c, 0);
+            return TRANSMIT_SOFT_ERROR;
+        }
+
+        if (c->uring_state == conn_uring_sent) {
+            c->uring_state = conn_uring_idle;
+            res = c->uring_res;
+            if (res < 0) {
+                errno = -res;
+                res = -1;
+            }
+        } else if (thread_uring_sendmsg(c, m)) {
+            return TRANSMIT_SOFT_ERROR;
+        } else {
+            res = sendmsg(c->sfd, m, 0);
+        }
         if (res > 0) {
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.bytes_written += res;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THREAD_STATS_ADD(c->thread->stats.bytes_written, res);
 
             /* We've written some of the data. Remove the completed
                iovec entries from the list of pending writes. */
@@ -3323,27 +3493,33 @@ static enum transmit_result transmit(conn *c) {
                 m->msg_iov->iov_base = (caddr_t)m->msg_iov->iov_base + res;
                 m->msg_iov->iov_len -= res;
             }
-            return TRANSMIT_INCOMPLETE;
-        }
-        if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            if (!update_event(c, EV_WRITE | EV_PERSIST)) {
-                if (settings.verbose > 0)
-                    moxi_log_write("Couldn't update event\n");
-                conn_set_state(c, conn_closing);
-                return TRANSMIT_HARD_ERROR;
+
+            /* A short write to a non-blocking TCP socket means its send
+               buffer is full, so wait for it to drain rather than make
+               another sendmsg() call that would only fail with EAGAIN. */
+            if (m->msg_iovlen == 0 || IS_UDP(c->transport)) {
+                return TRANSMIT_INCOMPLETE;
             }
-            return TRANSMIT_SOFT_ERROR;
+        } else if (!(res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+            /* if res == 0 or res == -1 and error is not EAGAIN or EWOULDBLOCK,
+               we have a real error, on which we close the connection */
+            if (settings.verbose > 0)
+                perror("Failed to write, and not due to blocking");
+
+            if (IS_UDP(c->transport))
+                conn_set_state(c, conn_read);
+            else
+                conn_set_state(c, conn_closing);
+            return TRANSMIT_HARD_ERROR;
         }
-        /* if res == 0 or res == -1 and error is not EAGAIN or EWOULDBLOCK,
-           we have a real error, on which we close the connection */
-        if (settings.verbose > 0)
-            perror("Failed to write, and not due to blocking");
 
-        if (IS_UDP(c->transport))
-            conn_set_state(c, conn_read);
-        else
+        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+            if (settings.verbose > 0)
+                moxi_log_write("Couldn't update event\n");
             conn_set_state(c, conn_closing);
-        return TRANSMIT_HARD_ERROR;
+            return TRANSMIT_HARD_ERROR;
+        }
+        return TRANSMIT_SOFT_ERROR;
     } else {
         return TRANSMIT_COMPLETE;
     }
@@ -3375,7 +3551,14 @@ void drive_machine(conn *c) {
                 } else if (errno == EMFILE) {
                     if (settings.verbose > 0)
                         moxi_log_write("Too many open connections\n");
-                    accept_new_conns(false);
+                    if (is_listen_thread()) {
+                        accept_new_conns(false);
+                    } else {
+                        /* a worker's own SO_REUSEPORT listener, which
+                         * the main thread's listen_conn list doesn't have
+                         */
+                        thread_accept_pause(c);
+                    }
                     stop = true;
                 } else {
                     perror("accept()");
@@ -3390,11 +3573,23 @@ void drive_machine(conn *c) {
                 break;
             }
 
-            dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
-                              DATA_BUFFER_SIZE,
-                              c->protocol,
-                              tcp_transport,
-                              c->funcs, c->extra);
+            if (is_listen_thread()) {
+                dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                                  DATA_BUFFER_SIZE,
+                                  c->protocol,
+                                  tcp_transport,
+                                  c->funcs, c->extra);
+            } else {
+                /* a worker's own SO_REUSEPORT listener, so keep the
+                 * new conn on this thread, see server_socket_per_thread()
+                 */
+                thread_conn_new(c->thread, sfd, conn_new_cmd,
+                                EV_READ | EV_PERSIST,
+                                DATA_BUFFER_SIZE,
+                                c->protocol,
+                                tcp_transport,
+                                c->funcs, c->extra);
+            }
             stop = true;
             break;
 
@@ -3417,11 +3612,22 @@ void drive_machine(conn *c) {
                 break;
             }
 
+            if (c->rbytes == 0 && conn_buffers_lendable(c)) {
+                conn_release_buffers(c);
+            }
+
             conn_set_state(c, conn_read);
             stop = true;
             break;
 
         case conn_read:
+            if (c->rbuf == NULL && !conn_acquire_buffers(c)) {
+                if (settings.verbose > 0)
+                    moxi_log_write("Couldn't allocate conn buffers\n");
+                conn_set_state(c, conn_closing);
+                break;
+            }
+
             res = IS_UDP(c->transport) ? try_read_udp(c) : try_read_network(c);
 
             switch (res) {
@@ -3456,9 +3662,7 @@ void drive_machine(conn *c) {
             if (nreqs >= 0) {
                 reset_cmd_handler(c);
             } else {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.conn_yields++;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
+                THREAD_STATS_ADD(c->thread->stats.conn_yields, 1);
                 if (c->rbytes > 0) {
                     /* We have already read in data into the input buffer,
                        so libevent will most likely not signal read events
@@ -3555,9 +3759,7 @@ void drive_machine(conn *c) {
             /*  now try reading from the socket */
             res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
             if (res > 0) {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.bytes_read += res;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
+                THREAD_STATS_ADD(c->thread->stats.bytes_read, res);
                 add_bytes_read(c, res);
                 c->sbytes -= res;
                 break;
@@ -3680,9 +3882,7 @@ void drive_machine(conn *c) {
 
 void add_bytes_read(conn *c, int bytes_read) {
     assert(c != NULL);
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.bytes_read += bytes_read;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THREAD_STATS_ADD(c->thread->stats.bytes_read, bytes_read);
 }
 
 void event_handler(const int fd, const short which, void *arg) {
@@ -3767,18 +3967,12 @@ static void maximize_sndbuf(const int sfd) {
  *        when they are successfully added to the list of ports we
  *        listen on.
  */
-int server_socket(int port, enum network_transport transport,
-                  FILE *portnumber_file) {
-    int sfd;
-    struct linger ling = {0, 0};
-    struct addrinfo *ai;
-    struct addrinfo *next;
+static int server_socket_addrinfo(int port, enum network_transport transport,
+                                  struct addrinfo **ai) {
     struct addrinfo hints = { .ai_flags = AI_PASSIVE,
                               .ai_family = AF_UNSPEC };
     char port_buf[NI_MAXSERV];
     int error;
-    int success = 0;
-    int flags =1;
 
     hints.ai_socktype = IS_UDP(transport) ? SOCK_DGRAM : SOCK_STREAM;
 
@@ -3786,7 +3980,7 @@ int server_socket(int port, enum network_transport transport,
         port = 0;
     }
     snprintf(port_buf, sizeof(port_buf), "%d", port);
-    error= getaddrinfo(settings.inter, port_buf, &hints, &ai);
+    error= getaddrinfo(settings.inter, port_buf, &hints, ai);
     if (error != 0) {
         if (error != EAI_SYSTEM)
           moxi_log_write("getaddrinfo(): %s\n", gai_strerror(error));
@@ -3794,61 +3988,111 @@ int server_socket(int port, enum network_transport transport,
           perror("getaddrinfo()");
         return 1;
     }
+    return 0;
+}
 
-    for (next= ai; next; next= next->ai_next) {
-        conn *listen_conn_add;
-        if ((sfd = new_socket(next)) == -1) {
-            /* getaddrinfo can return "junk" addresses,
-             * we make sure at least one works before erroring.
-             */
-            continue;
-        }
+/**
+ * Create a socket bound to one address, and listening if it's TCP.
+ * Returns the socket, or -1 if the address should be skipped, in
+ * which case *fatal is set when the caller should give up entirely.
+ */
+static int server_socket_bind(struct addrinfo *next,
+                              enum network_transport transport,
+                              bool reuseport, bool *fatal) {
+    int sfd;
+    struct linger ling = {0, 0};
+    int error;
+    int flags =1;
+
+    *fatal = false;
+
+    if ((sfd = new_socket(next)) == -1) {
+        /* getaddrinfo can return "junk" addresses,
+         * we make sure at least one works before erroring.
+         */
+        return -1;
+    }
 
 #ifdef IPV6_V6ONLY
-        if (next->ai_family == AF_INET6) {
-            error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
-            if (error != 0) {
-                perror("setsockopt");
-                close(sfd);
-                continue;
-            }
+    if (next->ai_family == AF_INET6) {
+        error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+        if (error != 0) {
+            perror("setsockopt");
+            close(sfd);
+            return -1;
         }
+    }
 #endif
 
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
-        if (IS_UDP(transport)) {
-            maximize_sndbuf(sfd);
-        } else {
-            error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-            if (error != 0)
-                perror("setsockopt");
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+#ifdef SO_REUSEPORT
+    if (reuseport) {
+        error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            perror("setsockopt(SO_REUSEPORT)");
+            close(sfd);
+            *fatal = true;
+            return -1;
+        }
+    }
+#else
+    assert(!reuseport);
+#endif
+    if (IS_UDP(transport)) {
+        maximize_sndbuf(sfd);
+    } else {
+        error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+        if (error != 0)
+            perror("setsockopt");
+
+        error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+        if (error != 0)
+            perror("setsockopt");
 
-            error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-            if (error != 0)
-                perror("setsockopt");
+        error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+        if (error != 0)
+            perror("setsockopt");
+    }
 
-            error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
-            if (error != 0)
-                perror("setsockopt");
+    if (bind(sfd, next->ai_addr, next->ai_addrlen) == -1) {
+        if (errno != EADDRINUSE) {
+            perror("bind()");
+            *fatal = true;
         }
+        close(sfd);
+        return -1;
+    }
+    if (!IS_UDP(transport) && listen(sfd, settings.backlog) == -1) {
+        perror("listen()");
+        close(sfd);
+        *fatal = true;
+        return -1;
+    }
+    return sfd;
+}
 
-        if (bind(sfd, next->ai_addr, next->ai_addrlen) == -1) {
-            if (errno != EADDRINUSE) {
-                perror("bind()");
-                close(sfd);
+int server_socket(int port, enum network_transport transport,
+                  FILE *portnumber_file) {
+    int sfd;
+    struct addrinfo *ai;
+    struct addrinfo *next;
+    bool fatal;
+    int success = 0;
+
+    if (server_socket_addrinfo(port, transport, &ai) != 0) {
+        return 1;
+    }
+
+    for (next= ai; next; next= next->ai_next) {
+        conn *listen_conn_add;
+        if ((sfd = server_socket_bind(next, transport, false, &fatal)) == -1) {
+            if (fatal) {
                 freeaddrinfo(ai);
                 return 1;
             }
-            close(sfd);
             continue;
         } else {
             success++;
-            if (!IS_UDP(transport) && listen(sfd, settings.backlog) == -1) {
-                perror("listen()");
-                close(sfd);
-                freeaddrinfo(ai);
-                return 1;
-            }
             if (portnumber_file != NULL &&
                 (next->ai_addr->sa_family == AF_INET ||
                  next->ai_addr->sa_family == AF_INET6)) {
@@ -3899,6 +4143,59 @@ int server_socket(int port, enum network_transport transport,
     return success == 0;
 }
 
+/**
+ * Like server_socket() for TCP, except that every worker thread gets
+ * its own SO_REUSEPORT listening socket for each bindable address,
+ * and accepts on it directly instead of going through the dispatch
+ * thread.  The listening conn's are created on the workers, so they
+ * aren't on the listen_conn list.
+ *
+ * Returns the number of listening sockets handed to worker threads,
+ * or -1 when there are none, such as when SO_REUSEPORT isn't supported.
+ */
+int server_socket_per_thread(int port, enum protocol prot,
+                             conn_funcs *funcs, void *extra) {
+#ifdef SO_REUSEPORT
+    int sfd;
+    struct addrinfo *ai;
+    struct addrinfo *next;
+    bool fatal = false;
+    int listening = 0;
+
+    if (server_socket_addrinfo(port, tcp_transport, &ai) != 0) {
+        return -1;
+    }
+
+    /* listeners already handed to workers can't be taken back, so
+     * a partial success still counts
+     */
+    for (next= ai; next && !fatal; next= next->ai_next) {
+        for (int t = 1; t < settings.num_threads; t++) {
+            if ((sfd = server_socket_bind(next, tcp_transport, true, &fatal)) == -1) {
+                break;
+            }
+
+            dispatch_conn_new_to_thread(t, sfd, conn_listening,
+                                        EV_READ | EV_PERSIST, 1,
+                                        prot, tcp_transport,
+                                        funcs, extra);
+            listening++;
+        }
+    }
+
+    freeaddrinfo(ai);
+
+    return listening > 0 ? listening : -1;
+#else
+    (void)port;
+    (void)prot;
+    (void)funcs;
+    (void)extra;
+
+    return -1;
+#endif
+}
+
 static int new_socket_unix(void) {
     int sfd;
     int flags;
@@ -4055,6 +4352,8 @@ static void usage(char **argv) {
     printf("The optional FLAGS are...\n\n");
     printf("-Z <key=val*> optional comma-separated key=value proxy behaviors, including:\n");
     printf("              port_listen=11211,downstream_max=1,downstream_protocol=binary\n");
+    printf("              listen_reuseport=1 has each worker thread accept on its own\n"
+           "              SO_REUSEPORT listener\n");
     printf("-l <ip_addr>  interface to listen on (default: INADDR_ANY, all addresses)\n"
            "-d            run as a daemon\n"
            "-r            maximize core file limit\n");
@@ -4095,12 +4394,21 @@ static void usage(char **argv) {
            "-M            (deprecated) return error on memory exhausted\n"
            "-f <factor>   (deprecated) chunk size growth factor (default: 1.25)\n"
            "-n <bytes>    (deprecated) minimum allocated for key+value+flags (default: 48)\n"
-#if defined(HAVE_GETPAGESIZES) && defined(HAVE_MEMCNTL)
+#if (defined(HAVE_GETPAGESIZES) && defined(HAVE_MEMCNTL)) || \
+    (defined(__linux__) && defined(HAVE_SYS_MMAN_H))
            "-L            (deprecated) try to use large memory pages (if available). Increasing\n"
            "              the memory page size could reduce the number of TLB misses\n"
            "              and improve the performance. In order to get large pages\n"
            "              from the OS, memcached will allocate the total item-cache\n"
            "              in one large chunk.\n"
+#endif
+#if defined(__linux__) && defined(HAVE_SYS_MMAN_H)
+           "-N            (deprecated) interleave the item-cache across NUMA nodes,\n"
+           "              allocating it in one large chunk.\n"
+#endif
+#ifndef MOXI_ITEM_MALLOC
+           "-A            (deprecated) move item memory between slab classes\n"
+           "              automatically, to the ones that evict the most.\n"
 #endif
            "-D <char>     (deprecated) use <char> as delimiter for key prefixes and IDs.\n"
            "              This is used for per-prefix stats reporting. The default is\n"
@@ -4215,7 +4523,7 @@ static void sig_handler(const int sig) {
     switch (sig) {
 
         case SIGHUP :
-            log_error_cycle(ml);
+            log_error_request_cycle(ml);
             break;
         default :
             printf("SIGINT handled.\n");
@@ -4394,6 +4702,8 @@ int main (int argc, char **argv) {
           "t:"  /* threads */
           "D:"  /* prefix delimiter? */
           "L"   /* Large memory pages */
+          "N"   /* NUMA interleaved item memory */
+          "A"   /* automatic slab page moves */
           "R:"  /* max requests per event */
           "C"   /* Disable use of CAS */
           "b:"  /* backlog queue limit */
@@ -4496,6 +4806,23 @@ int main (int argc, char **argv) {
             if (enable_large_pages() == 0) {
                 preallocate = true;
             }
+#elif defined(__linux__) && defined(HAVE_SYS_MMAN_H)
+            settings.large_pages = true;
+            preallocate = true;
+#endif
+            break;
+        case 'N' :
+#if defined(__linux__) && defined(HAVE_SYS_MMAN_H)
+            settings.numa_interleave = true;
+            preallocate = true;
+#endif
+            break;
+        case 'A' :
+#ifdef MOXI_ITEM_MALLOC
+            /* items are malloc'ed, so there are no slab pages to move */
+            moxi_log_write("warning: -A ignored, items aren't kept in slabs in this build\n");
+#else
+            settings.slab_automove = true;
 #endif
             break;
         case 'C' :
@@ -4670,6 +4997,11 @@ int main (int argc, char **argv) {
         }
     }
 
+#ifndef MAIN_CHECK
+    /* from here on, threads log through the log writer thread */
+    log_error_start_writer(ml);
+#endif
+
     /* lock paged memory if needed */
     if (lock_memory) {
 #ifdef HAVE_MLOCKALL
@@ -4713,6 +5045,12 @@ int main (int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+#ifndef MOXI_ITEM_MALLOC
+    if (settings.slab_automove && start_slab_rebalance_thread() == -1) {
+        exit(EXIT_FAILURE);
+    }
+#endif
+
     if (do_daemonize)
         save_pid(getpid(), pid_file);
     /* initialise clock event */
@@ -4841,10 +5179,15 @@ int main (int argc, char **argv) {
     work_collect_one(&main_completion);
 #endif
 
-    /* enter the event loop */
-    event_base_loop(main_base, 0);
+    /* enter the event loop, main_base being thread 0's */
+    thread_event_loop(thread_by_index(0));
 
     stop_assoc_maintenance_thread();
+#ifndef MOXI_ITEM_MALLOC
+    if (settings.slab_automove) {
+        stop_slab_rebalance_thread();
+    }
+#endif
 
     /* remove the PID file if we're a daemon */
     if (do_daemonize)
@@ -19,6 +19,8 @@
 
 #include "work.h"
 #include "genhash.h"
+#include "twheel.h"
+#include "uring.h"
 
 #include "protocol_binary.h"
 #include "cache.h"
@@ -64,6 +66,9 @@
 #define IOV_LIST_HIGHWAT 600
 #define MSG_LIST_HIGHWAT 100
 
+/* Max idle buffer sets kept per thread when settings.conn_buffer_pool is on. */
+#define CONN_BUFFER_POOL_MAX 64
+
 /* Binary protocol stuff */
 #define MIN_BIN_PKT_LENGTH 16
 #define BIN_PKT_HDR_WORDS (MIN_BIN_PKT_LENGTH/sizeof(uint32_t))
@@ -161,6 +166,16 @@ enum conn_states {
     conn_max_state   /**< Max state value (used for assertion) */
 };
 
+/*
+ * Where a conn's io_uring send is, see thread_uring_sendmsg().
+ */
+enum conn_uring_states {
+    conn_uring_idle,    /**< no send queued */
+    conn_uring_sending, /**< the kernel may still read the msghdr buffers */
+    conn_uring_sent,    /**< uring_res holds the result for transmit() */
+    conn_uring_closing  /**< closed while sending, see thread_uring_cancel() */
+};
+
 enum bin_substates {
     bin_no_state,
     bin_reading_set_header,
@@ -234,11 +249,34 @@ struct slab_stats {
     uint64_t  decr_hits;
 };
 
+/**
+ * Per-thread stats are only ever bumped by their owning thread, so
+ * instead of a lock they're single-writer counters, updated with a
+ * relaxed load and store and read by other threads with a relaxed
+ * load.  A stats reset doesn't store to them, which would race with
+ * a bump, but records their values as the thread's stats_base, which
+ * threadlocal_stats_aggregate() then subtracts.
+ */
+#ifdef __ATOMIC_RELAXED
+#define THREAD_STATS_GET(counter) \
+    __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define THREAD_STATS_SET(counter, val) \
+    __atomic_store_n(&(counter), (val), __ATOMIC_RELAXED)
+#else
+#define THREAD_STATS_GET(counter) \
+    (*(volatile uint64_t *) &(counter))
+#define THREAD_STATS_SET(counter, val) \
+    (*(volatile uint64_t *) &(counter) = (val))
+#endif
+#define THREAD_STATS_ADD(counter, n) \
+    THREAD_STATS_SET(counter, THREAD_STATS_GET(counter) + (n))
+
+#define CACHE_LINE_SIZE 64
+
 /**
  * Stats stored per-thread.
  */
 struct thread_stats {
-    pthread_mutex_t   mutex;
     uint64_t          get_cmds;
     uint64_t          get_misses;
     uint64_t          delete_misses;
@@ -249,6 +287,9 @@ struct thread_stats {
     uint64_t          bytes_written;
     uint64_t          flush_cmds;
     uint64_t          conn_yields; /* # of yields for connections (-R option)*/
+    uint64_t          conn_buffer_hits;   /* buffer sets borrowed from the pool */
+    uint64_t          conn_buffer_misses; /* buffer sets malloc()'ed when the pool was empty */
+    uint64_t          conns_unbuffered;   /* idle conns currently holding no buffers, not reset */
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
 };
 
@@ -311,10 +352,16 @@ struct settings {
     enum protocol binding_protocol;
     int backlog;
     bool enable_mcmux_mode; /* enable mcmux compatiblity mode, disables libvbucket/libmemcached support */
+    bool conn_buffer_pool;  /* idle conns lend their buffers to a per-thread pool */
+    bool large_pages;       /* map preallocated item memory with huge pages */
+    bool numa_interleave;   /* interleave preallocated item memory over nodes */
+    bool slab_automove;     /* move slab pages to the classes that evict most */
+    bool io_uring;          /* batch conn sends through per-thread io_urings */
 };
 
 extern struct stats stats;
 extern time_t process_started;
+extern uint64_t process_started_usec; /* in monotonic_usec() */
 extern struct settings settings;
 
 #define ITEM_LINKED 1
@@ -353,17 +400,47 @@ struct bin_cmd {
     bin_cmd *next;
 };
 
+/**
+ * The buffers a conn only needs while it's handling a request,
+ * at their initial sizes, see settings.conn_buffer_pool.
+ */
+typedef struct {
+    char          *rbuf;
+    char          *wbuf;
+    item         **ilist;
+    char         **suffixlist;
+    struct iovec  *iov;
+    struct msghdr *msglist;
+} conn_buffers;
+
 typedef struct {
     pthread_t thread_id;        /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
     struct event notify_event;  /* listen event for notify pipe */
     int notify_receive_fd;      /* receiving end of notify pipe */
     int notify_send_fd;         /* sending end of notify pipe */
+    char stats_pad_head[CACHE_LINE_SIZE]; /* keep stats off lines shared with */
     struct thread_stats stats;  /* Stats generated by this thread */
+    char stats_pad_tail[CACHE_LINE_SIZE]; /* the fields around them */
+    struct thread_stats stats_base; /* stats at the last reset, under
+                                       the stats_base_lock */
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
     cache_t *suffix_cache;      /* suffix cache */
     work_queue *work_queue;
     genhash_t *conn_hash;       /* per thread connection hash, keyed by host_ident */
+    twheel timer_wheel;         /* per thread timeouts, see thread_timer_add() */
+    struct event timer_wheel_event; /* ticks timer_wheel while it has timers */
+    bool timer_wheel_ticking;
+    uint64_t usec_time;         /* cached usec_now(), 0 when stale, see usec_now_cached() */
+    struct conn *listen_paused; /* own listeners paused on EMFILE, see thread_accept_pause() */
+    twheel_timer listen_timer;  /* resumes listen_paused if no conn closes meanwhile */
+    conn_buffers conn_buffer_pool[CONN_BUFFER_POOL_MAX]; /* idle conn buffer sets */
+    int conn_buffer_pool_count;
+    uring *uring;               /* set up on first send when settings.io_uring */
+    struct event uring_event;   /* reads the uring's eventfd */
+    struct event uring_submit_event; /* activated to submit at the end of a loop */
+    bool uring_submit_pending;
+    struct conn *uring_done;    /* conns with a completed send, not yet driven */
 } LIBEVENT_THREAD;
 
 /**
@@ -483,9 +560,18 @@ struct conn {
     char     *cmd_start;      // Pointer into rbuf, snapshot of rcurr.
     uint64_t  cmd_start_time; // Snapshot of usec_now or msec_current_time.
     int       cmd_retries;
+    uint64_t  trace_id;       // Nonzero while a sampled request is traced.
+    uint64_t  noreply_batch;  // The proxy_td's noreply_batch_seq of the
+                              // last batch holding one of our writes.
 
     bin_cmd *corked;
 
+    enum conn_uring_states uring_state;
+    int   uring_res;  // Bytes sent or -errno, when conn_uring_sent.
+    conn *uring_next; // In the thread's uring_done list.
+
+    twheel_timer timer; // Per-conn timeout, such as for a downstream connect.
+
     char *host_ident; // Uniquely identifies a memcached server, including
                       // address:port and possibly optional bucket/usr/pwd info.
     char *peer_host;    // this and the following two paramters are used for mcmux
@@ -511,8 +597,10 @@ extern volatile rel_time_t current_time;
  */
 void do_accept_new_conns(const bool do_accept);
 enum delta_result_type do_add_delta(conn *c, item *item, const bool incr,
-                                    const int64_t delta, char *buf);
-enum store_item_type do_store_item(item *item, int comm, conn* c);
+                                    const int64_t delta, char *buf,
+                                    const uint32_t hv);
+enum store_item_type do_store_item(item *item, int comm, conn* c,
+                                   const uint32_t hv);
 
 conn *conn_new(const int sfd, const enum conn_states init_state,
                const int event_flags, const int read_buffer_size,
@@ -520,6 +608,7 @@ conn *conn_new(const int sfd, const enum conn_states init_state,
                struct event_base *base,
                conn_funcs *funcs, void *extra);
 void conn_set_state(conn *c, enum conn_states state);
+void conn_close(conn *c);
 void add_bytes_read(conn *c, int bytes_read);
 void out_string(conn *c, const char *str);
 bool update_event(conn *c, const int new_flags);
@@ -554,6 +643,9 @@ int server_socket(const int port,
                   enum network_transport transport,
                   FILE *portnum_file);
 
+int server_socket_per_thread(int port, enum protocol prot,
+                             conn_funcs *funcs, void *extra);
+
 #ifdef HAVE_SYS_UN_H
 int server_socket_unix(const char *path, int access_mask);
 #endif
@@ -581,6 +673,10 @@ void write_bin_error(conn *c, protocol_binary_response_status err, int swallow);
 void thread_init(int nthreads, struct event_base *main_base);
 int  thread_index(pthread_t thread_id);
 LIBEVENT_THREAD *thread_by_index(int i);
+int thread_event_loop(LIBEVENT_THREAD *me);
+
+void thread_timer_add(LIBEVENT_THREAD *thread, twheel_timer *t,
+                      uint32_t msec, twheel_cb cb, void *arg);
 
 int  dispatch_event_add(int thread, conn *c);
 
@@ -598,10 +694,22 @@ void dispatch_conn_new_to_thread(int tid, int sfd, enum conn_states init_state,
                                  enum network_transport transport,
                                  conn_funcs *funcs, void *extra);
 
+conn *thread_conn_new(LIBEVENT_THREAD *me, int sfd,
+                      enum conn_states init_state,
+                      int event_flags,
+                      int read_buffer_size,
+                      enum protocol prot,
+                      enum network_transport transport,
+                      conn_funcs *funcs, void *extra);
+
 /* Lock wrappers for cache functions that are called from main loop. */
 enum delta_result_type add_delta(conn *c, item *item, const int incr,
                                  const int64_t delta, char *buf);
 void accept_new_conns(const bool do_accept);
+void thread_accept_pause(conn *c);
+void thread_accept_resume(LIBEVENT_THREAD *me);
+bool thread_uring_sendmsg(conn *c, struct msghdr *m);
+bool thread_uring_cancel(conn *c);
 conn *conn_from_freelist(void);
 bool  conn_add_to_freelist(conn *c);
 int   is_listen_thread(void);
@@ -611,6 +719,7 @@ void  item_flush_expired(void);
 item *item_get(const char *key, const size_t nkey);
 int   item_link(item *it);
 void  item_remove(item *it);
+void  item_ref(item *it);
 int   item_replace(item *it, item *new_it);
 void  item_stats(ADD_STAT add_stats, void *c);
 void  item_stats_sizes(ADD_STAT add_stats, void *c);
@@ -0,0 +1,1375 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * Load generator for moxi, plus a mock downstream memcached for moxi
+ * to proxy to, so that a whole benchmark can run on one box without
+ * real memcached servers:
+ *
+ *   ./moxi_bench -M 11311 -t 2 &
+ *   ./moxi -z 11211=127.0.0.1:11311 -t 4 &
+ *   ./moxi_bench -p 11211 -t 4 -c 8 -d 10 -z 0.99 -m 10 -D 4
+ *
+ * Each load generator thread runs its own libevent loop over its own
+ * conns.  By default requests are closed loop, each conn keeping -D
+ * requests in flight.  With -R, requests instead arrive at a fixed
+ * rate, and a request's latency is measured from when it was due to
+ * be sent, so queueing behind a slow proxy isn't hidden.
+ *
+ * The mock downstream answers every get as a hit with a -s byte value
+ * and every update as stored, in ascii or binary, without keeping any
+ * data, so it stays out of the way of the proxy being measured.
+ */
+
+#include "config.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event.h>
+
+#include "protocol_binary.h"
+#include "htgram.h"
+
+#define BENCH_READ_CHUNK 16384
+#define BENCH_KEY_MAX    250
+#define BENCH_KEYS_MAX   100 // Max keys per multiget.
+
+// Settings, from the command line.
+//
+static const char *host = "127.0.0.1";
+static int      port = 11211;
+static int      num_threads = 4;
+static int      num_conns = 4;       // Per thread.
+static int      duration = 10;       // Secs.
+static bool     binary = false;
+static uint64_t num_keys = 100000;
+static double   zipf_theta = 0.0;    // 0 means uniform keys.
+static int      get_percent = 90;
+static int      multiget = 1;        // Keys per get.
+static int      value_size = 100;
+static int      depth = 1;           // Requests in flight per conn.
+static double   rate = 0.0;          // Total requests/sec, 0 means closed loop.
+static int      mock_port = 0;       // Run as the mock downstream instead.
+
+static char    *value_data;          // value_size bytes of 'x'.
+
+static uint64_t bench_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// -------------------------------------------------
+
+// A growable byte buffer, consumed from the front.
+//
+typedef struct {
+    char  *data;
+    size_t size;
+    size_t len; // Bytes filled.
+    size_t off; // Bytes consumed, off <= len.
+} bench_buf;
+
+static void buf_reserve(bench_buf *b, size_t n) {
+    if (b->off > 0 && b->off == b->len) {
+        b->off = b->len = 0;
+    }
+
+    if (b->size - b->len >= n) {
+        return;
+    }
+
+    if (b->off > 0) {
+        memmove(b->data, b->data + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
+
+        if (b->size - b->len >= n) {
+            return;
+        }
+    }
+
+    size_t size = b->size > 0 ? b->size : 4096;
+    while (size - b->len < n) {
+        size *= 2;
+    }
+
+    b->data = realloc(b->data, size);
+    if (b->data == NULL) {
+        fprintf(stderr, "moxi_bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    b->size = size;
+}
+
+static void buf_append(bench_buf *b, const void *data, size_t n) {
+    buf_reserve(b, n);
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+static size_t buf_avail(bench_buf *b) {
+    return b->len - b->off;
+}
+
+static char *buf_head(bench_buf *b) {
+    return b->data + b->off;
+}
+
+// Returns 0 on success, or -1 when the peer closed or failed.
+//
+static int buf_read(bench_buf *b, int fd) {
+    for (;;) {
+        buf_reserve(b, BENCH_READ_CHUNK);
+
+        ssize_t n = read(fd, b->data + b->len, b->size - b->len);
+        if (n > 0) {
+            b->len += n;
+            if ((size_t) n < BENCH_READ_CHUNK) {
+                return 0;
+            }
+            continue;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+}
+
+// Returns 0 on success, even if only part was written, or -1 on error.
+//
+static int buf_write(bench_buf *b, int fd) {
+    while (buf_avail(b) > 0) {
+        ssize_t n = write(fd, buf_head(b), buf_avail(b));
+        if (n > 0) {
+            b->off += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return -1;
+    }
+
+    b->off = b->len = 0;
+
+    return 0;
+}
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 ||
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("moxi_bench: fcntl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Finds the end of the line at the head of b, returning its length
+// without the "\r\n", or -1 if the line isn't complete yet.
+//
+static ssize_t buf_line(bench_buf *b, size_t *consumed) {
+    char *s = buf_head(b);
+    char *nl = memchr(s, '\n', buf_avail(b));
+    if (nl == NULL) {
+        return -1;
+    }
+
+    *consumed = nl - s + 1;
+
+    size_t n = nl - s;
+    if (n > 0 && s[n - 1] == '\r') {
+        n--;
+    }
+
+    return n;
+}
+
+static void bin_header(bench_buf *b, uint8_t magic, uint8_t opcode,
+                       uint16_t keylen, uint8_t extlen, uint16_t status,
+                       uint32_t bodylen, uint32_t opaque, uint64_t cas) {
+    protocol_binary_response_header h;
+
+    memset(&h, 0, sizeof(h));
+    h.response.magic    = magic;
+    h.response.opcode   = opcode;
+    h.response.keylen   = htons(keylen);
+    h.response.extlen   = extlen;
+    h.response.status   = htons(status);
+    h.response.bodylen  = htonl(bodylen);
+    h.response.opaque   = opaque;
+    h.response.cas      = cas;
+
+    buf_append(b, h.bytes, sizeof(h.bytes));
+}
+
+// -------------------------------------------------
+
+// The mock downstream.  Every thread watches the one listen socket,
+// and the thread that wins an accept() owns the conn.
+//
+typedef struct {
+    int                fd;
+    struct event       ev;
+    short              ev_flags;
+    struct event_base *base;
+    bench_buf          rbuf;
+    bench_buf          wbuf;
+} mock_conn;
+
+typedef struct {
+    pthread_t          tid;
+    struct event_base *base;
+    struct event       listen_ev;
+} mock_thread;
+
+static int mock_listen_fd = -1;
+
+static void mock_conn_event(int fd, short which, void *arg);
+
+static void mock_conn_close(mock_conn *c) {
+    event_del(&c->ev);
+    close(c->fd);
+    free(c->rbuf.data);
+    free(c->wbuf.data);
+    free(c);
+}
+
+static void mock_conn_update(mock_conn *c) {
+    short flags = EV_READ | EV_PERSIST;
+    if (buf_avail(&c->wbuf) > 0) {
+        flags |= EV_WRITE;
+    }
+
+    if (flags != c->ev_flags) {
+        if (c->ev_flags != 0) {
+            event_del(&c->ev);
+        }
+        event_set(&c->ev, c->fd, flags, mock_conn_event, c);
+        event_base_set(c->base, &c->ev);
+        event_add(&c->ev, NULL);
+        c->ev_flags = flags;
+    }
+}
+
+static void mock_value(mock_conn *c, const char *key, size_t key_len,
+                       bool with_cas) {
+    char line[BENCH_KEY_MAX + 100];
+    int n = snprintf(line, sizeof(line), "VALUE %.*s 0 %d%s\r\n",
+                     (int) key_len, key, value_size,
+                     with_cas ? " 1" : "");
+
+    buf_append(&c->wbuf, line, n);
+    buf_append(&c->wbuf, value_data, value_size);
+    buf_append(&c->wbuf, "\r\n", 2);
+}
+
+// Returns false when the request isn't complete yet, or the conn
+// should close.
+//
+static bool mock_ascii(mock_conn *c, bool *close_conn) {
+    size_t consumed;
+    ssize_t n = buf_line(&c->rbuf, &consumed);
+    if (n < 0) {
+        return false;
+    }
+
+    char  stack[2048];
+    char *line = (size_t) n < sizeof(stack) ? stack : malloc(n + 1);
+    if (line == NULL) {
+        *close_conn = true;
+        return false;
+    }
+    memcpy(line, buf_head(&c->rbuf), n);
+    line[n] = '\0';
+
+    bool  ok = true;
+    char *save = NULL;
+    char *cmd = strtok_r(line, " ", &save);
+    if (cmd == NULL) {
+        cmd = "";
+    }
+
+    // A get can have any number of keys, as the proxy batches the
+    // keys of many clients' gets together.
+    //
+    if (strcmp(cmd, "get") == 0 || strcmp(cmd, "gets") == 0) {
+        bool with_cas = cmd[3] == 's';
+
+        for (char *key = strtok_r(NULL, " ", &save); key != NULL;
+             key = strtok_r(NULL, " ", &save)) {
+            mock_value(c, key, strlen(key), with_cas);
+        }
+        buf_append(&c->wbuf, "END\r\n", 5);
+        c->rbuf.off += consumed;
+
+        if (line != stack) {
+            free(line);
+        }
+        return true;
+    }
+
+    char *tokens[8];
+    int   ntokens = 1;
+
+    tokens[0] = cmd;
+    for (char *x = strtok_r(NULL, " ", &save); x != NULL && ntokens < 8;
+         x = strtok_r(NULL, " ", &save)) {
+        tokens[ntokens++] = x;
+    }
+
+    bool noreply = ntokens > 1 && strcmp(tokens[ntokens - 1], "noreply") == 0;
+
+    if (strcmp(cmd, "set") == 0 ||
+               strcmp(cmd, "add") == 0 ||
+               strcmp(cmd, "replace") == 0 ||
+               strcmp(cmd, "append") == 0 ||
+               strcmp(cmd, "prepend") == 0 ||
+               strcmp(cmd, "cas") == 0) {
+        long bytes = ntokens > 4 ? strtol(tokens[4], NULL, 10) : -1;
+        if (bytes < 0) {
+            buf_append(&c->wbuf, "CLIENT_ERROR bad command line format\r\n",
+                       38);
+            c->rbuf.off += consumed;
+        } else if (buf_avail(&c->rbuf) < consumed + bytes + 2) {
+            ok = false; // Wait for the rest of the value.
+        } else {
+            if (!noreply) {
+                buf_append(&c->wbuf, "STORED\r\n", 8);
+            }
+            c->rbuf.off += consumed + bytes + 2;
+        }
+    } else if (strcmp(cmd, "delete") == 0) {
+        if (!noreply) {
+            buf_append(&c->wbuf, "DELETED\r\n", 9);
+        }
+        c->rbuf.off += consumed;
+    } else if (strcmp(cmd, "incr") == 0 || strcmp(cmd, "decr") == 0) {
+        if (!noreply) {
+            buf_append(&c->wbuf, "1\r\n", 3);
+        }
+        c->rbuf.off += consumed;
+    } else if (strcmp(cmd, "version") == 0) {
+        buf_append(&c->wbuf, "VERSION moxi_bench_mock\r\n", 25);
+        c->rbuf.off += consumed;
+    } else if (strcmp(cmd, "stats") == 0) {
+        buf_append(&c->wbuf, "END\r\n", 5);
+        c->rbuf.off += consumed;
+    } else if (strcmp(cmd, "flush_all") == 0 ||
+               strcmp(cmd, "verbosity") == 0) {
+        if (!noreply) {
+            buf_append(&c->wbuf, "OK\r\n", 4);
+        }
+        c->rbuf.off += consumed;
+    } else if (strcmp(cmd, "quit") == 0) {
+        *close_conn = true;
+        ok = false;
+    } else {
+        buf_append(&c->wbuf, "ERROR\r\n", 7);
+        c->rbuf.off += consumed;
+    }
+
+    if (line != stack) {
+        free(line);
+    }
+
+    return ok;
+}
+
+static bool mock_binary(mock_conn *c, bool *close_conn) {
+    if (buf_avail(&c->rbuf) < sizeof(protocol_binary_request_header)) {
+        return false;
+    }
+
+    protocol_binary_request_header req;
+    memcpy(req.bytes, buf_head(&c->rbuf), sizeof(req.bytes));
+
+    if (req.request.magic != PROTOCOL_BINARY_REQ) {
+        *close_conn = true;
+        return false;
+    }
+
+    uint32_t bodylen = ntohl(req.request.bodylen);
+    if (buf_avail(&c->rbuf) < sizeof(req.bytes) + bodylen) {
+        return false;
+    }
+
+    uint16_t    keylen = ntohs(req.request.keylen);
+    const char *key = buf_head(&c->rbuf) + sizeof(req.bytes) +
+        req.request.extlen;
+    uint8_t     op = req.request.opcode;
+    uint32_t    opaque = req.request.opaque;
+
+    switch (op) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ: {
+        bool     with_key = (op == PROTOCOL_BINARY_CMD_GETK ||
+                             op == PROTOCOL_BINARY_CMD_GETKQ);
+        uint16_t rkeylen = with_key ? keylen : 0;
+        uint32_t flags = 0;
+
+        bin_header(&c->wbuf, PROTOCOL_BINARY_RES, op, rkeylen, 4, 0,
+                   4 + rkeylen + value_size, opaque, 1);
+        buf_append(&c->wbuf, &flags, 4);
+        buf_append(&c->wbuf, key, rkeylen);
+        buf_append(&c->wbuf, value_data, value_size);
+        break;
+    }
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+    case PROTOCOL_BINARY_CMD_FLUSHQ:
+        break;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENT: {
+        uint64_t one = 0;
+        ((uint8_t *) &one)[7] = 1; // Network byte order.
+
+        bin_header(&c->wbuf, PROTOCOL_BINARY_RES, op, 0, 0, 0,
+                   8, opaque, 1);
+        buf_append(&c->wbuf, &one, 8);
+        break;
+    }
+    case PROTOCOL_BINARY_CMD_VERSION:
+        bin_header(&c->wbuf, PROTOCOL_BINARY_RES, op, 0, 0, 0,
+                   4, opaque, 0);
+        buf_append(&c->wbuf, "mock", 4);
+        break;
+    case PROTOCOL_BINARY_CMD_QUIT:
+    case PROTOCOL_BINARY_CMD_QUITQ:
+        *close_conn = true;
+        return false;
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_FLUSH:
+    case PROTOCOL_BINARY_CMD_NOOP:
+    case PROTOCOL_BINARY_CMD_STAT: // An empty stats response.
+        bin_header(&c->wbuf, PROTOCOL_BINARY_RES, op, 0, 0, 0,
+                   0, opaque, op == PROTOCOL_BINARY_CMD_NOOP ? 0 : 1);
+        break;
+    default:
+        bin_header(&c->wbuf, PROTOCOL_BINARY_RES, op, 0, 0,
+                   PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND,
+                   0, opaque, 0);
+        break;
+    }
+
+    c->rbuf.off += sizeof(req.bytes) + bodylen;
+
+    return true;
+}
+
+static void mock_conn_event(int fd, short which, void *arg) {
+    mock_conn *c = arg;
+    bool close_conn = false;
+
+    (void) fd;
+
+    if (which & EV_READ) {
+        if (buf_read(&c->rbuf, c->fd) < 0) {
+            close_conn = true;
+        }
+
+        while (!close_conn && buf_avail(&c->rbuf) > 0) {
+            bool more;
+
+            if ((uint8_t) buf_head(&c->rbuf)[0] == PROTOCOL_BINARY_REQ) {
+                more = mock_binary(c, &close_conn);
+            } else {
+                more = mock_ascii(c, &close_conn);
+            }
+
+            if (!more) {
+                break;
+            }
+        }
+    }
+
+    if (!close_conn &&
+        buf_write(&c->wbuf, c->fd) < 0) {
+        close_conn = true;
+    }
+
+    if (close_conn) {
+        mock_conn_close(c);
+        return;
+    }
+
+    mock_conn_update(c);
+}
+
+static void mock_accept(int fd, short which, void *arg) {
+    mock_thread *t = arg;
+
+    (void) which;
+
+    for (;;) {
+        int sfd = accept(fd, NULL, NULL);
+        if (sfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("moxi_bench: accept");
+            }
+            return;
+        }
+
+        set_nonblocking(sfd);
+        set_nodelay(sfd);
+
+        mock_conn *c = calloc(1, sizeof(mock_conn));
+        if (c == NULL) {
+            close(sfd);
+            continue;
+        }
+
+        c->fd = sfd;
+        c->base = t->base;
+        mock_conn_update(c);
+    }
+}
+
+static void *mock_thread_main(void *arg) {
+    mock_thread *t = arg;
+
+    event_base_loop(t->base, 0);
+
+    return NULL;
+}
+
+static int mock_run(void) {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    mock_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (mock_listen_fd < 0) {
+        perror("moxi_bench: socket");
+        return EXIT_FAILURE;
+    }
+
+    setsockopt(mock_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(mock_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(mock_listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(mock_listen_fd, 1024) < 0) {
+        perror("moxi_bench: bind/listen");
+        return EXIT_FAILURE;
+    }
+
+    set_nonblocking(mock_listen_fd);
+
+    fprintf(stderr, "moxi_bench: mock downstream on 127.0.0.1:%d,"
+            " %d threads, %d byte values\n",
+            mock_port, num_threads, value_size);
+
+    mock_thread *threads = calloc(num_threads, sizeof(mock_thread));
+    assert(threads != NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        mock_thread *t = &threads[i];
+
+        t->base = event_base_new();
+        assert(t->base != NULL);
+
+        event_set(&t->listen_ev, mock_listen_fd, EV_READ | EV_PERSIST,
+                  mock_accept, t);
+        event_base_set(t->base, &t->listen_ev);
+        event_add(&t->listen_ev, NULL);
+
+        if (pthread_create(&t->tid, NULL, mock_thread_main, t) != 0) {
+            perror("moxi_bench: pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// -------------------------------------------------
+
+// The load generator.
+//
+enum bench_req_kind {
+    BENCH_REQ_GET = 0,
+    BENCH_REQ_SET
+};
+
+typedef struct {
+    uint8_t  kind;  // An enum bench_req_kind.
+    uint8_t  nkeys;
+    uint64_t stamp; // When it was sent, or was due to be sent.
+} bench_req;
+
+typedef struct bench_thread bench_thread;
+
+typedef struct {
+    int           fd;
+    struct event  ev;
+    short         ev_flags;
+    bench_thread *t;
+    bench_buf     rbuf;
+    bench_buf     wbuf;
+    bench_req    *reqs;  // A ring of depth in flight requests.
+    int           req_head;
+    int           req_num;
+    uint32_t      skip;  // Ascii value bytes still to skip.
+} bench_conn;
+
+struct bench_thread {
+    int                id;
+    pthread_t          tid;
+    struct event_base *base;
+    struct event       timer;
+    bench_conn        *conns;
+    int                conns_open;
+    int                next_conn;
+    uint64_t           rng;
+    uint64_t           start;
+    uint64_t           end;
+    double             rate;      // Per thread requests/usec, open loop.
+    uint64_t           scheduled; // Open loop requests sent so far.
+
+    HTGRAM_HANDLE htgram;
+    uint64_t      max_usec;
+    uint64_t      ops;
+    uint64_t      gets;
+    uint64_t      sets;
+    uint64_t      keys;
+    uint64_t      hits;
+    uint64_t      errors;
+    uint64_t      behind;   // Open loop requests never sent.
+};
+
+// Zipfian key ranks, as in "Quickly Generating Billion-Record
+// Synthetic Databases" by Gray et al, which YCSB also uses.
+//
+static double zipf_zetan;
+static double zipf_eta;
+static double zipf_alpha;
+
+static void zipf_init(void) {
+    double zeta2 = 0.0;
+
+    zipf_zetan = 0.0;
+    for (uint64_t i = 1; i <= num_keys; i++) {
+        zipf_zetan += 1.0 / pow((double) i, zipf_theta);
+        if (i == 2) {
+            zeta2 = zipf_zetan;
+        }
+    }
+
+    zipf_alpha = 1.0 / (1.0 - zipf_theta);
+    zipf_eta = (1.0 - pow(2.0 / num_keys, 1.0 - zipf_theta)) /
+        (1.0 - zeta2 / zipf_zetan);
+}
+
+static uint64_t bench_rand(bench_thread *t) {
+    // xorshift64*
+    //
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 2685821657736338717ULL;
+}
+
+static double bench_rand01(bench_thread *t) {
+    return (bench_rand(t) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t bench_key(bench_thread *t) {
+    if (zipf_theta <= 0.0 || num_keys < 2) {
+        return bench_rand(t) % num_keys;
+    }
+
+    double u = bench_rand01(t);
+    double uz = u * zipf_zetan;
+
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, zipf_theta)) {
+        return 1;
+    }
+
+    uint64_t k = (uint64_t) (num_keys *
+                             pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha));
+
+    return k < num_keys ? k : num_keys - 1;
+}
+
+static void bench_conn_event(int fd, short which, void *arg);
+
+static void bench_conn_update(bench_conn *c) {
+    short flags = EV_READ | EV_PERSIST;
+    if (buf_avail(&c->wbuf) > 0) {
+        flags |= EV_WRITE;
+    }
+
+    if (flags != c->ev_flags) {
+        if (c->ev_flags != 0) {
+            event_del(&c->ev);
+        }
+        event_set(&c->ev, c->fd, flags, bench_conn_event, c);
+        event_base_set(c->t->base, &c->ev);
+        event_add(&c->ev, NULL);
+        c->ev_flags = flags;
+    }
+}
+
+static void bench_conn_close(bench_conn *c) {
+    if (c->fd < 0) {
+        return;
+    }
+
+    if (c->ev_flags != 0) {
+        event_del(&c->ev);
+        c->ev_flags = 0;
+    }
+    close(c->fd);
+    c->fd = -1;
+    c->t->errors++;
+
+    if (--c->t->conns_open <= 0) {
+        event_base_loopbreak(c->t->base);
+    }
+}
+
+static void bench_flush(bench_conn *c) {
+    if (c->fd >= 0) {
+        if (buf_write(&c->wbuf, c->fd) < 0) {
+            fprintf(stderr, "moxi_bench: write: %s\n", strerror(errno));
+            bench_conn_close(c);
+        } else {
+            bench_conn_update(c);
+        }
+    }
+}
+
+static void bench_send(bench_conn *c, uint64_t stamp) {
+    bench_thread *t = c->t;
+    bench_req *r = &c->reqs[(c->req_head + c->req_num) % depth];
+    char key[BENCH_KEY_MAX + 1];
+    char line[BENCH_KEY_MAX + 100];
+
+    assert(c->req_num < depth);
+    c->req_num++;
+
+    r->stamp = stamp;
+
+    if ((int) (bench_rand(t) % 100) < get_percent) {
+        r->kind = BENCH_REQ_GET;
+        r->nkeys = multiget;
+
+        if (!binary) {
+            buf_append(&c->wbuf, "get", 3);
+        }
+
+        for (int i = 0; i < multiget; i++) {
+            int n = snprintf(key, sizeof(key), "bench:%llu",
+                             (unsigned long long) bench_key(t));
+            if (binary) {
+                uint8_t op = multiget > 1 ?
+                    PROTOCOL_BINARY_CMD_GETKQ : PROTOCOL_BINARY_CMD_GET;
+                bin_header(&c->wbuf, PROTOCOL_BINARY_REQ, op, n, 0, 0,
+                           n, 0, 0);
+                buf_append(&c->wbuf, key, n);
+            } else {
+                buf_append(&c->wbuf, " ", 1);
+                buf_append(&c->wbuf, key, n);
+            }
+        }
+
+        if (binary) {
+            if (multiget > 1) {
+                bin_header(&c->wbuf, PROTOCOL_BINARY_REQ,
+                           PROTOCOL_BINARY_CMD_NOOP, 0, 0, 0, 0, 0, 0);
+            }
+        } else {
+            buf_append(&c->wbuf, "\r\n", 2);
+        }
+
+        t->gets++;
+        t->keys += multiget;
+    } else {
+        r->kind = BENCH_REQ_SET;
+        r->nkeys = 1;
+
+        int n = snprintf(key, sizeof(key), "bench:%llu",
+                         (unsigned long long) bench_key(t));
+        if (binary) {
+            uint32_t extras[2] = { 0, 0 }; // Flags and exptime.
+
+            bin_header(&c->wbuf, PROTOCOL_BINARY_REQ,
+                       PROTOCOL_BINARY_CMD_SET, n, 8, 0,
+                       8 + n + value_size, 0, 0);
+            buf_append(&c->wbuf, extras, 8);
+            buf_append(&c->wbuf, key, n);
+            buf_append(&c->wbuf, value_data, value_size);
+        } else {
+            int m = snprintf(line, sizeof(line), "set %s 0 0 %d\r\n",
+                             key, value_size);
+            buf_append(&c->wbuf, line, m);
+            buf_append(&c->wbuf, value_data, value_size);
+            buf_append(&c->wbuf, "\r\n", 2);
+        }
+
+        t->sets++;
+    }
+}
+
+// Sends the open loop requests that are due, as conns have room.
+//
+static void bench_schedule(bench_thread *t, uint64_t now) {
+    // Request i is due at t->start + i / t->rate.
+    //
+    uint64_t due = (uint64_t) ((now - t->start) * t->rate) + 1;
+
+    while (t->scheduled < due) {
+        bench_conn *c = NULL;
+
+        for (int i = 0; i < num_conns; i++) {
+            bench_conn *x = &t->conns[t->next_conn];
+            t->next_conn = (t->next_conn + 1) % num_conns;
+
+            if (x->fd >= 0 && x->req_num < depth) {
+                c = x;
+                break;
+            }
+        }
+
+        if (c == NULL) {
+            break;
+        }
+
+        bench_send(c, t->start + (uint64_t) (t->scheduled / t->rate));
+        t->scheduled++;
+    }
+
+    for (int i = 0; i < num_conns; i++) {
+        if (buf_avail(&t->conns[i].wbuf) > 0) {
+            bench_flush(&t->conns[i]);
+        }
+    }
+}
+
+static void bench_complete(bench_conn *c, bool error) {
+    bench_thread *t = c->t;
+    bench_req *r = &c->reqs[c->req_head];
+    uint64_t now = bench_usec();
+    uint64_t usec = now > r->stamp ? now - r->stamp : 0;
+
+    assert(c->req_num > 0);
+    c->req_head = (c->req_head + 1) % depth;
+    c->req_num--;
+
+    htgram_incr(t->htgram, usec, 1);
+    if (t->max_usec < usec) {
+        t->max_usec = usec;
+    }
+
+    t->ops++;
+    if (error) {
+        t->errors++;
+    }
+
+    if (rate <= 0.0 && now < t->end) {
+        bench_send(c, now);
+    }
+}
+
+static bool is_error_line(const char *line, ssize_t n) {
+    return (n >= 5 && strncmp(line, "ERROR", 5) == 0) ||
+           (n >= 12 && strncmp(line, "CLIENT_ERROR", 12) == 0) ||
+           (n >= 12 && strncmp(line, "SERVER_ERROR", 12) == 0);
+}
+
+static bool bench_read_ascii(bench_conn *c) {
+    if (c->skip > 0) {
+        size_t n = buf_avail(&c->rbuf);
+        if (n > c->skip) {
+            n = c->skip;
+        }
+        c->rbuf.off += n;
+        c->skip -= n;
+        return c->skip == 0;
+    }
+
+    size_t consumed;
+    ssize_t n = buf_line(&c->rbuf, &consumed);
+    if (n < 0) {
+        return false;
+    }
+
+    const char *line = buf_head(&c->rbuf);
+    bench_req *r = &c->reqs[c->req_head];
+
+    if (r->kind == BENCH_REQ_GET &&
+        n > 6 && strncmp(line, "VALUE ", 6) == 0) {
+        // VALUE <key> <flags> <bytes> [<cas>]
+        //
+        char tmp[BENCH_KEY_MAX + 100];
+        unsigned long bytes = 0;
+
+        if ((size_t) n < sizeof(tmp)) {
+            memcpy(tmp, line, n);
+            tmp[n] = '\0';
+
+            char *s = strchr(tmp + 6, ' ');
+            s = s != NULL ? strchr(s + 1, ' ') : NULL;
+            if (s != NULL) {
+                bytes = strtoul(s + 1, NULL, 10);
+            }
+        }
+
+        c->rbuf.off += consumed;
+        c->skip = bytes + 2;
+        c->t->hits++;
+        return true;
+    }
+
+    bool error = is_error_line(line, n);
+
+    c->rbuf.off += consumed;
+    bench_complete(c, error);
+
+    return true;
+}
+
+static bool bench_read_binary(bench_conn *c) {
+    protocol_binary_response_header h;
+
+    if (buf_avail(&c->rbuf) < sizeof(h.bytes)) {
+        return false;
+    }
+
+    memcpy(h.bytes, buf_head(&c->rbuf), sizeof(h.bytes));
+
+    uint32_t bodylen = ntohl(h.response.bodylen);
+    if (buf_avail(&c->rbuf) < sizeof(h.bytes) + bodylen) {
+        return false;
+    }
+
+    c->rbuf.off += sizeof(h.bytes) + bodylen;
+
+    uint16_t status = ntohs(h.response.status);
+
+    switch (h.response.opcode) {
+    case PROTOCOL_BINARY_CMD_GETKQ:
+    case PROTOCOL_BINARY_CMD_GETQ:
+        // Hits of a multiget, which its NOOP completes.
+        //
+        if (status == 0) {
+            c->t->hits++;
+        }
+        return true;
+    case PROTOCOL_BINARY_CMD_GET:
+        if (status == 0) {
+            c->t->hits++;
+        }
+        bench_complete(c, status != 0 &&
+                       status != PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+        return true;
+    case PROTOCOL_BINARY_CMD_NOOP:
+        bench_complete(c, false);
+        return true;
+    default:
+        bench_complete(c, status != 0);
+        return true;
+    }
+}
+
+static void bench_conn_event(int fd, short which, void *arg) {
+    bench_conn *c = arg;
+
+    (void) fd;
+
+    if (which & EV_READ) {
+        if (buf_read(&c->rbuf, c->fd) < 0) {
+            fprintf(stderr, "moxi_bench: conn closed by server\n");
+            bench_conn_close(c);
+            return;
+        }
+
+        while (c->req_num > 0 && buf_avail(&c->rbuf) > 0) {
+            bool more = binary ?
+                bench_read_binary(c) : bench_read_ascii(c);
+            if (!more) {
+                break;
+            }
+        }
+
+        if (rate > 0.0) {
+            bench_schedule(c->t, bench_usec());
+        }
+    }
+
+    bench_flush(c);
+}
+
+static void bench_timer(int fd, short which, void *arg) {
+    bench_thread *t = arg;
+    uint64_t now = bench_usec();
+
+    (void) fd;
+    (void) which;
+
+    if (now >= t->end) {
+        event_base_loopbreak(t->base);
+        return;
+    }
+
+    if (rate > 0.0) {
+        bench_schedule(t, now);
+    }
+
+    // Wake up when the next open loop request is due, if that's
+    // sooner than the timer's period.
+    //
+    uint64_t usec = rate > 0.0 ? 1000 : 100000;
+    if (rate > 0.0) {
+        uint64_t next = t->start + (uint64_t) (t->scheduled / t->rate);
+        if (next > now && next - now < usec) {
+            usec = next - now;
+        }
+    }
+    if (usec > t->end - now) {
+        usec = t->end - now;
+    }
+
+    struct timeval tv = { 0, usec };
+    evtimer_add(&t->timer, &tv);
+}
+
+/*
+ * Open loop requests are sent from a 1 msec timer, which libevent 2.1
+ * can keep precise, rather than rounding the epoll timeout up to the
+ * kernel's clock tick.
+ */
+static struct event_base *bench_event_base_new(void) {
+#if defined(LIBEVENT_VERSION_NUMBER) && LIBEVENT_VERSION_NUMBER >= 0x02010000
+    struct event_config *cfg = event_config_new();
+    if (cfg != NULL) {
+        event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+
+        struct event_base *base = event_base_new_with_config(cfg);
+
+        event_config_free(cfg);
+
+        if (base != NULL) {
+            return base;
+        }
+    }
+#endif
+    return event_base_new();
+}
+
+static int bench_connect(void) {
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    char portstr[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    snprintf(portstr, sizeof(portstr), "%d", port);
+
+    int rc = getaddrinfo(host, portstr, &hints, &ai);
+    if (rc != 0) {
+        fprintf(stderr, "moxi_bench: getaddrinfo %s: %s\n",
+                host, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd >= 0 &&
+        connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd < 0) {
+        fprintf(stderr, "moxi_bench: connect %s:%d: %s\n",
+                host, port, strerror(errno));
+    }
+
+    freeaddrinfo(ai);
+
+    return fd;
+}
+
+static void *bench_thread_main(void *arg) {
+    bench_thread *t = arg;
+
+    evtimer_set(&t->timer, bench_timer, t);
+    event_base_set(t->base, &t->timer);
+
+    t->start = bench_usec();
+    t->end = t->start + (uint64_t) duration * 1000000;
+
+    if (rate <= 0.0) {
+        for (int i = 0; i < num_conns; i++) {
+            bench_conn *c = &t->conns[i];
+            for (int k = 0; k < depth; k++) {
+                bench_send(c, t->start);
+            }
+            bench_flush(c);
+        }
+    }
+
+    bench_timer(-1, 0, t);
+
+    event_base_loop(t->base, 0);
+
+    if (rate > 0.0) {
+        uint64_t due = (uint64_t) ((bench_usec() - t->start) * t->rate) + 1;
+        t->behind = due > t->scheduled ? due - t->scheduled : 0;
+    }
+
+    return NULL;
+}
+
+static void bench_report(bench_thread *threads, uint64_t elapsed) {
+    HTGRAM_HANDLE agg = htgram_mk_loglinear(6, 27);
+    bench_thread sum;
+
+    assert(agg != NULL);
+    memset(&sum, 0, sizeof(sum));
+
+    for (int i = 0; i < num_threads; i++) {
+        bench_thread *t = &threads[i];
+
+        htgram_add(agg, t->htgram);
+        if (sum.max_usec < t->max_usec) {
+            sum.max_usec = t->max_usec;
+        }
+        sum.ops    += t->ops;
+        sum.gets   += t->gets;
+        sum.sets   += t->sets;
+        sum.keys   += t->keys;
+        sum.hits   += t->hits;
+        sum.errors += t->errors;
+        sum.behind += t->behind;
+    }
+
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    printf("moxi_bench: %s:%d %s, %d threads x %d conns, depth %d, %s",
+           host, port, binary ? "binary" : "ascii",
+           num_threads, num_conns, depth,
+           rate > 0.0 ? "open loop" : "closed loop");
+    if (rate > 0.0) {
+        printf(" at %.0f/sec", rate);
+    }
+    printf("\n");
+    printf("keys %llu %s", (unsigned long long) num_keys,
+           zipf_theta > 0.0 ? "zipfian" : "uniform");
+    if (zipf_theta > 0.0) {
+        printf(" %.2f", zipf_theta);
+    }
+    printf(", %d%% gets of %d keys, %d byte values\n",
+           get_percent, multiget, value_size);
+
+    printf("ops      %llu in %.2f secs, %.0f ops/sec\n",
+           (unsigned long long) sum.ops, elapsed / 1000000.0,
+           sum.ops * 1000000.0 / elapsed);
+    printf("gets     %llu, %llu keys, %llu hits (%.1f%%)\n",
+           (unsigned long long) sum.gets,
+           (unsigned long long) sum.keys,
+           (unsigned long long) sum.hits,
+           sum.keys > 0 ? 100.0 * sum.hits / sum.keys : 0.0);
+    printf("sets     %llu\n", (unsigned long long) sum.sets);
+    printf("errors   %llu\n", (unsigned long long) sum.errors);
+    if (rate > 0.0) {
+        printf("behind   %llu requests never sent\n",
+               (unsigned long long) sum.behind);
+    }
+
+    static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+
+    printf("latency  usecs");
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        int64_t v = 0;
+        if (htgram_percentile(agg, percentiles[i], &v)) {
+            printf(", p%g %lld", percentiles[i], (long long) v);
+        }
+    }
+    printf(", max %llu\n", (unsigned long long) sum.max_usec);
+
+    htgram_destroy(agg);
+}
+
+static int bench_run(void) {
+    if (zipf_theta > 0.0) {
+        zipf_init();
+    }
+
+    bench_thread *threads = calloc(num_threads, sizeof(bench_thread));
+    assert(threads != NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        bench_thread *t = &threads[i];
+
+        t->id = i;
+        t->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        t->rate = rate / num_threads / 1000000.0;
+        t->base = bench_event_base_new();
+        t->htgram = htgram_mk_loglinear(6, 27);
+        t->conns = calloc(num_conns, sizeof(bench_conn));
+        assert(t->base != NULL && t->htgram != NULL && t->conns != NULL);
+
+        for (int k = 0; k < num_conns; k++) {
+            bench_conn *c = &t->conns[k];
+
+            c->t = t;
+            c->fd = bench_connect();
+            if (c->fd < 0) {
+                return EXIT_FAILURE;
+            }
+
+            set_nonblocking(c->fd);
+            set_nodelay(c->fd);
+
+            c->reqs = calloc(depth, sizeof(bench_req));
+            assert(c->reqs != NULL);
+
+            t->conns_open++;
+            bench_conn_update(c);
+        }
+    }
+
+    uint64_t start = bench_usec();
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i].tid, NULL,
+                           bench_thread_main, &threads[i]) != 0) {
+            perror("moxi_bench: pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+
+    bench_report(threads, bench_usec() - start);
+
+    return EXIT_SUCCESS;
+}
+
+static void usage(void) {
+    printf("Usage: moxi_bench [options]\n"
+           "Load generator:\n"
+           "  -h <host>    server host (default 127.0.0.1)\n"
+           "  -p <port>    server port (default 11211)\n"
+           "  -t <num>     threads (default 4)\n"
+           "  -c <num>     conns per thread (default 4)\n"
+           "  -d <secs>    duration (default 10)\n"
+           "  -b           binary protocol (default ascii)\n"
+           "  -n <num>     distinct keys (default 100000)\n"
+           "  -z <theta>   zipfian keys, 0 < theta < 1 (default uniform)\n"
+           "  -g <pct>     percent of requests that are gets (default 90)\n"
+           "  -m <num>     keys per get, max %d (default 1)\n"
+           "  -s <bytes>   value size (default 100)\n"
+           "  -D <num>     requests in flight per conn (default 1)\n"
+           "  -R <num>     open loop requests/sec, total (default closed loop)\n"
+           "Mock downstream:\n"
+           "  -M <port>    serve on 127.0.0.1:<port> with -t threads,\n"
+           "               answering gets with -s byte values\n",
+           BENCH_KEYS_MAX);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+
+    while ((ch = getopt(argc, argv, "h:p:t:c:d:bn:z:g:m:s:D:R:M:")) != -1) {
+        switch (ch) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 't': num_threads = atoi(optarg); break;
+        case 'c': num_conns = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'b': binary = true; break;
+        case 'n': num_keys = strtoull(optarg, NULL, 10); break;
+        case 'z': zipf_theta = atof(optarg); break;
+        case 'g': get_percent = atoi(optarg); break;
+        case 'm': multiget = atoi(optarg); break;
+        case 's': value_size = atoi(optarg); break;
+        case 'D': depth = atoi(optarg); break;
+        case 'R': rate = atof(optarg); break;
+        case 'M': mock_port = atoi(optarg); break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (num_threads <= 0 || num_conns <= 0 || duration <= 0 ||
+        num_keys == 0 || zipf_theta < 0.0 || zipf_theta >= 1.0 ||
+        get_percent < 0 || get_percent > 100 ||
+        multiget <= 0 || multiget > BENCH_KEYS_MAX ||
+        value_size < 0 || depth <= 0 || rate < 0.0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    value_data = malloc(value_size + 1);
+    assert(value_data != NULL);
+    memset(value_data, 'x', value_size);
+
+    if (mock_port > 0) {
+        return mock_run();
+    }
+
+    return bench_run();
+}
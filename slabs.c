@@ -12,10 +12,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 #include <pthread.h>
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
 #include "log.h"
 
+#if defined(__linux__) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define SLABS_LINUX_ARENA 1
+#endif
+
 /* powers-of-N allocation structures */
 
 typedef struct {
@@ -36,6 +47,10 @@ typedef struct {
 
     unsigned int killing;  /* index+1 of dying slab, or zero if none */
     size_t requested; /* The number of requested bytes */
+
+    void *rebal_page;        /* page the rebalancer is taking away, or NULL */
+    unsigned int pages_in;   /* pages the rebalancer moved here */
+    unsigned int pages_out;  /* pages the rebalancer moved away */
 } slabclass_t;
 
 static slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES];
@@ -47,16 +62,128 @@ static void *mem_base = NULL;
 static void *mem_current = NULL;
 static size_t mem_avail = 0;
 
+/* How the preallocated mem_base was mapped, for the stats. */
+static const char *arena_pages = "none";
+static size_t arena_page_size = 0;
+static int arena_numa_nodes = 0;
+static long arena_prefault_faults = 0;
+
 /**
  * Access to the slab allocator is protected by this lock
  */
 static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Each thread keeps a magazine of free chunks per slab class, so most
+ * slabs_alloc() and slabs_free() calls don't take the slabs_lock.  An
+ * empty magazine is refilled, and a full one is drained, by half its
+ * capacity at a time under the lock.  The capacity is limited by
+ * SLAB_MAGAZINE_BYTES, so classes of big chunks don't have magazines
+ * and free memory isn't stranded in idle threads.
+ *
+ * Only the owning thread changes a magazine, except that the stats
+ * read its counters, and a thread's magazines are drained when it
+ * exits and then reused by the next new thread.
+ */
+#define SLAB_MAGAZINE_MAX   32
+#define SLAB_MAGAZINE_BYTES (64 * 1024)
+
+typedef struct {
+    void        *chunks[SLAB_MAGAZINE_MAX];
+    unsigned int count;
+    int64_t      requested;    /* net bytes requested by this thread */
+    uint64_t     alloc_hits;   /* allocs served from the magazine */
+    uint64_t     alloc_misses; /* allocs that had to refill it */
+    uint64_t     free_hits;    /* frees kept in the magazine */
+    uint64_t     free_misses;  /* frees that had to drain it */
+} slab_magazine;
+
+typedef struct slab_magazines slab_magazines;
+
+struct slab_magazines {
+    slab_magazine   mags[MAX_NUMBER_OF_SLAB_CLASSES];
+    bool            orphan;
+    slab_magazines *next;
+};
+
+static unsigned int    magazine_capacity[MAX_NUMBER_OF_SLAB_CLASSES];
+static slab_magazines *magazines;  /* all threads' magazines, under slabs_lock */
+static pthread_key_t   magazines_key;
+static pthread_once_t  magazines_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * With settings.slab_automove, a background thread moves slab pages
+ * to a class that keeps evicting, from one that doesn't need them.
+ * Every second it compares each class's evictions and allocation
+ * failures (item_class_pressure()) with the second before.  When one
+ * class has had the most of them for SLAB_REBAL_WINDOWS seconds in a
+ * row, it gets a page from a class that has a page's worth of free
+ * chunks ("free"), or else from the biggest class that hasn't evicted
+ * for as long ("cold").
+ *
+ * A page is moved in three steps.  Under the slabs_lock, the page's
+ * free chunks are taken off the source class, and do_slabs_free()
+ * catches its other chunks as they're freed from then on.  Without
+ * the lock, the thread evicts the items in the page, walking at most
+ * SLAB_REBAL_STEP chunks at a time.  Once every chunk is back, the
+ * page goes to the destination class under the lock.  A page that
+ * still has busy items after SLAB_REBAL_PASSES walks, or chunks left
+ * in the magazines of a thread that went idle, goes back to its class.
+ *
+ * Any class can only take any page if they're all POWER_BLOCK bytes,
+ * so that's how big pages are made when slab_automove is on.
+ */
+#define SLAB_REBAL_WINDOWS 3
+#define SLAB_REBAL_STEP    1024
+#define SLAB_REBAL_PASSES  1000
+
+enum rebal_reason {
+    REBAL_FREE,
+    REBAL_COLD,
+    REBAL_last
+};
+
+static const char *rebal_reason_names[REBAL_last] = {
+    "free",
+    "cold"
+};
+
+/* The page being moved, set under the slabs_lock, and only walked
+ * by the rebalancer thread. */
+static struct {
+    char        *page;          /* NULL when no page is being moved */
+    unsigned int src;
+    unsigned int dst;
+    int          reason;        /* enum rebal_reason */
+    unsigned int chunks;        /* chunks in the page */
+    unsigned int reclaimed;     /* chunks the source class gave back */
+    uint8_t     *reclaimed_map; /* bit per chunk of the page */
+    unsigned int next;          /* next chunk to walk */
+    unsigned int passes;        /* walks of the whole page so far */
+} rebal;
+
+/* Under the slabs_lock */
+static struct {
+    uint64_t moves[REBAL_last];
+    uint64_t aborts;
+    uint64_t evictions;
+    uint64_t busy;
+} rebal_stats;
+
+/* The class rebal.page is taken from, or 0, for the magazines. */
+static unsigned int rebal_class;
+
 /*
  * Forward Declarations
  */
 static int do_slabs_newslab(const unsigned int id);
 static void *memory_allocate(size_t size);
+#ifdef SLABS_LINUX_ARENA
+static void *arena_alloc(const size_t limit);
+#endif
+static void *do_slabs_alloc(const size_t size, unsigned int id);
+static void do_slabs_free(void *ptr, const size_t size, unsigned int id);
+static void do_rebal_reclaim(void *ptr);
 
 #ifndef DONT_PREALLOC_SLABS
 /* Preallocate as many slab pages as possible (called from slabs_init)
@@ -102,8 +229,18 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc) {
     mem_limit = limit;
 
     if (prealloc) {
-        /* Allocate everything in a big chunk with malloc */
-        mem_base = malloc(mem_limit);
+#ifdef SLABS_LINUX_ARENA
+        if (settings.large_pages || settings.numa_interleave) {
+            mem_base = arena_alloc(mem_limit);
+        }
+#endif
+        if (mem_base == NULL) {
+            /* Allocate everything in a big chunk with malloc */
+            mem_base = malloc(mem_limit);
+            if (mem_base != NULL) {
+                arena_pages = "malloc";
+            }
+        }
         if (mem_base != NULL) {
             mem_current = mem_base;
             mem_avail = mem_limit;
@@ -122,6 +259,15 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc) {
 
         slabclass[i].size = size;
         slabclass[i].perslab = POWER_BLOCK / slabclass[i].size;
+#if !defined(USE_SYSTEM_MALLOC) && !defined(ALLOW_SLABS_REASSIGN)
+        magazine_capacity[i] = SLAB_MAGAZINE_BYTES / slabclass[i].size;
+        if (magazine_capacity[i] > SLAB_MAGAZINE_MAX) {
+            magazine_capacity[i] = SLAB_MAGAZINE_MAX;
+        }
+        if (magazine_capacity[i] < 2) {
+            magazine_capacity[i] = 0;
+        }
+#endif
         size *= factor;
         if (settings.verbose > 1) {
             moxi_log_write("slab class %3d: chunk size %6u perslab %5u\n",
@@ -173,6 +319,225 @@ static void slabs_preallocate (const unsigned int maxslabs) {
 }
 #endif
 
+#ifdef SLABS_LINUX_ARENA
+/*
+ * On Linux the preallocated item memory can be mapped with huge pages,
+ * from the hugetlb pool if pages are reserved there, or else as
+ * transparent huge pages, so that a big cache doesn't take a TLB miss
+ * on most accesses.  It can also be interleaved across the NUMA nodes,
+ * so no one node's memory and bandwidth takes all of the cache.  It's
+ * then prefaulted, so the page faults happen at startup instead of
+ * while serving requests.
+ */
+
+/* Returns the number after prefix in a file, times unit, or 0. */
+static size_t read_size_file(const char *path, const char *prefix,
+                             size_t unit) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    char line[256];
+    size_t ret = 0;
+    size_t len = strlen(prefix);
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, prefix, len) == 0) {
+            ret = strtoull(line + len, NULL, 10) * unit;
+            break;
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
+
+static size_t round_up(size_t len, size_t align) {
+    return (len + align - 1) / align * align;
+}
+
+static void *arena_map(size_t *len) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *p;
+
+    arena_pages = "mmap";
+    arena_page_size = page;
+
+    if (!settings.large_pages) {
+        *len = round_up(*len, page);
+        p = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p != MAP_FAILED ? p : NULL;
+    }
+
+#ifdef MAP_HUGETLB
+    size_t huge = read_size_file("/proc/meminfo", "Hugepagesize:", 1024);
+    if (huge != 0) {
+        size_t want = round_up(*len, huge);
+
+        p = mmap(NULL, want, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            arena_pages = "hugetlb";
+            arena_page_size = huge;
+            *len = want;
+            return p;
+        }
+
+        if (settings.verbose > 0) {
+            moxi_log_write("No hugetlb pages for item memory: %s\n",
+                           strerror(errno));
+        }
+    }
+#endif
+
+    /* Transparent huge pages need the region to be aligned to them. */
+    size_t thp = read_size_file("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size",
+                                "", 1);
+    if (thp < page) {
+        thp = 2 * 1024 * 1024;
+    }
+
+    size_t want = round_up(*len, thp);
+    char *raw = mmap(NULL, want + thp, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    p = (char *) round_up((size_t) raw, thp);
+    if (p > raw) {
+        munmap(raw, p - raw);
+    }
+    if (raw + want + thp > p + want) {
+        munmap(p + want, raw + want + thp - (p + want));
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(p, want, MADV_HUGEPAGE) == 0) {
+        arena_pages = "thp";
+        arena_page_size = thp;
+    } else if (settings.verbose > 0) {
+        moxi_log_write("No transparent huge pages for item memory: %s\n",
+                       strerror(errno));
+    }
+#endif
+
+    *len = want;
+    return p;
+}
+
+#define ARENA_MPOL_INTERLEAVE 3
+#define ARENA_MAX_NODES       1024
+
+/* Interleaves the pages of a region across the online NUMA nodes,
+ * returning the number of nodes, or 0 if it didn't. */
+static int arena_interleave(void *p, size_t len) {
+#ifdef SYS_mbind
+    unsigned long mask[ARENA_MAX_NODES / (8 * sizeof(unsigned long))];
+    int nodes = 0;
+
+    memset(mask, 0, sizeof(mask));
+
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    /* A list of node ranges, like "0-3,6". */
+    char line[256];
+    if (fgets(line, sizeof(line), f) != NULL) {
+        char *next = line;
+        while (*next >= '0' && *next <= '9') {
+            long lo = strtol(next, &next, 10);
+            long hi = lo;
+            if (*next == '-') {
+                hi = strtol(next + 1, &next, 10);
+            }
+            for (long n = lo; n <= hi && n < ARENA_MAX_NODES; n++) {
+                mask[n / (8 * sizeof(unsigned long))] |=
+                    1UL << (n % (8 * sizeof(unsigned long)));
+                nodes++;
+            }
+            if (*next == ',') {
+                next++;
+            }
+        }
+    }
+
+    fclose(f);
+
+    if (nodes < 2) {
+        return nodes;
+    }
+
+    if (syscall(SYS_mbind, p, len, ARENA_MPOL_INTERLEAVE,
+                mask, (unsigned long) ARENA_MAX_NODES, 0) != 0) {
+        moxi_log_write("Failed to interleave item memory: %s\n",
+                       strerror(errno));
+        return 0;
+    }
+
+    return nodes;
+#else
+    (void) p;
+    (void) len;
+    return 0;
+#endif
+}
+
+static long arena_faults(void) {
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return usage.ru_minflt + usage.ru_majflt;
+#else
+    return 0;
+#endif
+}
+
+static void *arena_alloc(const size_t limit) {
+    size_t len = limit;
+    char *p = arena_map(&len);
+
+    if (p == NULL) {
+        moxi_log_write("Failed to map item memory: %s\n", strerror(errno));
+        arena_pages = "none";
+        arena_page_size = 0;
+        return NULL;
+    }
+
+    if (settings.numa_interleave) {
+        arena_numa_nodes = arena_interleave(p, len);
+    }
+
+    /* Touch every base page, which faults in a whole huge page at
+     * its first one. */
+    size_t page = sysconf(_SC_PAGESIZE);
+    long faults = arena_faults();
+
+    for (size_t off = 0; off < len; off += page) {
+        ((volatile char *) p)[off] = 0;
+    }
+
+    arena_prefault_faults = arena_faults() - faults;
+
+    if (settings.verbose > 0) {
+        moxi_log_write("Item memory: %lu bytes of %s pages of %lu bytes,"
+                       " %d numa nodes, %ld faults to prefault\n",
+                       (unsigned long) len, arena_pages,
+                       (unsigned long) arena_page_size,
+                       arena_numa_nodes, arena_prefault_faults);
+    }
+
+    return p;
+}
+#endif
+
 static int grow_slab_list (const unsigned int id) {
     slabclass_t *p = &slabclass[id];
     if (p->slabs == p->list_size) {
@@ -190,7 +555,7 @@ static int do_slabs_newslab(const unsigned int id) {
 #ifdef ALLOW_SLABS_REASSIGN
     int len = POWER_BLOCK;
 #else
-    int len = p->size * p->perslab;
+    int len = settings.slab_automove ? POWER_BLOCK : p->size * p->perslab;
 #endif
     char *ptr;
 
@@ -284,6 +649,15 @@ static void do_slabs_free(void *ptr, const size_t size, unsigned int id) {
     return;
 #endif
 
+    if (p->rebal_page != NULL &&
+        (char *)ptr >= (char *)p->rebal_page &&
+        (char *)ptr < (char *)p->rebal_page + POWER_BLOCK) {
+        /* The rebalancer is taking this chunk's page away. */
+        do_rebal_reclaim(ptr);
+        p->requested -= size;
+        return;
+    }
+
     if (p->sl_curr == p->sl_total) { /* need more space on the free list */
         int new_size = (p->sl_total != 0) ? p->sl_total * 2 : 16;  /* 16 is arbitrary */
         void **new_slots = realloc(p->slots, new_size * sizeof(void *));
@@ -337,6 +711,9 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
     struct thread_stats thread_stats;
     threadlocal_stats_aggregate(&thread_stats);
 
+    uint64_t total_alloc_hits = 0;
+    uint64_t total_alloc_misses = 0;
+
     total = 0;
     for (i = POWER_SMALLEST; i <= (int) power_largest; i++) {
         slabclass_t *p = &slabclass[i];
@@ -345,6 +722,26 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
             slabs = p->slabs;
             perslab = p->perslab;
 
+            /* Chunks in the threads' magazines are free. */
+            uint32_t mag_chunks = 0;
+            int64_t requested = p->requested;
+            uint64_t alloc_hits = 0, alloc_misses = 0;
+            uint64_t free_hits = 0, free_misses = 0;
+
+            for (slab_magazines *ms = magazines; ms != NULL; ms = ms->next) {
+                slab_magazine *m = &ms->mags[i];
+
+                mag_chunks   += __atomic_load_n(&m->count, __ATOMIC_RELAXED);
+                requested    += __atomic_load_n(&m->requested, __ATOMIC_RELAXED);
+                alloc_hits   += __atomic_load_n(&m->alloc_hits, __ATOMIC_RELAXED);
+                alloc_misses += __atomic_load_n(&m->alloc_misses, __ATOMIC_RELAXED);
+                free_hits    += __atomic_load_n(&m->free_hits, __ATOMIC_RELAXED);
+                free_misses  += __atomic_load_n(&m->free_misses, __ATOMIC_RELAXED);
+            }
+
+            total_alloc_hits   += alloc_hits;
+            total_alloc_misses += alloc_misses;
+
             char key_str[STAT_KEY_LEN];
             char val_str[STAT_VAL_LEN];
             int klen = 0, vlen = 0;
@@ -354,11 +751,23 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
             APPEND_NUM_STAT(i, "total_pages", "%u", slabs);
             APPEND_NUM_STAT(i, "total_chunks", "%u", slabs * perslab);
             APPEND_NUM_STAT(i, "used_chunks", "%u",
-                            slabs*perslab - p->sl_curr - p->end_page_free);
+                            slabs*perslab - p->sl_curr - p->end_page_free -
+                            mag_chunks);
             APPEND_NUM_STAT(i, "free_chunks", "%u", p->sl_curr);
             APPEND_NUM_STAT(i, "free_chunks_end", "%u", p->end_page_free);
             APPEND_NUM_STAT(i, "mem_requested", "%llu",
-                            (unsigned long long)p->requested);
+                            (unsigned long long)requested);
+            APPEND_NUM_STAT(i, "mag_chunks", "%u", mag_chunks);
+            APPEND_NUM_STAT(i, "mag_alloc_hits", "%llu",
+                            (unsigned long long)alloc_hits);
+            APPEND_NUM_STAT(i, "mag_alloc_misses", "%llu",
+                            (unsigned long long)alloc_misses);
+            APPEND_NUM_STAT(i, "mag_free_hits", "%llu",
+                            (unsigned long long)free_hits);
+            APPEND_NUM_STAT(i, "mag_free_misses", "%llu",
+                            (unsigned long long)free_misses);
+            APPEND_NUM_STAT(i, "pages_moved_in", "%u", p->pages_in);
+            APPEND_NUM_STAT(i, "pages_moved_out", "%u", p->pages_out);
             APPEND_NUM_STAT(i, "get_hits", "%llu",
                     (unsigned long long)thread_stats.slab_stats[i].get_hits);
             APPEND_NUM_STAT(i, "cmd_set", "%llu",
@@ -382,6 +791,47 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
 
     APPEND_STAT("active_slabs", "%d", total);
     APPEND_STAT("total_malloced", "%llu", (unsigned long long)mem_malloced);
+    APPEND_STAT("mag_alloc_hits", "%llu",
+                (unsigned long long)total_alloc_hits);
+    APPEND_STAT("mag_alloc_misses", "%llu",
+                (unsigned long long)total_alloc_misses);
+
+    APPEND_STAT("slab_reassign_running", "%d", rebal.page != NULL);
+    if (rebal.page != NULL) {
+        APPEND_STAT("slab_reassign_src", "%u", rebal.src);
+        APPEND_STAT("slab_reassign_dst", "%u", rebal.dst);
+        APPEND_STAT("slab_reassign_reason", "%s",
+                    rebal_reason_names[rebal.reason]);
+    }
+    for (i = 0; i < REBAL_last; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "slab_reassign_moves_%s",
+                 rebal_reason_names[i]);
+        APPEND_STAT(name, "%llu", (unsigned long long)rebal_stats.moves[i]);
+    }
+    APPEND_STAT("slab_reassign_aborts", "%llu",
+                (unsigned long long)rebal_stats.aborts);
+    APPEND_STAT("slab_reassign_evictions", "%llu",
+                (unsigned long long)rebal_stats.evictions);
+    APPEND_STAT("slab_reassign_busy", "%llu",
+                (unsigned long long)rebal_stats.busy);
+
+    long minor_faults = 0;
+    long major_faults = 0;
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        minor_faults = usage.ru_minflt;
+        major_faults = usage.ru_majflt;
+    }
+#endif
+
+    APPEND_STAT("arena_pages", "%s", arena_pages);
+    APPEND_STAT("arena_page_size", "%lu", (unsigned long)arena_page_size);
+    APPEND_STAT("arena_numa_nodes", "%d", arena_numa_nodes);
+    APPEND_STAT("arena_prefault_faults", "%ld", arena_prefault_faults);
+    APPEND_STAT("minor_faults", "%ld", minor_faults);
+    APPEND_STAT("major_faults", "%ld", major_faults);
     add_stats(NULL, 0, NULL, 0, c);
 }
 
@@ -495,8 +945,150 @@ static void *memory_allocate(size_t size) {
     return ret;
 }
 
+static void magazine_count(uint64_t *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/* Returns a thread's chunks to the slab classes.  The caller holds
+ * the slabs_lock. */
+static void do_magazines_drain(slab_magazines *ms) {
+    for (int id = POWER_SMALLEST; id <= (int) power_largest; id++) {
+        slab_magazine *m = &ms->mags[id];
+
+        while (m->count > 0) {
+            do_slabs_free(m->chunks[m->count - 1], 0, id);
+            __atomic_store_n(&m->count, m->count - 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void magazines_orphan(void *arg) {
+    slab_magazines *ms = arg;
+
+    pthread_mutex_lock(&slabs_lock);
+    do_magazines_drain(ms);
+    ms->orphan = true;
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+static void magazines_key_create(void) {
+    pthread_key_create(&magazines_key, magazines_orphan);
+}
+
+/* Returns the calling thread's magazine for a slab class, or NULL
+ * if the class doesn't use magazines. */
+static slab_magazine *slabs_magazine(unsigned int id) {
+    if (id < POWER_SMALLEST || id > power_largest) {
+        return NULL;
+    }
+
+    pthread_once(&magazines_key_once, magazines_key_create);
+
+    slab_magazines *ms = pthread_getspecific(magazines_key);
+
+    /* While the rebalancer takes a page away from a class, threads hand
+     * back their chunks of that class, which may be in the page, and
+     * go through the lock for it. */
+    unsigned int moving = __atomic_load_n(&rebal_class, __ATOMIC_RELAXED);
+    if (moving != 0 && ms != NULL && ms->mags[moving].count > 0) {
+        slab_magazine *m = &ms->mags[moving];
+
+        pthread_mutex_lock(&slabs_lock);
+        while (m->count > 0) {
+            do_slabs_free(m->chunks[m->count - 1], 0, moving);
+            __atomic_store_n(&m->count, m->count - 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&slabs_lock);
+    }
+
+    if (magazine_capacity[id] == 0 || id == moving) {
+        return NULL;
+    }
+
+    if (ms == NULL) {
+        pthread_mutex_lock(&slabs_lock);
+
+        /* Reuse the magazines of an exited thread, which keeps its
+         * hit counts in the stats. */
+        for (ms = magazines; ms != NULL; ms = ms->next) {
+            if (ms->orphan) {
+                ms->orphan = false;
+                break;
+            }
+        }
+
+        if (ms == NULL) {
+            ms = calloc(1, sizeof(slab_magazines));
+            if (ms != NULL) {
+                ms->next = magazines;
+                magazines = ms;
+            }
+        }
+
+        pthread_mutex_unlock(&slabs_lock);
+
+        if (ms == NULL) {
+            return NULL;
+        }
+
+        pthread_setspecific(magazines_key, ms);
+    }
+
+    return &ms->mags[id];
+}
+
+static void magazine_refill(slab_magazine *m, unsigned int id) {
+    unsigned int want = magazine_capacity[id] / 2;
+
+    pthread_mutex_lock(&slabs_lock);
+    while (m->count < want) {
+        void *ptr = do_slabs_alloc(0, id);
+        if (ptr == NULL) {
+            break;
+        }
+        m->chunks[m->count] = ptr;
+        __atomic_store_n(&m->count, m->count + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+/* Drains the older half of a full magazine, keeping the chunks that
+ * were freed most recently, and are likelier to be in cache. */
+static void magazine_drain(slab_magazine *m, unsigned int id) {
+    unsigned int n = magazine_capacity[id] / 2;
+
+    pthread_mutex_lock(&slabs_lock);
+    for (unsigned int i = 0; i < n; i++) {
+        do_slabs_free(m->chunks[i], 0, id);
+    }
+    pthread_mutex_unlock(&slabs_lock);
+
+    memmove(m->chunks, m->chunks + n, (m->count - n) * sizeof(void *));
+    __atomic_store_n(&m->count, m->count - n, __ATOMIC_RELAXED);
+}
+
 void *slabs_alloc(size_t size, unsigned int id) {
     void *ret;
+    slab_magazine *m = slabs_magazine(id);
+
+    if (m != NULL) {
+        if (m->count == 0) {
+            magazine_count(&m->alloc_misses);
+            magazine_refill(m, id);
+            if (m->count == 0) {
+                MEMCACHED_SLABS_ALLOCATE_FAILED(size, id);
+                return NULL;
+            }
+        } else {
+            magazine_count(&m->alloc_hits);
+        }
+
+        ret = m->chunks[m->count - 1];
+        __atomic_store_n(&m->count, m->count - 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&m->requested, m->requested + size, __ATOMIC_RELAXED);
+        MEMCACHED_SLABS_ALLOCATE(size, id, slabclass[id].size, ret);
+        return ret;
+    }
 
     pthread_mutex_lock(&slabs_lock);
     ret = do_slabs_alloc(size, id);
@@ -505,6 +1097,25 @@ void *slabs_alloc(size_t size, unsigned int id) {
 }
 
 void slabs_free(void *ptr, size_t size, unsigned int id) {
+    slab_magazine *m = slabs_magazine(id);
+
+    if (m != NULL) {
+        assert(((item *)ptr)->slabs_clsid == 0);
+        MEMCACHED_SLABS_FREE(size, id, ptr);
+
+        if (m->count == magazine_capacity[id]) {
+            magazine_count(&m->free_misses);
+            magazine_drain(m, id);
+        } else {
+            magazine_count(&m->free_hits);
+        }
+
+        m->chunks[m->count] = ptr;
+        __atomic_store_n(&m->count, m->count + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&m->requested, m->requested - size, __ATOMIC_RELAXED);
+        return;
+    }
+
     pthread_mutex_lock(&slabs_lock);
     do_slabs_free(ptr, size, id);
     pthread_mutex_unlock(&slabs_lock);
@@ -515,3 +1126,360 @@ void slabs_stats(ADD_STAT add_stats, void *c) {
     do_slabs_stats(add_stats, c);
     pthread_mutex_unlock(&slabs_lock);
 }
+
+/* Takes back a chunk of the page being moved from its class.  The
+ * caller holds the slabs_lock. */
+static void do_rebal_reclaim(void *ptr) {
+    unsigned int i = ((char *)ptr - rebal.page) / slabclass[rebal.src].size;
+
+    assert(i < rebal.chunks);
+    if ((rebal.reclaimed_map[i / 8] & (1 << (i % 8))) == 0) {
+        rebal.reclaimed_map[i / 8] |= 1 << (i % 8);
+        rebal.reclaimed++;
+    }
+}
+
+static void do_rebal_clear(void) {
+    __atomic_store_n(&slabclass[rebal.src].rebal_page, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&rebal_class, 0, __ATOMIC_RELAXED);
+    free(rebal.reclaimed_map);
+    rebal.reclaimed_map = NULL;
+    rebal.page = NULL;
+}
+
+/* Starts taking a page away from class src for class dst.  The caller
+ * holds the slabs_lock. */
+static bool do_slabs_rebalance_start(unsigned int src, unsigned int dst,
+                                     int reason) {
+    slabclass_t *p = &slabclass[src];
+    char *page = NULL;
+    unsigned int i, j;
+
+    assert(rebal.page == NULL);
+    if (p->slabs < 2 || src == dst) {
+        return false;
+    }
+
+    /* The page still being carved up has the fewest items to evict. */
+    if (p->end_page_ptr != NULL) {
+        for (i = 0; i < p->slabs; i++) {
+            char *s = p->slab_list[i];
+            if ((char *)p->end_page_ptr >= s &&
+                (char *)p->end_page_ptr < s + POWER_BLOCK) {
+                page = s;
+                break;
+            }
+        }
+    }
+    if (page == NULL) {
+        page = p->slab_list[0];
+    }
+
+    rebal.reclaimed_map = calloc((p->perslab + 7) / 8, 1);
+    if (rebal.reclaimed_map == NULL) {
+        return false;
+    }
+
+    rebal.page      = page;
+    rebal.src       = src;
+    rebal.dst       = dst;
+    rebal.reason    = reason;
+    rebal.chunks    = p->perslab;
+    rebal.reclaimed = 0;
+    rebal.next      = 0;
+    rebal.passes    = 0;
+
+    if (p->end_page_ptr != NULL &&
+        (char *)p->end_page_ptr >= page &&
+        (char *)p->end_page_ptr < page + POWER_BLOCK) {
+        char *c = p->end_page_ptr;
+        for (i = 0; i < p->end_page_free; i++, c += p->size) {
+            do_rebal_reclaim(c);
+        }
+        p->end_page_ptr = 0;
+        p->end_page_free = 0;
+    }
+
+    for (i = 0, j = 0; i < p->sl_curr; i++) {
+        char *c = p->slots[i];
+        if (c >= page && c < page + POWER_BLOCK) {
+            do_rebal_reclaim(c);
+        } else {
+            p->slots[j++] = c;
+        }
+    }
+    p->sl_curr = j;
+
+    __atomic_store_n(&p->rebal_page, page, __ATOMIC_RELAXED);
+    __atomic_store_n(&rebal_class, src, __ATOMIC_RELAXED);
+
+    if (settings.verbose > 1) {
+        moxi_log_write("slab rebalance: moving a page from class %u to %u"
+                       " (%s), %u of %u chunks free\n",
+                       src, dst, rebal_reason_names[reason],
+                       rebal.reclaimed, rebal.chunks);
+    }
+
+    return true;
+}
+
+/* Gives the page being moved back to its class.  The caller holds the
+ * slabs_lock. */
+static void do_slabs_rebalance_abort(void) {
+    char *page = rebal.page;
+    unsigned int src = rebal.src;
+    unsigned int size = slabclass[src].size;
+    uint8_t *map = rebal.reclaimed_map;
+    unsigned int chunks = rebal.chunks;
+
+    rebal.reclaimed_map = NULL;
+    do_rebal_clear();
+
+    for (unsigned int i = 0; i < chunks; i++) {
+        if (map[i / 8] & (1 << (i % 8))) {
+            do_slabs_free(page + (size_t)i * size, 0, src);
+        }
+    }
+    free(map);
+
+    rebal_stats.aborts++;
+
+    if (settings.verbose > 1) {
+        moxi_log_write("slab rebalance: gave up moving a page from class %u\n",
+                       src);
+    }
+}
+
+/* Hands the page being moved, now that it's all free, to the
+ * destination class.  The caller holds the slabs_lock. */
+static void do_slabs_rebalance_finish(void) {
+    slabclass_t *p = &slabclass[rebal.src];
+    slabclass_t *dp = &slabclass[rebal.dst];
+    char *page = rebal.page;
+    unsigned int i;
+
+    if (grow_slab_list(rebal.dst) == 0) {
+        do_slabs_rebalance_abort();
+        return;
+    }
+
+    for (i = 0; i < p->slabs; i++) {
+        if (p->slab_list[i] == page) {
+            p->slab_list[i] = p->slab_list[--p->slabs];
+            break;
+        }
+    }
+
+    p->pages_out++;
+    dp->pages_in++;
+    rebal_stats.moves[rebal.reason]++;
+    do_rebal_clear();
+
+    /* Other code asserts that free chunks have a slabs_clsid of 0. */
+    memset(page, 0, POWER_BLOCK);
+    dp->slab_list[dp->slabs++] = page;
+
+    if (dp->end_page_ptr == NULL) {
+        dp->end_page_ptr = page;
+        dp->end_page_free = dp->perslab;
+    } else {
+        for (i = 0; i < dp->perslab; i++) {
+            do_slabs_free(page + (size_t)i * dp->size, 0, rebal.dst);
+        }
+    }
+
+    if (settings.verbose > 1) {
+        moxi_log_write("slab rebalance: moved a page from class %u to %u\n",
+                       rebal.src, rebal.dst);
+    }
+}
+
+/* Evicts the items in the next SLAB_REBAL_STEP chunks of the page
+ * being moved, then finishes or gives up on the move if it's time. */
+static void slabs_rebalance_step(void) {
+    unsigned int size = slabclass[rebal.src].size;
+    uint64_t evicted = 0, busy = 0;
+
+    for (unsigned int n = 0;
+         n < SLAB_REBAL_STEP && rebal.next < rebal.chunks;
+         n++, rebal.next++) {
+        item *it = (item *)(rebal.page + (size_t)rebal.next * size);
+
+        /* A free chunk is either back already, or in a magazine. */
+        if (__atomic_load_n(&it->slabs_clsid, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+
+        if (item_evict_chunk(it, rebal.src)) {
+            evicted++;
+        } else {
+            busy++;
+        }
+    }
+
+    pthread_mutex_lock(&slabs_lock);
+    rebal_stats.evictions += evicted;
+    rebal_stats.busy += busy;
+
+    if (rebal.reclaimed == rebal.chunks) {
+        do_slabs_rebalance_finish();
+    } else if (rebal.next == rebal.chunks) {
+        rebal.next = 0;
+        if (++rebal.passes >= SLAB_REBAL_PASSES) {
+            do_slabs_rebalance_abort();
+        }
+    }
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+/* Per class eviction pressure, as the rebalancer thread last saw it. */
+static uint64_t     rebal_pressure[MAX_NUMBER_OF_SLAB_CLASSES];
+static unsigned int rebal_quiet[MAX_NUMBER_OF_SLAB_CLASSES];
+static unsigned int rebal_top;
+static unsigned int rebal_top_windows;
+
+/* Called every second, to start moving a page to the class that
+ * keeps evicting the most, if there's one and a page for it. */
+static void slabs_rebalance_tick(void) {
+    uint64_t most = 0;
+    unsigned int top = 0;
+    unsigned int id;
+
+    for (id = POWER_SMALLEST; id <= power_largest; id++) {
+        uint64_t now = item_class_pressure(id);
+        uint64_t delta = now >= rebal_pressure[id] ?
+            now - rebal_pressure[id] : now; /* the item stats were reset */
+
+        rebal_pressure[id] = now;
+        rebal_quiet[id] = delta == 0 ? rebal_quiet[id] + 1 : 0;
+
+        if (delta > most) {
+            most = delta;
+            top = id;
+        }
+    }
+
+    if (top == 0 || top != rebal_top) {
+        rebal_top = top;
+        rebal_top_windows = top != 0;
+        return;
+    }
+
+    if (++rebal_top_windows < SLAB_REBAL_WINDOWS) {
+        return;
+    }
+
+    pthread_mutex_lock(&slabs_lock);
+    if (rebal.page == NULL) {
+        unsigned int src = 0;
+        int reason = REBAL_FREE;
+        double most_free = 1.0;
+        unsigned int most_slabs = 1;
+
+        for (id = POWER_SMALLEST; id <= power_largest; id++) {
+            slabclass_t *p = &slabclass[id];
+            double free_pages =
+                (double)(p->sl_curr + p->end_page_free) / p->perslab;
+
+            if (id != top && p->slabs > 1 && free_pages >= most_free) {
+                most_free = free_pages;
+                src = id;
+            }
+        }
+
+        if (src == 0) {
+            reason = REBAL_COLD;
+            for (id = POWER_SMALLEST; id <= power_largest; id++) {
+                slabclass_t *p = &slabclass[id];
+
+                if (id != top && rebal_quiet[id] >= SLAB_REBAL_WINDOWS &&
+                    p->slabs > most_slabs) {
+                    most_slabs = p->slabs;
+                    src = id;
+                }
+            }
+        }
+
+        if (src != 0 && do_slabs_rebalance_start(src, top, reason)) {
+            rebal_top_windows = 0;
+        }
+    }
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+static pthread_t       rebalance_tid;
+static pthread_mutex_t rebalance_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  rebalance_cond = PTHREAD_COND_INITIALIZER;
+static volatile int    do_run_rebalance_thread = 1;
+
+static void *slab_rebalance_thread(void *arg) {
+    (void)arg;
+    struct timespec next_tick;
+
+    clock_gettime(CLOCK_REALTIME, &next_tick);
+
+    pthread_mutex_lock(&rebalance_lock);
+    while (do_run_rebalance_thread) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        if (now.tv_sec > next_tick.tv_sec ||
+            (now.tv_sec == next_tick.tv_sec &&
+             now.tv_nsec >= next_tick.tv_nsec)) {
+            pthread_mutex_unlock(&rebalance_lock);
+            slabs_rebalance_tick();
+            pthread_mutex_lock(&rebalance_lock);
+            next_tick = now;
+            next_tick.tv_sec++;
+        }
+
+        if (rebal.page != NULL) {
+            pthread_mutex_unlock(&rebalance_lock);
+            slabs_rebalance_step();
+            pthread_mutex_lock(&rebalance_lock);
+
+            /* Let the workers have the item locks for a bit. */
+            struct timespec pause;
+            clock_gettime(CLOCK_REALTIME, &pause);
+            pause.tv_nsec += 1000000;
+            if (pause.tv_nsec >= 1000000000) {
+                pause.tv_sec++;
+                pause.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&rebalance_cond, &rebalance_lock, &pause);
+        } else {
+            pthread_cond_timedwait(&rebalance_cond, &rebalance_lock,
+                                   &next_tick);
+        }
+    }
+    pthread_mutex_unlock(&rebalance_lock);
+
+    return NULL;
+}
+
+int start_slab_rebalance_thread(void) {
+    int ret;
+
+    if ((ret = pthread_create(&rebalance_tid, NULL,
+                              slab_rebalance_thread, NULL)) != 0) {
+        moxi_log_write("Can't create thread: %s\n", strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+void stop_slab_rebalance_thread(void) {
+    pthread_mutex_lock(&rebalance_lock);
+    do_run_rebalance_thread = 0;
+    pthread_cond_signal(&rebalance_cond);
+    pthread_mutex_unlock(&rebalance_lock);
+
+    /* Wait for the rebalancer thread to stop */
+    pthread_join(rebalance_tid, NULL);
+
+    pthread_mutex_lock(&slabs_lock);
+    if (rebal.page != NULL) {
+        do_slabs_rebalance_abort();
+    }
+    pthread_mutex_unlock(&slabs_lock);
+}
@@ -36,4 +36,9 @@ void slabs_stats(ADD_STAT add_stats, void *c);
    -1 = tried. busy. send again shortly. */
 int slabs_reassign(unsigned char srcid, unsigned char dstid);
 
+/** Start and stop the thread that moves slab pages to the classes that
+    evict the most, when settings.slab_automove is on */
+int start_slab_rebalance_thread(void);
+void stop_slab_rebalance_thread(void);
+
 #endif
@@ -0,0 +1,188 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * Micro-benchmark of the per-thread stats counters on the GET hot
+ * path.  Each worker thread does the counter bumps of a GET hit, the
+ * way process_get_command() and the read/write paths do, either with
+ * stats off, with the old per-thread mutex, or with the current
+ * single-writer relaxed counters.  A collector thread aggregates
+ * all workers' stats concurrently, like a "stats" request would.
+ *
+ * Usage: stats_bench [num_threads] [ops_per_thread]
+ */
+
+#include "config.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "memcached.h"
+
+enum bench_mode {
+    BENCH_STATS_OFF,
+    BENCH_STATS_MUTEX,
+    BENCH_STATS_RELAXED
+};
+
+static const char *bench_mode_name[] = {
+    "off",
+    "mutex",
+    "relaxed"
+};
+
+// Mirrors the layout of the stats in a LIBEVENT_THREAD.
+//
+typedef struct {
+    char                pad_head[CACHE_LINE_SIZE];
+    pthread_mutex_t     mutex;
+    struct thread_stats stats;
+    char                pad_tail[CACHE_LINE_SIZE];
+} bench_thread;
+
+static bench_thread *threads;
+static int num_threads = 4;
+static uint64_t num_ops = 10000000;
+static enum bench_mode mode;
+static volatile int collector_done;
+
+static uint64_t bench_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((uint64_t) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void *bench_worker(void *arg) {
+    bench_thread *t = arg;
+    volatile uint64_t sink = 0;
+
+    for (uint64_t i = 0; i < num_ops; i++) {
+        int clsid = (i & 15) + 1;
+
+        switch (mode) {
+        case BENCH_STATS_OFF:
+            sink += clsid;
+            break;
+
+        case BENCH_STATS_MUTEX:
+            pthread_mutex_lock(&t->mutex);
+            t->stats.bytes_read += 16;
+            pthread_mutex_unlock(&t->mutex);
+            pthread_mutex_lock(&t->mutex);
+            t->stats.slab_stats[clsid].get_hits++;
+            t->stats.get_cmds++;
+            pthread_mutex_unlock(&t->mutex);
+            pthread_mutex_lock(&t->mutex);
+            t->stats.bytes_written += 100;
+            pthread_mutex_unlock(&t->mutex);
+            break;
+
+        case BENCH_STATS_RELAXED:
+            THREAD_STATS_ADD(t->stats.bytes_read, 16);
+            THREAD_STATS_ADD(t->stats.slab_stats[clsid].get_hits, 1);
+            THREAD_STATS_ADD(t->stats.get_cmds, 1);
+            THREAD_STATS_ADD(t->stats.bytes_written, 100);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void *bench_collector(void *arg) {
+    (void) arg;
+
+    uint64_t total = 0;
+
+    while (!collector_done) {
+        for (int i = 0; i < num_threads; i++) {
+            bench_thread *t = &threads[i];
+
+            if (mode == BENCH_STATS_MUTEX) {
+                pthread_mutex_lock(&t->mutex);
+                total += t->stats.get_cmds;
+                pthread_mutex_unlock(&t->mutex);
+            } else {
+                total += THREAD_STATS_GET(t->stats.get_cmds);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_run(enum bench_mode m) {
+    pthread_t *tids = calloc(num_threads, sizeof(pthread_t));
+    pthread_t collector;
+
+    assert(tids != NULL);
+
+    mode = m;
+    collector_done = 0;
+
+    for (int i = 0; i < num_threads; i++) {
+        memset(&threads[i].stats, 0, sizeof(threads[i].stats));
+    }
+
+    pthread_create(&collector, NULL, bench_collector, NULL);
+
+    uint64_t start = bench_usec();
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&tids[i], NULL, bench_worker, &threads[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    uint64_t elapsed = bench_usec() - start;
+
+    collector_done = 1;
+    pthread_join(collector, NULL);
+
+    if (m != BENCH_STATS_OFF) {
+        for (int i = 0; i < num_threads; i++) {
+            assert(threads[i].stats.get_cmds == num_ops);
+        }
+    }
+
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    printf("stats %-8s %d threads: %10llu usec, %12.0f gets/sec\n",
+           bench_mode_name[m], num_threads,
+           (unsigned long long) elapsed,
+           (double) num_ops * num_threads * 1000000.0 / elapsed);
+
+    free(tids);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        num_threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        num_ops = strtoull(argv[2], NULL, 10);
+    }
+    if (num_threads <= 0) {
+        num_threads = 1;
+    }
+
+    threads = calloc(num_threads, sizeof(bench_thread));
+    assert(threads != NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&threads[i].mutex, NULL);
+    }
+
+    bench_run(BENCH_STATS_OFF);
+    bench_run(BENCH_STATS_MUTEX);
+    bench_run(BENCH_STATS_RELAXED);
+
+    free(threads);
+
+    return 0;
+}
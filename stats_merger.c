@@ -0,0 +1,374 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats_merger.h"
+#include "util.h"
+
+// Special STATS value merging rules, instead of the
+// default to just sum the values.  Note the trailing space.
+//
+static const char *stats_keys_first =
+    "pid version libevent "
+    "ep_version ep_dbname ep_storage_type ep_flusher_state ep_warmup_thread ";
+
+static const char *stats_keys_largest =
+    "uptime "
+    "time "
+    "pointer_size "
+    "limit_maxbytes "
+    "accepting_conns "
+    ":chunk_size "
+    ":chunk_per_page "
+    ":age "; // TODO: Should age merge be smallest?
+
+typedef enum {
+    STATS_MERGE_SUM = 0,
+    STATS_MERGE_FIRST,
+    STATS_MERGE_LARGEST
+} enum_stats_merge_rule;
+
+typedef enum {
+    STATS_VAL_STRING = 0, // Not a number, so the first value is kept.
+    STATS_VAL_INT,
+    STATS_VAL_FLOAT
+} enum_stats_val_kind;
+
+typedef struct stats_merge_entry stats_merge_entry;
+
+struct stats_merge_entry {
+    stats_merge_entry *next; // In the order first seen.
+
+    uint8_t rule;   // An enum_stats_merge_rule.
+    uint8_t kind;   // An enum_stats_val_kind.
+    bool    merged; // False until a second value is merged in.
+
+    uint64_t vint;
+    double   vfloat;
+
+    int prefix_len;
+    int name_len;
+    int val_len;
+
+    // The prefix, name and first value, each zero terminated.
+    //
+    char text[];
+};
+
+struct stats_merger {
+    genhash_t         *index; // Name to stats_merge_entry.
+    stats_merge_entry *head;
+    stats_merge_entry *tail;
+    int                count;
+};
+
+static int stats_merger_str_eq(const void *v1, const void *v2) {
+    return strcmp(v1, v2) == 0;
+}
+
+static void *stats_merger_noop_dup(const void *v) {
+    return (void *) v;
+}
+
+static void stats_merger_noop_free(void *v) {
+    (void) v;
+}
+
+// Names and entries are owned by the entry list.
+//
+static struct hash_ops stats_merger_hash_ops = {
+    .hashfunc  = genhash_string_hash,
+    .hasheq    = stats_merger_str_eq,
+    .dupKey    = stats_merger_noop_dup,
+    .dupValue  = stats_merger_noop_dup,
+    .freeKey   = stats_merger_noop_free,
+    .freeValue = stats_merger_noop_free
+};
+
+static char *entry_prefix(stats_merge_entry *e) {
+    return e->text;
+}
+
+static char *entry_name(stats_merge_entry *e) {
+    return e->text + e->prefix_len + 1;
+}
+
+static char *entry_val(stats_merge_entry *e) {
+    return e->text + e->prefix_len + 1 + e->name_len + 1;
+}
+
+stats_merger *stats_merger_create(void) {
+    stats_merger *m = calloc(1, sizeof(stats_merger));
+    if (m != NULL) {
+        m->index = genhash_init(128, stats_merger_hash_ops);
+        if (m->index == NULL) {
+            free(m);
+            m = NULL;
+        }
+    }
+
+    return m;
+}
+
+void stats_merger_free(stats_merger *m) {
+    if (m == NULL) {
+        return;
+    }
+
+    stats_merge_entry *e = m->head;
+    while (e != NULL) {
+        stats_merge_entry *next = e->next;
+        free(e);
+        e = next;
+    }
+
+    genhash_free(m->index);
+    free(m);
+}
+
+int stats_merger_count(stats_merger *m) {
+    assert(m != NULL);
+
+    return m->count;
+}
+
+// The merge rule is keyed by the part of a name from its last colon,
+// so that "items:1:age" merges like ":age".
+//
+static enum_stats_merge_rule stats_merge_rule(const char *name) {
+    const char *key = strrchr(name, ':');
+    if (key == NULL) {
+        key = name;
+    }
+
+    if (strstr(stats_keys_first, key) != NULL) {
+        return STATS_MERGE_FIRST;
+    }
+
+    if (strstr(stats_keys_largest, key) != NULL) {
+        return STATS_MERGE_LARGEST;
+    }
+
+    return STATS_MERGE_SUM;
+}
+
+// Parses a zero terminated value, returning its kind.
+//
+static enum_stats_val_kind stats_val_parse(const char *val,
+                                           uint64_t *vint,
+                                           double *vfloat) {
+    if (strchr(val, '.') != NULL) {
+        *vfloat = strtod(val, NULL);
+        return STATS_VAL_FLOAT;
+    }
+
+    if (safe_strtoull(val, vint)) {
+        *vfloat = (double) *vint;
+        return STATS_VAL_INT;
+    }
+
+    return STATS_VAL_STRING;
+}
+
+static stats_merge_entry *stats_merger_intern(stats_merger *m,
+                                              const char *prefix,
+                                              int prefix_len,
+                                              const char *name,
+                                              int name_len,
+                                              const char *val,
+                                              int val_len) {
+    stats_merge_entry *e = malloc(sizeof(stats_merge_entry) +
+                                  prefix_len + 1 +
+                                  name_len + 1 +
+                                  val_len + 1);
+    if (e == NULL) {
+        return NULL;
+    }
+
+    e->next       = NULL;
+    e->merged     = false;
+    e->vint       = 0;
+    e->vfloat     = 0.0;
+    e->prefix_len = prefix_len;
+    e->name_len   = name_len;
+    e->val_len    = val_len;
+
+    memcpy(entry_prefix(e), prefix, prefix_len);
+    entry_prefix(e)[prefix_len] = '\0';
+    memcpy(entry_name(e), name, name_len);
+    entry_name(e)[name_len] = '\0';
+    memcpy(entry_val(e), val, val_len);
+    entry_val(e)[val_len] = '\0';
+
+    e->rule = stats_merge_rule(entry_name(e));
+    e->kind = stats_val_parse(entry_val(e), &e->vint, &e->vfloat);
+
+    genhash_store(m->index, entry_name(e), e);
+
+    if (m->tail != NULL) {
+        m->tail->next = e;
+    } else {
+        m->head = e;
+    }
+    m->tail = e;
+    m->count++;
+
+    return e;
+}
+
+bool stats_merger_add(stats_merger *m,
+                      const char *prefix, int prefix_len,
+                      const char *name, int name_len,
+                      const char *val, int val_len) {
+    assert(m != NULL);
+    assert(prefix != NULL);
+    assert(name != NULL);
+    assert(val != NULL);
+
+    if (name_len <= 0 ||
+        name_len >= STATS_MERGER_LINE_MAX ||
+        val_len < 0 ||
+        val_len >= STATS_MERGER_LINE_MAX) {
+        return false;
+    }
+
+    char buf_name[STATS_MERGER_LINE_MAX];
+    char buf_val[STATS_MERGER_LINE_MAX];
+
+    memcpy(buf_name, name, name_len);
+    buf_name[name_len] = '\0';
+
+    stats_merge_entry *e = genhash_find(m->index, buf_name);
+    if (e == NULL) {
+        stats_merger_intern(m, prefix, prefix_len,
+                            name, name_len, val, val_len);
+        return true;
+    }
+
+    if (e->rule == STATS_MERGE_FIRST ||
+        e->kind == STATS_VAL_STRING) {
+        return true;
+    }
+
+    memcpy(buf_val, val, val_len);
+    buf_val[val_len] = '\0';
+
+    uint64_t vint = 0;
+    double   vfloat = 0.0;
+
+    enum_stats_val_kind kind = stats_val_parse(buf_val, &vint, &vfloat);
+    if (kind == STATS_VAL_STRING) {
+        // Keep the previous value if we couldn't merge.
+        //
+        return true;
+    }
+
+    if (kind == STATS_VAL_FLOAT ||
+        e->kind == STATS_VAL_FLOAT) {
+        if (e->rule == STATS_MERGE_LARGEST) {
+            e->vfloat = e->vfloat > vfloat ? e->vfloat : vfloat;
+        } else {
+            e->vfloat += vfloat;
+        }
+        e->kind = STATS_VAL_FLOAT;
+    } else {
+        if (e->rule == STATS_MERGE_LARGEST) {
+            e->vint = e->vint > vint ? e->vint : vint;
+        } else {
+            e->vint += vint;
+        }
+        e->vfloat = (double) e->vint;
+    }
+
+    e->merged = true;
+
+    return true;
+}
+
+bool stats_merger_add_line(stats_merger *m, const char *line) {
+    assert(m != NULL);
+    assert(line != NULL);
+
+    int nline = strlen(line); // Ex: "STAT uptime 123455"
+    if (nline <= 0 ||
+        nline >= STATS_MERGER_LINE_MAX) {
+        return false;
+    }
+
+    // Split into exactly three space separated parts.
+    //
+    const char *part[3];
+    int         part_len[3];
+    int         nparts = 0;
+
+    const char *s = line;
+    const char *end = line + nline;
+
+    while (s < end) {
+        while (s < end && *s == ' ') {
+            s++;
+        }
+        if (s >= end) {
+            break;
+        }
+        if (nparts >= 3) {
+            return false;
+        }
+
+        const char *e = s;
+        while (e < end && *e != ' ') {
+            e++;
+        }
+
+        part[nparts] = s;
+        part_len[nparts] = e - s;
+        nparts++;
+
+        s = e;
+    }
+
+    if (nparts != 3) {
+        return false;
+    }
+
+    return stats_merger_add(m,
+                            part[0], part_len[0],
+                            part[1], part_len[1],
+                            part[2], part_len[2]);
+}
+
+void stats_merger_foreach(stats_merger *m, stats_merger_cb cb, void *arg) {
+    assert(m != NULL);
+    assert(cb != NULL);
+
+    char buf_val[400]; // Room for a "%f" of a huge double.
+
+    for (stats_merge_entry *e = m->head; e != NULL; e = e->next) {
+        const char *val = entry_val(e);
+        int val_len = e->val_len;
+
+        if (e->merged) {
+            if (e->kind == STATS_VAL_FLOAT) {
+                val_len = snprintf(buf_val, sizeof(buf_val), "%f",
+                                   e->vfloat);
+            } else {
+                val_len = snprintf(buf_val, sizeof(buf_val), "%llu",
+                                   (long long unsigned int) e->vint);
+            }
+
+            if (val_len <= 0 ||
+                val_len >= (int) sizeof(buf_val)) {
+                continue;
+            }
+
+            val = buf_val;
+        }
+
+        cb(entry_prefix(e), e->prefix_len,
+           entry_name(e), e->name_len,
+           val, val_len, arg);
+    }
+}
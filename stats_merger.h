@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef STATS_MERGER_H
+#define STATS_MERGER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "genhash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * Merges the "<prefix> <name> <value>" responses, such as
+     * "STAT uptime 1234", of a "stats" command that was broadcast to
+     * many downstream servers.
+     *
+     * Each stat name is interned on its first response, which also
+     * picks the name's merge rule and whether its value is an integer
+     * or a float.  Later responses just fold their parsed value into
+     * the interned one, and values are only formatted back into
+     * strings by stats_merger_foreach().
+     *
+     * The merge rules are the same as ever: most stats are summed,
+     * a few keep the first response's value, and a few keep the
+     * largest value.
+     */
+
+#define STATS_MERGER_LINE_MAX 300
+
+    typedef struct stats_merger stats_merger;
+
+    stats_merger *stats_merger_create(void);
+
+    void stats_merger_free(stats_merger *m);
+
+    /**
+     * Merges a zero terminated "<prefix> <name> <value>" line.
+     * Returns false if the line isn't one, so the caller should
+     * just forward it.
+     */
+    bool stats_merger_add_line(stats_merger *m, const char *line);
+
+    /**
+     * Merges a stat whose parts have already been parsed, such as
+     * from a binary response.  Returns false if the stat couldn't
+     * be merged.
+     */
+    bool stats_merger_add(stats_merger *m,
+                          const char *prefix, int prefix_len,
+                          const char *name, int name_len,
+                          const char *val, int val_len);
+
+    /**
+     * Number of distinct stat names merged so far.
+     */
+    int stats_merger_count(stats_merger *m);
+
+    typedef void (*stats_merger_cb)(const char *prefix, int prefix_len,
+                                    const char *name, int name_len,
+                                    const char *val, int val_len,
+                                    void *arg);
+
+    /**
+     * Calls cb for each merged stat, in the order their names were
+     * first seen.  The strings are only valid during the call.
+     */
+    void stats_merger_foreach(stats_merger *m, stats_merger_cb cb,
+                              void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,401 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * Micro-benchmark of merging the responses of a "stats" command that
+ * was broadcast to a pool of servers.  It compares the stats_merger
+ * against the previous way of merging, which kept each stat as its
+ * latest "<prefix> <name> <value>" line in a string keyed genhash, and
+ * re-tokenized, re-parsed and re-printed that line on every merge.
+ *
+ * The capture is either a file of the servers' responses, each
+ * "STAT ..." line as a server sent it and each server's response
+ * ending with an "END" line, or else a synthetic capture that looks
+ * like "stats", "stats slabs" and "stats items" from 40 servers.
+ *
+ * Usage: stats_merger_bench [capture_file] [iterations]
+ */
+
+#include "config.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "stats_merger.h"
+#include "util.h"
+
+#define BENCH_SERVERS 40
+
+static char **capture;
+static int    capture_num;
+static int    capture_max;
+static int    capture_servers;
+
+static uint64_t bench_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((uint64_t) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void capture_add(const char *line) {
+    if (capture_num >= capture_max) {
+        capture_max = capture_max * 2 + 1024;
+        capture = realloc(capture, capture_max * sizeof(char *));
+        assert(capture != NULL);
+    }
+
+    capture[capture_num] = strdup(line);
+    assert(capture[capture_num] != NULL);
+    capture_num++;
+}
+
+static void capture_synthesize(void) {
+    static const char *general[] = {
+        "pid", "uptime", "time", "version", "libevent", "pointer_size",
+        "rusage_user", "rusage_system", "curr_connections",
+        "total_connections", "connection_structures", "cmd_get",
+        "cmd_set", "cmd_flush", "get_hits", "get_misses",
+        "delete_misses", "delete_hits", "incr_misses", "incr_hits",
+        "decr_misses", "decr_hits", "cas_misses", "cas_hits",
+        "cas_badval", "auth_cmds", "auth_errors", "bytes_read",
+        "bytes_written", "limit_maxbytes", "accepting_conns",
+        "listen_disabled_num", "threads", "conn_yields", "bytes",
+        "curr_items", "total_items", "evictions", "reclaimed",
+        "ep_version", "ep_storage_type", "ep_flusher_state",
+        "ep_queue_size", "ep_flusher_todo", "ep_commit_time",
+        "ep_total_enqueued", "ep_total_persisted", "mem_used",
+        "ep_kv_size", "ep_overhead", "ep_max_data_size",
+        "ep_mem_low_wat", "ep_mem_high_wat", "curr_items_tot",
+        "vb_active_num", "vb_replica_num", "ep_num_value_ejects"
+    };
+    static const char *slab[] = {
+        "chunk_size", "chunks_per_page", "total_pages",
+        "total_chunks", "used_chunks", "free_chunks",
+        "free_chunks_end", "mem_requested", "get_hits", "cmd_set",
+        "delete_hits", "incr_hits", "decr_hits", "cas_hits",
+        "cas_badval"
+    };
+    static const char *items[] = {
+        "number", "age", "evicted", "evicted_nonzero",
+        "evicted_time", "outofmemory", "tailrepairs", "reclaimed"
+    };
+
+    char line[300];
+
+    srand(1234);
+
+    for (int s = 0; s < BENCH_SERVERS; s++) {
+        for (size_t i = 0; i < sizeof(general) / sizeof(general[0]); i++) {
+            if (strcmp(general[i], "version") == 0 ||
+                strcmp(general[i], "ep_version") == 0) {
+                snprintf(line, sizeof(line), "STAT %s 1.4.4_%d",
+                         general[i], s);
+            } else if (strncmp(general[i], "rusage", 6) == 0) {
+                snprintf(line, sizeof(line), "STAT %s %d.%06d",
+                         general[i], rand() % 10000, rand() % 1000000);
+            } else if (strcmp(general[i], "ep_storage_type") == 0 ||
+                       strcmp(general[i], "ep_flusher_state") == 0) {
+                snprintf(line, sizeof(line), "STAT %s running",
+                         general[i]);
+            } else {
+                snprintf(line, sizeof(line), "STAT %s %d",
+                         general[i], rand());
+            }
+            capture_add(line);
+        }
+
+        for (int c = 1; c <= 40; c++) {
+            for (size_t i = 0; i < sizeof(slab) / sizeof(slab[0]); i++) {
+                snprintf(line, sizeof(line), "STAT %d:%s %d",
+                         c, slab[i], rand() % 100000);
+                capture_add(line);
+            }
+            for (size_t i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+                snprintf(line, sizeof(line), "STAT items:%d:%s %d",
+                         c, items[i], rand() % 100000);
+                capture_add(line);
+            }
+        }
+
+        capture_add("END");
+    }
+}
+
+static void capture_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    char line[1000];
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0') {
+            capture_add(line);
+        }
+    }
+
+    fclose(f);
+}
+
+// The previous merging, kept here as the baseline.
+//
+static const char *baseline_keys_first =
+    "pid version libevent "
+    "ep_version ep_dbname ep_storage_type ep_flusher_state ep_warmup_thread ";
+
+static const char *baseline_keys_smallest =
+    "uptime time pointer_size limit_maxbytes accepting_conns "
+    ":chunk_size :chunk_per_page :age ";
+
+// Like the skeyhash_ops, keys are zero or space terminated, so the
+// genhash can be keyed by the name inside a "<name> <value>" string.
+//
+static size_t baseline_skey_len(const char *key) {
+    const char *x = key;
+    while (*x != ' ' && *x != '\0') {
+        x++;
+    }
+    return x - key;
+}
+
+static int baseline_skey_hash(const void *v) {
+    const char *key = v;
+    size_t len = baseline_skey_len(key);
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t) key[i]) * 16777619u;
+    }
+
+    return h;
+}
+
+static int baseline_skey_eq(const void *v1, const void *v2) {
+    size_t len1 = baseline_skey_len(v1);
+    size_t len2 = baseline_skey_len(v2);
+
+    return len1 == len2 && memcmp(v1, v2, len1) == 0;
+}
+
+static void *baseline_noop_dup(const void *v) {
+    return (void *) v;
+}
+
+static void baseline_noop_free(void *v) {
+    (void) v;
+}
+
+static struct hash_ops baseline_hash_ops = {
+    .hashfunc  = baseline_skey_hash,
+    .hasheq    = baseline_skey_eq,
+    .dupKey    = baseline_noop_dup,
+    .dupValue  = baseline_noop_dup,
+    .freeKey   = baseline_noop_free,
+    .freeValue = baseline_noop_free
+};
+
+typedef struct {
+    char *prefix;
+    char *name;
+    char *val;
+} baseline_line;
+
+static int baseline_split(char *line, baseline_line *out) {
+    char *part[4];
+    int   n = 0;
+
+    for (char *tok = strtok(line, " "); tok != NULL && n < 4;
+         tok = strtok(NULL, " ")) {
+        part[n++] = tok;
+    }
+
+    if (n == 3) {
+        out->prefix = part[0];
+        out->name   = part[1];
+        out->val    = part[2];
+    }
+
+    return n;
+}
+
+static char *baseline_join(const char *prefix, const char *name,
+                           const char *val) {
+    char *line = malloc(strlen(prefix) + strlen(name) + strlen(val) + 3);
+    assert(line != NULL);
+
+    sprintf(line, "%s %s %s", prefix, name, val);
+    return line;
+}
+
+static void baseline_merge_line(genhash_t *merger, const char *src) {
+    char line[300];
+    baseline_line cur;
+
+    strcpy(line, src);
+    if (baseline_split(line, &cur) != 3) {
+        return;
+    }
+
+    char *key = strrchr(cur.name, ':');
+    if (key == NULL) {
+        key = cur.name;
+    }
+
+    char *prev = genhash_find(merger, cur.name);
+    if (prev == NULL) {
+        char *hval = baseline_join(cur.prefix, cur.name, cur.val);
+        genhash_update(merger, strchr(hval, ' ') + 1, hval);
+        return;
+    }
+
+    if (strstr(baseline_keys_first, key) != NULL) {
+        return;
+    }
+
+    char prev_buf[300];
+    baseline_line old;
+
+    strcpy(prev_buf, prev);
+    if (baseline_split(prev_buf, &old) != 3) {
+        return;
+    }
+
+    bool smallest = strstr(baseline_keys_smallest, key) != NULL;
+    char out[300];
+
+    if (strchr(old.val, '.') != NULL ||
+        strchr(cur.val, '.') != NULL) {
+        float v1 = strtof(old.val, NULL);
+        float v2 = strtof(cur.val, NULL);
+        sprintf(out, "%f", smallest ? (v1 > v2 ? v1 : v2) : v1 + v2);
+    } else {
+        uint64_t v1 = 0;
+        uint64_t v2 = 0;
+
+        if (!safe_strtoull(old.val, &v1) ||
+            !safe_strtoull(cur.val, &v2)) {
+            return;
+        }
+
+        sprintf(out, "%llu", (long long unsigned int)
+                (smallest ? (v1 > v2 ? v1 : v2) : v1 + v2));
+    }
+
+    char *hval = baseline_join(cur.prefix, cur.name, out);
+    genhash_update(merger, strchr(hval, ' ') + 1, hval);
+    free(prev);
+}
+
+static void baseline_foreach_write(const void *key, const void *value,
+                                   void *user_data) {
+    (void) key;
+
+    uint64_t *bytes = user_data;
+    *bytes += strlen(value) + 2;
+}
+
+static void baseline_foreach_free(const void *key, const void *value,
+                                  void *user_data) {
+    (void) key;
+    (void) user_data;
+
+    free((void *) value);
+}
+
+static void merger_write(const char *prefix, int prefix_len,
+                         const char *name, int name_len,
+                         const char *val, int val_len,
+                         void *arg) {
+    (void) prefix;
+    (void) name;
+    (void) val;
+
+    uint64_t *bytes = arg;
+    *bytes += prefix_len + 1 + name_len + 1 + val_len + 2;
+}
+
+static void bench_report(const char *name, int iterations,
+                         uint64_t elapsed, uint64_t bytes) {
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    printf("stats merge %-8s %d servers, %d lines: %10llu usec,"
+           " %12.0f lines/sec, %llu bytes out\n",
+           name, capture_servers, capture_num,
+           (unsigned long long) elapsed,
+           (double) capture_num * iterations * 1000000.0 / elapsed,
+           (unsigned long long) (bytes / iterations));
+}
+
+int main(int argc, char **argv) {
+    int iterations = 100;
+
+    if (argc > 1) {
+        capture_load(argv[1]);
+    } else {
+        capture_synthesize();
+    }
+    if (argc > 2) {
+        iterations = atoi(argv[2]);
+    }
+    if (iterations <= 0) {
+        iterations = 1;
+    }
+
+    for (int i = 0; i < capture_num; i++) {
+        if (strcmp(capture[i], "END") == 0) {
+            capture_servers++;
+        }
+    }
+
+    uint64_t bytes = 0;
+    uint64_t start = bench_usec();
+
+    for (int n = 0; n < iterations; n++) {
+        genhash_t *merger = genhash_init(128, baseline_hash_ops);
+        assert(merger != NULL);
+
+        for (int i = 0; i < capture_num; i++) {
+            if (strncmp(capture[i], "STAT ", 5) == 0) {
+                baseline_merge_line(merger, capture[i]);
+            }
+        }
+
+        genhash_iter(merger, baseline_foreach_write, &bytes);
+        genhash_iter(merger, baseline_foreach_free, NULL);
+        genhash_free(merger);
+    }
+
+    bench_report("baseline", iterations, bench_usec() - start, bytes);
+
+    bytes = 0;
+    start = bench_usec();
+
+    for (int n = 0; n < iterations; n++) {
+        stats_merger *merger = stats_merger_create();
+        assert(merger != NULL);
+
+        for (int i = 0; i < capture_num; i++) {
+            if (strncmp(capture[i], "STAT ", 5) == 0) {
+                stats_merger_add_line(merger, capture[i]);
+            }
+        }
+
+        stats_merger_foreach(merger, merger_write, &bytes);
+        stats_merger_free(merger);
+    }
+
+    bench_report("typed", iterations, bench_usec() - start, bytes);
+
+    for (int i = 0; i < capture_num; i++) {
+        free(capture[i]);
+    }
+    free(capture);
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stats_merger.h>
+
+// Collects the merged stats as "<prefix> <name> <value>\n" lines.
+//
+static void collect(const char *prefix, int prefix_len,
+                    const char *name, int name_len,
+                    const char *val, int val_len,
+                    void *arg) {
+    char *out = arg;
+    char line[1000];
+
+    snprintf(line, sizeof(line), "%.*s %.*s %.*s\n",
+             prefix_len, prefix, name_len, name, val_len, val);
+    strcat(out, line);
+}
+
+static void testMerge(void) {
+    stats_merger *m = stats_merger_create();
+    assert(m != NULL);
+
+    for (int i = 0; i < 3; i++) {
+        char line[100];
+
+        snprintf(line, sizeof(line), "STAT pid %d", 100 + i);
+        assert(stats_merger_add_line(m, line));
+        snprintf(line, sizeof(line), "STAT uptime %d", 10 * (i + 1));
+        assert(stats_merger_add_line(m, line));
+        snprintf(line, sizeof(line), "STAT curr_items %d", i + 1);
+        assert(stats_merger_add_line(m, line));
+        snprintf(line, sizeof(line), "STAT rusage_user 0.%d", i + 1);
+        assert(stats_merger_add_line(m, line));
+        snprintf(line, sizeof(line), "ITEM items:1:age %d", 3 - i);
+        assert(stats_merger_add_line(m, line));
+        assert(stats_merger_add_line(m, "STAT engine default"));
+    }
+
+    assert(stats_merger_count(m) == 6);
+
+    char out[1000] = "";
+    stats_merger_foreach(m, collect, out);
+
+    assert(strcmp(out,
+                  "STAT pid 100\n"
+                  "STAT uptime 30\n"
+                  "STAT curr_items 6\n"
+                  "STAT rusage_user 0.600000\n"
+                  "ITEM items:1:age 3\n"
+                  "STAT engine default\n") == 0);
+
+    stats_merger_free(m);
+}
+
+static void testSingle(void) {
+    stats_merger *m = stats_merger_create();
+    assert(m != NULL);
+
+    // A stat seen only once keeps its value as-is.
+    //
+    assert(stats_merger_add(m, "STAT", 4, "rusage_system", 13,
+                            "1.250\r\n", 5));
+    assert(stats_merger_add(m, "STAT", 4, "total_items", 11, "007", 3));
+
+    char out[1000] = "";
+    stats_merger_foreach(m, collect, out);
+
+    assert(strcmp(out,
+                  "STAT rusage_system 1.250\n"
+                  "STAT total_items 007\n") == 0);
+
+    // A value that isn't a number keeps the previous value.
+    //
+    assert(stats_merger_add(m, "STAT", 4, "total_items", 11, "x", 1));
+    assert(stats_merger_add(m, "STAT", 4, "total_items", 11, "3", 1));
+
+    out[0] = '\0';
+    stats_merger_foreach(m, collect, out);
+
+    assert(strcmp(out,
+                  "STAT rusage_system 1.250\n"
+                  "STAT total_items 10\n") == 0);
+
+    stats_merger_free(m);
+}
+
+static void testBadLines(void) {
+    stats_merger *m = stats_merger_create();
+    assert(m != NULL);
+
+    char big[400];
+    memset(big, 'x', sizeof(big));
+    big[sizeof(big) - 1] = '\0';
+    memcpy(big, "STAT a ", 7);
+
+    assert(stats_merger_add_line(m, "") == false);
+    assert(stats_merger_add_line(m, "STAT") == false);
+    assert(stats_merger_add_line(m, "STAT a") == false);
+    assert(stats_merger_add_line(m, "STAT a 1 2") == false);
+    assert(stats_merger_add_line(m, big) == false);
+    assert(stats_merger_add_line(m, "STAT  a   1 "));
+
+    assert(stats_merger_count(m) == 1);
+
+    stats_merger_free(m);
+}
+
+int main(void) {
+    testMerge();
+    testSingle();
+    testBadLines();
+
+    return 0;
+}
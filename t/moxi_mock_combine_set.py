@@ -0,0 +1,122 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+import struct
+
+from memcacheConstants import REQ_MAGIC_BYTE, RES_MAGIC_BYTE
+from memcacheConstants import REQ_PKT_FMT, RES_PKT_FMT, MIN_RECV_PACKET
+from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
+
+import memcacheConstants
+
+import moxi_mock_server
+
+# Before you run moxi_mock_combine_set.py, start a moxi like...
+#
+#   ./moxi -z 11333=localhost:11311 -p 0 -U 0 -vvv -t 1
+#                -Z downstream_max=1,downstream_protocol=binary,combine_set=cs,combine_set_window=500
+#
+# Then...
+#
+#   python ./t/moxi_mock_combine_set.py
+#
+# ----------------------------------
+
+CMD_SETQ = 0x11
+
+OPAQUE_IGNORE_REPLY = 0x0411F00D
+
+class TestProxyCombineSet(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def packSet(self, key, val):
+        return self.packReq(memcacheConstants.CMD_SET, key=key,
+                            extraHeader=struct.pack(memcacheConstants.SET_PKT_FMT, 0, 0),
+                            val=val)
+
+    def packSetQ(self, key, val):
+        return self.packReq(CMD_SETQ, key=key, opaque=OPAQUE_IGNORE_REPLY,
+                            extraHeader=struct.pack(memcacheConstants.SET_PKT_FMT, 0, 0),
+                            val=val)
+
+    def doKeepSet(self, key):
+        """The first set goes downstream, the second one is kept"""
+        self.client_send('set %s 0 0 1\r\n1\r\n' % key)
+        self.mock_recv(self.packSet(key, '1'))
+        self.mock_send(self.packRes(memcacheConstants.CMD_SET, status=0))
+        self.client_recv('STORED\r\n')
+
+        self.client_send('set %s 0 0 1\r\n2\r\n' % key)
+        self.client_recv('STORED\r\n')
+        self.wait(5)
+        self.assertTrue(self.mock_quiet())
+
+    def testSetSetGet(self):
+        """Test a get of a kept set waits for the flush's NOOP"""
+        self.client_connect()
+        self.doKeepSet('csSSG')
+
+        self.client_send('get csSSG\r\n')
+        self.mock_recv(self.packSetQ('csSSG', '2') +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+
+        # The get must not reach the server before the kept set.
+        self.wait(5)
+        self.assertTrue(self.mock_quiet())
+
+        self.mock_send(self.packRes(memcacheConstants.CMD_NOOP))
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='csSSG'))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETK, key='csSSG',
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='2'))
+        self.client_recv('VALUE csSSG 0 1\r\n2\r\nEND\r\n')
+
+    def testMultiGetWithKeptKey(self):
+        """Test a multi-get flushes a kept set that's not its first key"""
+        self.client_connect()
+        self.doKeepSet('csMG')
+
+        self.client_send('get x csMG\r\n')
+        self.mock_recv(self.packSetQ('csMG', '2') +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+
+        self.wait(5)
+        self.assertTrue(self.mock_quiet())
+
+        self.mock_send(self.packRes(memcacheConstants.CMD_NOOP))
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETKQ, key='x', opaque=4) +
+                       self.packReq(memcacheConstants.CMD_GETKQ, key='csMG', opaque=6) +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETKQ, key='csMG', opaque=6,
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='2'))
+        self.mock_send(self.packRes(memcacheConstants.CMD_NOOP))
+        self.client_recv('VALUE csMG 0 1\r\n2\r\nEND\r\n')
+
+    def testGetDuringWindowFlush(self):
+        """Test a get waits for a flush that the window timer started"""
+        self.client_connect()
+        self.doKeepSet('csWF')
+
+        self.mock_recv(self.packSetQ('csWF', '2') +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+
+        self.client_send('get csWF\r\n')
+        self.wait(5)
+        self.assertTrue(self.mock_quiet())
+
+        self.mock_send(self.packRes(memcacheConstants.CMD_NOOP))
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='csWF'))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETK, key='csWF',
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='2'))
+        self.client_recv('VALUE csWF 0 1\r\n2\r\nEND\r\n')
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,87 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+import struct
+
+from memcacheConstants import REQ_MAGIC_BYTE, RES_MAGIC_BYTE
+from memcacheConstants import REQ_PKT_FMT, RES_PKT_FMT, MIN_RECV_PACKET
+from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
+
+import memcacheConstants
+
+import moxi_mock_server
+
+# Before you run moxi_mock_conn_buffer.py, start a moxi like...
+#
+#   ./moxi -z 11333=localhost:11311 -p 0 -U 0 -vvv -t 1
+#                -Z downstream_max=1,downstream_protocol=binary,conn_buffer_pool=1
+#
+# Then...
+#
+#   python ./t/moxi_mock_conn_buffer.py
+#
+# ----------------------------------
+
+class TestProxyConnBuffer(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def client_stats(self, idx=0):
+        """Returns the proxy stats, keyed by name without prefix"""
+        self.client_send('stats proxy\r\n', idx)
+        s = ''
+        while not s.endswith('END\r\n'):
+            s = s + self.clients[idx].recv(4096)
+        stats = {}
+        for line in s.split('\r\n'):
+            parts = line.split(' ')
+            if len(parts) == 3 and parts[0] == 'STAT':
+                stats[parts[1].split(':')[-1]] = parts[2]
+        return stats
+
+    def doGet(self, key, idx=0):
+        self.client_send('get %s\r\n' % key, idx)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key=key))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETK, key=key,
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='1'))
+        self.client_recv('VALUE %s 0 1\r\n1\r\nEND\r\n' % key, idx)
+
+    def testIdleConnLendsBuffers(self):
+        """Test an idle conn lends its buffers, gets them back, and closes"""
+        self.client_connect(0)
+        self.doGet('cbIdle', 0)
+        self.wait(5)
+
+        # Client 1 reads the stats, so it's busy while client 0 is idle.
+        self.client_connect(1)
+        idle = self.client_stats(1)
+        self.assertTrue(int(idle['conns_unbuffered']) >= 1)
+
+        # The next read takes a set of buffers back from the pool,
+        # which client 1 lent to when it went idle.
+        self.doGet('cbIdle', 0)
+        self.wait(5)
+
+        again = self.client_stats(1)
+        self.assertTrue(int(again['conn_buffer_hits']) >
+                        int(idle['conn_buffer_hits']))
+        self.assertEqual(int(again['conns_unbuffered']),
+                         int(idle['conns_unbuffered']))
+
+        # Closing client 0 while it has no buffers must not free any,
+        # and it's no longer counted as unbuffered.
+        self.client_close(0)
+        self.wait(5)
+
+        closed = self.client_stats(1)
+        self.assertEqual(int(closed['conns_unbuffered']),
+                         int(again['conns_unbuffered']) - 1)
+
+if __name__ == '__main__':
+    unittest.main()
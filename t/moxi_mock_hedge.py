@@ -0,0 +1,86 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+import struct
+
+from memcacheConstants import REQ_MAGIC_BYTE, RES_MAGIC_BYTE
+from memcacheConstants import REQ_PKT_FMT, RES_PKT_FMT, MIN_RECV_PACKET
+from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
+
+import memcacheConstants
+
+import moxi_mock_server
+
+# Before you run moxi_mock_hedge.py, start a vbucket-aware moxi like...
+#
+#   ./moxi -z ./t/moxi_mock_hedge.cfg -p 0 -U 0 -vvv -t 1
+#                -Z downstream_max=1,downstream_protocol=binary,hedge_delay=50,hedge_budget=100
+#
+# The config's master and replica are both the mock server, so the
+# master's downstream conn is mock session 0 and the replica's is 1.
+#
+# Then...
+#
+#   python ./t/moxi_mock_hedge.py
+#
+# ----------------------------------
+
+class TestProxyHedge(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def client_stats(self, idx=0):
+        """Returns the proxy stats, keyed by name without prefix"""
+        self.client_send('stats proxy\r\n', idx)
+        s = ''
+        while not s.endswith('END\r\n'):
+            s = s + self.clients[idx].recv(4096)
+        stats = {}
+        for line in s.split('\r\n'):
+            parts = line.split(' ')
+            if len(parts) == 3 and parts[0] == 'STAT':
+                stats[parts[1].split(':')[-1]] = parts[2]
+        return stats
+
+    def testHedgeToReplica(self):
+        """Test a slow master's GET is hedged to the replica, which wins"""
+        self.client_connect()
+
+        # Opens a downstream conn to each server, as a hedge only
+        # goes out on a replica conn that's already open.
+        self.client_send('flush_all 0\r\n')
+        flush = self.packReq(memcacheConstants.CMD_FLUSH,
+                             extraHeader=struct.pack(memcacheConstants.FLUSH_PKT_FMT, 0))
+        self.mock_recv(flush, 0)
+        self.mock_recv(flush, 1)
+        self.mock_send(self.packRes(memcacheConstants.CMD_FLUSH, status=0), 0)
+        self.mock_send(self.packRes(memcacheConstants.CMD_FLUSH, status=0), 1)
+        self.client_recv('OK\r\n')
+
+        before = self.client_stats()
+
+        self.client_send('get hedged\r\n')
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='hedged'), 0)
+
+        # The master stays quiet past the hedge_delay.
+        self.wait(10)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='hedged'), 1)
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETK, key='hedged',
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='fast'), 1)
+        self.client_recv('VALUE hedged 0 4\r\nfast\r\nEND\r\n')
+
+        after = self.client_stats()
+
+        for k in ['tot_hedge_eligible', 'tot_hedge', 'tot_hedge_win']:
+            self.assertEqual(int(after[k]), int(before[k]) + 1)
+        self.assertEqual(int(after['tot_hedge_over_budget']),
+                         int(before['tot_hedge_over_budget']))
+
+if __name__ == '__main__':
+    unittest.main()
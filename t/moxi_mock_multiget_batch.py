@@ -0,0 +1,129 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+import struct
+
+from memcacheConstants import REQ_MAGIC_BYTE, RES_MAGIC_BYTE
+from memcacheConstants import REQ_PKT_FMT, RES_PKT_FMT, MIN_RECV_PACKET
+from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
+
+import memcacheConstants
+
+import moxi_mock_server
+
+# Before you run moxi_mock_multiget_batch.py, start a moxi like...
+#
+#   ./moxi -z 11333=localhost:11311 -p 0 -U 0 -vvv -t 1
+#                -Z downstream_max=1,downstream_protocol=binary,multiget_batch_max=2,multiget_batch_window=1000
+#
+# Then...
+#
+#   python ./t/moxi_mock_multiget_batch.py
+#
+# The opaque of a merged batch's GETKQ is its key's offset in the
+# batch's copy of the command lines, which are each '\0' terminated.
+#
+# ----------------------------------
+
+class TestProxyMultigetBatch(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def packGetKQRes(self, key, val, opaque):
+        return self.packRes(memcacheConstants.CMD_GETKQ, key=key, opaque=opaque,
+                            extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                            val=val)
+
+    def testMergedGets(self):
+        """Test two upstreams' gets are merged, and each gets its own keys"""
+        self.client_connect(0)
+        self.client_connect(1)
+
+        # The first get waits in the multiget_batch_window.
+        self.client_send('get mbA1 mbA2\r\n', 0)
+        self.wait(5)
+        self.assertTrue(self.mock_quiet())
+
+        # The second get fills the batch, so both are sent now.
+        self.client_send('get mbB1\r\n', 1)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETKQ, key='mbA1', opaque=4) +
+                       self.packReq(memcacheConstants.CMD_GETKQ, key='mbA2', opaque=9) +
+                       self.packReq(memcacheConstants.CMD_GETKQ, key='mbB1', opaque=18) +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+        self.mock_send(self.packGetKQRes('mbA2', 'A', 9) +
+                       self.packGetKQRes('mbB1', 'B', 18) +
+                       self.packRes(memcacheConstants.CMD_NOOP))
+
+        self.client_recv('VALUE mbA2 0 1\r\nA\r\nEND\r\n', 0)
+        self.client_recv('VALUE mbB1 0 1\r\nB\r\nEND\r\n', 1)
+
+    def testSameKeyMerged(self):
+        """Test a key both upstreams get is sent once, and reaches both"""
+        self.client_connect(0)
+        self.client_connect(1)
+
+        self.client_send('get mbS1 mbS2\r\n', 0)
+        self.wait(5)
+        self.client_send('get mbS2\r\n', 1)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETKQ, key='mbS1', opaque=4) +
+                       self.packReq(memcacheConstants.CMD_GETKQ, key='mbS2', opaque=9) +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+        self.mock_send(self.packGetKQRes('mbS1', '1', 4) +
+                       self.packGetKQRes('mbS2', '2', 9) +
+                       self.packRes(memcacheConstants.CMD_NOOP))
+
+        self.client_recv('VALUE mbS1 0 1\r\n1\r\nVALUE mbS2 0 1\r\n2\r\nEND\r\n', 0)
+        self.client_recv('VALUE mbS2 0 1\r\n2\r\nEND\r\n', 1)
+
+    def testHeldUpstreamClosed(self):
+        """Test an upstream that closes while its get is held"""
+        self.client_connect(0)
+        self.client_connect(1)
+
+        self.client_send('get mbC1\r\n', 0)
+        self.wait(5)
+        self.client_close(0)
+        self.wait(5)
+        self.assertTrue(self.mock_quiet())
+
+        # A paused upstream isn't read, so its close is only seen when
+        # its response is written.  The other upstream still gets just
+        # its own key.
+        self.client_send('get mbD1\r\n', 1)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETKQ, key='mbC1', opaque=4) +
+                       self.packReq(memcacheConstants.CMD_GETKQ, key='mbD1', opaque=13) +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+        self.mock_send(self.packGetKQRes('mbC1', 'C', 4) +
+                       self.packGetKQRes('mbD1', 'D', 13) +
+                       self.packRes(memcacheConstants.CMD_NOOP))
+        self.client_recv('VALUE mbD1 0 1\r\nD\r\nEND\r\n', 1)
+
+        # The downstream was released, after the window of a lone get.
+        self.client_send('get mbD2\r\n', 1)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='mbD2'))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETK, key='mbD2',
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='D'))
+        self.client_recv('VALUE mbD2 0 1\r\nD\r\nEND\r\n', 1)
+
+    def testWindowTimeout(self):
+        """Test a lone get is sent once the multiget_batch_window ends"""
+        self.client_connect(0)
+
+        self.client_send('get mbW\r\n', 0)
+        self.wait(10)
+        self.assertTrue(self.mock_quiet())
+
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='mbW'))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETK, key='mbW',
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='W'))
+        self.client_recv('VALUE mbW 0 1\r\nW\r\nEND\r\n', 0)
+
+if __name__ == '__main__':
+    unittest.main()
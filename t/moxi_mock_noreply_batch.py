@@ -0,0 +1,129 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+import struct
+
+from memcacheConstants import REQ_MAGIC_BYTE, RES_MAGIC_BYTE
+from memcacheConstants import REQ_PKT_FMT, RES_PKT_FMT, MIN_RECV_PACKET
+from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
+
+import memcacheConstants
+
+import moxi_mock_server
+
+# Before you run moxi_mock_noreply_batch.py, start a moxi like...
+#
+#   ./moxi -z 11333=localhost:11311 -p 0 -U 0 -vvv -t 1
+#                -Z downstream_max=1,downstream_protocol=binary,noreply_batch_max=3,noreply_batch_interval=300
+#
+# Then...
+#
+#   python ./t/moxi_mock_noreply_batch.py
+#
+# ----------------------------------
+
+CMD_SETQ = 0x11
+
+OPAQUE_IGNORE_REPLY = 0x0411F00D
+
+class TestProxyNoreplyBatch(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def packSetQ(self, key, val):
+        return self.packReq(CMD_SETQ, key=key, opaque=OPAQUE_IGNORE_REPLY,
+                            extraHeader=struct.pack(memcacheConstants.SET_PKT_FMT, 0, 0),
+                            val=val)
+
+    def doGet(self, key, val):
+        """A get after a batch's NOOP response, so the batch was released"""
+        self.client_send('get %s\r\n' % key)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key=key))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETK, key=key,
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val=val))
+        self.client_recv('VALUE %s 0 %d\r\n%s\r\nEND\r\n' % (key, len(val), val))
+
+    def testFlushAtMax(self):
+        """Test a batch is flushed once it holds noreply_batch_max writes"""
+        self.client_connect()
+        self.client_send('set nbM1 0 0 1 noreply\r\n1\r\n' +
+                         'set nbM2 0 0 1 noreply\r\n2\r\n' +
+                         'set nbM3 0 0 1 noreply\r\n3\r\n')
+
+        # Well before the noreply_batch_interval.
+        self.wait(10)
+        self.assertFalse(self.mock_quiet())
+
+        self.mock_recv(self.packSetQ('nbM1', '1') +
+                       self.packSetQ('nbM2', '2') +
+                       self.packSetQ('nbM3', '3') +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+        self.mock_send(self.packRes(memcacheConstants.CMD_NOOP))
+
+        self.doGet('nbM1', '1')
+
+    def testFlushOnInterval(self):
+        """Test a partial batch is flushed by the noreply_batch_interval"""
+        self.client_connect()
+        self.client_send('set nbI 0 0 1 noreply\r\n1\r\n')
+
+        self.wait(10)
+        self.assertTrue(self.mock_quiet())
+
+        self.mock_recv(self.packSetQ('nbI', '1') +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+        self.mock_send(self.packRes(memcacheConstants.CMD_NOOP))
+
+        self.doGet('nbI', '1')
+
+    def testQuietErrorIgnored(self):
+        """Test an error response to a batched write isn't seen upstream"""
+        self.client_connect()
+        self.client_send('set nbE1 0 0 1 noreply\r\n1\r\n' +
+                         'set nbE2 0 0 1 noreply\r\n2\r\n' +
+                         'set nbE3 0 0 1 noreply\r\n3\r\n')
+
+        self.mock_recv(self.packSetQ('nbE1', '1') +
+                       self.packSetQ('nbE2', '2') +
+                       self.packSetQ('nbE3', '3') +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+        self.mock_send(self.packRes(CMD_SETQ,
+                                    status=memcacheConstants.ERR_NOT_STORED,
+                                    opaque=OPAQUE_IGNORE_REPLY) +
+                       self.packRes(memcacheConstants.CMD_NOOP))
+
+        # The get's response is all the client sees.
+        self.doGet('nbE1', '1')
+
+    def testNextRequestBehindBatch(self):
+        """Test an upstream's next request flushes its batched write first"""
+        self.client_connect()
+        self.client_send('set nbN 0 0 1 noreply\r\n1\r\n' +
+                         'get nbN\r\n')
+
+        # The get flushes the batch before the noreply_batch_interval.
+        self.wait(10)
+        self.assertFalse(self.mock_quiet())
+
+        self.mock_recv(self.packSetQ('nbN', '1') +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+
+        # The get isn't sent until the batch's NOOP response.
+        self.wait(5)
+        self.assertTrue(self.mock_quiet())
+
+        self.mock_send(self.packRes(memcacheConstants.CMD_NOOP))
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='nbN'))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETK, key='nbN',
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='1'))
+        self.client_recv('VALUE nbN 0 1\r\n1\r\nEND\r\n')
+
+if __name__ == '__main__':
+    unittest.main()
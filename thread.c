@@ -10,10 +10,16 @@
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "log.h"
 
 #define ITEMS_PER_ALLOC 64
 
+/* Resolution of the per-thread timer wheel, in millisecs. */
+#define TIMER_WHEEL_TICK_MSEC 10
+#define LISTEN_PAUSE_MSEC 100 /* see thread_accept_pause() */
+
 extern struct hash_ops strhash_ops;
 extern struct hash_ops skeyhash_ops;
 
@@ -40,8 +46,6 @@ struct conn_queue {
     pthread_cond_t  cond;
 };
 
-/* Lock for cache operations (item_*, assoc_*) */
-pthread_mutex_t cache_lock;
 
 /* Connection lock around accepting new connections */
 pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -49,6 +53,9 @@ pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
 /* Lock for global stats */
 static pthread_mutex_t stats_lock;
 
+/* Lock for the threads' stats_base */
+static pthread_mutex_t stats_base_lock;
+
 /* Free list of CQ_ITEM structs */
 static CQ_ITEM *cqi_freelist;
 static pthread_mutex_t cqi_freelist_lock;
@@ -68,6 +75,8 @@ static pthread_cond_t init_cond;
 
 
 static void thread_libevent_process(int fd, short which, void *arg);
+static void thread_timer_tick(int fd, short which, void *arg);
+static uint64_t thread_timer_clock(void);
 
 /*
  * Initializes a connection queue.
@@ -189,14 +198,336 @@ void accept_new_conns(const bool do_accept) {
     do_accept_new_conns(do_accept);
     pthread_mutex_unlock(&conn_lock);
 }
+
+static void thread_accept_timeout(twheel_timer *t, void *arg) {
+    (void)t;
+    thread_accept_resume(arg);
+}
+
+/*
+ * Stops a worker's own SO_REUSEPORT listener from accepting when it's
+ * out of fds.  Unlike accept_new_conns(), this only touches the calling
+ * thread's events.  The listener resumes when a conn on the same thread
+ * closes, or else after LISTEN_PAUSE_MSEC.
+ */
+void thread_accept_pause(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+    assert(me != NULL);
+    assert(pthread_equal(me->thread_id, pthread_self()));
+
+    if (!update_event(c, 0)) {
+        return;
+    }
+
+    c->next = me->listen_paused;
+    me->listen_paused = c;
+
+    STATS_LOCK();
+    stats.listen_disabled_num++;
+    STATS_UNLOCK();
+
+    if (!twheel_timer_pending(&me->listen_timer)) {
+        thread_timer_add(me, &me->listen_timer, LISTEN_PAUSE_MSEC,
+                         thread_accept_timeout, me);
+    }
+}
+
+/*
+ * Resumes the calling thread's listeners paused by thread_accept_pause().
+ */
+void thread_accept_resume(LIBEVENT_THREAD *me) {
+    if (me == NULL || me->listen_paused == NULL) {
+        return;
+    }
+
+    twheel_del(&me->listen_timer);
+
+    while (me->listen_paused != NULL) {
+        conn *c = me->listen_paused;
+        me->listen_paused = c->next;
+        c->next = NULL;
+
+        if (!update_event(c, EV_READ | EV_PERSIST)) {
+            if (settings.verbose > 0)
+                moxi_log_write("Couldn't resume listening\n");
+        }
+    }
+}
+/*
+ * A worker's io_uring batches the sendmsg()'s of its conns.  transmit()
+ * queues a conn's current msghdr with thread_uring_sendmsg(), which
+ * parks the conn without events, and the first send queued during an
+ * event loop iteration activates uring_submit_event, which runs after
+ * the iteration's other events.  So every send queued in between goes
+ * to the kernel with one io_uring_enter().  Sends that complete during
+ * the submit are reaped right away, the rest through the eventfd, and
+ * each conn is then driven again in conn_write or conn_mwrite, where
+ * transmit() picks up its result in place of calling sendmsg().
+ *
+ * Reads stay on libevent, as do the sends of UDP conns.
+ */
+#define THREAD_URING_ENTRIES 256
+
+static void thread_uring_complete(void *data, int res) {
+    conn *c = data;
+    assert(c != NULL);
+    assert(c->uring_state == conn_uring_sending ||
+           c->uring_state == conn_uring_closing);
+
+    LIBEVENT_THREAD *me = c->thread;
+
+    c->uring_res = res;
+    if (c->uring_state == conn_uring_sending) {
+        c->uring_state = conn_uring_sent;
+    }
+    c->uring_next  = me->uring_done;
+    me->uring_done = c;
+}
+
+/*
+ * Reaps completed sends and drives their conns, or finishes closing
+ * them.  Only called from the thread's own uring events, so never from
+ * within drive_machine().
+ */
+static void thread_uring_drive(LIBEVENT_THREAD *me) {
+    uring_reap(me->uring, thread_uring_complete);
+
+    while (me->uring_done != NULL) {
+        conn *c = me->uring_done;
+        me->uring_done = c->uring_next;
+        c->uring_next = NULL;
+
+        if (c->uring_state == conn_uring_closing) {
+            c->uring_state = conn_uring_idle;
+            conn_close(c);
+        } else if (c->state == conn_write || c->state == conn_mwrite) {
+            c->which = EV_WRITE;
+            drive_machine(c);
+        } else {
+            c->uring_state = conn_uring_idle;
+        }
+    }
+}
+
+static void thread_uring_submit(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    assert(me != NULL);
+
+    (void) fd;
+    (void) which;
+
+    me->uring_submit_pending = false;
+
+    if (uring_submit(me->uring, 0) < 0 && settings.verbose > 1) {
+        moxi_log_write("io_uring submit failed: %s\n", strerror(errno));
+    }
+
+    thread_uring_drive(me);
+
+    /* whatever the kernel didn't take, and anything the driven conns
+       queued, goes with the next loop iteration */
+    if (uring_queued(me->uring) > 0 && !me->uring_submit_pending) {
+        me->uring_submit_pending = true;
+        event_active(&me->uring_submit_event, EV_WRITE, 1);
+    }
+}
+
+static void thread_uring_event(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    assert(me != NULL);
+
+    (void) which;
+
+    uint64_t n;
+
+    if (read(fd, &n, sizeof(n)) != sizeof(n) && settings.verbose > 2) {
+        moxi_log_write("io_uring eventfd read: %s\n", strerror(errno));
+    }
+
+    thread_uring_drive(me);
+}
+
+static bool thread_uring_init(LIBEVENT_THREAD *me) {
+    me->uring = calloc(1, sizeof(uring));
+    if (me->uring == NULL) {
+        return false;
+    }
+
+    if (!uring_init(me->uring, THREAD_URING_ENTRIES)) {
+        if (settings.verbose > 0) {
+            moxi_log_write("Can't set up io_uring, using sendmsg\n");
+        }
+        return false;
+    }
+
+    event_set(&me->uring_event, me->uring->event_fd,
+              EV_READ | EV_PERSIST, thread_uring_event, me);
+    event_base_set(me->base, &me->uring_event);
+
+    if (event_add(&me->uring_event, 0) == -1) {
+        if (settings.verbose > 0) {
+            moxi_log_write("Can't monitor io_uring eventfd\n");
+        }
+        uring_destroy(me->uring);
+        return false;
+    }
+
+    event_set(&me->uring_submit_event, -1, 0, thread_uring_submit, me);
+    event_base_set(me->base, &me->uring_submit_event);
+
+    return true;
+}
+
+/*
+ * Queues a send of the conn's msghdr on its thread's io_uring, and
+ * takes the conn off its events until the send completes.  Returns
+ * false if the caller should sendmsg() instead, such as for UDP, when
+ * the ring is full, or when settings.io_uring is off.
+ */
+bool thread_uring_sendmsg(conn *c, struct msghdr *m) {
+    assert(c != NULL);
+    assert(c->uring_state == conn_uring_idle);
+
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (!settings.io_uring ||
+        me == NULL ||
+        IS_UDP(c->transport)) {
+        return false;
+    }
+
+    if (me->uring == NULL && !thread_uring_init(me)) {
+        return false;
+    }
+
+    if (me->uring->fd < 0) {
+        return false;
+    }
+
+    if (uring_full(me->uring)) {
+        uring_submit(me->uring, 0);
+
+        if (uring_full(me->uring)) {
+            return false;
+        }
+    }
+
+    if (!update_event(c, 0)) {
+        return false;
+    }
+
+    uring_sendmsg(me->uring, c->sfd, m, c);
+
+    c->uring_state = conn_uring_sending;
+
+    if (!me->uring_submit_pending) {
+        me->uring_submit_pending = true;
+        event_active(&me->uring_submit_event, EV_WRITE, 1);
+    }
+
+    return true;
+}
+
+/*
+ * Called before a conn closes, to forget its completed send, or to
+ * wait out one that's still in flight, as the kernel might still be
+ * reading the conn's buffers.  The shutdown() fails a send that's
+ * waiting for room in the socket, so the wait is short.  Other conns
+ * whose sends complete meanwhile are driven on the next loop.
+ *
+ * Returns false if the send can't be waited out, when the ring can't
+ * be entered, and then the caller must leave the conn, its fd and its
+ * buffers alone.  The send's completion finishes the close instead.
+ */
+bool thread_uring_cancel(conn *c) {
+    assert(c != NULL);
+
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (c->uring_state == conn_uring_sending) {
+        shutdown(c->sfd, SHUT_RDWR);
+
+        while (c->uring_state == conn_uring_sending) {
+            if (uring_submit(me->uring, 1) < 0 &&
+                errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                if (settings.verbose > 0) {
+                    moxi_log_write("io_uring wait failed: %s\n",
+                                   strerror(errno));
+                }
+
+                // Retry from the event loop, whose submits and reaps
+                // will get to the send's completion.
+                //
+                c->uring_state = conn_uring_closing;
+
+                if (!me->uring_submit_pending) {
+                    me->uring_submit_pending = true;
+                    event_active(&me->uring_submit_event, EV_WRITE, 1);
+                }
+                break;
+            }
+
+            uring_reap(me->uring, thread_uring_complete);
+        }
+    }
+
+    if (c->uring_state == conn_uring_closing) {
+        return false;
+    }
+
+    if (c->uring_state == conn_uring_sent) {
+        conn **prev = &me->uring_done;
+        while (*prev != NULL && *prev != c) {
+            prev = &(*prev)->uring_next;
+        }
+        if (*prev == c) {
+            *prev = c->uring_next;
+        }
+    }
+
+    c->uring_state = conn_uring_idle;
+    c->uring_next  = NULL;
+
+    if (me != NULL &&
+        me->uring_done != NULL &&
+        !me->uring_submit_pending) {
+        me->uring_submit_pending = true;
+        event_active(&me->uring_submit_event, EV_WRITE, 1);
+    }
+
+    return true;
+}
+
 /****************************** LIBEVENT THREADS *****************************/
 
 /*
- * Set up a thread's information.
+ * Creates a worker's event base.  With libevent 2, the epoll backend
+ * can keep a changelist, so the event_del()/event_add() pairs from
+ * update_event() get batched into at most one epoll_ctl() per fd per
+ * loop iteration.  That's only unsafe with dup()'ed fds, which we
+ * never register.
  */
+static struct event_base *thread_event_base_new(void) {
+#if defined(LIBEVENT_VERSION_NUMBER) && LIBEVENT_VERSION_NUMBER >= 0x02001000
+    struct event_config *cfg = event_config_new();
+    if (cfg != NULL) {
+        event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+
+        struct event_base *base = event_base_new_with_config(cfg);
+
+        event_config_free(cfg);
+
+        if (base != NULL) {
+            return base;
+        }
+    }
+#endif
+    return event_init();
+}
+
 static void setup_thread(LIBEVENT_THREAD *me) {
     if (! me->base) {
-        me->base = event_init();
+        me->base = thread_event_base_new();
         if (! me->base) {
             moxi_log_write("Can't allocate event base\n");
             exit(1);
@@ -229,11 +560,6 @@ static void setup_thread(LIBEVENT_THREAD *me) {
     }
     work_queue_init(me->work_queue, me->base);
 
-    if (pthread_mutex_init(&me->stats.mutex, NULL) != 0) {
-        perror("Failed to initialize mutex");
-        exit(EXIT_FAILURE);
-    }
-
     me->suffix_cache = cache_create("suffix", SUFFIX_SIZE, sizeof(char*),
                                     NULL, NULL);
     if (me->suffix_cache == NULL) {
@@ -246,6 +572,15 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         moxi_log_write("Failed to create connection hash\n");
         exit(EXIT_FAILURE);
     }
+
+    twheel_init(&me->timer_wheel, TIMER_WHEEL_TICK_MSEC, thread_timer_clock);
+
+    evtimer_set(&me->timer_wheel_event, thread_timer_tick, me);
+    event_base_set(me->base, &me->timer_wheel_event);
+    me->timer_wheel_ticking = false;
+
+    me->listen_paused = NULL;
+    twheel_timer_init(&me->listen_timer);
 }
 
 
@@ -269,10 +604,26 @@ static void *worker_libevent(void *arg) {
     pthread_cond_signal(&init_cond);
     pthread_mutex_unlock(&init_lock);
 
-    event_base_loop(me->base, 0);
+    thread_event_loop(me);
     return NULL;
 }
 
+/*
+ * Runs a thread's event loop an iteration at a time, clearing the
+ * thread's usec_now_cached() time before each iteration's callbacks,
+ * whatever they're for.  Returns like event_base_loop().
+ */
+int thread_event_loop(LIBEVENT_THREAD *me) {
+    int rv;
+
+    do {
+        me->usec_time = 0;
+        rv = event_base_loop(me->base, EVLOOP_ONCE);
+    } while (rv == 0);
+
+    return rv;
+}
+
 
 /*
  * Processes an incoming "handle a new connection" item. This is called when
@@ -292,30 +643,53 @@ static void thread_libevent_process(int fd, short which, void *arg) {
     cq_item = cq_pop(me->new_conn_queue);
 
     if (NULL != cq_item) {
-        conn *c = conn_new(cq_item->sfd, cq_item->init_state, cq_item->event_flags,
-                           cq_item->read_buffer_size,
-                           cq_item->transport,
-                           me->base,
-                           cq_item->funcs, cq_item->extra);
-        if (c == NULL) {
-            if (IS_UDP(cq_item->transport)) {
-                moxi_log_write("Can't listen for events on UDP socket\n");
-                exit(1);
-            } else {
-                if (settings.verbose > 0) {
-                    moxi_log_write("Can't listen for events on fd %d\n",
-                        cq_item->sfd);
-                }
-                close(cq_item->sfd);
-            }
-        } else {
-            c->protocol = cq_item->protocol;
-            c->thread = me;
+        conn *c = thread_conn_new(me, cq_item->sfd, cq_item->init_state,
+                                  cq_item->event_flags,
+                                  cq_item->read_buffer_size,
+                                  cq_item->protocol,
+                                  cq_item->transport,
+                                  cq_item->funcs, cq_item->extra);
+        if (c == NULL && IS_UDP(cq_item->transport)) {
+            moxi_log_write("Can't listen for events on UDP socket\n");
+            exit(1);
         }
         cqi_free(cq_item);
     }
 }
 
+/*
+ * Sets up a new connection on the calling thread, which must be me.
+ * On failure, a TCP socket is closed and NULL is returned.
+ */
+conn *thread_conn_new(LIBEVENT_THREAD *me, int sfd,
+                      enum conn_states init_state, int event_flags,
+                      int read_buffer_size,
+                      enum protocol prot,
+                      enum network_transport transport,
+                      conn_funcs *funcs, void *extra) {
+    assert(me != NULL);
+
+    conn *c = conn_new(sfd, init_state, event_flags,
+                       read_buffer_size,
+                       transport,
+                       me->base,
+                       funcs, extra);
+    if (c == NULL) {
+        if (!IS_UDP(transport)) {
+            if (settings.verbose > 0) {
+                moxi_log_write("Can't listen for events on fd %d\n", sfd);
+            }
+            close(sfd);
+        }
+        return NULL;
+    }
+
+    c->protocol = prot;
+    c->thread = me;
+
+    return c;
+}
+
 /* Which thread we assigned a connection to most recently. */
 static int last_thread = 0;
 
@@ -401,22 +775,69 @@ LIBEVENT_THREAD *thread_by_index(int i) {
     return &threads[i];
 }
 
+/******************************* TIMER WHEEL *******************************/
+
+static uint64_t thread_timer_clock(void) {
+    return monotonic_usec() / 1000;
+}
+
+static void thread_timer_start_ticking(LIBEVENT_THREAD *thread) {
+    struct timeval tv = { .tv_sec  = 0,
+                          .tv_usec = TIMER_WHEEL_TICK_MSEC * 1000 };
+
+    thread->timer_wheel_ticking = (evtimer_add(&thread->timer_wheel_event,
+                                               &tv) == 0);
+}
+
+/*
+ * Advances a thread's timer wheel.  The one libevent timer per thread
+ * only keeps ticking while the wheel has pending timers, so idle
+ * threads don't wake up.
+ */
+static void thread_timer_tick(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+
+    (void)fd;
+    (void)which;
+
+    twheel_run(&me->timer_wheel);
+
+    if (me->timer_wheel.count > 0) {
+        thread_timer_start_ticking(me);
+    } else {
+        me->timer_wheel_ticking = false;
+    }
+}
+
+/*
+ * Arms a timeout on the given thread's timer wheel.  Must be called
+ * from that thread.  Use twheel_del() to cancel.
+ */
+void thread_timer_add(LIBEVENT_THREAD *thread, twheel_timer *t,
+                      uint32_t msec, twheel_cb cb, void *arg) {
+    assert(thread != NULL);
+    assert(thread->base != NULL);
+
+    twheel_add(&thread->timer_wheel, t, msec, cb, arg);
+
+    if (!thread->timer_wheel_ticking) {
+        thread_timer_start_ticking(thread);
+    }
+}
+
 /********************************* ITEM ACCESS *******************************/
 
 /*
- * Allocates a new item.
+ * The item functions below lock the item lock of the key's hash, so
+ * threads only contend when their keys share one (see items.c).
+ */
+
+/*
+ * Allocates a new item.  Any locking of the LRU and slabs is done
+ * inside.
  */
 item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbytes) {
-#ifdef MOXI_ITEM_MALLOC
-    // Skip past the lock, since we're using malloc.
     return do_item_alloc(key, nkey, flags, exptime, nbytes);
-#else
-    item *it;
-    pthread_mutex_lock(&cache_lock);
-    it = do_item_alloc(key, nkey, flags, exptime, nbytes);
-    pthread_mutex_unlock(&cache_lock);
-    return it;
-#endif
 }
 
 /*
@@ -425,9 +846,10 @@ item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbyt
  */
 item *item_get(const char *key, const size_t nkey) {
     item *it;
-    pthread_mutex_lock(&cache_lock);
-    it = do_item_get(key, nkey);
-    pthread_mutex_unlock(&cache_lock);
+    uint32_t hv = hash(key, nkey, 0);
+    item_lock(hv);
+    it = do_item_get(key, nkey, hv);
+    item_unlock(hv);
     return it;
 }
 
@@ -436,10 +858,11 @@ item *item_get(const char *key, const size_t nkey) {
  */
 int item_link(item *cq_item) {
     int ret;
+    uint32_t hv = hash(ITEM_key(cq_item), cq_item->nkey, 0);
 
-    pthread_mutex_lock(&cache_lock);
-    ret = do_item_link(cq_item);
-    pthread_mutex_unlock(&cache_lock);
+    item_lock(hv);
+    ret = do_item_link(cq_item, hv);
+    item_unlock(hv);
     return ret;
 }
 
@@ -452,37 +875,59 @@ void item_remove(item *cq_item) {
     // Skip past the lock, since we're using malloc.
     do_item_remove(cq_item);
 #else
-    pthread_mutex_lock(&cache_lock);
+    uint32_t hv = hash(ITEM_key(cq_item), cq_item->nkey, 0);
+    item_lock(hv);
     do_item_remove(cq_item);
-    pthread_mutex_unlock(&cache_lock);
+    item_unlock(hv);
+#endif
+}
+
+/*
+ * Increments the reference count on an item, for a holder that later
+ * drops it with item_remove().
+ */
+void item_ref(item *cq_item) {
+#ifdef MOXI_ITEM_MALLOC
+    do_item_ref(cq_item);
+#else
+    uint32_t hv = hash(ITEM_key(cq_item), cq_item->nkey, 0);
+    item_lock(hv);
+    do_item_ref(cq_item);
+    item_unlock(hv);
 #endif
 }
 
 /*
  * Replaces one item with another in the hashtable.
- * Unprotected by a mutex lock since the core server does not require
- * it to be thread-safe.
  */
 int item_replace(item *old_it, item *new_it) {
-    return do_item_replace(old_it, new_it);
+    int ret;
+    uint32_t hv = hash(ITEM_key(old_it), old_it->nkey, 0);
+
+    item_lock(hv);
+    ret = do_item_replace(old_it, new_it, hv);
+    item_unlock(hv);
+    return ret;
 }
 
 /*
  * Unlinks an item from the LRU and hashtable.
  */
 void item_unlink(item *cq_item) {
-    pthread_mutex_lock(&cache_lock);
-    do_item_unlink(cq_item);
-    pthread_mutex_unlock(&cache_lock);
+    uint32_t hv = hash(ITEM_key(cq_item), cq_item->nkey, 0);
+    item_lock(hv);
+    do_item_unlink(cq_item, hv);
+    item_unlock(hv);
 }
 
 /*
  * Moves an item to the back of the LRU queue.
  */
 void item_update(item *cq_item) {
-    pthread_mutex_lock(&cache_lock);
+    uint32_t hv = hash(ITEM_key(cq_item), cq_item->nkey, 0);
+    item_lock(hv);
     do_item_update(cq_item);
-    pthread_mutex_unlock(&cache_lock);
+    item_unlock(hv);
 }
 
 /*
@@ -491,10 +936,11 @@ void item_update(item *cq_item) {
 enum delta_result_type add_delta(conn *c, item *cq_item, int incr,
                                  const int64_t delta, char *buf) {
     enum delta_result_type ret;
+    uint32_t hv = hash(ITEM_key(cq_item), cq_item->nkey, 0);
 
-    pthread_mutex_lock(&cache_lock);
-    ret = do_add_delta(c, cq_item, incr, delta, buf);
-    pthread_mutex_unlock(&cache_lock);
+    item_lock(hv);
+    ret = do_add_delta(c, cq_item, incr, delta, buf, hv);
+    item_unlock(hv);
     return ret;
 }
 
@@ -503,10 +949,11 @@ enum delta_result_type add_delta(conn *c, item *cq_item, int incr,
  */
 enum store_item_type store_item(item *cq_item, int comm, conn* c) {
     enum store_item_type ret;
+    uint32_t hv = hash(ITEM_key(cq_item), cq_item->nkey, 0);
 
-    pthread_mutex_lock(&cache_lock);
-    ret = do_store_item(cq_item, comm, c);
-    pthread_mutex_unlock(&cache_lock);
+    item_lock(hv);
+    ret = do_store_item(cq_item, comm, c, hv);
+    item_unlock(hv);
     return ret;
 }
 
@@ -514,39 +961,30 @@ enum store_item_type store_item(item *cq_item, int comm, conn* c) {
  * Flushes expired items after a flush_all call
  */
 void item_flush_expired() {
-    pthread_mutex_lock(&cache_lock);
+    item_lock_all();
     do_item_flush_expired();
-    pthread_mutex_unlock(&cache_lock);
+    item_unlock_all();
 }
 
 /*
  * Dumps part of the cache
  */
 char *item_cachedump(unsigned int clsid, unsigned int limit, unsigned int *bytes) {
-    char *ret;
-
-    pthread_mutex_lock(&cache_lock);
-    ret = do_item_cachedump(clsid, limit, bytes);
-    pthread_mutex_unlock(&cache_lock);
-    return ret;
+    return do_item_cachedump(clsid, limit, bytes);
 }
 
 /*
  * Dumps statistics about slab classes
  */
 void  item_stats(ADD_STAT add_stats, void *c) {
-    pthread_mutex_lock(&cache_lock);
     do_item_stats(add_stats, c);
-    pthread_mutex_unlock(&cache_lock);
 }
 
 /*
  * Dumps a list of objects of each size in 32-byte increments
  */
 void  item_stats_sizes(ADD_STAT add_stats, void *c) {
-    pthread_mutex_lock(&cache_lock);
     do_item_stats_sizes(add_stats, c);
-    pthread_mutex_unlock(&cache_lock);
 }
 
 /******************************* GLOBAL STATS ******************************/
@@ -559,39 +997,49 @@ void STATS_UNLOCK() {
     pthread_mutex_unlock(&stats_lock);
 }
 
+/*
+ * A reset records each counter's current value, which later reads
+ * subtract, as only the owning thread may store to its counters.
+ */
+#define THREAD_STATS_RESET(ii, field) \
+    (threads[ii].stats_base.field = \
+        THREAD_STATS_GET(threads[ii].stats.field))
+#define THREAD_STATS_SINCE_RESET(ii, field) \
+    (THREAD_STATS_GET(threads[ii].stats.field) - \
+        threads[ii].stats_base.field)
+
 void threadlocal_stats_reset(void) {
     int ii, sid;
+    pthread_mutex_lock(&stats_base_lock);
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&threads[ii].stats.mutex);
-
-        threads[ii].stats.get_cmds = 0;
-        threads[ii].stats.get_misses = 0;
-        threads[ii].stats.delete_misses = 0;
-        threads[ii].stats.incr_misses = 0;
-        threads[ii].stats.decr_misses = 0;
-        threads[ii].stats.cas_misses = 0;
-        threads[ii].stats.bytes_read = 0;
-        threads[ii].stats.bytes_written = 0;
-        threads[ii].stats.flush_cmds = 0;
-        threads[ii].stats.conn_yields = 0;
+        THREAD_STATS_RESET(ii, get_cmds);
+        THREAD_STATS_RESET(ii, get_misses);
+        THREAD_STATS_RESET(ii, delete_misses);
+        THREAD_STATS_RESET(ii, incr_misses);
+        THREAD_STATS_RESET(ii, decr_misses);
+        THREAD_STATS_RESET(ii, cas_misses);
+        THREAD_STATS_RESET(ii, bytes_read);
+        THREAD_STATS_RESET(ii, bytes_written);
+        THREAD_STATS_RESET(ii, flush_cmds);
+        THREAD_STATS_RESET(ii, conn_yields);
+        THREAD_STATS_RESET(ii, conn_buffer_hits);
+        THREAD_STATS_RESET(ii, conn_buffer_misses);
 
         for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-            threads[ii].stats.slab_stats[sid].set_cmds = 0;
-            threads[ii].stats.slab_stats[sid].get_hits = 0;
-            threads[ii].stats.slab_stats[sid].delete_hits = 0;
-            threads[ii].stats.slab_stats[sid].incr_hits = 0;
-            threads[ii].stats.slab_stats[sid].decr_hits = 0;
-            threads[ii].stats.slab_stats[sid].cas_hits = 0;
-            threads[ii].stats.slab_stats[sid].cas_badval = 0;
+            THREAD_STATS_RESET(ii, slab_stats[sid].set_cmds);
+            THREAD_STATS_RESET(ii, slab_stats[sid].get_hits);
+            THREAD_STATS_RESET(ii, slab_stats[sid].delete_hits);
+            THREAD_STATS_RESET(ii, slab_stats[sid].incr_hits);
+            THREAD_STATS_RESET(ii, slab_stats[sid].decr_hits);
+            THREAD_STATS_RESET(ii, slab_stats[sid].cas_hits);
+            THREAD_STATS_RESET(ii, slab_stats[sid].cas_badval);
         }
-
-        pthread_mutex_unlock(&threads[ii].stats.mutex);
     }
+    pthread_mutex_unlock(&stats_base_lock);
 }
 
 void threadlocal_stats_aggregate(struct thread_stats *thread_stats) {
     int ii, sid;
-    /* The struct contains a mutex, so I should probably not memset it.. */
     thread_stats->get_cmds = 0;
     thread_stats->get_misses = 0;
     thread_stats->delete_misses = 0;
@@ -602,43 +1050,47 @@ void threadlocal_stats_aggregate(struct thread_stats *thread_stats) {
     thread_stats->bytes_read = 0;
     thread_stats->flush_cmds = 0;
     thread_stats->conn_yields = 0;
+    thread_stats->conn_buffer_hits = 0;
+    thread_stats->conn_buffer_misses = 0;
+    thread_stats->conns_unbuffered = 0;
 
     memset(thread_stats->slab_stats, 0,
            sizeof(struct slab_stats) * MAX_NUMBER_OF_SLAB_CLASSES);
 
+    pthread_mutex_lock(&stats_base_lock);
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&threads[ii].stats.mutex);
-
-        thread_stats->get_cmds += threads[ii].stats.get_cmds;
-        thread_stats->get_misses += threads[ii].stats.get_misses;
-        thread_stats->delete_misses += threads[ii].stats.delete_misses;
-        thread_stats->decr_misses += threads[ii].stats.decr_misses;
-        thread_stats->incr_misses += threads[ii].stats.incr_misses;
-        thread_stats->cas_misses += threads[ii].stats.cas_misses;
-        thread_stats->bytes_read += threads[ii].stats.bytes_read;
-        thread_stats->bytes_written += threads[ii].stats.bytes_written;
-        thread_stats->flush_cmds += threads[ii].stats.flush_cmds;
-        thread_stats->conn_yields += threads[ii].stats.conn_yields;
+        thread_stats->get_cmds += THREAD_STATS_SINCE_RESET(ii, get_cmds);
+        thread_stats->get_misses += THREAD_STATS_SINCE_RESET(ii, get_misses);
+        thread_stats->delete_misses += THREAD_STATS_SINCE_RESET(ii, delete_misses);
+        thread_stats->decr_misses += THREAD_STATS_SINCE_RESET(ii, decr_misses);
+        thread_stats->incr_misses += THREAD_STATS_SINCE_RESET(ii, incr_misses);
+        thread_stats->cas_misses += THREAD_STATS_SINCE_RESET(ii, cas_misses);
+        thread_stats->bytes_read += THREAD_STATS_SINCE_RESET(ii, bytes_read);
+        thread_stats->bytes_written += THREAD_STATS_SINCE_RESET(ii, bytes_written);
+        thread_stats->flush_cmds += THREAD_STATS_SINCE_RESET(ii, flush_cmds);
+        thread_stats->conn_yields += THREAD_STATS_SINCE_RESET(ii, conn_yields);
+        thread_stats->conn_buffer_hits += THREAD_STATS_SINCE_RESET(ii, conn_buffer_hits);
+        thread_stats->conn_buffer_misses += THREAD_STATS_SINCE_RESET(ii, conn_buffer_misses);
+        thread_stats->conns_unbuffered += THREAD_STATS_GET(threads[ii].stats.conns_unbuffered);
 
         for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
             thread_stats->slab_stats[sid].set_cmds +=
-                threads[ii].stats.slab_stats[sid].set_cmds;
+                THREAD_STATS_SINCE_RESET(ii, slab_stats[sid].set_cmds);
             thread_stats->slab_stats[sid].get_hits +=
-                threads[ii].stats.slab_stats[sid].get_hits;
+                THREAD_STATS_SINCE_RESET(ii, slab_stats[sid].get_hits);
             thread_stats->slab_stats[sid].delete_hits +=
-                threads[ii].stats.slab_stats[sid].delete_hits;
+                THREAD_STATS_SINCE_RESET(ii, slab_stats[sid].delete_hits);
             thread_stats->slab_stats[sid].decr_hits +=
-                threads[ii].stats.slab_stats[sid].decr_hits;
+                THREAD_STATS_SINCE_RESET(ii, slab_stats[sid].decr_hits);
             thread_stats->slab_stats[sid].incr_hits +=
-                threads[ii].stats.slab_stats[sid].incr_hits;
+                THREAD_STATS_SINCE_RESET(ii, slab_stats[sid].incr_hits);
             thread_stats->slab_stats[sid].cas_hits +=
-                threads[ii].stats.slab_stats[sid].cas_hits;
+                THREAD_STATS_SINCE_RESET(ii, slab_stats[sid].cas_hits);
             thread_stats->slab_stats[sid].cas_badval +=
-                threads[ii].stats.slab_stats[sid].cas_badval;
+                THREAD_STATS_SINCE_RESET(ii, slab_stats[sid].cas_badval);
         }
-
-        pthread_mutex_unlock(&threads[ii].stats.mutex);
     }
+    pthread_mutex_unlock(&stats_base_lock);
 }
 
 void slab_stats_aggregate(struct thread_stats *thread_stats, struct slab_stats *out) {
@@ -679,8 +1131,8 @@ void thread_init(int nthreads, struct event_base *main_base) {
         exit(1);
 #endif
 
-    pthread_mutex_init(&cache_lock, NULL);
     pthread_mutex_init(&stats_lock, NULL);
+    pthread_mutex_init(&stats_base_lock, NULL);
 
     pthread_mutex_init(&init_lock, NULL);
     pthread_cond_init(&init_cond, NULL);
@@ -0,0 +1,278 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "topk.h"
+
+static int topk_str_eq(const void *v1, const void *v2) {
+    return strcmp(v1, v2) == 0;
+}
+
+static void *topk_noop_dup(const void *v) {
+    return (void *) v;
+}
+
+static void topk_noop_free(void *v) {
+    (void) v;
+}
+
+// Keys are owned by their entries, which are owned by the heap.
+//
+static struct hash_ops topk_hash_ops = {
+    .hashfunc  = genhash_string_hash,
+    .hasheq    = topk_str_eq,
+    .dupKey    = topk_noop_dup,
+    .dupValue  = topk_noop_dup,
+    .freeKey   = topk_noop_free,
+    .freeValue = topk_noop_free
+};
+
+static void heap_swap(topk *t, int a, int b) {
+    topk_entry *e = t->heap[a];
+
+    t->heap[a] = t->heap[b];
+    t->heap[b] = e;
+
+    t->heap[a]->pos = a;
+    t->heap[b]->pos = b;
+}
+
+static void heap_up(topk *t, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (t->heap[parent]->count <= t->heap[i]->count) {
+            break;
+        }
+
+        heap_swap(t, parent, i);
+        i = parent;
+    }
+}
+
+static void heap_down(topk *t, int i) {
+    while (true) {
+        int min = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+
+        if (l < t->num &&
+            t->heap[l]->count < t->heap[min]->count) {
+            min = l;
+        }
+        if (r < t->num &&
+            t->heap[r]->count < t->heap[min]->count) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+
+        heap_swap(t, min, i);
+        i = min;
+    }
+}
+
+bool topk_init(topk *t, int max) {
+    assert(t != NULL);
+    assert(max >= 0);
+
+    memset(t, 0, sizeof(*t));
+
+    if (max == 0) {
+        return true;
+    }
+
+    t->heap = calloc(max, sizeof(topk_entry *));
+    if (t->heap == NULL) {
+        return false;
+    }
+
+    t->index = genhash_init(max, topk_hash_ops);
+    if (t->index == NULL) {
+        free(t->heap);
+        t->heap = NULL;
+        return false;
+    }
+
+    t->max = max;
+
+    return true;
+}
+
+void topk_destroy(topk *t) {
+    assert(t != NULL);
+
+    topk_reset(t);
+
+    if (t->index != NULL) {
+        genhash_free(t->index);
+    }
+
+    free(t->heap);
+
+    memset(t, 0, sizeof(*t));
+}
+
+void topk_reset(topk *t) {
+    assert(t != NULL);
+
+    if (t->index != NULL) {
+        genhash_clear(t->index);
+    }
+
+    for (int i = 0; i < t->num; i++) {
+        free(t->heap[i]->key);
+        free(t->heap[i]);
+        t->heap[i] = NULL;
+    }
+
+    t->num = 0;
+    t->total = 0;
+}
+
+// Returns an entry for a key that's not yet tracked, either a new
+// one or the smallest one, re-keyed.  Returns NULL on OOM.
+//
+static topk_entry *topk_add(topk *t, const char *key, int key_len) {
+    char *k = malloc(key_len + 1);
+    if (k == NULL) {
+        return NULL;
+    }
+
+    memcpy(k, key, key_len);
+    k[key_len] = '\0';
+
+    topk_entry *e;
+
+    if (t->num < t->max) {
+        e = calloc(1, sizeof(topk_entry));
+        if (e == NULL) {
+            free(k);
+            return NULL;
+        }
+
+        e->pos = t->num;
+        t->heap[t->num++] = e;
+    } else {
+        e = t->heap[0];
+
+        genhash_delete(t->index, e->key);
+        free(e->key);
+
+        // Space-Saving: the new key inherits the evicted count,
+        // which is the most it could have been seen before.
+        //
+        e->error  = e->count;
+        e->gets   = 0;
+        e->sets   = 0;
+        e->misses = 0;
+        e->bytes  = 0;
+    }
+
+    e->key = k;
+
+    genhash_store(t->index, e->key, e);
+
+    return e;
+}
+
+topk_entry *topk_touch(topk *t, const char *key, int key_len,
+                       uint64_t weight) {
+    assert(t != NULL);
+    assert(key != NULL);
+
+    if (t->max <= 0 ||
+        key_len <= 0 ||
+        key_len > TOPK_KEY_MAX) {
+        return NULL;
+    }
+
+    char buf[TOPK_KEY_MAX + 1];
+
+    memcpy(buf, key, key_len);
+    buf[key_len] = '\0';
+
+    topk_entry *e = genhash_find(t->index, buf);
+    if (e == NULL) {
+        if (weight == 0) {
+            return NULL;
+        }
+
+        e = topk_add(t, buf, key_len);
+        if (e == NULL) {
+            return NULL;
+        }
+    }
+
+    t->total += weight;
+
+    if (weight > 0) {
+        // A new entry starts at the bottom of the heap, while
+        // an existing one only ever moves down.
+        //
+        e->count += weight;
+        heap_down(t, e->pos);
+        heap_up(t, e->pos);
+    }
+
+    return e;
+}
+
+void topk_merge(topk *agg, topk *x) {
+    assert(agg != NULL);
+    assert(x != NULL);
+
+    for (int i = 0; i < x->num; i++) {
+        topk_entry *xe = x->heap[i];
+        topk_entry *e = topk_touch(agg, xe->key, strlen(xe->key),
+                                   xe->count);
+        if (e != NULL) {
+            e->error  += xe->error;
+            e->gets   += xe->gets;
+            e->sets   += xe->sets;
+            e->misses += xe->misses;
+            e->bytes  += xe->bytes;
+        }
+    }
+}
+
+static int topk_entry_cmp_desc(const void *a, const void *b) {
+    const topk_entry *ea = *(const topk_entry **) a;
+    const topk_entry *eb = *(const topk_entry **) b;
+
+    if (ea->count > eb->count) {
+        return -1;
+    }
+    if (ea->count < eb->count) {
+        return 1;
+    }
+
+    return strcmp(ea->key, eb->key);
+}
+
+int topk_sorted(topk *t, topk_entry **out, int out_max) {
+    assert(t != NULL);
+    assert(out != NULL || out_max == 0);
+
+    if (t->num == 0 || out_max <= 0) {
+        return 0;
+    }
+
+    topk_entry **all = malloc(t->num * sizeof(topk_entry *));
+    if (all == NULL) {
+        return 0;
+    }
+
+    memcpy(all, t->heap, t->num * sizeof(topk_entry *));
+    qsort(all, t->num, sizeof(topk_entry *), topk_entry_cmp_desc);
+
+    int n = t->num < out_max ? t->num : out_max;
+
+    memcpy(out, all, n * sizeof(topk_entry *));
+    free(all);
+
+    return n;
+}
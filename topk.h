@@ -0,0 +1,93 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef TOPK_H
+#define TOPK_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "genhash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * Heavy hitter (top-K) key tracking, using the Space-Saving
+     * algorithm.
+     *
+     * A topk tracks at most max keys.  When a new key is seen and
+     * the topk is full, the key with the smallest count is evicted,
+     * and the new key inherits its count, which becomes the new
+     * key's error.  So a count is never less than the real number of
+     * accesses since the key was tracked, and is at most error more
+     * than that.  Any key accessed more than N / max times, of N
+     * total accesses, is guaranteed to be tracked.
+     *
+     * A topk is not thread-safe, and is meant to be owned by a
+     * single thread.
+     */
+
+#define TOPK_KEY_MAX 250
+
+    typedef struct {
+        char    *key;   // Zero terminated, owned by the entry.
+        uint64_t count; // Estimated number of accesses.
+        uint64_t error; // Max amount that count is overestimated.
+        uint64_t gets;
+        uint64_t sets;
+        uint64_t misses;
+        uint64_t bytes;
+        int      pos;   // Index in the heap.
+    } topk_entry;
+
+    typedef struct {
+        int          max;
+        int          num;
+        topk_entry **heap;  // Min-heap by count, of num entries.
+        genhash_t   *index; // Key to topk_entry.
+        uint64_t     total; // Total weight of all touches.
+    } topk;
+
+    /**
+     * Initialize a topk that tracks up to max keys.  A max of 0
+     * leaves the topk disabled, where every touch is a no-op.
+     */
+    bool topk_init(topk *t, int max);
+
+    void topk_destroy(topk *t);
+
+    /**
+     * Forget all tracked keys.
+     */
+    void topk_reset(topk *t);
+
+    /**
+     * Count weight accesses of a key, returning its entry so the
+     * caller can update the entry's other counters.  A weight of 0
+     * only looks up the key, returning NULL if it's not tracked.
+     */
+    topk_entry *topk_touch(topk *t, const char *key, int key_len,
+                           uint64_t weight);
+
+    /**
+     * Add the entries of topk x into topk agg.  Keys that don't fit
+     * into agg displace agg's smallest entries, as in topk_touch().
+     * To merge several topk's without losing any keys, agg's max
+     * should be the sum of their max's.
+     */
+    void topk_merge(topk *agg, topk *x);
+
+    /**
+     * Fills out with up to out_max entries, largest count first,
+     * returning the number of entries filled.  The entries are owned
+     * by the topk and are only valid until it's next changed.
+     */
+    int topk_sorted(topk *t, topk_entry **out, int out_max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
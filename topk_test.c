@@ -0,0 +1,150 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <topk.h>
+
+static void testSimple(void) {
+    topk t;
+    topk_entry *out[10];
+
+    assert(topk_init(&t, 3) == true);
+    assert(topk_sorted(&t, out, 10) == 0);
+
+    // Weight 0 only looks up.
+    //
+    assert(topk_touch(&t, "a", 1, 0) == NULL);
+    assert(t.num == 0);
+
+    topk_entry *e = topk_touch(&t, "abc", 1, 1);
+    assert(e != NULL);
+    assert(strcmp(e->key, "a") == 0);
+    assert(e->count == 1);
+    assert(e->error == 0);
+    e->gets++;
+
+    assert(topk_touch(&t, "a", 1, 0) == e);
+    assert(topk_touch(&t, "a", 1, 2) == e);
+    assert(e->count == 3);
+
+    topk_touch(&t, "b", 1, 2);
+    topk_touch(&t, "c", 1, 1);
+    assert(t.num == 3);
+
+    assert(topk_sorted(&t, out, 10) == 3);
+    assert(strcmp(out[0]->key, "a") == 0);
+    assert(strcmp(out[1]->key, "b") == 0);
+    assert(strcmp(out[2]->key, "c") == 0);
+    assert(out[0]->gets == 1);
+
+    // A new key replaces the smallest, inheriting its count.
+    //
+    e = topk_touch(&t, "d", 1, 1);
+    assert(e != NULL);
+    assert(e->count == 2);
+    assert(e->error == 1);
+    assert(e->gets == 0);
+    assert(topk_touch(&t, "c", 1, 0) == NULL);
+    assert(t.num == 3);
+    assert(t.total == 7);
+
+    assert(topk_sorted(&t, out, 1) == 1);
+    assert(strcmp(out[0]->key, "a") == 0);
+
+    topk_reset(&t);
+    assert(t.num == 0);
+    assert(topk_touch(&t, "a", 1, 0) == NULL);
+
+    topk_destroy(&t);
+
+    // Disabled.
+    //
+    assert(topk_init(&t, 0) == true);
+    assert(topk_touch(&t, "a", 1, 1) == NULL);
+    topk_destroy(&t);
+}
+
+static void testHeavyHitters(void) {
+    topk t;
+    topk_entry *out[10];
+    char key[32];
+
+    assert(topk_init(&t, 20) == true);
+
+    // A few hot keys among lots of cold, churning ones.
+    //
+    srand(1234);
+    for (int i = 0; i < 100000; i++) {
+        int k;
+        if (i % 2 == 0) {
+            k = i % 5;
+        } else {
+            k = 1000 + (rand() % 10000);
+        }
+
+        int key_len = snprintf(key, sizeof(key), "key-%d", k);
+        assert(topk_touch(&t, key, key_len, 1) != NULL);
+    }
+
+    assert(t.num == 20);
+    assert(t.total == 100000);
+
+    int n = topk_sorted(&t, out, 5);
+    assert(n == 5);
+
+    for (int i = 0; i < n; i++) {
+        int k = atoi(out[i]->key + 4);
+        assert(k < 5);
+        assert(out[i]->count >= 10000);
+        assert(out[i]->count - out[i]->error <= 10000);
+        if (i > 0) {
+            assert(out[i - 1]->count >= out[i]->count);
+        }
+    }
+
+    topk_destroy(&t);
+}
+
+static void testMerge(void) {
+    topk t0, t1, agg;
+    topk_entry *out[10];
+
+    assert(topk_init(&t0, 3) == true);
+    assert(topk_init(&t1, 3) == true);
+    assert(topk_init(&agg, 6) == true);
+
+    topk_touch(&t0, "a", 1, 5)->sets = 5;
+    topk_touch(&t0, "b", 1, 2);
+    topk_touch(&t1, "a", 1, 1)->sets = 1;
+    topk_touch(&t1, "c", 1, 4);
+    topk_touch(&t1, "d", 1, 3);
+
+    topk_merge(&agg, &t0);
+    topk_merge(&agg, &t1);
+
+    assert(agg.num == 4);
+    assert(agg.total == 15);
+    assert(topk_sorted(&agg, out, 10) == 4);
+    assert(strcmp(out[0]->key, "a") == 0);
+    assert(out[0]->count == 6);
+    assert(out[0]->sets == 6);
+    assert(strcmp(out[1]->key, "c") == 0);
+    assert(strcmp(out[2]->key, "d") == 0);
+    assert(strcmp(out[3]->key, "b") == 0);
+
+    topk_destroy(&agg);
+    topk_destroy(&t1);
+    topk_destroy(&t0);
+}
+
+int main(void) {
+    testSimple();
+    testHeavyHitters();
+    testMerge();
+
+    return 0;
+}
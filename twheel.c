@@ -0,0 +1,237 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "twheel.h"
+
+static void list_init(twheel_timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(twheel_timer *head, twheel_timer *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_unlink(twheel_timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+static void list_move(twheel_timer *from, twheel_timer *to) {
+    list_init(to);
+
+    if (from->next != from) {
+        to->next = from->next;
+        to->prev = from->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+
+        list_init(from);
+    }
+}
+
+static uint64_t twheel_elapsed_msec(twheel *w) {
+    uint64_t msec = w->clock();
+    if (msec < w->start_msec) {
+        return 0;
+    }
+
+    return msec - w->start_msec;
+}
+
+static uint64_t twheel_current_tick(twheel *w) {
+    return twheel_elapsed_msec(w) / w->tick_msec;
+}
+
+// Links a timer into the slot for its expire tick, relative to w->now.
+//
+static void twheel_place(twheel *w, twheel_timer *t) {
+    if (t->expire < w->now) {
+        t->expire = w->now;
+    }
+
+    uint64_t delta = t->expire - w->now;
+    uint64_t max = ((uint64_t) 1 << (TWHEEL_BITS * TWHEEL_LEVELS)) - 1;
+
+    if (delta > max) {
+        t->expire = w->now + max;
+        delta = max;
+    }
+
+    int level = 0;
+    while (level < TWHEEL_LEVELS - 1 &&
+           delta >= ((uint64_t) 1 << (TWHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    int idx = (t->expire >> (TWHEEL_BITS * level)) & TWHEEL_MASK;
+
+    list_append(&w->slots[level][idx], t);
+}
+
+// Re-places all the timers of a higher level slot, which moves
+// them closer to level 0 now that they're due soon enough.
+//
+static void twheel_cascade(twheel *w, int level, int idx) {
+    twheel_timer list;
+
+    list_move(&w->slots[level][idx], &list);
+
+    while (list.next != &list) {
+        twheel_timer *t = list.next;
+        list_unlink(t);
+        twheel_place(w, t);
+    }
+}
+
+// Processes tick w->now, returning the number of timers fired.
+//
+static int twheel_tick(twheel *w) {
+    uint64_t now = w->now;
+    int idx = now & TWHEEL_MASK;
+
+    if (idx == 0) {
+        for (int level = 1; level < TWHEEL_LEVELS; level++) {
+            int lidx = (now >> (TWHEEL_BITS * level)) & TWHEEL_MASK;
+
+            twheel_cascade(w, level, lidx);
+
+            if (lidx != 0) {
+                break;
+            }
+        }
+    }
+
+    // Advance before firing, so callbacks that re-arm
+    // land in a later tick.
+    //
+    w->now = now + 1;
+
+    twheel_timer list;
+
+    list_move(&w->slots[0][idx], &list);
+
+    int fired = 0;
+
+    while (list.next != &list) {
+        twheel_timer *t = list.next;
+        list_unlink(t);
+        t->wheel = NULL;
+
+        assert(w->count > 0);
+        w->count--;
+
+        fired++;
+
+        t->cb(t, t->arg);
+    }
+
+    return fired;
+}
+
+void twheel_init(twheel *w, uint32_t tick_msec, uint64_t (*clock)(void)) {
+    assert(w != NULL);
+    assert(tick_msec > 0);
+    assert(clock != NULL);
+
+    memset(w, 0, sizeof(*w));
+
+    w->clock      = clock;
+    w->tick_msec  = tick_msec;
+    w->start_msec = clock();
+
+    for (int level = 0; level < TWHEEL_LEVELS; level++) {
+        for (int idx = 0; idx < TWHEEL_SLOTS; idx++) {
+            list_init(&w->slots[level][idx]);
+        }
+    }
+}
+
+void twheel_timer_init(twheel_timer *t) {
+    assert(t != NULL);
+
+    memset(t, 0, sizeof(*t));
+}
+
+bool twheel_timer_pending(twheel_timer *t) {
+    assert(t != NULL);
+
+    return t->wheel != NULL;
+}
+
+void twheel_add(twheel *w, twheel_timer *t, uint32_t msec,
+                twheel_cb cb, void *arg) {
+    assert(w != NULL);
+    assert(t != NULL);
+    assert(cb != NULL);
+
+    twheel_del(t);
+
+    // An empty wheel doesn't need to be ticked, so it may
+    // have fallen behind the clock.
+    //
+    uint64_t elapsed = twheel_elapsed_msec(w);
+    uint64_t curr = elapsed / w->tick_msec;
+    if (w->count == 0 &&
+        w->now < curr) {
+        w->now = curr;
+    }
+
+    // Tick N is only processed once N * tick_msec millisecs have
+    // elapsed, so rounding the deadline up to a whole tick means
+    // a timer never fires early, wherever the clock is in its tick.
+    // It's always after the current tick, though, so a callback
+    // that re-arms for 0 msec doesn't fire again in the same run.
+    //
+    t->expire = (elapsed + msec + w->tick_msec - 1) / w->tick_msec;
+    if (t->expire <= curr) {
+        t->expire = curr + 1;
+    }
+    t->wheel  = w;
+    t->cb     = cb;
+    t->arg    = arg;
+
+    twheel_place(w, t);
+
+    w->count++;
+}
+
+void twheel_del(twheel_timer *t) {
+    assert(t != NULL);
+
+    twheel *w = t->wheel;
+    if (w != NULL) {
+        list_unlink(t);
+        t->wheel = NULL;
+
+        assert(w->count > 0);
+        w->count--;
+    }
+}
+
+int twheel_run(twheel *w) {
+    assert(w != NULL);
+
+    uint64_t target = twheel_current_tick(w);
+    int fired = 0;
+
+    while (w->now <= target) {
+        if (w->count == 0) {
+            w->now = target + 1;
+            break;
+        }
+
+        fired += twheel_tick(w);
+    }
+
+    return fired;
+}
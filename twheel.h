@@ -0,0 +1,99 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef TWHEEL_H
+#define TWHEEL_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * Hierarchical timer wheel, with O(1) add and cancel.
+     *
+     * Time is counted in ticks of tick_msec millisecs.  Level 0 has
+     * one slot per tick, and each higher level has one slot per full
+     * revolution of the level below it.  Timers due further out than
+     * the top level can hold are clamped to the furthest slot.
+     *
+     * A twheel is not thread-safe, and is meant to be owned by a
+     * single thread, such as a LIBEVENT_THREAD.
+     */
+
+#define TWHEEL_BITS   6
+#define TWHEEL_SLOTS  (1 << TWHEEL_BITS)
+#define TWHEEL_MASK   (TWHEEL_SLOTS - 1)
+#define TWHEEL_LEVELS 4
+
+    typedef struct twheel_timer twheel_timer;
+    typedef struct twheel_st    twheel;
+
+    typedef void (*twheel_cb)(twheel_timer *t, void *arg);
+
+    /**
+     * A timer is embedded by its owner and must be initialized
+     * with twheel_timer_init() before first use.
+     */
+    struct twheel_timer {
+        twheel_timer *next;
+        twheel_timer *prev;
+        twheel       *wheel;  // Non-NULL while pending.
+        uint64_t      expire; // In ticks.
+        twheel_cb     cb;
+        void         *arg;
+    };
+
+    struct twheel_st {
+        uint64_t (*clock)(void); // Millisecs, monotonic.
+
+        uint32_t tick_msec;
+        uint64_t start_msec; // Clock value at tick 0.
+        uint64_t now;        // Next tick to be processed.
+        uint32_t count;      // Number of pending timers.
+
+        // Circular list sentinels.
+        //
+        twheel_timer slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+    };
+
+    /**
+     * Initialize a timer wheel, which reads the current time
+     * from the given clock function.
+     */
+    void twheel_init(twheel *w, uint32_t tick_msec, uint64_t (*clock)(void));
+
+    void twheel_timer_init(twheel_timer *t);
+
+    /**
+     * Returns true if the timer is pending.
+     */
+    bool twheel_timer_pending(twheel_timer *t);
+
+    /**
+     * Arm a timer to fire after msec millisecs, rounded up to a
+     * whole tick.  A pending timer is first cancelled.
+     */
+    void twheel_add(twheel *w, twheel_timer *t, uint32_t msec,
+                    twheel_cb cb, void *arg);
+
+    /**
+     * Cancel a timer, on whichever wheel it's pending.  Cancelling
+     * a timer that isn't pending is a no-op.
+     */
+    void twheel_del(twheel_timer *t);
+
+    /**
+     * Fire all timers that are due as of the clock's current time.
+     * Returns the number of timers fired.  Callbacks may add or
+     * cancel timers, including their own.
+     */
+    int twheel_run(twheel *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
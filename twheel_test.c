@@ -0,0 +1,217 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <twheel.h>
+
+static uint64_t fake_msec = 1000;
+
+static uint64_t fake_clock(void) {
+    return fake_msec;
+}
+
+static int fired_count = 0;
+
+static void on_fire(twheel_timer *t, void *arg) {
+    (void) t;
+
+    fired_count++;
+
+    if (arg != NULL) {
+        *((uint64_t *) arg) = fake_msec;
+    }
+}
+
+static void testSimple(void) {
+    twheel w;
+    twheel_timer t;
+    uint64_t when = 0;
+
+    fake_msec = 1000;
+    fired_count = 0;
+
+    twheel_init(&w, 10, fake_clock);
+    twheel_timer_init(&t);
+    assert(twheel_timer_pending(&t) == false);
+
+    twheel_add(&w, &t, 50, on_fire, &when);
+    assert(twheel_timer_pending(&t) == true);
+    assert(w.count == 1);
+
+    // Never early.
+    //
+    for (fake_msec = 1000; fake_msec < 1050; fake_msec++) {
+        assert(twheel_run(&w) == 0);
+    }
+
+    for (; fake_msec < 1100 && fired_count == 0; fake_msec++) {
+        twheel_run(&w);
+    }
+
+    assert(fired_count == 1);
+    assert(when >= 1050);
+    assert(when <= 1070);
+    assert(twheel_timer_pending(&t) == false);
+    assert(w.count == 0);
+}
+
+static void testMidTick(void) {
+    twheel w;
+    twheel_timer t;
+    uint64_t when = 0;
+
+    fake_msec = 1000;
+    fired_count = 0;
+
+    twheel_init(&w, 10, fake_clock);
+    twheel_timer_init(&t);
+
+    // Added late in a tick, for less than a tick past its end.
+    //
+    fake_msec = 1019;
+    twheel_add(&w, &t, 15, on_fire, &when);
+
+    for (; fake_msec < 1034; fake_msec++) {
+        assert(twheel_run(&w) == 0);
+    }
+
+    for (; fake_msec < 1100 && fired_count == 0; fake_msec++) {
+        twheel_run(&w);
+    }
+
+    assert(fired_count == 1);
+    assert(when >= 1034);
+    assert(when <= 1044);
+}
+
+static void testCancel(void) {
+    twheel w;
+    twheel_timer t0, t1;
+
+    fake_msec = 5000;
+    fired_count = 0;
+
+    twheel_init(&w, 1, fake_clock);
+    twheel_timer_init(&t0);
+    twheel_timer_init(&t1);
+
+    twheel_add(&w, &t0, 10, on_fire, NULL);
+    twheel_add(&w, &t1, 10, on_fire, NULL);
+    assert(w.count == 2);
+
+    twheel_del(&t0);
+    twheel_del(&t0);
+    assert(w.count == 1);
+    assert(twheel_timer_pending(&t0) == false);
+
+    // Re-adding a pending timer moves it.
+    //
+    twheel_add(&w, &t1, 100, on_fire, NULL);
+    assert(w.count == 1);
+
+    fake_msec += 50;
+    assert(twheel_run(&w) == 0);
+
+    fake_msec += 60;
+    assert(twheel_run(&w) == 1);
+    assert(fired_count == 1);
+    assert(w.count == 0);
+}
+
+static void testCascade(void) {
+    twheel w;
+    twheel_timer t[100];
+    uint64_t when[100];
+
+    fake_msec = 0;
+    fired_count = 0;
+
+    twheel_init(&w, 1, fake_clock);
+
+    // Spread timers over every level of the wheel.
+    //
+    uint32_t msec = 1;
+    for (int i = 0; i < 100; i++) {
+        twheel_timer_init(&t[i]);
+        twheel_add(&w, &t[i], msec, on_fire, &when[i]);
+        when[i] = 0;
+        msec = msec * 6 / 5 + 1;
+    }
+
+    assert(w.count == 100);
+
+    msec = 1;
+    for (int i = 0; i < 100; i++) {
+        while (fake_msec < msec + 2) {
+            fake_msec++;
+            twheel_run(&w);
+        }
+
+        // Due right at msec, which is never early, no matter
+        // how many levels the timer cascaded through.
+        //
+        assert(when[i] == msec);
+
+        msec = msec * 6 / 5 + 1;
+        if (msec >= (1u << (TWHEEL_BITS * TWHEEL_LEVELS))) {
+            break;
+        }
+    }
+
+    // Big clock jumps fire everything that's due.
+    //
+    fake_msec += ((uint64_t) 1 << (TWHEEL_BITS * TWHEEL_LEVELS));
+    twheel_run(&w);
+
+    assert(fired_count == 100);
+    assert(w.count == 0);
+}
+
+static void on_fire_rearm(twheel_timer *t, void *arg) {
+    twheel *w = arg;
+
+    fired_count++;
+
+    if (fired_count < 3) {
+        twheel_add(w, t, 0, on_fire_rearm, w);
+    }
+}
+
+static void testRearm(void) {
+    twheel w;
+    twheel_timer t;
+
+    fake_msec = 0;
+    fired_count = 0;
+
+    twheel_init(&w, 1, fake_clock);
+    twheel_timer_init(&t);
+
+    twheel_add(&w, &t, 0, on_fire_rearm, &w);
+
+    fake_msec = 1;
+    assert(twheel_run(&w) == 1);
+    fake_msec = 2;
+    assert(twheel_run(&w) == 1);
+    fake_msec = 3;
+    assert(twheel_run(&w) == 1);
+    fake_msec = 100;
+    assert(twheel_run(&w) == 0);
+
+    assert(fired_count == 3);
+    assert(w.count == 0);
+}
+
+int main(void) {
+    testSimple();
+    testMidTick();
+    testCancel();
+    testCascade();
+    testRearm();
+
+    return 0;
+}
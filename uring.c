@@ -0,0 +1,341 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include "uring.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_EVENTFD_H)
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Sends need IORING_OP_SENDMSG (linux 5.3), and we rely on
+// IORING_FEAT_NODROP and IORING_FEAT_SUBMIT_STABLE (both 5.5), so
+// no completion is ever lost and a msghdr only has to stay put until
+// its send is submitted, not until it completes.
+//
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_EVENTFD_H) && \
+    defined(__NR_io_uring_setup) && defined(IORING_FEAT_SUBMIT_STABLE)
+#define URING_SYSCALLS 1
+#endif
+
+#ifdef URING_SYSCALLS
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit,
+                         min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode,
+                                 void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Registers the ring's eventfd, preferably so it's only signaled
+ * for sends that complete after io_uring_enter() returns, as the
+ * others get reaped right after the submit anyway.
+ */
+static bool uring_register_event_fd(uring *r) {
+#ifdef IORING_REGISTER_EVENTFD_ASYNC
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_EVENTFD_ASYNC,
+                              &r->event_fd, 1) == 0) {
+        return true;
+    }
+#endif
+    return sys_io_uring_register(r->fd, IORING_REGISTER_EVENTFD,
+                                 &r->event_fd, 1) == 0;
+}
+
+/* Sets up a ring with room for the given number of queued sends.
+ * Returns false, leaving r->fd at -1, if the kernel can't do it.
+ */
+bool uring_init(uring *r, unsigned entries) {
+    assert(r != NULL);
+
+    memset(r, 0, sizeof(uring));
+    r->fd       = -1;
+    r->event_fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0) {
+        return false;
+    }
+
+    r->fd = fd;
+
+    if ((p.features & IORING_FEAT_NODROP) == 0 ||
+        (p.features & IORING_FEAT_SUBMIT_STABLE) == 0) {
+        uring_destroy(r);
+        return false;
+    }
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes +
+                    p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_len > r->sq_map_len) {
+            r->sq_map_len = r->cq_map_len;
+        }
+        r->cq_map_len = r->sq_map_len;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        r->sq_map = NULL;
+        uring_destroy(r);
+        return false;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            r->cq_map = NULL;
+            uring_destroy(r);
+            return false;
+        }
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_destroy(r);
+        return false;
+    }
+
+    char *sq = r->sq_map;
+    char *cq = r->cq_map;
+
+    r->sq_entries = p.sq_entries;
+    r->sq_head    = (unsigned *) (sq + p.sq_off.head);
+    r->sq_tail    = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask    = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array   = (unsigned *) (sq + p.sq_off.array);
+
+    r->cq_entries = p.cq_entries;
+    r->cq_head    = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail    = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask    = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes       = cq + p.cq_off.cqes;
+
+    r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->event_fd < 0 ||
+        !uring_register_event_fd(r)) {
+        uring_destroy(r);
+        return false;
+    }
+
+    return true;
+}
+
+void uring_destroy(uring *r) {
+    assert(r != NULL);
+
+    if (r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_map != NULL && r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_len);
+    }
+    if (r->sq_map != NULL) {
+        munmap(r->sq_map, r->sq_map_len);
+    }
+    if (r->event_fd >= 0) {
+        close(r->event_fd);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+
+    memset(r, 0, sizeof(uring));
+    r->fd       = -1;
+    r->event_fd = -1;
+}
+
+/* Returns the number of sends queued but not yet submitted.
+ */
+unsigned uring_queued(uring *r) {
+    return *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Returns true when another send can't be queued, either because
+ * the submission queue needs a uring_submit(), or because as many
+ * sends as the completion queue holds haven't been reaped yet.
+ */
+bool uring_full(uring *r) {
+    return uring_queued(r) >= r->sq_entries ||
+           r->inflight >= r->cq_entries;
+}
+
+/* Queues a sendmsg() of the msghdr, which must stay put until the
+ * next uring_submit().  The data is handed back to the uring_reap()
+ * callback with the result of the send.
+ */
+bool uring_sendmsg(uring *r, int fd, const struct msghdr *m, void *data) {
+    assert(r != NULL);
+    assert(r->fd >= 0);
+
+    if (uring_full(r)) {
+        return false;
+    }
+
+    unsigned tail = *r->sq_tail;
+    unsigned idx  = tail & *r->sq_mask;
+
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *) r->sqes)[idx];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t) (uintptr_t) m;
+    sqe->len       = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t) (uintptr_t) data;
+
+    r->sq_array[idx] = idx;
+
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    r->inflight++;
+
+    return true;
+}
+
+/* Submits the queued sends with one io_uring_enter(), which also
+ * waits for min_complete completions, if that's nonzero.  Returns
+ * the number of sends submitted, or -1 with errno set.
+ */
+int uring_submit(uring *r, unsigned min_complete) {
+    assert(r != NULL);
+    assert(r->fd >= 0);
+
+    unsigned queued = uring_queued(r);
+
+    if (queued == 0 && min_complete == 0) {
+        return 0;
+    }
+
+    return sys_io_uring_enter(r->fd, queued, min_complete,
+                              min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/* Hands each completed send to the callback, with the data given
+ * to uring_sendmsg() and either the bytes sent or a -errno.
+ * Returns the number of completions reaped.
+ */
+int uring_reap(uring *r, void (*cb)(void *data, int res)) {
+    assert(r != NULL);
+    assert(r->fd >= 0);
+
+    int n = 0;
+
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe =
+            &((struct io_uring_cqe *) r->cqes)[head & *r->cq_mask];
+
+        void *data = (void *) (uintptr_t) cqe->user_data;
+        int   res  = cqe->res;
+
+        head++;
+
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+        r->inflight--;
+        n++;
+
+        cb(data, res);
+
+        if (head == tail) {
+            tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    return n;
+}
+
+#else // !URING_SYSCALLS
+
+bool uring_init(uring *r, unsigned entries) {
+    (void) entries;
+
+    memset(r, 0, sizeof(uring));
+    r->fd       = -1;
+    r->event_fd = -1;
+
+    return false;
+}
+
+void uring_destroy(uring *r) {
+    (void) r;
+}
+
+unsigned uring_queued(uring *r) {
+    (void) r;
+    return 0;
+}
+
+bool uring_full(uring *r) {
+    (void) r;
+    return true;
+}
+
+bool uring_sendmsg(uring *r, int fd, const struct msghdr *m, void *data) {
+    (void) r;
+    (void) fd;
+    (void) m;
+    (void) data;
+    return false;
+}
+
+int uring_submit(uring *r, unsigned min_complete) {
+    (void) r;
+    (void) min_complete;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_reap(uring *r, void (*cb)(void *data, int res)) {
+    (void) r;
+    (void) cb;
+    return 0;
+}
+
+#endif // !URING_SYSCALLS
+
+/* Returns true if this kernel lets us set up a ring.
+ */
+bool uring_probe(void) {
+    uring r;
+
+    if (!uring_init(&r, 2)) {
+        return false;
+    }
+
+    uring_destroy(&r);
+
+    return true;
+}
@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// A minimal io_uring, set up and driven with raw syscalls, so a
+// worker thread can queue the sendmsg()'s of its conns during an
+// event loop iteration and submit them all with one io_uring_enter().
+// A ring belongs to one thread.
+//
+// Without linux/io_uring.h and sys/eventfd.h at build time, or with
+// a kernel that lacks io_uring or refuses it, uring_init() returns
+// false and callers keep using sendmsg().
+//
+typedef struct uring uring;
+
+struct uring {
+    int fd;       // -1 when the ring isn't set up.
+    int event_fd; // Readable when async sends complete.
+
+    unsigned  sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    void     *sqes;       // struct io_uring_sqe[sq_entries].
+
+    unsigned  cq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void     *cqes;       // struct io_uring_cqe[cq_entries].
+
+    unsigned  inflight;   // Queued or submitted, but not yet reaped.
+
+    void   *sq_map;
+    size_t  sq_map_len;
+    void   *cq_map;       // Same as sq_map with IORING_FEAT_SINGLE_MMAP.
+    size_t  cq_map_len;
+    size_t  sqes_len;
+};
+
+bool uring_init(uring *r, unsigned entries);
+void uring_destroy(uring *r);
+
+bool uring_probe(void);
+
+bool uring_full(uring *r);
+unsigned uring_queued(uring *r);
+
+bool uring_sendmsg(uring *r, int fd, const struct msghdr *m, void *data);
+
+int uring_submit(uring *r, unsigned min_complete);
+
+int uring_reap(uring *r, void (*cb)(void *data, int res));
+
+#endif // URING_H
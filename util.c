@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include "memcached.h"
 
@@ -121,6 +122,24 @@ double timeval_to_double(struct timeval tv)
     return (double)tv.tv_sec + ((double)tv.tv_usec / 1000000);
 }
 
+uint64_t monotonic_usec(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    /* Served from the vDSO on linux, so there's no syscall.
+     * CLOCK_MONOTONIC_COARSE would be cheaper still, but only
+     * has jiffy resolution, which is too coarse for the usec
+     * timing histograms.
+     */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((uint64_t) tv.tv_sec) * 1000000 + tv.tv_usec;
+#endif
+}
+
 static int cmp_doubles(const void *pa, const void *pb)
 {
     double a = *(double*)pa;
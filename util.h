@@ -27,6 +27,13 @@ int timeval_subtract(struct timeval *result,
  */
 double timeval_to_double(struct timeval tv);
 
+/**
+ * Microsecs from an arbitrary, fixed starting point.  Unlike
+ * gettimeofday(), this never jumps on clock adjustments, so it's
+ * the one to use for measuring durations and timeouts.
+ */
+uint64_t monotonic_usec(void);
+
 struct moxi_stats {
     double min;
     double max;